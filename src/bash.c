@@ -116,13 +116,32 @@ void fg(pid_t pid) {
 }
 
 void bash_mount(const char *fs_name, int *status) {
-    if (f_mount(fs_name) == -1) {
+    if (f_mount(fs_name, NULL, false) == -1) {
         *status = -1;
     } else {
         *status = 0;
     }
 }
 
+void bash_mount_volume(struct parsed_command *cmd) {
+    char **args = &cmd->commands[0][1];
+    bool read_only = args[0] != NULL && strcmp(args[0], "-r") == 0;
+    if (read_only) {
+        args++;
+    }
+    if (args[0] == NULL) {
+        p_perror("mount [-r] FS_NAME [LABEL]", ArgumentNotFoundError);
+    } else {
+        f_mount(args[0], args[1], read_only);
+    }
+    p_exit();
+}
+
+void bash_umount(struct parsed_command *cmd) {
+    f_umount(cmd->commands[0][1]);
+    p_exit();
+}
+
 void bash_touch(struct parsed_command *cmd) {
     f_touch(cmd);
     p_exit();
@@ -148,8 +167,8 @@ void bash_cat(struct parsed_command *cmd) {
     p_exit();
 }
 
-void bash_ls() {
-    f_ls();
+void bash_ls(struct parsed_command *cmd) {
+    f_ls(cmd->commands[0][1]);
     p_exit();
 }
 
@@ -158,6 +177,92 @@ void bash_chmod(const char* mode, const char* fs_name) {
     p_exit();
 }
 
+void bash_fragstat() {
+    f_fragstat();
+    p_exit();
+}
+
+void bash_sync() {
+    f_sync();
+    p_exit();
+}
+
+void bash_writeback(struct parsed_command *cmd) {
+    int dirty_age = cmd->commands[0][1] != NULL ? atoi(cmd->commands[0][1]) : -1;
+    int dirty_bytes = cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL ? atoi(cmd->commands[0][2]) : -1;
+    f_writeback(dirty_age, dirty_bytes);
+    p_exit();
+}
+
+void bash_ioworkers(struct parsed_command *cmd) {
+    f_ioworkers(cmd->commands[0][1] != NULL ? atoi(cmd->commands[0][1]) : -1);
+    p_exit();
+}
+
+void bash_snapshot(struct parsed_command *cmd) {
+    if (cmd->commands[0][1] == NULL) {
+        p_perror("snapshot create|list|delete|rollback [LABEL:]NAME", ArgumentNotFoundError);
+    } else {
+        f_snapshot(cmd->commands[0][1], cmd->commands[0][2]);
+    }
+    p_exit();
+}
+
+void bash_dedup(struct parsed_command *cmd) {
+    f_dedup(cmd->commands[0][1]);
+    p_exit();
+}
+
+void bash_scrub(struct parsed_command *cmd) {
+    bool status = false;
+    const char *label = NULL;
+    int rate = 0;
+    for (int i = 1; cmd->commands[0][i] != NULL; i++) {
+        const char *arg = cmd->commands[0][i];
+        if (strcmp(arg, "status") == 0) {
+            status = true;
+        } else if (arg[0] >= '0' && arg[0] <= '9') {
+            rate = atoi(arg);
+        } else {
+            label = arg;
+        }
+    }
+    if (status) {
+        f_scrub_status(label);
+    } else {
+        f_scrub(label, rate);
+    }
+    p_exit();
+}
+
+void bash_fsstat(struct parsed_command *cmd) {
+    f_fsstat(cmd->commands[0][1]);
+    p_exit();
+}
+
+void bash_fstrace(struct parsed_command *cmd) {
+    f_fstrace(cmd->commands[0][1], cmd->commands[0][1] != NULL ? cmd->commands[0][2] : NULL);
+    p_exit();
+}
+
+void bash_pack(struct parsed_command *cmd) {
+    if (cmd->commands[0][1] == NULL) {
+        p_perror("pack HOST_DIR [LABEL:]", ArgumentNotFoundError);
+    } else {
+        f_pack(cmd->commands[0][1], cmd->commands[0][2]);
+    }
+    p_exit();
+}
+
+void bash_unpack(struct parsed_command *cmd) {
+    if (cmd->commands[0][1] == NULL) {
+        p_perror("unpack HOST_DIR [LABEL:]", ArgumentNotFoundError);
+    } else {
+        f_unpack(cmd->commands[0][1], cmd->commands[0][2]);
+    }
+    p_exit();
+}
+
 void print_busy() {
     int i = 0;
     while(1) {
@@ -109,6 +109,20 @@ void fg(pid_t job_id);
  */
 void bash_mount(const char *fs_name, int *status);
 
+/**
+ * @brief Mounts another file system while PennOS is running.
+ *
+ * @param cmd Parsed command containing the file system name, an optional label and -r to mount it read-only.
+ */
+void bash_mount_volume(struct parsed_command *cmd);
+
+/**
+ * @brief Unmounts a file system.
+ *
+ * @param cmd Parsed command containing the optional label of the volume.
+ */
+void bash_umount(struct parsed_command *cmd);
+
 
 /**
  * @brief Creates an empty file if it does not exist,
@@ -150,8 +164,10 @@ void bash_cat(struct parsed_command *cmd);
 
 /**
  * @brief Lists all files in the current directory.
+ *
+ * @param cmd Parsed command, whose optional argument is the label of the volume to list.
  */
-void bash_ls();
+void bash_ls(struct parsed_command *cmd);
 
 /**
  *  @brief Changes permissions of specified file
@@ -161,6 +177,79 @@ void bash_ls();
  */
 void bash_chmod(const char* mode, const char* fs_name);
 
+/**
+ * @brief Prints the average run length of every file and of the whole image.
+ */
+void bash_fragstat();
+
+/**
+ * @brief Writes back everything that changed on the mounted volumes.
+ */
+void bash_sync();
+
+/**
+ * @brief Adjusts the flushd thresholds and prints its writeback statistics.
+ *
+ * @param cmd The parsed command: writeback [DIRTY_AGE [DIRTY_BYTES]].
+ */
+void bash_writeback(struct parsed_command *cmd);
+
+/**
+ * @brief Creates, lists, deletes or rolls back to a snapshot of a volume.
+ *
+ * @param cmd The parsed command: snapshot create|list|delete|rollback [LABEL:]NAME.
+ */
+void bash_snapshot(struct parsed_command *cmd);
+
+/**
+ * @brief Deduplicates a volume and prints the space reclaimed.
+ *
+ * @param cmd The parsed command: dedup [LABEL:].
+ */
+void bash_dedup(struct parsed_command *cmd);
+
+/**
+ * @brief Scrubs a volume at low priority, or prints how far its scrub got.
+ *
+ * @param cmd The parsed command: scrub [status] [LABEL:] [BLOCKS_PER_QUANTUM].
+ */
+void bash_scrub(struct parsed_command *cmd);
+
+/**
+ * @brief Prints or resets the file system operation counters and latency histograms.
+ *
+ * @param cmd The parsed command: fsstat [reset|OPERATION].
+ */
+void bash_fsstat(struct parsed_command *cmd);
+
+/**
+ * @brief Starts or stops recording the file system calls to a trace.
+ *
+ * @param cmd The parsed command: fstrace start HOST_FILE|stop.
+ */
+void bash_fstrace(struct parsed_command *cmd);
+
+/**
+ * @brief Copies every regular file of a host directory into a volume.
+ *
+ * @param cmd The parsed command: pack HOST_DIR [LABEL:].
+ */
+void bash_pack(struct parsed_command *cmd);
+
+/**
+ * @brief Copies every file of a volume into a host directory.
+ *
+ * @param cmd The parsed command: unpack HOST_DIR [LABEL:].
+ */
+void bash_unpack(struct parsed_command *cmd);
+
+/**
+ * @brief Sets how many I/O workers take blocking transfers off the processes, and prints what they are doing.
+ *
+ * @param cmd The parsed command: ioworkers [N].
+ */
+void bash_ioworkers(struct parsed_command *cmd);
+
 /**
  * @brief A secret easter egg we created! 
  */
@@ -0,0 +1,465 @@
+/*
+fsreplay replays a trace recorded with fstrace against a fresh PennFAT image,
+through the same f_ calls PennOS processes make, and reports the throughput and
+the latency of every operation.
+
+The image is formatted with the geometry of the recorded volume unless -c and
+-f say otherwise. Calls run back to back, or with -t at the times they were
+recorded. File descriptors are mapped from the ones each recorded process got
+to the ones the replay gets, and volume labels are dropped, so every call lands
+on the one fresh volume. Data written is a fixed pattern of the recorded size,
+since traces do not keep file contents.
+
+Asynchronous reads and writes get a buffer of their own until they are
+awaited, and mappings are tracked by the slot recorded for them, so awaits and
+munmaps reach the replayed ones. Locks are asked for with LOCK_NB: the replay
+is one process, so a lock another recorded process held would block it for
+good. Mappings and transfers still outstanding at the end of the trace are
+undone before the volume is unmounted.
+
+Calls that cannot run offline are skipped: calls on descriptors opened before
+recording started, awaits and munmaps of transfers and mappings made before it,
+cp to or from the host, and cat reading its input from the terminal. A call
+diverges when it fails where the recorded one succeeded or the other way
+around, or moves another number of bytes.
+*/
+
+#include <time.h>
+#include <fcntl.h>
+#include "f_pennos.h"
+#include "k_pennos.h"
+#include "fsstat.h"
+#include "fstrace.h"
+
+FILE* logFile;
+
+#define MAX_FD_MAPPINGS 1024
+#define MAX_ARGS 64
+
+// A descriptor a recorded process had, and the one the replay got for it
+typedef struct {
+    int32_t pid;
+    int32_t fd;
+    int replay_fd;
+} fd_mapping;
+
+// An asynchronous transfer a recorded process started, and the replayed one with its buffer
+typedef struct {
+    int32_t handle;
+    int replay_handle;
+    bool write;
+    char *buffer;
+} handle_mapping;
+
+// A mapping a recorded process made, and the replayed one
+typedef struct {
+    int32_t slot;
+    void *addr;
+    int length;
+} map_mapping;
+
+static fd_mapping mappings[MAX_FD_MAPPINGS];
+static int num_mappings;
+static handle_mapping handles[MAX_ASYNC_IO];
+static int num_handles;
+static map_mapping maps[MAX_MAPPINGS];
+static int num_maps;
+// Whether the last await replayed finished a write
+static bool awaited_write;
+static char *data;
+static int data_size;
+static int dev_null = -1;
+static int saved_stdout, saved_stderr;
+
+static int find_mapping(int32_t pid, int32_t fd) {
+    for (int i = 0; i < num_mappings; i++) {
+        if (mappings[i].pid == pid && mappings[i].fd == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void add_mapping(int32_t pid, int32_t fd, int replay_fd) {
+    int i = find_mapping(pid, fd);
+    if (i == -1 && num_mappings < MAX_FD_MAPPINGS) {
+        i = num_mappings++;
+    }
+    if (i != -1) {
+        mappings[i] = (fd_mapping){ pid, fd, replay_fd };
+    }
+}
+
+static void drop_mapping(int i) {
+    mappings[i] = mappings[--num_mappings];
+}
+
+static int find_handle(int32_t handle) {
+    for (int i = 0; i < num_handles; i++) {
+        if (handles[i].handle == handle) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int find_map(int32_t slot) {
+    for (int i = 0; i < num_maps; i++) {
+        if (maps[i].slot == slot) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// A buffer of count bytes of the pattern data is written with
+static char *pattern(int count) {
+    char *buffer = malloc(count > 0 ? count : 1);
+    for (int i = 0; buffer != NULL && i < count; i++) {
+        buffer[i] = 'a' + i % 26;
+    }
+    return buffer;
+}
+
+// Awaits a replayed transfer and frees its buffer
+static int await_handle(int i) {
+    int result = f_await(handles[i].replay_handle);
+    awaited_write = handles[i].write;
+    free(handles[i].buffer);
+    handles[i] = handles[--num_handles];
+    return result;
+}
+
+static int unmap(int i) {
+    int result = f_munmap(maps[i].addr, maps[i].length);
+    maps[i] = maps[--num_maps];
+    return result;
+}
+
+// Drops the LABEL: of a path, every call replays on the one volume
+static char *strip_label(char *name) {
+    char *colon = strchr(name, ':');
+    return colon != NULL ? colon + 1 : name;
+}
+
+// Splits the names of a call into an argument list
+static int split_names(char *names, int names_len, char **args) {
+    int num_args = 0;
+    for (int i = 0; i < names_len && num_args < MAX_ARGS - 1; i += strlen(names + i) + 1) {
+        args[num_args++] = names + i;
+    }
+    args[num_args] = NULL;
+    return num_args;
+}
+
+// Output of ls and cat goes to /dev/null while they replay
+static void mute() {
+    fflush(stdout);
+    fflush(stderr);
+    saved_stdout = dup(STDOUT_FILENO);
+    saved_stderr = dup(STDERR_FILENO);
+    dup2(dev_null, STDOUT_FILENO);
+    dup2(dev_null, STDERR_FILENO);
+}
+
+static void unmute() {
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+}
+
+static int run_command(fs_op op, char **args, int num_args) {
+    struct parsed_command *cmd = malloc(sizeof(struct parsed_command) + sizeof(char **));
+    memset(cmd, 0, sizeof(struct parsed_command));
+    cmd->num_commands = 1;
+    cmd->commands[0] = args;
+    int result;
+    if (op == FS_OP_CP) {
+        result = f_cp(cmd);
+    } else if (op == FS_OP_CAT) {
+        mute();
+        result = f_cat(cmd);
+        unmute();
+    } else {
+        result = f_touch(cmd);
+    }
+    free(cmd);
+    return result;
+}
+
+// Replays one call; returns 1 if it ran, 0 if it was skipped, and its result in result
+static int replay(fstrace_record *record, char *names, int *result) {
+    char *args[MAX_ARGS];
+    int num_args = split_names(names, record->names_len, args);
+    for (int i = 0; i < num_args; i++) {
+        args[i] = strip_label(args[i]);
+    }
+    int mapping = find_mapping(record->pid, record->fd);
+    int replay_fd = mapping != -1 ? mappings[mapping].replay_fd : -1;
+
+    switch (record->op) {
+    case FS_OP_OPEN:
+        if (num_args < 1) {
+            return 0;
+        }
+        *result = f_open(args[0], record->fd);
+        if (record->result >= 0 && *result >= 0) {
+            add_mapping(record->pid, record->result, *result);
+        }
+        return 1;
+    case FS_OP_READ:
+    case FS_OP_WRITE:
+        if (mapping == -1) {
+            return 0;
+        }
+        if (record->count > data_size) {
+            data = realloc(data, record->count);
+            for (int i = data_size; i < record->count; i++) {
+                data[i] = 'a' + i % 26;
+            }
+            data_size = record->count;
+        }
+        *result = record->op == FS_OP_READ ? f_read(replay_fd, record->count, data) : f_write(replay_fd, data, record->count);
+        return 1;
+    case FS_OP_READ_ASYNC:
+    case FS_OP_WRITE_ASYNC: {
+        char *buffer = mapping != -1 ? pattern(record->count) : NULL;
+        if (buffer == NULL) {
+            return 0;
+        }
+        bool write = record->op == FS_OP_WRITE_ASYNC;
+        *result = write ? f_write_async(replay_fd, buffer, record->count) : f_read_async(replay_fd, record->count, buffer);
+        // The buffer must outlive the transfer, it is freed when the transfer is awaited
+        int handle = find_handle(record->result);
+        if (handle != -1) {
+            await_handle(handle);
+        }
+        if (*result >= 0 && record->result >= 0 && num_handles < MAX_ASYNC_IO) {
+            handles[num_handles++] = (handle_mapping){ record->result, *result, write, buffer };
+        } else if (*result >= 0) {
+            f_await(*result);
+            free(buffer);
+        } else {
+            free(buffer);
+        }
+        return 1;
+    }
+    case FS_OP_AWAIT: {
+        int handle = find_handle(record->fd);
+        if (handle == -1) {
+            return 0;
+        }
+        *result = await_handle(handle);
+        return 1;
+    }
+    case FS_OP_FALLOCATE:
+    case FS_OP_FLOCK:
+    case FS_OP_FSYNC:
+    case FS_OP_FADVISE:
+        if (mapping == -1) {
+            return 0;
+        }
+        if (record->op == FS_OP_FALLOCATE) {
+            *result = f_fallocate(replay_fd, record->count);
+        } else if (record->op == FS_OP_FLOCK) {
+            *result = f_flock(replay_fd, record->whence | LOCK_NB);
+        } else if (record->op == FS_OP_FSYNC) {
+            *result = f_fsync(replay_fd);
+        } else {
+            *result = f_fadvise(replay_fd, record->offset, record->count, record->whence);
+        }
+        return 1;
+    case FS_OP_SYNC:
+        *result = f_sync();
+        return 1;
+    case FS_OP_MMAP: {
+        if (mapping == -1) {
+            return 0;
+        }
+        void *addr = f_mmap(replay_fd, record->offset, record->count, record->whence);
+        *result = addr != NULL ? 0 : -1;
+        int map = find_map(record->result);
+        if (map != -1) {
+            unmap(map);
+        }
+        if (addr != NULL && record->result >= 0 && num_maps < MAX_MAPPINGS) {
+            maps[num_maps++] = (map_mapping){ record->result, addr, record->count };
+        } else if (addr != NULL) {
+            f_munmap(addr, record->count);
+        }
+        return 1;
+    }
+    case FS_OP_MUNMAP: {
+        int map = find_map(record->fd);
+        if (map == -1) {
+            return 0;
+        }
+        *result = unmap(map);
+        return 1;
+    }
+    case FS_OP_LSEEK:
+        if (mapping == -1) {
+            return 0;
+        }
+        *result = f_lseek(replay_fd, record->count, record->whence);
+        return 1;
+    case FS_OP_CLOSE:
+        if (mapping == -1) {
+            return 0;
+        }
+        *result = f_close(replay_fd);
+        drop_mapping(mapping);
+        return 1;
+    case FS_OP_UNLINK:
+    case FS_OP_RM:
+        if (num_args < 1) {
+            return 0;
+        }
+        *result = record->op == FS_OP_UNLINK ? f_unlink(args[0]) : f_rm(args[0]);
+        return 1;
+    case FS_OP_MV:
+        if (num_args < 2) {
+            return 0;
+        }
+        *result = f_mv(args[0], args[1]);
+        return 1;
+    case FS_OP_LS:
+        mute();
+        *result = f_ls(NULL);
+        unmute();
+        return 1;
+    case FS_OP_CP:
+    case FS_OP_CAT:
+    case FS_OP_TOUCH:
+        if (num_args < 2) {
+            return 0;
+        }
+        for (int i = 1; i < num_args; i++) {
+            if (record->op == FS_OP_CP && strcmp(args[i], "-h") == 0) {
+                return 0;
+            }
+        }
+        if (record->op == FS_OP_CAT && (strcmp(args[1], "-w") == 0 || strcmp(args[1], "-a") == 0)) {
+            return 0;
+        }
+        *result = run_command(record->op, args, num_args);
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+    bool timed = false;
+    int config = -1, fat_blocks = -1;
+    const char *image = "/tmp/fsreplay.img";
+    const char *trace_name = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0) {
+            timed = true;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            config = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            fat_blocks = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            image = argv[++i];
+        } else if (argv[i][0] != '-' && trace_name == NULL) {
+            trace_name = argv[i];
+        } else {
+            trace_name = NULL;
+            break;
+        }
+    }
+    if (trace_name == NULL) {
+        fprintf(stderr, "usage: fsreplay [-t] [-c CONFIG] [-f FAT_BLOCKS] [-i IMAGE] TRACE\n");
+        return 1;
+    }
+
+    FILE *trace = fopen(trace_name, "r");
+    fstrace_header header;
+    if (trace == NULL || fstrace_read_header(trace, &header) == -1) {
+        fprintf(stderr, "%s is not a trace\n", trace_name);
+        return 1;
+    }
+    // Traces recorded with nothing mounted get the largest image
+    config = config != -1 ? config : header.fat_blocks != 0 ? header.block_size_config : 4;
+    fat_blocks = fat_blocks != -1 ? fat_blocks : header.fat_blocks != 0 ? header.fat_blocks : 32;
+
+    logFile = fopen("/dev/null", "w");
+    dev_null = open("/dev/null", O_WRONLY);
+    k_system_init();
+    unlink(image);
+    if (mkfs((char *)image, fat_blocks, config) == -1 || f_mount(image, NULL, false) == -1) {
+        fprintf(stderr, "Failed to create %s\n", image);
+        return 1;
+    }
+    fsstat_reset();
+
+    fstrace_record record;
+    char names[FSTRACE_NAMES_MAX];
+    long num_calls = 0, replayed = 0, skipped = 0, diverged = 0;
+    unsigned long read_bytes = 0, written_bytes = 0;
+    double recorded_seconds = 0, recorded_busy = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int next;
+    while ((next = fstrace_next(trace, &record, names)) == 1) {
+        num_calls++;
+        recorded_seconds = (record.start_ns + record.duration_ns) / 1e9;
+        recorded_busy += record.duration_ns / 1e9;
+        if (timed) {
+            double ahead = record.start_ns / 1e9 - seconds_since(&start);
+            if (ahead > 0) {
+                struct timespec pause = { (time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9) };
+                nanosleep(&pause, NULL);
+            }
+        }
+
+        int result = 0;
+        if (!replay(&record, names, &result)) {
+            skipped++;
+            continue;
+        }
+        replayed++;
+        bool moves_bytes = record.op == FS_OP_READ || record.op == FS_OP_WRITE || record.op == FS_OP_AWAIT;
+        if ((result < 0) != (record.result < 0) || (moves_bytes && result != record.result)) {
+            diverged++;
+        }
+        bool wrote = record.op == FS_OP_WRITE || (record.op == FS_OP_AWAIT && awaited_write);
+        if (result > 0 && wrote) {
+            written_bytes += result;
+        } else if (result > 0 && moves_bytes) {
+            read_bytes += result;
+        }
+    }
+    double seconds = seconds_since(&start);
+    if (next == -1) {
+        fprintf(stderr, "%s is cut short after %ld calls\n", trace_name, num_calls);
+    }
+
+    printf("trace: %ld calls over %.3f s, %.3f s in calls\n", num_calls, recorded_seconds, recorded_busy);
+    printf("replay: %ld calls (%ld skipped, %ld diverged) in %.3f s, %.0f calls/s, read %.2f MB/s, written %.2f MB/s\n",
+        replayed, skipped, diverged, seconds, seconds > 0 ? replayed / seconds : 0,
+        seconds > 0 ? read_bytes / seconds / (1 << 20) : 0, seconds > 0 ? written_bytes / seconds / (1 << 20) : 0);
+    fsstat_print(stdout);
+
+    fclose(trace);
+    while (num_handles > 0) {
+        await_handle(0);
+    }
+    while (num_maps > 0) {
+        unmap(0);
+    }
+    f_umount(NULL);
+    unlink(image);
+    return next == -1;
+}
@@ -0,0 +1,357 @@
+/*
+pennbench measures the PennFAT file system through the same f_ calls PennOS
+processes make. For every block size configuration it formats a fresh image,
+mounts it and times:
+ - sequential writes and reads of one large file, 4 KB at a time,
+ - random 4 KB reads from that file,
+ - repeated scans of that file, through f_read and through one f_mmap,
+ - creating, writing and deleting small files,
+ - ls on a directory of 1k and 10k entries,
+ - cp -h of a host file into the image and back out,
+ - append-heavy logging, one short line per f_write.
+
+Every host system call the file system issues is counted by the fsstat
+wrappers, so a change that saves syscalls shows up even where the page cache
+hides it in the timings.
+
+Results are written as CSV, or as JSON with -j, one row per configuration and
+workload.
+*/
+
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "f_pennos.h"
+#include "k_pennos.h"
+#include "fsstat.h"
+
+FILE* logFile;
+
+#define IO_SIZE 4096
+#define MAX_DATA_BYTES (8 << 20)
+#define RANDOM_READS 2000
+#define SMALL_FILES 500
+#define SMALL_FILE_SIZE 100
+#define LOG_LINES 20000
+#define LS_REPEATS 5
+#define SCAN_PASSES 10
+
+typedef struct {
+    const char *name;
+    unsigned long ops;
+    unsigned long bytes;
+    double seconds;
+    unsigned long syscalls[NUM_SYSCALLS];
+} bench_result;
+
+static struct timespec started;
+static bool json = false;
+static bool first_row = true;
+static FILE *out;
+static char buf[IO_SIZE];
+static unsigned long scan_sum; // Keeps the scans from being optimized away
+
+static unsigned long sum_bytes(const char *data, int n) {
+    unsigned long sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += (unsigned char)data[i];
+    }
+    return sum;
+}
+
+static void bench_start() {
+    memset(fsstat_syscalls, 0, sizeof(fsstat_syscalls));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static bench_result bench_stop(const char *name, unsigned long ops, unsigned long bytes) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bench_result result = { name, ops, bytes };
+    result.seconds = (end.tv_sec - started.tv_sec) + (end.tv_nsec - started.tv_nsec) / 1e9;
+    memcpy(result.syscalls, fsstat_syscalls, sizeof(fsstat_syscalls));
+    return result;
+}
+
+static void report(int config, bench_result *result) {
+    unsigned long total = 0;
+    for (int i = 0; i < NUM_SYSCALLS; i++) {
+        total += result->syscalls[i];
+    }
+    double ops_per_sec = result->seconds > 0 ? result->ops / result->seconds : 0;
+    double mb_per_sec = result->seconds > 0 ? result->bytes / result->seconds / (1 << 20) : 0;
+    if (json) {
+        fprintf(out, "%s\n  {\"config\": %d, \"block_size\": %d, \"workload\": \"%s\", \"ops\": %lu, \"bytes\": %lu, "
+            "\"seconds\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, \"syscalls\": %lu",
+            first_row ? "[" : ",", config, 256 << config, result->name, result->ops, result->bytes,
+            result->seconds, ops_per_sec, mb_per_sec, total);
+        for (int i = 0; i < NUM_SYSCALLS; i++) {
+            fprintf(out, ", \"%s\": %lu", fsstat_syscall_names[i], result->syscalls[i]);
+        }
+        fprintf(out, "}");
+    } else {
+        if (first_row) {
+            fprintf(out, "config,block_size,workload,ops,bytes,seconds,ops_per_sec,mb_per_sec,syscalls");
+            for (int i = 0; i < NUM_SYSCALLS; i++) {
+                fprintf(out, ",%s", fsstat_syscall_names[i]);
+            }
+            fprintf(out, "\n");
+        }
+        fprintf(out, "%d,%d,%s,%lu,%lu,%.6f,%.1f,%.2f,%lu", config, 256 << config, result->name,
+            result->ops, result->bytes, result->seconds, ops_per_sec, mb_per_sec, total);
+        for (int i = 0; i < NUM_SYSCALLS; i++) {
+            fprintf(out, ",%lu", result->syscalls[i]);
+        }
+        fprintf(out, "\n");
+    }
+    first_row = false;
+    fflush(out);
+}
+
+static int write_file(const char *name, int mode, unsigned long bytes) {
+    int fd = f_open(name, mode);
+    if (fd == -1) {
+        return -1;
+    }
+    for (unsigned long done = 0; done < bytes; done += IO_SIZE) {
+        int n = bytes - done < IO_SIZE ? bytes - done : IO_SIZE;
+        if (f_write(fd, buf, n) != n) {
+            f_close(fd);
+            return -1;
+        }
+    }
+    return f_close(fd);
+}
+
+// Creates empty files until the directory holds count of them
+static int fill_directory(int *files, int count) {
+    char name[32];
+    for (; *files < count; (*files)++) {
+        snprintf(name, sizeof(name), "entry%05d", *files);
+        int fd = f_open(name, F_WRITE);
+        if (fd == -1) {
+            return -1;
+        }
+        f_close(fd);
+    }
+    return 0;
+}
+
+// Lists the root directory with the listing itself going to /dev/null
+static bench_result bench_ls(const char *name) {
+    fflush(stdout);
+    fflush(stderr);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int saved_stderr = dup(STDERR_FILENO);
+    int dev_null = open("/dev/null", O_WRONLY);
+    dup2(dev_null, STDOUT_FILENO);
+    dup2(dev_null, STDERR_FILENO);
+    bench_start();
+    for (int i = 0; i < LS_REPEATS; i++) {
+        f_ls(NULL);
+        fflush(stdout);
+    }
+    bench_result result = bench_stop(name, LS_REPEATS, 0);
+    dup2(saved_stdout, STDOUT_FILENO);
+    dup2(saved_stderr, STDERR_FILENO);
+    close(saved_stdout);
+    close(saved_stderr);
+    close(dev_null);
+    return result;
+}
+
+static int cp_host(const char *from, const char *to, bool to_host) {
+    char *args[] = { "cp", to_host ? (char *)from : "-h", to_host ? "-h" : (char *)from, (char *)to, NULL };
+    struct parsed_command *cmd = malloc(sizeof(struct parsed_command) + sizeof(char **));
+    memset(cmd, 0, sizeof(struct parsed_command));
+    cmd->num_commands = 1;
+    cmd->commands[0] = args;
+    int copied = f_cp(cmd);
+    free(cmd);
+    return copied;
+}
+
+static int run_config(int config, const char *dir) {
+    char image[4096], host_in[4096], host_out[4096];
+    snprintf(image, sizeof(image), "%s/pennbench-%d.img", dir, config);
+    snprintf(host_in, sizeof(host_in), "%s/pennbench-%d.in", dir, config);
+    snprintf(host_out, sizeof(host_out), "%s/pennbench-%d.out", dir, config);
+    unlink(image);
+    if (mkfs(image, 32, config) == -1 || f_mount(image, NULL, false) == -1) {
+        fprintf(stderr, "Failed to create %s\n", image);
+        return -1;
+    }
+
+    // A quarter of the image, so that every workload fits next to the others
+    int block_size = 256 << config;
+    unsigned long capacity = (unsigned long)((32 * block_size / 2 > 0xFFFF ? 0xFFFF : 32 * block_size / 2) - 2) * block_size;
+    unsigned long data_bytes = capacity / 4 < MAX_DATA_BYTES ? capacity / 4 : MAX_DATA_BYTES;
+    bench_result result;
+
+    bench_start();
+    if (write_file("seq", F_WRITE, data_bytes) == -1) {
+        return -1;
+    }
+    f_sync();
+    result = bench_stop("seq_write", data_bytes / IO_SIZE, data_bytes);
+    report(config, &result);
+
+    bench_start();
+    int fd = f_open("seq", F_READ);
+    unsigned long read_bytes = 0;
+    int n;
+    while ((n = f_read(fd, IO_SIZE, buf)) > 0) {
+        read_bytes += n;
+    }
+    result = bench_stop("seq_read", read_bytes / IO_SIZE, read_bytes);
+    report(config, &result);
+
+    srand(config + 1);
+    bench_start();
+    for (int i = 0; i < RANDOM_READS; i++) {
+        f_lseek(fd, (rand() % (data_bytes / IO_SIZE)) * IO_SIZE, F_SEEK_SET);
+        f_read(fd, IO_SIZE, buf);
+    }
+    result = bench_stop("rand_read_4k", RANDOM_READS, (unsigned long)RANDOM_READS * IO_SIZE);
+    report(config, &result);
+
+    // The same file scanned over and over, as analytics commands do
+    bench_start();
+    for (int pass = 0; pass < SCAN_PASSES; pass++) {
+        f_lseek(fd, 0, F_SEEK_SET);
+        while ((n = f_read(fd, IO_SIZE, buf)) > 0) {
+            scan_sum += sum_bytes(buf, n);
+        }
+    }
+    result = bench_stop("scan_read", SCAN_PASSES, SCAN_PASSES * read_bytes);
+    report(config, &result);
+
+    bench_start();
+    char *mapped = f_mmap(fd, 0, read_bytes, PROT_READ);
+    if (mapped != NULL) {
+        for (int pass = 0; pass < SCAN_PASSES; pass++) {
+            scan_sum += sum_bytes(mapped, read_bytes);
+        }
+        f_munmap(mapped, read_bytes);
+        result = bench_stop("scan_mmap", SCAN_PASSES, SCAN_PASSES * read_bytes);
+        report(config, &result);
+    }
+    f_close(fd);
+
+    char name[32];
+    bench_start();
+    for (int i = 0; i < SMALL_FILES; i++) {
+        snprintf(name, sizeof(name), "small%04d", i);
+        write_file(name, F_WRITE, SMALL_FILE_SIZE);
+    }
+    for (int i = 0; i < SMALL_FILES; i++) {
+        snprintf(name, sizeof(name), "small%04d", i);
+        f_unlink(name);
+    }
+    result = bench_stop("create_delete", 2 * SMALL_FILES, (unsigned long)SMALL_FILES * SMALL_FILE_SIZE);
+    report(config, &result);
+
+    int log_lines = data_bytes / 64 < LOG_LINES ? data_bytes / 64 : LOG_LINES;
+    bench_start();
+    fd = f_open("log", F_APPEND);
+    for (int i = 0; i < log_lines; i++) {
+        int length = snprintf(buf, sizeof(buf), "%08d pennbench audit line for the append workload\n", i);
+        f_write(fd, buf, length);
+    }
+    f_close(fd);
+    f_sync();
+    directory_entry log_entry;
+    fs_lock();
+    f_find_file("log", &log_entry);
+    fs_unlock();
+    result = bench_stop("append_log", log_lines, log_entry.size);
+    report(config, &result);
+    f_unlink("log");
+
+    // Host side of the round trip, the same size as the sequential file
+    int host_fd = open(host_in, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (unsigned long done = 0; done < data_bytes; done += IO_SIZE) {
+        write(host_fd, buf, IO_SIZE);
+    }
+    close(host_fd);
+    f_unlink("seq");
+    bench_start();
+    int copied = cp_host(host_in, "copy", false) != -1 && cp_host("copy", host_out, true) != -1;
+    result = bench_stop("cp_h_round_trip", 2, 2 * data_bytes);
+    if (copied) {
+        report(config, &result);
+    }
+    f_unlink("copy");
+    unlink(host_in);
+    unlink(host_out);
+
+    // Growing the directory is timed too, every create scans the entries before it
+    int files = 0;
+    bench_start();
+    if (fill_directory(&files, 1000) == 0) {
+        result = bench_stop("create_1k", files, 0);
+        report(config, &result);
+        result = bench_ls("ls_1k");
+        report(config, &result);
+    }
+    bench_start();
+    if (fill_directory(&files, 10000) == 0) {
+        result = bench_stop("create_10k", files - 1000, 0);
+        report(config, &result);
+        result = bench_ls("ls_10k");
+        report(config, &result);
+    }
+
+    f_umount(NULL);
+    unlink(image);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = "/tmp";
+    const char *out_name = NULL;
+    int only_config = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            only_config = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_name = argv[++i];
+        } else {
+            fprintf(stderr, "usage: pennbench [-j] [-c CONFIG] [-d DIR] [-o FILE]\n");
+            return 1;
+        }
+    }
+    out = out_name != NULL ? fopen(out_name, "w") : stdout;
+    if (out == NULL) {
+        fprintf(stderr, "Failed to open %s\n", out_name);
+        return 1;
+    }
+
+    logFile = fopen("/dev/null", "w");
+    k_system_init();
+    for (int i = 0; i < IO_SIZE; i++) {
+        buf[i] = 'a' + i % 26;
+    }
+
+    int failed = 0;
+    for (int config = 0; config <= 4; config++) {
+        if (only_config != -1 && config != only_config) {
+            continue;
+        }
+        if (run_config(config, dir) == -1) {
+            fprintf(stderr, "Block size configuration %d failed\n", config);
+            failed = 1;
+        }
+    }
+    if (json && !first_row) {
+        fprintf(out, "\n]\n");
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return failed;
+}
@@ -13,7 +13,7 @@ const char* pennos_errors[] = {
     "Process was already waited on",
     "Status was not found",
     "PCB was not found",
-    "Error with Process status"
+    "Error with Process status",
     "Too many files open", 
     "No space to allocate Deque",
     "Invalid file descriptor error",
@@ -6,7 +6,11 @@
 #include <sys/mman.h>
 #include <time.h>
 #include "f_pennos.h"
+#include "scheduler.h"
+#include "fsstat.h"
+#include "fstrace.h"
 #include <stdarg.h>
+#include <sched.h>
 
 // error macros
 #define ERRNO errno
@@ -17,27 +21,141 @@ extern Deque* global_pcbs;
 extern pid_t current_pid;
 extern PCB* current_pcb;
 extern FILE* logFile;
+extern int current_quantum;
 
 // Extern variables from pennfat.c
 extern int fs_fd;
 extern uint16_t *fat;
 extern size_t fat_size;
 extern int block_size;
+extern int default_volume;
+extern pennfat_volume volumes[MAX_VOLUMES];
 
 FileDescriptor fd_table[MAX_OPEN_FILES];
+writeback_state writeback = { FLUSHD_DIRTY_AGE, FLUSHD_DIRTY_BYTES };
+
+// Advisory locks held, and the processes waiting for one in the order they asked
+file_lock flock_holders[MAX_OPEN_FILES];
+int num_flock_holders = 0;
+file_lock flock_waiters[MAX_OPEN_FILES];
+int num_flock_waiters = 0;
+
+// Ranges mapped with f_mmap, a slot is free while its addr is NULL
+file_mapping mappings[MAX_MAPPINGS];
+
+// Asynchronous reads and writes, a handle is a slot
+async_io async_ios[MAX_ASYNC_IO];
+
+// While set, read_fs_file and write_fs_file queue their host transfers on it instead of doing them
+static io_request *pending_io = NULL;
+
+// Whether a transfer an I/O worker has not finished touches a file, or a whole volume if name is NULL, or any
+// volume if volume is -1; an asynchronous caller does not wait for its own asynchronous transfers
+static bool io_busy(int volume, const char *name, bool async) {
+    for (int handle = 0; handle < MAX_ASYNC_IO; handle++) {
+        async_io *io = &async_ios[handle];
+        if (io->request == NULL || io_done(io->request)
+            || (async && io->async && current_pcb != NULL && io->pid == current_pcb->pid)) {
+            continue;
+        }
+        // The transfers of a cp may touch any file
+        if (io->global_fd == -1 || volume == -1) {
+            return true;
+        }
+        if (fd_table[io->global_fd].volume == volume && (name == NULL || strcmp(fd_table[io->global_fd].dir_entry.name, name) == 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void release_global_fd(int global_fd);
+
+// Frees a slot whose transfers are done, letting go of its file; the caller holds fs_lock()
+static void free_io_slot(int handle) {
+    int global_fd = async_ios[handle].global_fd;
+    io_request_free(async_ios[handle].request);
+    memset(&async_ios[handle], 0, sizeof(async_io));
+    if (global_fd != -1) {
+        release_global_fd(global_fd);
+    }
+}
+
+// Waits until no transfer an I/O worker has not finished touches a file (see io_busy), the caller holds fs_lock()
+// and selects its volume again afterwards. Frees the slots f_async_release left to their transfers on the way.
+static void wait_for_io(int volume, const char *name, bool async) {
+    unsigned long seen = io_completions();
+    while (io_busy(volume, name, async)) {
+        fs_unlock();
+        io_sleep(seen);
+        fs_lock();
+        seen = io_completions();
+    }
+    for (int handle = 0; handle < MAX_ASYNC_IO; handle++) {
+        if (async_ios[handle].request != NULL && async_ios[handle].pid == -1 && io_done(async_ios[handle].request)) {
+            free_io_slot(handle);
+        }
+    }
+}
+
+// Waits until no transfer touches the file at a path, the caller holds fs_lock()
+static void wait_for_path_io(const char *path) {
+    const char *name;
+    int volume = resolve_path(path, &name);
+    if (volume != -1) {
+        wait_for_io(volume, name, false);
+    }
+}
 
 int update_fs_dir_entry(directory_entry dir_entry, off_t position) {
     int offset = lseek(fs_fd, position, SEEK_SET);
     if (offset == -1) {
         return -1;
     }
-    int write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
+    int write_bytes = write_dir_entry(&dir_entry);
     if (write_bytes == -1) {
         return -1;
     }
     return 0;
 }
 
+// Writes back the directory entry an open file has been holding back
+int flush_dir_entry(int global_fd) {
+    if (fd_table[global_fd].fd_type != FD_FILE || fd_table[global_fd].dirty_since == 0) {
+        return 0;
+    }
+    fd_table[global_fd].dirty_since = 0;
+    select_volume(fd_table[global_fd].volume);
+    directory_entry temp_dir_entry;
+    int dir_position = find_file(fd_table[global_fd].dir_entry.name, &temp_dir_entry);
+    if (dir_position == -1) {
+        return -1; // Removed or renamed while open, nothing left to update
+    }
+    return update_fs_dir_entry(fd_table[global_fd].dir_entry, dir_position);
+}
+
+// Writes back every held back directory entry that has been dirty for at least min_age seconds
+int flush_dir_entries(int min_age) {
+    time_t now = time(NULL);
+    int flushed = 0;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fd_table[i].fd_type == FD_FILE && fd_table[i].dirty_since != 0 && now - fd_table[i].dirty_since >= min_age) {
+            flush_dir_entry(i);
+            flushed++;
+        }
+    }
+    return flushed;
+}
+
+// Returns volume, or -1 after reporting it if the volume is mounted read-only
+int writable_volume(int volume) {
+    if (volume != -1 && volumes[volume].read_only) {
+        p_perror("The volume is mounted read-only", PermissionError);
+        return -1;
+    }
+    return volume;
+}
+
 int find_global_open_fd() {
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (fd_table[i].fd_type == FD_UNINIT) {
@@ -76,22 +194,43 @@ int add_fd_to_pcb(int global_i) {
     return -1;
 }
 
-int find_fat() {
-    int open_fat_value = -1;
-    int blocks_in_fat = fat_size / block_size;
-    int num_fat_entries = block_size * blocks_in_fat / 2;
+// Returns the global fd of a file of the volume that is open, or -1
+static int find_open_file(int volume, const char *name) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fd_table[i].fd_type == FD_FILE && fd_table[i].volume == volume && strcmp(name, fd_table[i].dir_entry.name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
 
-    for (int i = 1; i < num_fat_entries; i++) {
-        if (fat[i] == 0) {
-            open_fat_value = i;
-            break;
+// Whether an open file is mapped with f_mmap, its blocks may be aliased by the mapping
+static bool file_mapped(int global_fd) {
+    for (int slot = 0; slot < MAX_MAPPINGS; slot++) {
+        if (mappings[slot].addr != NULL && mappings[slot].global_fd == global_fd) {
+            return true;
         }
     }
-    
-    return open_fat_value;
+    return false;
 }
 
-int f_open(const char *fname, int mode) {
+int open_fs_file(const char *fname, int mode) {
+    // Select the file's volume
+    int volume = resolve_path(fname, &fname);
+    if (volume == -1) {
+        p_perror("File not found", FileNotFoundError);
+        return -1;
+    }
+    if (mode != F_READ && writable_volume(volume) == -1) {
+        return -1;
+    }
+
+    // First check if file is already on the global table, and set if possible
+    int global_index = find_open_file(volume, fname);
+    if (global_index != -1) {
+        flush_dir_entry(global_index); // The entry on disk must be current before it is read
+    }
+
     // Check if file exists
     directory_entry dir_entry;
     int position;
@@ -101,15 +240,6 @@ int f_open(const char *fname, int mode) {
         return -1;
     }
 
-    // First check if file is already on the global table, and set if possible
-    int global_index = -1;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (strcmp(fname, fd_table[i].dir_entry.name) == 0) {
-            global_index = i;
-            break;
-        }
-    }
-
     switch (mode) {
         // F_READ, check if file has read permissions
         case F_READ: {
@@ -129,6 +259,7 @@ int f_open(const char *fname, int mode) {
                 
                 fd_table[global_index].dir_entry = dir_entry;
                 fd_table[global_index].fd_type = FD_FILE;
+                fd_table[global_index].volume = volume;
                 fd_table[global_index].mode = F_READ;
                 fd_table[global_index].offset = 0;
                 fd_table[global_index].ref_count = 1;
@@ -175,6 +306,7 @@ int f_open(const char *fname, int mode) {
                 // Add to global table
                 fd_table[global_index].dir_entry = dir_entry;
                 fd_table[global_index].fd_type = FD_FILE;
+                fd_table[global_index].volume = volume;
                 fd_table[global_index].mode = F_WRITE;
                 fd_table[global_index].offset = 0;
                 fd_table[global_index].ref_count = 1;
@@ -184,6 +316,11 @@ int f_open(const char *fname, int mode) {
                     p_perror("Permission denied", PermissionError);
                     return -1;
                 }
+                // Truncating frees the blocks a mapping may still read and write
+                if (file_mapped(global_index)) {
+                    p_perror("File is mapped", FileIsOpenError);
+                    return -1;
+                }
                 rm(fname);
                 touch_single(fname);
                 position = find_file(fname, &dir_entry);
@@ -223,6 +360,7 @@ int f_open(const char *fname, int mode) {
                 // Add to global table
                 fd_table[global_index].dir_entry = dir_entry;
                 fd_table[global_index].fd_type = FD_FILE;
+                fd_table[global_index].volume = volume;
                 fd_table[global_index].mode = F_APPEND;
                 fd_table[global_index].offset = dir_entry.size; // Set offset to end of file
                 fd_table[global_index].ref_count = 1;
@@ -249,7 +387,109 @@ int f_open(const char *fname, int mode) {
     return -1;
 }
 
-int f_close(int fd) {
+// Appends a call that finished to the trace being recorded, if any
+static void trace(fs_op op, const fsstat_timer *timer, int result, int fd, int offset, int count, int whence, char *const *names) {
+    if (!fstrace_active()) {
+        return;
+    }
+    fs_lock();
+    fstrace_add(op, timer, current_pcb != NULL ? current_pcb->pid : 0, result, fd, offset, count, whence, names);
+    fs_unlock();
+}
+
+int f_open(const char *fname, int mode) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    fs_lock();
+    if (mode == F_WRITE) {
+        // Truncating frees blocks a worker may still be transferring
+        wait_for_path_io(fname);
+    }
+    int fd = open_fs_file(fname, mode);
+    fs_unlock();
+    fsstat_end(FS_OP_OPEN, &timer, fd, -1);
+    trace(FS_OP_OPEN, &timer, fd, mode, 0, 0, 0, (char *[]){ (char *)fname, NULL });
+    return fd;
+}
+
+// Removes entry i of a lock table
+static void flock_remove(file_lock *table, int *count, int i) {
+    memmove(&table[i], &table[i + 1], (*count - i - 1) * sizeof(file_lock));
+    (*count)--;
+}
+
+// Whether a lock on a file would be granted now, given its holders other than pid
+static bool flock_compatible(int global_fd, pid_t pid, int operation) {
+    for (int i = 0; i < num_flock_holders; i++) {
+        if (flock_holders[i].global_fd == global_fd && flock_holders[i].pid != pid
+            && (operation == LOCK_EX || flock_holders[i].operation == LOCK_EX)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Hands a file's lock to its waiters in FIFO order, as far as the first one that has to keep waiting
+static void flock_grant(int global_fd) {
+    for (int i = 0; i < num_flock_waiters; ) {
+        file_lock *waiter = &flock_waiters[i];
+        if (waiter->global_fd != global_fd) {
+            i++;
+            continue;
+        }
+        if (!flock_compatible(global_fd, waiter->pid, waiter->operation)) {
+            return;
+        }
+        flock_holders[num_flock_holders++] = *waiter;
+        PCB *pcb = waiter->pcb;
+        flock_remove(flock_waiters, &num_flock_waiters, i);
+        unblock_process(pcb);
+    }
+}
+
+// Releases the lock pid holds or waits for on a file; called with the file system locked
+static void flock_drop(int global_fd, pid_t pid) {
+    bool released = false;
+    for (int i = 0; i < num_flock_holders; i++) {
+        if (flock_holders[i].global_fd == global_fd && flock_holders[i].pid == pid) {
+            flock_remove(flock_holders, &num_flock_holders, i);
+            released = true;
+            break;
+        }
+    }
+    for (int i = 0; i < num_flock_waiters; i++) {
+        if (flock_waiters[i].global_fd == global_fd && flock_waiters[i].pid == pid) {
+            flock_remove(flock_waiters, &num_flock_waiters, i);
+            released = true;
+            break;
+        }
+    }
+    if (released) {
+        flock_grant(global_fd);
+    }
+}
+
+// Drops a reference to an open file, writing it back once nothing holds it open
+static void release_global_fd(int global_fd) {
+    // Under the lock, so the slot cannot be opened again and handed out between the count and the reset
+    fs_lock();
+    fd_table[global_fd].ref_count -= 1;
+    if (fd_table[global_fd].ref_count == 0) {
+        flush_dir_entry(global_fd);
+        // Selected first, the size cap is in blocks of the file's own volume
+        if (fd_table[global_fd].mode != F_READ && select_volume(fd_table[global_fd].volume) != -1
+            && fd_table[global_fd].dir_entry.size <= DEDUP_CLOSE_BLOCKS * block_size
+            && !io_busy(fd_table[global_fd].volume, NULL, false)) {
+            // Written files are matched against the rest of a deduplicated volume, unless workers are writing
+            // to it. Matching hashes the whole file with the lock held, larger ones wait for the next f_dedup.
+            dedup_name(fd_table[global_fd].dir_entry.name);
+        }
+        memset(&fd_table[global_fd], 0, sizeof(fd_table[global_fd]));
+    }
+    fs_unlock();
+}
+
+static int close_fd(int fd) {
     if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
         p_perror("Invalid file descriptor", InvalidFileDescriptorError);
         return -1;
@@ -259,11 +499,11 @@ int f_close(int fd) {
     int global_fd = current_pcb->open_fds[fd];
     // Only decrement ref_count if file is a file
     if (fd_table[global_fd].fd_type == FD_FILE) {
-        // Decrement ref_count, if 0, remove from global table
-        fd_table[global_fd].ref_count -= 1;
-        if (fd_table[global_fd].ref_count == 0) {
-            memset(&fd_table[global_fd], 0, sizeof(fd_table[global_fd]));
-        }
+        fs_lock();
+        flock_drop(global_fd, current_pcb->pid);
+        fs_unlock();
+        // Removed from the global table once no descriptor or mapping holds it
+        release_global_fd(global_fd);
     }
 
     // Remove from pcb
@@ -273,30 +513,210 @@ int f_close(int fd) {
     return 0;
 }
 
-int f_unlink(const char* fname){
+int f_close(int fd) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int closed = close_fd(fd);
+    fsstat_end(FS_OP_CLOSE, &timer, closed, -1);
+    trace(FS_OP_CLOSE, &timer, closed, fd, 0, 0, 0, NULL);
+    return closed;
+}
+
+static int flock_fd(int fd, int operation) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_pcb->open_fds[fd] == -1
+        || fd_table[current_pcb->open_fds[fd]].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+    bool nonblocking = operation & LOCK_NB;
+    operation &= ~LOCK_NB;
+    if (operation != LOCK_SH && operation != LOCK_EX && operation != LOCK_UN) {
+        p_perror("Invalid argument: operation", ArgumentNotFoundError);
+        return -1;
+    }
+
+    int global_fd = current_pcb->open_fds[fd];
+    pid_t pid = current_pcb->pid;
+    fs_lock();
+    for (int i = 0; i < num_flock_holders; i++) {
+        if (flock_holders[i].global_fd == global_fd && flock_holders[i].pid == pid && flock_holders[i].operation == operation) {
+            fs_unlock();
+            return 0; // Already held
+        }
+    }
+    // Like flock(2), converting a lock is not atomic: it is released, then asked for again
+    flock_drop(global_fd, pid);
+    if (operation == LOCK_UN) {
+        fs_unlock();
+        return 0;
+    }
+
+    // Queued waiters go first, so a stream of readers cannot starve a writer
+    bool queued = false;
+    for (int i = 0; i < num_flock_waiters && !queued; i++) {
+        queued = flock_waiters[i].global_fd == global_fd;
+    }
+    file_lock request = { global_fd, pid, operation, current_pcb };
+    if (!queued && flock_compatible(global_fd, pid, operation)) {
+        if (num_flock_holders == MAX_OPEN_FILES) {
+            fs_unlock();
+            p_perror("Too many file locks", TooManyFilesOpenError);
+            return -1;
+        }
+        flock_holders[num_flock_holders++] = request;
+        fs_unlock();
+        return 0;
+    }
+    if (nonblocking) {
+        fs_unlock();
+        p_perror("The file is locked by another process", FileIsOpenError);
+        return -1;
+    }
+    if (num_flock_waiters == MAX_OPEN_FILES) {
+        fs_unlock();
+        p_perror("Too many file locks", TooManyFilesOpenError);
+        return -1;
+    }
+    flock_waiters[num_flock_waiters++] = request;
+
+    // Block until flock_grant moves the request over to the holders
+    bool waiting = true;
+    while (waiting) {
+        current_pcb->status = BLOCKED;
+        fs_unlock();
+        while (current_pcb->status == BLOCKED);
+        fs_lock();
+        waiting = false;
+        for (int i = 0; i < num_flock_waiters && !waiting; i++) {
+            waiting = flock_waiters[i].pid == pid && flock_waiters[i].global_fd == global_fd;
+        }
+    }
+    fs_unlock();
+    return 0;
+}
+
+int f_flock(int fd, int operation) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int locked = flock_fd(fd, operation);
+    fsstat_end(FS_OP_FLOCK, &timer, locked, -1);
+    trace(FS_OP_FLOCK, &timer, locked, fd, 0, 0, operation, NULL);
+    return locked;
+}
+
+void f_flock_release(pid_t pid) {
+    fs_lock();
+    for (int global_fd = 0; global_fd < MAX_OPEN_FILES; global_fd++) {
+        flock_drop(global_fd, pid);
+    }
+    fs_unlock();
+}
+
+static int unlink_fs_file(const char* fname){
+    fs_lock();
+    wait_for_path_io(fname);
+    flush_dir_entries(0);
+
     // Check if file exists
     directory_entry dir_entry;
-    int position;
-    position = find_file(fname, &dir_entry);
-    if (position == -1) { // Error if file not found
+    int volume = resolve_path(fname, &fname);
+    if (volume == -1 || find_file(fname, &dir_entry) == -1) { // Error if file not found
+        fs_unlock();
         p_perror("File not found", FileNotFoundError);
         return -1;
     }
 
     // Remove file from global table
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (strcmp(fname, fd_table[i].dir_entry.name) == 0) {
-            p_perror("File is open", FileIsOpenError);
-            return -1;
-        }
+    if (find_open_file(volume, fname) != -1) {
+        fs_unlock();
+        p_perror("File is open", FileIsOpenError);
+        return -1;
     }
 
     // Remove file from fs
     rm(fname);
+    fs_unlock();
     return 0;
 }
 
-int f_read(int fd, int n, char *buf) {
+int f_unlink(const char* fname) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int unlinked = unlink_fs_file(fname);
+    fsstat_end(FS_OP_UNLINK, &timer, unlinked, -1);
+    trace(FS_OP_UNLINK, &timer, unlinked, 0, 0, 0, 0, (char *[]){ (char *)fname, NULL });
+    return unlinked;
+}
+
+// Reads file data from a block, or queues the read on pending_io
+static ssize_t file_block_read(uint16_t block, int offset, char *buf, size_t n) {
+    if (pending_io == NULL || block_is_hole(block)) {
+        return block_read(block, offset, buf, n);
+    }
+    off_t position = fat_size + (off_t)(block - 1) * block_size + offset;
+    return io_request_add(pending_io, fs_fd, false, buf, n, position) == -1 ? -1 : (ssize_t)n;
+}
+
+// Writes file data to a block, or queues the write on pending_io
+static ssize_t file_block_write(uint16_t block, int offset, const char *buf, size_t n) {
+    if (pending_io == NULL) {
+        return block_write(block, offset, buf, n);
+    }
+    set_block_hole(block, false);
+    mark_block_dirty(block);
+    off_t position = fat_size + (off_t)(block - 1) * block_size + offset;
+    return io_request_add(pending_io, fs_fd, true, (char *)buf, n, position) == -1 ? -1 : (ssize_t)n;
+}
+
+// Reads from a file on a volume, the caller holds fs_lock()
+int read_fs_file(int global_fd, int n, char *buf) {
+    select_volume(fd_table[global_fd].volume);
+    int original_offset = fd_table[global_fd].offset;
+    int file_size = fd_table[global_fd].dir_entry.size;
+    if (n < 1 || original_offset >= file_size) {
+        return 0;
+    }
+
+    int total_bytes_to_read = n;
+    if (original_offset + n > file_size) {
+        total_bytes_to_read = file_size - original_offset;
+    }
+
+    // Get the the block number and offset within the block
+    int actual_offset = original_offset;
+    int fat_value = fd_table[global_fd].dir_entry.firstBlock;
+    while (actual_offset >= block_size && fat_value != 0xFFFF) {
+        fat_value = fat[fat_value];
+        actual_offset -= block_size;
+    }
+
+    int total_bytes_read = 0;
+    while (total_bytes_to_read > 0 && fat_value != 0xFFFF) {
+        int bytes_to_read = total_bytes_to_read;
+        if (actual_offset + bytes_to_read > block_size) {
+            bytes_to_read = block_size - actual_offset;
+        }
+
+        // Holes come back as zeros without touching the image
+        int read_bytes = file_block_read(fat_value, actual_offset, buf + total_bytes_read, bytes_to_read);
+        if (read_bytes != bytes_to_read) {
+            p_perror("Error reading from file", FileReadError);
+            return -1;
+        }
+        total_bytes_read += read_bytes;
+        fd_table[global_fd].offset += read_bytes;
+        total_bytes_to_read -= read_bytes;
+
+        // Go to next block
+        fat_value = fat[fat_value];
+        actual_offset = 0;
+    }
+    return total_bytes_read;
+}
+
+static int offload_io(int global_fd, char *buf, int n, bool write);
+
+static int read_fd(int fd, int n, char *buf) {
     if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
         p_perror("Invalid file descriptor", InvalidFileDescriptorError);
         return -1;
@@ -317,125 +737,136 @@ int f_read(int fd, int n, char *buf) {
         }
         return read_bytes;
     } else { // Reading from fs file
-        int actual_offset = fd_table[global_fd].offset;
-        int original_offset = actual_offset;
-        int fat_value = fd_table[global_fd].dir_entry.firstBlock;
-        if (fat_value == 0xFFFF) {
-            return 0;
-        }
-
-        // Get the the block number and offset within the block
-        while (actual_offset > block_size && fat_value != 0xFFFF) {
-            fat_value = fat[fat_value];
-            actual_offset -= block_size;
-        }
-        if (actual_offset >= block_size || actual_offset > fd_table[global_fd].dir_entry.size) {
-            return 0;
-        }
-
-        // Seek to correct position in file
-        int read_offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1) + actual_offset, SEEK_SET);
-        if (read_offset == -1) {
-            p_perror("Error seeking position", FileNotFoundError);
-            return -1;
-        }
-
-        int total_bytes_to_read;
-        if (original_offset + n < fd_table[global_fd].dir_entry.size) {
-            total_bytes_to_read = n;
-        } else {
-            total_bytes_to_read = fd_table[global_fd].dir_entry.size - original_offset;
-        }
-        int total_bytes_read = 0;
-        
-        while (total_bytes_to_read > 0) {
-            int bytes_to_read = total_bytes_to_read;
-            if (actual_offset + bytes_to_read > block_size) {
-                bytes_to_read = block_size - actual_offset;
-                actual_offset = 0;
-            }
-
-            int read_bytes = read(fs_fd, buf + total_bytes_read, bytes_to_read);
-            if (read_bytes != bytes_to_read) {
-                p_perror("Error reading from file", FileReadError);
-                return -1;
-            }
-            total_bytes_read += read_bytes;
-            fd_table[global_fd].offset += read_bytes;
-            total_bytes_to_read -= read_bytes;
-
-            // Go to next block
-            fat_value = fat[fat_value];
-            if (fat_value == 0xFFFF) {
-                return total_bytes_read;
-            }
-
-            read_offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-            if (read_offset == -1) {
-                p_perror("Error seeking position", FileNotFoundError);
-                return -1;
-            }
-        }
-        return total_bytes_read;
+        return offload_io(global_fd, buf, n, false);
     }
 }
 
-int f_write(int fd, const char *str, int n) {
-    // Check for valid file descriptor
-    if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
-        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
-        return -1;
-    }
+int f_read(int fd, int n, char *buf) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int read_bytes = read_fd(fd, n, buf);
+    fsstat_end(FS_OP_READ, &timer, read_bytes, read_bytes > 0 ? read_bytes : 0);
+    trace(FS_OP_READ, &timer, read_bytes, fd, 0, n, 0, NULL);
+    return read_bytes;
+}
 
-    // Get the global_fd, error check if its uninit or stdin
-    int global_fd = current_pcb->open_fds[fd];
-    if (fd_table[global_fd].fd_type != FD_FILE && fd_table[global_fd].fd_type != FD_STDOUT) {
-        p_perror("Improper file to write to: ", InvalidFileDescriptorError);
-        return -1;
+// Gives an open file its own copy of a block a snapshot holds, before the block is written
+int unshare_block(int global_fd, int prev_block, int block) {
+    if (!block_shared(block)) {
+        return block;
     }
-
-    // Write to stdout if fd is stdout
-    if (fd_table[global_fd].fd_type == FD_STDOUT) {
-        int write_bytes = write(STDOUT_FILENO, str, n);
-        if (write_bytes == -1) {
-            p_perror("Error writing to stdout", FileWriteError);
-            return -1;
-        }
-        return write_bytes;
+    int copy = cow_block(&fd_table[global_fd].dir_entry, prev_block, block);
+    if (copy != -1 && prev_block == 0xFFFF) {
+        // The old first block is free in the live FAT now, the entry cannot wait for flushd
+        fd_table[global_fd].dirty_since = time(NULL);
+        flush_dir_entry(global_fd);
     }
+    return copy;
+}
 
-    // Check if file has write permissions
-    if (fd_table[global_fd].mode == F_READ || fd_table[global_fd].mode == 0) {
-        p_perror("Permission denied", PermissionError);
+// Links a new block after prev_block (0xFFFF for an empty file), returns it or -1 if the volume is full
+int append_block(int global_fd, int prev_block) {
+    int block = fat_alloc(prev_block + 1);
+    if (block == -1) {
         return -1;
     }
+    if (prev_block != 0xFFFF) {
+        fat_set(prev_block, block);
+    } else {
+        fd_table[global_fd].dir_entry.firstBlock = block;
+    }
+    fat_set(block, 0xFFFF);
+    fd_table[global_fd].dir_entry.lastBlock = block;
+    return block;
+}
 
-    if (n < 1) {
+// Ends the transaction of a write the journal has no room left in for another block. The
+// directory entry is written as far as the write got first, so a crash keeps that much of it.
+static int write_split(int global_fd, int end) {
+    // A block may be appended and copied, and the entry written for the copy and here
+    if (journal_fits(5, 2)) {
         return 0;
     }
+    if (end > fd_table[global_fd].dir_entry.size) {
+        fd_table[global_fd].dir_entry.size = end;
+    }
+    fd_table[global_fd].dirty_since = time(NULL);
+    if (flush_dir_entry(global_fd) == -1 || journal_split() == -1) {
+        p_perror("Error writing to file", FileWriteError);
+        return -1;
+    }
+    return 0;
+}
 
+// Writes to a file on a volume for write_fs_file, which settles the directory entry
+static int write_fs_blocks(int global_fd, const char *str, int n) {
     int actual_offset = fd_table[global_fd].offset;
-    int original_offset = actual_offset;
     int fat_value = fd_table[global_fd].dir_entry.firstBlock;
-    if (actual_offset > fd_table[global_fd].dir_entry.size) {
-        p_perror("Error writing to file, offset > file size", FileWriteError);
-        return -1;
+    int file_size = fd_table[global_fd].dir_entry.size;
+
+    // Traverse through FAT by offset, remembering the block before so that
+    // the file can be extended right after its current last block. Blocks
+    // skipped past the end of the file become holes instead of being zeroed.
+    int prev_fat_value = 0xFFFF;
+    int block_start = 0;
+
+    // Appends start at the last block the directory entry names instead of walking the
+    // chain, unless the file has preallocated blocks past its end or its tail is shared
+    directory_entry *dir_entry = &fd_table[global_fd].dir_entry;
+    int num_blocks = (file_size + block_size - 1) / block_size;
+    uint16_t last_block = dir_entry->lastBlock;
+    if (num_blocks > 0 && dir_entry->allocSize <= file_size && actual_offset >= (num_blocks - 1) * block_size
+        && last_block != 0 && last_block != 0xFFFF && last_block < fat_num_entries() && fat[last_block] == 0xFFFF
+        && !block_shared(last_block) && !block_deduped(last_block)) {
+        fat_value = last_block;
+        block_start = (num_blocks - 1) * block_size;
+        actual_offset -= block_start;
     }
+    while (actual_offset >= block_size) {
+        if (write_split(global_fd, block_start) == -1) {
+            return -1;
+        }
+        if (fat_value == 0xFFFF && (fat_value = append_block(global_fd, prev_fat_value)) == -1) {
+            p_perror("No more space left", NoMoreSpaceError);
+            return -1;
+        }
 
-    // Traverse through FAT by offset
-    while (actual_offset > block_size && fat_value != 0xFFFF) {
+        // Every block after one shared with other files is theirs too, so the whole way
+        // to the written block has to become this file's own
+        if (block_deduped(fat_value) && (fat_value = unshare_block(global_fd, prev_fat_value, fat_value)) == -1) {
+            p_perror("No more space left", NoMoreSpaceError);
+            return -1;
+        }
+        if (block_start >= file_size && ((fat_value = unshare_block(global_fd, prev_fat_value, fat_value)) == -1 || set_block_hole(fat_value, true) == -1)) {
+            p_perror("Error creating hole", FileWriteError);
+            return -1;
+        }
+        prev_fat_value = fat_value;
         fat_value = fat[fat_value];
         actual_offset -= block_size;
+        block_start += block_size;
+    }
+
+    // Clear the stale tail between the old end of file and the write offset
+    if (fat_value != 0xFFFF && file_size > block_start && file_size - block_start < actual_offset) {
+        if (write_split(global_fd, block_start) == -1) {
+            return -1;
+        }
+        int gap = actual_offset - (file_size - block_start);
+        char zero_block[gap];
+        memset(zero_block, 0, gap);
+        if ((fat_value = unshare_block(global_fd, prev_fat_value, fat_value)) == -1) {
+            p_perror("No more space left", NoMoreSpaceError);
+            return -1;
+        }
+        if (block_write(fat_value, file_size - block_start, zero_block, gap) != gap) {
+            p_perror("Error writing to file", FileWriteError);
+            return -1;
+        }
     }
 
     int total_bytes_to_write = n;
     int total_bytes_written = 0;
-    int prev_fat_value = fat_value;
-    if (fat_value == 0xFFFF) {
-        fat_value = find_fat();
-        fat[fat_value] = 0xFFFF;
-        fd_table[global_fd].dir_entry.firstBlock = fat_value;
-    }
 
     while (total_bytes_to_write > 0) {
         int bytes_to_write = total_bytes_to_write;
@@ -443,51 +874,73 @@ int f_write(int fd, const char *str, int n) {
             bytes_to_write = block_size - actual_offset;
         }
 
-        // If new block is needed, find a new block
-        if (fat_value == 0xFFFF) {
-            int next_fat_value = find_fat();
-            if (next_fat_value == -1) {
-                p_perror("No more space left", NoMoreSpaceError);
-                break;
-            }
-            fat_value = next_fat_value;
-            if (prev_fat_value != 0xFFFF) {
-                fat[prev_fat_value] = fat_value;
-            }
-            fat[fat_value] = 0xFFFF;
+        if (write_split(global_fd, fd_table[global_fd].offset + total_bytes_written) == -1) {
+            break;
         }
 
-        int write_offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1) + actual_offset, SEEK_SET);
-        if (write_offset == -1) {
-            p_perror("Error seeking position", FileNotFoundError);
-            return -1;
+        // If new block is needed, look for one right after the previous block
+        if (fat_value == 0xFFFF && (fat_value = append_block(global_fd, prev_fat_value)) == -1) {
+            p_perror("No more space left", NoMoreSpaceError);
+            break;
         }
 
-        int write_bytes = write(fs_fd, str, bytes_to_write);
+        if ((fat_value = unshare_block(global_fd, prev_fat_value, fat_value)) == -1) {
+            p_perror("No more space left", NoMoreSpaceError);
+            break;
+        }
+
+        int write_bytes = file_block_write(fat_value, actual_offset, str + total_bytes_written, bytes_to_write);
         if (write_bytes != bytes_to_write) {
             p_perror("Error writing to file", FileWriteError);
             return -1;
         }
-        // fd_table[global_fd].offset += write_bytes;
         total_bytes_to_write -= write_bytes;
         total_bytes_written += write_bytes;
+        prev_fat_value = fat_value;
         fat_value = fat[fat_value];
         actual_offset = 0;
     }
 
+    // A write that ran into the end of the chain learns its last block, for files from older images
+    if (fat_value == 0xFFFF && prev_fat_value != 0xFFFF) {
+        dir_entry->lastBlock = prev_fat_value;
+    }
+
     // Update file size and offset
     fd_table[global_fd].offset += total_bytes_written;
     if (fd_table[global_fd].offset > fd_table[global_fd].dir_entry.size) {
         fd_table[global_fd].dir_entry.size = fd_table[global_fd].offset;
     }
-    directory_entry temp_dir_entry;
-    int dir_position = find_file(fd_table[global_fd].dir_entry.name, &temp_dir_entry);
-    update_fs_dir_entry(fd_table[global_fd].dir_entry, dir_position);
 
     return total_bytes_written;
 }
 
-int f_lseek(int fd, int offset, int whence) {
+// Writes to a file on a volume, the caller holds fs_lock()
+int write_fs_file(int global_fd, const char *str, int n) {
+    pennfat_volume *volume = &volumes[fd_table[global_fd].volume];
+    select_volume(fd_table[global_fd].volume);
+    directory_entry *dir_entry = &fd_table[global_fd].dir_entry;
+    uint32_t fat_writes = volume->fat_writes;
+    uint16_t first_block = dir_entry->firstBlock;
+    uint16_t last_block = dir_entry->lastBlock;
+    uint32_t num_blocks = (dir_entry->size + block_size - 1) / block_size;
+
+    int written = write_fs_blocks(global_fd, str, n);
+
+    // A changed chain, or a size that reaches into another block, goes into the journal with the
+    // write. Only the mtime and growth inside the last block wait for flushd, f_close or a sync.
+    if (fd_table[global_fd].dirty_since == 0) {
+        fd_table[global_fd].dirty_since = time(NULL);
+    }
+    if (volume->fat_writes != fat_writes || dir_entry->firstBlock != first_block || dir_entry->lastBlock != last_block
+        || (dir_entry->size + block_size - 1) / block_size != num_blocks) {
+        flush_dir_entry(global_fd);
+    }
+    return written;
+}
+
+static int write_fd(int fd, const char *str, int n) {
+    // Check for valid file descriptor
     if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
         p_perror("Invalid file descriptor", InvalidFileDescriptorError);
         return -1;
@@ -495,9 +948,683 @@ int f_lseek(int fd, int offset, int whence) {
 
     // Get the global_fd, error check if its uninit or stdin
     int global_fd = current_pcb->open_fds[fd];
-    if (fd_table[global_fd].fd_type != FD_FILE) {
-        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
-        return -1;
+    if (fd_table[global_fd].fd_type != FD_FILE && fd_table[global_fd].fd_type != FD_STDOUT) {
+        p_perror("Improper file to write to: ", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    // Write to stdout if fd is stdout
+    if (fd_table[global_fd].fd_type == FD_STDOUT) {
+        int write_bytes = write(STDOUT_FILENO, str, n);
+        if (write_bytes == -1) {
+            p_perror("Error writing to stdout", FileWriteError);
+            return -1;
+        }
+        return write_bytes;
+    }
+
+    // Check if file has write permissions
+    if (fd_table[global_fd].mode == F_READ || fd_table[global_fd].mode == 0) {
+        p_perror("Permission denied", PermissionError);
+        return -1;
+    }
+
+    if (n < 1) {
+        return 0;
+    }
+
+    return offload_io(global_fd, (char *)str, n, true);
+}
+
+int f_write(int fd, const char *str, int n) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int written = write_fd(fd, str, n);
+    fsstat_end(FS_OP_WRITE, &timer, written, written > 0 ? written : 0);
+    trace(FS_OP_WRITE, &timer, written, fd, 0, n, 0, NULL);
+    return written;
+}
+
+static int fallocate_fd(int fd, int length) {
+    if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    // Get the global_fd, error check if its uninit or stdin
+    int global_fd = current_pcb->open_fds[fd];
+    if (fd_table[global_fd].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    // Check if file has write permissions
+    if (fd_table[global_fd].mode == F_READ || fd_table[global_fd].mode == 0) {
+        p_perror("Permission denied", PermissionError);
+        return -1;
+    }
+
+    if (length < 0) {
+        p_perror("Invalid preallocation length", FileWriteError);
+        return -1;
+    }
+
+    // Link the blocks now, size only grows once data is actually written
+    fs_lock();
+    select_volume(fd_table[global_fd].volume);
+    if (journal_reserve(2 * ((length + block_size - 1) / block_size), 1) == -1) {
+        fs_unlock();
+        p_perror("Preallocation too large", FileWriteError);
+        return -1;
+    }
+    if (fallocate_chain(&fd_table[global_fd].dir_entry, length) == -1) {
+        fs_unlock();
+        p_perror("No more space left", NoMoreSpaceError);
+        return -1;
+    }
+    // The new blocks are only reachable through the entry, it commits with them
+    fd_table[global_fd].dirty_since = time(NULL);
+    flush_dir_entry(global_fd);
+    fs_unlock();
+
+    return 0;
+}
+
+int f_fallocate(int fd, int length) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int allocated = fallocate_fd(fd, length);
+    fsstat_end(FS_OP_FALLOCATE, &timer, allocated, -1);
+    trace(FS_OP_FALLOCATE, &timer, allocated, fd, 0, length, 0, NULL);
+    return allocated;
+}
+
+// Returns a free async_ios slot, or -1
+static int find_io_slot() {
+    for (int handle = 0; handle < MAX_ASYNC_IO; handle++) {
+        if (async_ios[handle].request == NULL) {
+            return handle;
+        }
+    }
+    return -1;
+}
+
+// Settles a read or write now and hands its host transfers to the I/O workers, the caller holds fs_lock() once.
+// Returns the handle, -1 if the read or write failed, or -2 if there is no slot for it.
+static int submit_io(int global_fd, char *buf, int n, bool write, bool async) {
+    wait_for_io(fd_table[global_fd].volume, fd_table[global_fd].dir_entry.name, async);
+    int handle = find_io_slot();
+    io_request *request = handle == -1 ? NULL : io_request_create();
+    if (request == NULL) {
+        return -2;
+    }
+    pending_io = request;
+    int bytes = n < 1 ? 0 : write ? write_fs_file(global_fd, buf, n) : read_fs_file(global_fd, n, buf);
+    pending_io = NULL;
+    if (bytes == -1) {
+        io_request_free(request);
+        return -1;
+    }
+    io_submit(request);
+    async_ios[handle] = (async_io) { request, global_fd, current_pcb->pid, bytes, async };
+    fd_table[global_fd].ref_count++;
+    return handle;
+}
+
+// Waits for the transfers of a slot and frees it, returns its bytes or -1 if a transfer failed
+static int await_io(int handle) {
+    ssize_t result = io_wait(async_ios[handle].request);
+
+    fs_lock();
+    int bytes = result == -1 ? -1 : async_ios[handle].bytes;
+    free_io_slot(handle);
+    fs_unlock();
+    return bytes;
+}
+
+// Keeps READAHEAD_BYTES past the offset of an F_FADV_SEQUENTIAL file loading, the caller holds fs_lock()
+static void read_ahead(int global_fd) {
+    FileDescriptor *file = &fd_table[global_fd];
+    if (file->advice != F_FADV_SEQUENTIAL) {
+        return;
+    }
+    int size = file->dir_entry.size;
+    int end = file->offset + READAHEAD_BYTES < size ? file->offset + READAHEAD_BYTES : size;
+    int start = file->readahead > file->offset && file->readahead - file->offset <= READAHEAD_BYTES ? file->readahead : file->offset;
+    // Topped up once half of it is used, so that small reads do not each cost a syscall
+    if (start < end && (end - start >= READAHEAD_BYTES / 2 || end == size)) {
+        select_volume(file->volume);
+        advise_chain(file->dir_entry.firstBlock, start, end - start, F_FADV_WILLNEED);
+        file->readahead = end;
+    }
+}
+
+// Drops what was just read or written from an F_FADV_NOREUSE file from the page cache, the caller holds fs_lock()
+static void drop_behind(int global_fd, int offset, int bytes) {
+    if (fd_table[global_fd].advice == F_FADV_NOREUSE && bytes > 0) {
+        select_volume(fd_table[global_fd].volume);
+        advise_chain(fd_table[global_fd].dir_entry.firstBlock, offset, bytes, F_FADV_DONTNEED);
+    }
+}
+
+// f_read and f_write of a file: large transfers go to an I/O worker while the process is blocked
+static int offload_io(int global_fd, char *buf, int n, bool write) {
+    bool offload = n >= OFFLOAD_MIN_BYTES && io_get_workers() > 0 && io_can_block();
+    fs_lock();
+    int handle = -2;
+    if (offload) {
+        handle = submit_io(global_fd, buf, n, write, false);
+    }
+    if (handle == -2) {
+        // Done right here, after any transfer of another process on the file
+        wait_for_io(fd_table[global_fd].volume, fd_table[global_fd].dir_entry.name, false);
+        int bytes = write ? write_fs_file(global_fd, buf, n) : read_fs_file(global_fd, n, buf);
+        if (!write) {
+            read_ahead(global_fd);
+        }
+        drop_behind(global_fd, fd_table[global_fd].offset - bytes, bytes);
+        fs_unlock();
+        return bytes;
+    }
+    if (handle >= 0 && !write) {
+        read_ahead(global_fd);
+    }
+    int end = fd_table[global_fd].offset;
+    fs_unlock();
+    if (handle == -1) {
+        return -1;
+    }
+    int bytes = await_io(handle);
+    if (bytes == -1) {
+        p_perror(write ? "Error writing to file" : "Error reading from file", write ? FileWriteError : FileReadError);
+    } else if (fd_table[global_fd].advice == F_FADV_NOREUSE) {
+        // Only once the worker is through with the pages
+        fs_lock();
+        drop_behind(global_fd, end - bytes, bytes);
+        fs_unlock();
+    }
+    return bytes;
+}
+
+// Settles an asynchronous read or write and hands its host transfers to the I/O workers
+static int submit_async(int fd, char *buf, int n, bool write) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_pcb->open_fds[fd] == -1
+        || fd_table[current_pcb->open_fds[fd]].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+    int global_fd = current_pcb->open_fds[fd];
+    if (write && (fd_table[global_fd].mode == F_READ || fd_table[global_fd].mode == 0)) {
+        p_perror("Permission denied", PermissionError);
+        return -1;
+    }
+
+    fs_lock();
+    int handle = submit_io(global_fd, buf, n, write, true);
+    fs_unlock();
+    if (handle == -2) {
+        p_perror("Too many asynchronous reads and writes", TooManyFilesOpenError);
+        return -1;
+    }
+    return handle;
+}
+
+int f_read_async(int fd, int n, char *buf) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int handle = submit_async(fd, buf, n, false);
+    fsstat_end(FS_OP_READ_ASYNC, &timer, handle, 0);
+    trace(FS_OP_READ_ASYNC, &timer, handle, fd, 0, n, 0, NULL);
+    return handle;
+}
+
+int f_write_async(int fd, const char *str, int n) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int handle = submit_async(fd, (char *)str, n, true);
+    fsstat_end(FS_OP_WRITE_ASYNC, &timer, handle, 0);
+    trace(FS_OP_WRITE_ASYNC, &timer, handle, fd, 0, n, 0, NULL);
+    return handle;
+}
+
+static int await_handle(int handle) {
+    if (handle < 0 || handle >= MAX_ASYNC_IO || async_ios[handle].request == NULL || !async_ios[handle].async
+        || async_ios[handle].pid != current_pcb->pid) {
+        p_perror("Invalid asynchronous I/O handle", ArgumentNotFoundError);
+        return -1;
+    }
+    int bytes = await_io(handle);
+    if (bytes == -1) {
+        p_perror("Error in asynchronous I/O", FileReadError);
+    }
+    return bytes;
+}
+
+int f_await(int handle) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int bytes = await_handle(handle);
+    fsstat_end(FS_OP_AWAIT, &timer, bytes, bytes > 0 ? bytes : 0);
+    trace(FS_OP_AWAIT, &timer, bytes, handle, 0, 0, 0, NULL);
+    return bytes;
+}
+
+void f_async_release(pid_t pid) {
+    fs_lock();
+    for (int handle = 0; handle < MAX_ASYNC_IO; handle++) {
+        if (async_ios[handle].request == NULL || async_ios[handle].pid != pid) {
+            continue;
+        }
+        // Process memory is never freed, so the workers may go on using its buffers: a slot still in flight
+        // is left to its transfers, for wait_for_io to free, rather than held up here with every process
+        if (io_done(async_ios[handle].request)) {
+            free_io_slot(handle);
+        } else {
+            async_ios[handle].pid = -1;
+        }
+    }
+    fs_unlock();
+}
+
+int f_ioworkers(int workers) {
+    if (workers > IOPOOL_MAX_WORKERS || (workers >= 0 && io_set_workers(workers) < 0)) {
+        p_perror("Could not set the I/O workers", ArgumentNotFoundError);
+        return -1;
+    }
+    fs_lock();
+    int in_flight = 0, async = 0;
+    long bytes = 0;
+    for (int handle = 0; handle < MAX_ASYNC_IO; handle++) {
+        if (async_ios[handle].request != NULL && !io_done(async_ios[handle].request)) {
+            in_flight++;
+            async += async_ios[handle].async;
+            bytes += async_ios[handle].bytes;
+        }
+    }
+    fprintf(stderr, "%d I/O workers, transfers of %d bytes or more offloaded\n", io_get_workers(), OFFLOAD_MIN_BYTES);
+    fprintf(stderr, "%d in flight (%d asynchronous), %ld bytes\n", in_flight, async, bytes);
+    fs_unlock();
+    return io_get_workers();
+}
+
+// Maps a range of an open file, storing the slot of the mapping in *slot_out
+static void *map_fd(int fd, int offset, int length, int prot, int *slot_out) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_pcb->open_fds[fd] == -1) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return NULL;
+    }
+    int global_fd = current_pcb->open_fds[fd];
+    if (fd_table[global_fd].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return NULL;
+    }
+    if ((prot & PROT_WRITE) && (fd_table[global_fd].mode == F_READ || fd_table[global_fd].mode == 0)) {
+        p_perror("Permission denied", PermissionError);
+        return NULL;
+    }
+    if (offset < 0 || length < 1 || prot == 0 || (prot & ~(PROT_READ | PROT_WRITE)) != 0) {
+        p_perror("Invalid mapping", ArgumentNotFoundError);
+        return NULL;
+    }
+
+    fs_lock();
+    wait_for_io(fd_table[global_fd].volume, fd_table[global_fd].dir_entry.name, false);
+    select_volume(fd_table[global_fd].volume);
+    directory_entry *dir_entry = &fd_table[global_fd].dir_entry;
+    int slot = 0;
+    while (slot < MAX_MAPPINGS && mappings[slot].addr != NULL) {
+        slot++;
+    }
+    if (slot == MAX_MAPPINGS) {
+        fs_unlock();
+        p_perror("Too many mappings", TooManyFilesOpenError);
+        return NULL;
+    }
+    if ((uint32_t)offset + length > dir_entry->size) {
+        fs_unlock();
+        p_perror("Mapping past the end of the file", FileReadError);
+        return NULL;
+    }
+
+    // A contiguous range is mapped straight from the image, mmap only needs a page aligned start
+    file_mapping *mapping = &mappings[slot];
+    char *base = MAP_FAILED;
+    int block = chain_extent(dir_entry->firstBlock, offset, length);
+    if (block != -1) {
+        off_t image_offset = fat_size + (off_t)(block - 1) * block_size + offset % block_size;
+        mapping->delta = image_offset % sysconf(_SC_PAGESIZE);
+        base = mmap(NULL, length + mapping->delta, prot, MAP_SHARED, fs_fd, image_offset - mapping->delta);
+        mapping->direct = base != MAP_FAILED;
+    }
+    if (base == MAP_FAILED) {
+        // A fragmented range gets a copy, read through the file like f_read
+        mapping->delta = 0;
+        base = malloc(length);
+        int saved_offset = fd_table[global_fd].offset;
+        fd_table[global_fd].offset = offset;
+        int read_bytes = base != NULL ? read_fs_file(global_fd, length, base) : -1;
+        fd_table[global_fd].offset = saved_offset;
+        if (read_bytes != length) {
+            free(base);
+            fs_unlock();
+            p_perror("Failed to map the file", FileReadError);
+            return NULL;
+        }
+    }
+    mapping->addr = base + mapping->delta;
+    mapping->length = length;
+    mapping->offset = offset;
+    mapping->prot = prot;
+    mapping->global_fd = global_fd;
+    mapping->pid = current_pcb->pid;
+    fd_table[global_fd].ref_count++;
+    *slot_out = slot;
+    fs_unlock();
+    return mapping->addr;
+}
+
+void *f_mmap(int fd, int offset, int length, int prot) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int slot = -1;
+    void *addr = map_fd(fd, offset, length, prot, &slot);
+    fsstat_end(FS_OP_MMAP, &timer, slot, -1);
+    trace(FS_OP_MMAP, &timer, slot, fd, offset, length, prot, NULL);
+    return addr;
+}
+
+// Unmaps a mapping, the caller holds fs_lock()
+static int unmap_slot(int slot) {
+    file_mapping *mapping = &mappings[slot];
+    int global_fd = mapping->global_fd;
+    int result = 0;
+    select_volume(fd_table[global_fd].volume);
+    if (mapping->prot & PROT_WRITE) {
+        if (mapping->direct) {
+            // The pages are the image already, a sync just needs to know which blocks they cover
+            int block = chain_extent(fd_table[global_fd].dir_entry.firstBlock, mapping->offset, mapping->length);
+            int num_blocks = (mapping->offset % block_size + mapping->length + block_size - 1) / block_size;
+            for (int i = 0; block != -1 && i < num_blocks; i++) {
+                mark_block_dirty(block + i);
+            }
+        } else {
+            int saved_offset = fd_table[global_fd].offset;
+            fd_table[global_fd].offset = mapping->offset;
+            if (write_fs_file(global_fd, mapping->addr, mapping->length) != mapping->length) {
+                result = -1;
+            }
+            fd_table[global_fd].offset = saved_offset;
+        }
+    }
+    if (mapping->direct) {
+        munmap(mapping->addr - mapping->delta, mapping->length + mapping->delta);
+    } else {
+        free(mapping->addr);
+    }
+    memset(mapping, 0, sizeof(file_mapping));
+    release_global_fd(global_fd);
+    return result;
+}
+
+// Unmaps the mapping at addr, storing its slot in *slot_out
+static int unmap_addr(void *addr, int length, int *slot_out) {
+    fs_lock();
+    int slot = 0;
+    while (slot < MAX_MAPPINGS && (addr == NULL || mappings[slot].addr != addr || mappings[slot].length != length)) {
+        slot++;
+    }
+    if (slot == MAX_MAPPINGS) {
+        fs_unlock();
+        p_perror("Not a mapping", ArgumentNotFoundError);
+        return -1;
+    }
+    *slot_out = slot;
+    int global_fd = mappings[slot].global_fd;
+    wait_for_io(fd_table[global_fd].volume, fd_table[global_fd].dir_entry.name, false);
+    int result = unmap_slot(slot);
+    fs_unlock();
+    if (result == -1) {
+        p_perror("Error writing the mapping back", FileWriteError);
+    }
+    return result;
+}
+
+int f_munmap(void *addr, int length) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int slot = -1;
+    int result = unmap_addr(addr, length, &slot);
+    fsstat_end(FS_OP_MUNMAP, &timer, result, -1);
+    trace(FS_OP_MUNMAP, &timer, result, slot, 0, length, 0, NULL);
+    return result;
+}
+
+void f_munmap_release(pid_t pid) {
+    fs_lock();
+    for (int slot = 0; slot < MAX_MAPPINGS; slot++) {
+        if (mappings[slot].addr != NULL && mappings[slot].pid == pid) {
+            unmap_slot(slot);
+        }
+    }
+    fs_unlock();
+}
+
+// Passes an f_fadvise hint on to the ranges of a file mapped straight from the image, the caller holds fs_lock()
+static void advise_mappings(int global_fd, int offset, int length, int advice) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    for (int slot = 0; slot < MAX_MAPPINGS; slot++) {
+        file_mapping *mapping = &mappings[slot];
+        if (mapping->addr == NULL || !mapping->direct || mapping->global_fd != global_fd) {
+            continue;
+        }
+        int start = offset > mapping->offset ? offset : mapping->offset;
+        int end = mapping->offset + mapping->length;
+        if (length > 0 && offset + length < end) {
+            end = offset + length;
+        }
+        if (start >= end) {
+            continue;
+        }
+        // The image mapping starts delta bytes before addr, on a page boundary as madvise wants
+        char *base = mapping->addr - mapping->delta;
+        size_t first = (mapping->delta + start - mapping->offset) / page_size * page_size;
+        advise_mapping(base + first, mapping->delta + end - mapping->offset - first, advice);
+    }
+}
+
+static int fadvise_fd(int fd, int offset, int length, int advice) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES || current_pcb->open_fds[fd] == -1
+        || fd_table[current_pcb->open_fds[fd]].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+    if (offset < 0 || length < 0 || advice < F_FADV_NORMAL || advice > F_FADV_NOREUSE) {
+        p_perror("Invalid advice", ArgumentNotFoundError);
+        return -1;
+    }
+    int global_fd = current_pcb->open_fds[fd];
+    FileDescriptor *file = &fd_table[global_fd];
+
+    fs_lock();
+    select_volume(file->volume);
+    int advised = 0;
+    if (advice == F_FADV_WILLNEED || advice == F_FADV_DONTNEED) {
+        advised = advise_chain(file->dir_entry.firstBlock, offset, length, advice);
+    } else {
+        // Every file shares the image's host descriptor, whose access pattern Linux keeps for all of it,
+        // so the pattern is applied here, per open file
+        file->advice = advice;
+        file->readahead = offset;
+    }
+    advise_mappings(global_fd, offset, length, advice);
+    fs_unlock();
+    if (advised == -1) {
+        p_perror("Error passing the advice to the host", FileReadError);
+    }
+    return advised;
+}
+
+int f_fadvise(int fd, int offset, int length, int advice) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int advised = fadvise_fd(fd, offset, length, advice);
+    fsstat_end(FS_OP_FADVISE, &timer, advised, -1);
+    trace(FS_OP_FADVISE, &timer, advised, fd, offset, length, advice, NULL);
+    return advised;
+}
+
+// Whether a volume has writable mappings of the image, which write around copy-on-write
+static bool mapped_writable(int volume) {
+    for (int slot = 0; slot < MAX_MAPPINGS; slot++) {
+        if (mappings[slot].addr != NULL && mappings[slot].direct && (mappings[slot].prot & PROT_WRITE)
+            && fd_table[mappings[slot].global_fd].volume == volume) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether any file of the volume is open, holding a copy of its directory entry
+static bool files_open(int volume) {
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (fd_table[i].fd_type == FD_FILE && fd_table[i].volume == volume) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int sync_all() {
+    fs_lock();
+    // Data still on its way to the image would be left out
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int synced = 0;
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (volumes[i].label[0] == '\0') {
+            continue;
+        }
+        // Everything is on disk afterwards, so the journal can be emptied as well
+        select_volume(i);
+        if (journal_checkpoint() == -1) {
+            synced = -1;
+        }
+    }
+    fs_unlock();
+
+    if (synced == -1) {
+        p_perror("Failed to sync the filesystem", FileWriteError);
+    }
+    return synced;
+}
+
+int f_sync() {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int synced = sync_all();
+    fsstat_end(FS_OP_SYNC, &timer, synced, -1);
+    trace(FS_OP_SYNC, &timer, synced, 0, 0, 0, 0, NULL);
+    return synced;
+}
+
+static int fsync_fd(int fd) {
+    if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    // Get the global_fd, error check if its uninit or stdin
+    int global_fd = current_pcb->open_fds[fd];
+    if (fd_table[global_fd].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    fs_lock();
+    wait_for_io(fd_table[global_fd].volume, fd_table[global_fd].dir_entry.name, false);
+    flush_dir_entry(global_fd);
+    select_volume(fd_table[global_fd].volume);
+    int synced = sync_file(fd_table[global_fd].dir_entry.name);
+    fs_unlock();
+
+    if (synced == -1) {
+        p_perror("Failed to sync the file", FileWriteError);
+    }
+    return synced;
+}
+
+int f_fsync(int fd) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int synced = fsync_fd(fd);
+    fsstat_end(FS_OP_FSYNC, &timer, synced, -1);
+    trace(FS_OP_FSYNC, &timer, synced, fd, 0, 0, 0, NULL);
+    return synced;
+}
+
+void flushd() {
+    writeback.started = time(NULL);
+    while (1) {
+        int status;
+        p_waitpid(p_sleep(FLUSHD_INTERVAL * CLOCKS_PER_SEC), &status, false);
+
+        fs_lock();
+        wait_for_io(-1, NULL, false);
+        writeback.passes++;
+        writeback.dir_entries += flush_dir_entries(writeback.dirty_age);
+        time_t now = time(NULL);
+        for (int i = 0; i < MAX_VOLUMES; i++) {
+            if (volumes[i].label[0] == '\0' || volumes[i].dirty_since == 0) {
+                continue;
+            }
+            if (now - volumes[i].dirty_since < writeback.dirty_age && volumes[i].dirty_bytes < writeback.dirty_bytes) {
+                continue;
+            }
+            uint32_t dirty_bytes = volumes[i].dirty_bytes;
+            select_volume(i);
+            if (journal_checkpoint() == 0) {
+                writeback.writebacks++;
+                writeback.bytes += dirty_bytes;
+            }
+        }
+        fs_unlock();
+    }
+}
+
+int f_writeback(int dirty_age, int dirty_bytes) {
+    fs_lock();
+    if (dirty_age >= 0) {
+        writeback.dirty_age = dirty_age;
+    }
+    if (dirty_bytes >= 0) {
+        writeback.dirty_bytes = dirty_bytes;
+    }
+
+    time_t uptime = writeback.started != 0 ? time(NULL) - writeback.started : 0;
+    fprintf(stderr, "dirty age %ds, dirty bytes %d\n", writeback.dirty_age, writeback.dirty_bytes);
+    fprintf(stderr, "%lu passes, %lu directory entries, %lu volume writebacks, %lu bytes (%.1f bytes/s)\n",
+        writeback.passes, writeback.dir_entries, writeback.writebacks, writeback.bytes,
+        uptime > 0 ? (double)writeback.bytes / uptime : 0.0);
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (volumes[i].label[0] != '\0') {
+            fprintf(stderr, "%s: %u dirty bytes\n", volumes[i].label, volumes[i].dirty_bytes);
+        }
+    }
+    fs_unlock();
+    return 0;
+}
+
+static int seek_fd(int fd, int offset, int whence) {
+    if (fd > MAX_OPEN_FILES || (current_pcb->open_fds[fd] == -1) || fd < 0) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
+    }
+
+    // Get the global_fd, error check if its uninit or stdin
+    int global_fd = current_pcb->open_fds[fd];
+    if (fd_table[global_fd].fd_type != FD_FILE) {
+        p_perror("Invalid file descriptor", InvalidFileDescriptorError);
+        return -1;
     }
 
     switch (whence) {
@@ -516,41 +1643,169 @@ int f_lseek(int fd, int offset, int whence) {
     return fd_table[global_fd].offset;
 }
 
-int f_mount(const char *fs_name) {
-    if (mount(fs_name) == -1) {
+int f_lseek(int fd, int offset, int whence) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    int position = seek_fd(fd, offset, whence);
+    fsstat_end(FS_OP_LSEEK, &timer, position, 0);
+    trace(FS_OP_LSEEK, &timer, position, fd, 0, offset, whence, NULL);
+    return position;
+}
+
+int f_mount(const char *fs_name, const char *label, bool read_only) {
+    fs_lock();
+    bool first_volume = default_volume == -1;
+    int mounted = mount(fs_name, label, read_only);
+    fs_unlock();
+    if (mounted == -1) {
         return -1;
     }
 
-    memset(fd_table, 0, sizeof(fd_table));
-    fd_table[0].fd_type = FD_STDIN;
-    fd_table[0].mode = F_READ;
-    fd_table[1].fd_type = FD_STDOUT;
-    fd_table[1].mode = F_WRITE;
+    // The fd table outlives individual volumes, only set it up on the first mount
+    if (first_volume) {
+        memset(fd_table, 0, sizeof(fd_table));
+        fd_table[0].fd_type = FD_STDIN;
+        fd_table[0].mode = F_READ;
+        fd_table[1].fd_type = FD_STDOUT;
+        fd_table[1].mode = F_WRITE;
+    }
     return 0;
 }
 
+int f_umount(const char *label) {
+    fs_lock();
+    int volume = label == NULL ? default_volume : find_volume(label);
+    if (volume != -1) {
+        // Transfers the killed processes left behind keep their files open until they are done
+        wait_for_io(volume, NULL, false);
+    }
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (volume != -1 && fd_table[i].fd_type == FD_FILE && fd_table[i].volume == volume) {
+            fs_unlock();
+            p_perror("Volume has open files", FileIsOpenError);
+            return -1;
+        }
+    }
+    int unmounted = umount(label);
+    fs_unlock();
+    return unmounted;
+}
+
 int f_touch(struct parsed_command *cmd) {
-    return touch(cmd);
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    fs_lock();
+    flush_dir_entries(0);
+    int touched = 0;
+    for (int length = 1; cmd->commands[0][length] != NULL; length++) {
+        const char *name;
+        if (writable_volume(resolve_path(cmd->commands[0][length], &name)) == -1 || touch_single(name) != 0) {
+            touched = -1;
+            break;
+        }
+    }
+    fs_unlock();
+    fsstat_end(FS_OP_TOUCH, &timer, touched, -1);
+    trace(FS_OP_TOUCH, &timer, touched, 0, 0, 0, 0, cmd->commands[0]);
+    return touched;
 }
 
 int f_rm(const char *fs_name) {
-    return rm(fs_name);
+    char *const names[] = { (char *)fs_name, NULL };
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    fs_lock();
+    wait_for_path_io(fs_name);
+    flush_dir_entries(0);
+    int removed = -1;
+    int volume = writable_volume(resolve_path(fs_name, &fs_name));
+    if (volume != -1 && find_open_file(volume, fs_name) != -1) {
+        // Its chain would be freed under the processes that have it open
+        p_perror("File is open", FileIsOpenError);
+    } else if (volume != -1) {
+        removed = rm(fs_name);
+    }
+    fs_unlock();
+    fsstat_end(FS_OP_RM, &timer, removed, -1);
+    trace(FS_OP_RM, &timer, removed, 0, 0, 0, 0, names);
+    return removed;
 }
 
 int f_mv(const char *src, const char *dst) {
-    return mv(src, dst);
+    char *const names[] = { (char *)src, (char *)dst, NULL };
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    fs_lock();
+    wait_for_path_io(src);
+    wait_for_path_io(dst);
+    flush_dir_entries(0);
+    int src_volume = writable_volume(resolve_path(src, &src));
+    int dst_volume = writable_volume(resolve_path(dst, &dst));
+    int moved = -1;
+    if (src_volume != -1 && dst_volume != -1 && (find_open_file(src_volume, src) != -1 || find_open_file(dst_volume, dst) != -1)) {
+        // Open files find their entry by name, and a replaced destination is removed
+        p_perror("File is open", FileIsOpenError);
+    } else if (src_volume != -1 && dst_volume != -1) {
+        if (src_volume == dst_volume) {
+            moved = mv(src, dst);
+        } else if (copy_file(src_volume, src, dst_volume, dst) == 0) {
+            // Across volumes a move is a copy that keeps the permissions, then a remove
+            directory_entry src_dir_entry, dst_dir_entry;
+            select_volume(src_volume);
+            find_file(src, &src_dir_entry);
+            select_volume(dst_volume);
+            int dst_position = find_file(dst, &dst_dir_entry);
+            dst_dir_entry.perm = src_dir_entry.perm;
+            update_fs_dir_entry(dst_dir_entry, dst_position);
+            select_volume(src_volume);
+            moved = rm(src);
+        }
+    }
+    fs_unlock();
+    fsstat_end(FS_OP_MV, &timer, moved, -1);
+    trace(FS_OP_MV, &timer, moved, 0, 0, 0, 0, names);
+    return moved;
 }
 
 int f_cp(struct parsed_command *cmd) {
-    return cp(cmd);
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    bool offload = io_get_workers() > 0 && io_can_block();
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int handle = offload ? find_io_slot() : -1;
+    io_request *request = handle == -1 ? NULL : io_request_create();
+    int copied = request == NULL ? cp(cmd) : cp_queued(cmd, request);
+    if (request != NULL && request->buffer != NULL) {
+        // The entry already covers the data, so its transfers run even if the copy failed part way
+        io_submit(request);
+        async_ios[handle] = (async_io) { request, -1, current_pcb->pid, 0, false };
+        fs_unlock();
+        if (await_io(handle) == -1) {
+            p_perror("Error copying the data", FileWriteError);
+            copied = -1;
+        } else if (copied == 0) {
+            fs_lock();
+            copied = cp_queued_done(cmd);
+            fs_unlock();
+        }
+    } else {
+        io_request_free(request);
+        fs_unlock();
+    }
+    fsstat_end(FS_OP_CP, &timer, copied, -1);
+    trace(FS_OP_CP, &timer, copied, 0, 0, 0, 0, cmd->commands[0]);
+    return copied;
 }
 
-int f_cat(struct parsed_command *cmd) {
+// Dispatches cat on its flags once the paths are resolved, input is the line cat -a and cat -w write
+int cat_all_files(struct parsed_command *cmd, const char *input) {
     int length = 1;
     if (strcmp(cmd->commands[0][1], "-w") == 0) {
-        return cat_w_f(cmd);
+        return cat_w_f(cmd, input);
     } else if (strcmp(cmd->commands[0][1], "-a") == 0) {
-        return cat_a_f(cmd);
+        return cat_a_f(cmd, input);
     }
 
     // get the last argument
@@ -567,12 +1822,330 @@ int f_cat(struct parsed_command *cmd) {
     }
 }
 
-int f_ls() {
-    return ls();
+// Strips the labels off cat's file arguments, which must all be on one volume
+int resolve_cat_paths(struct parsed_command *cmd) {
+    int volume = -1;
+    bool writes = false;
+    for (int i = 1; cmd->commands[0][i] != NULL; i++) {
+        if (strcmp(cmd->commands[0][i], "-w") == 0 || strcmp(cmd->commands[0][i], "-a") == 0) {
+            writes = true;
+            continue;
+        }
+        const char *name;
+        int file_volume = resolve_path(cmd->commands[0][i], &name);
+        if (file_volume == -1) {
+            return -1;
+        }
+        if (volume != -1 && file_volume != volume) {
+            fprintf(stderr, "cat: all files must be on the same volume\n");
+            return -1;
+        }
+        volume = file_volume;
+        cmd->commands[0][i] = (char *)name;
+    }
+    if (writes && writable_volume(volume) == -1) {
+        return -1;
+    }
+    return volume == -1 ? -1 : select_volume(volume);
+}
+
+int f_cat(struct parsed_command *cmd) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    // The terminal is read before the file system is locked, so the scheduler keeps running while the user types
+    char input[MAX_LINE_LENGTH] = "";
+    if (cmd->commands[0][1] != NULL && (strcmp(cmd->commands[0][1], "-w") == 0 || strcmp(cmd->commands[0][1], "-a") == 0)) {
+        cat_read_input(input, sizeof(input));
+    }
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int catted = -1;
+    if (resolve_cat_paths(cmd) != -1) {
+        catted = cat_all_files(cmd, input);
+        // cat goes through its files once, their blocks should not push hotter ones out of the page cache.
+        // The output file's chain changed under its lastBlock.
+        for (int i = 1; cmd->commands[0][i] != NULL; i++) {
+            directory_entry dir_entry;
+            if (find_file(cmd->commands[0][i], &dir_entry) != -1) {
+                advise_chain(dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+                refresh_last_block(cmd->commands[0][i]);
+            }
+        }
+    }
+    fs_unlock();
+    fsstat_end(FS_OP_CAT, &timer, catted, -1);
+    trace(FS_OP_CAT, &timer, catted, 0, 0, 0, 0, cmd->commands[0]);
+    return catted;
+}
+
+int f_ls(const char *label) {
+    fsstat_timer timer;
+    fsstat_begin(&timer);
+    fs_lock();
+    flush_dir_entries(0);
+    int volume = default_volume;
+    if (label != NULL) {
+        // Accept both "hot" and "hot:"
+        char volume_label[VOLUME_LABEL_LEN] = "";
+        strncpy(volume_label, label, VOLUME_LABEL_LEN - 1);
+        char *colon = strchr(volume_label, ':');
+        if (colon != NULL) {
+            *colon = '\0';
+        }
+        volume = find_volume(volume_label);
+    }
+    int listed = -1;
+    if (select_volume(volume) != -1) {
+        listed = ls();
+    }
+    fs_unlock();
+    fsstat_end(FS_OP_LS, &timer, listed, -1);
+    trace(FS_OP_LS, &timer, listed, 0, 0, 0, 0, (char *[]){ (char *)label, NULL });
+    return listed;
+}
+
+int f_fragstat() {
+    fs_lock();
+    flush_dir_entries(0);
+    int result = select_volume(default_volume) == -1 ? -1 : fragstat();
+    fs_unlock();
+    return result;
+}
+
+int f_snapshot(const char *action, const char *name) {
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int result = -1;
+    int volume = resolve_path(name != NULL ? name : "", &name);
+    if (volume == -1 || (strcmp(action, "list") != 0 && writable_volume(volume) == -1)) {
+        fs_unlock();
+        return -1;
+    }
+
+    if (strcmp(action, "create") == 0 && mapped_writable(volume)) {
+        p_perror("Files are mapped writable on the volume", FileIsOpenError);
+    } else if (strcmp(action, "create") == 0) {
+        result = snapshot_create(name);
+    } else if (strcmp(action, "list") == 0) {
+        result = snapshot_list();
+    } else if (strcmp(action, "delete") == 0) {
+        result = snapshot_delete(name);
+    } else if (strcmp(action, "rollback") == 0) {
+        // Open files would keep writing to chains the rollback takes away
+        if (files_open(volume)) {
+            p_perror("Files are open on the volume", FileIsOpenError);
+        } else {
+            result = snapshot_rollback(name);
+        }
+    } else {
+        p_perror("Unknown snapshot action", ArgumentNotFoundError);
+    }
+    fs_unlock();
+    return result;
+}
+
+int f_dedup(const char *label) {
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int freed = -1;
+    int volume = writable_volume(resolve_path(label != NULL ? label : "", &label));
+    if (volume != -1 && files_open(volume)) {
+        // Relinking a chain under an open file would leave its entry pointing at freed blocks
+        p_perror("Files are open on the volume", FileIsOpenError);
+    } else if (volume != -1) {
+        freed = dedup();
+    }
+    fs_unlock();
+    return freed;
+}
+
+int f_scrub(const char *label, int rate) {
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    // The progress of the pass is kept on the volume
+    int volume = writable_volume(resolve_path(label != NULL ? label : "", &label));
+    scrub_header *scrub = volume == -1 ? NULL : scrub_begin();
+    if (scrub == NULL) {
+        fs_unlock();
+        return -1;
+    }
+    char volume_label[VOLUME_LABEL_LEN];
+    strcpy(volume_label, volumes[volume].label);
+    if (scrub->phase == SCRUB_CHAINS && scrub->cursor == 0 && scrub->chain_block == 0) {
+        fprintf(logFile, "[%d] SCRUB\t\t\t%d\t%s\tstarted\n", current_quantum, current_pcb->pid, volume_label);
+    } else {
+        fprintf(logFile, "[%d] SCRUB\t\t\t%d\t%s\tresumed at %s %u\n", current_quantum, current_pcb->pid, volume_label,
+            scrub->phase == SCRUB_CHAINS ? "directory slot" : "block", scrub->cursor);
+    }
+    fflush(logFile);
+    fs_unlock();
+
+    // Out of the shell's way: lowest priority, and a sleep after every few blocks
+    p_nice(current_pcb->pid, 1);
+    if (rate <= 0) {
+        rate = SCRUB_RATE;
+    }
+    int finished = 0;
+    while (finished == 0) {
+        fs_lock();
+        if (strcmp(volumes[volume].label, volume_label) != 0 || volumes[volume].scrub == NULL) {
+            fs_unlock();
+            p_perror("The volume was unmounted during the scrub", FileNotFoundError);
+            return -1;
+        }
+        // Sizes are checked against the directory, which must not lag behind the chains
+        if (volumes[volume].scrub->phase == SCRUB_CHAINS) {
+            flush_dir_entries(0);
+        }
+        select_volume(volume);
+        finished = scrub_step(rate, logFile);
+        fs_unlock();
+        if (finished == 0) {
+            int status;
+            p_waitpid(p_sleep(1), &status, false);
+        }
+    }
+    if (finished == -1) {
+        return -1;
+    }
+
+    fs_lock();
+    scrub_counts *last = &volumes[volume].scrub->last;
+    int problems = last->bad_chains + last->bad_sizes + last->io_errors + (last->leaked > 0);
+    fprintf(logFile, "[%d] SCRUB\t\t\t%d\t%s\t%u files, %u blocks read, %u bad chains, %u bad sizes, %u read errors, %u leaked blocks in %lds\n",
+        current_quantum, current_pcb->pid, volume_label, last->files, last->blocks, last->bad_chains, last->bad_sizes,
+        last->io_errors, last->leaked, (long)(volumes[volume].scrub->finished - volumes[volume].scrub->started));
+    fflush(logFile);
+    fs_unlock();
+    return problems;
+}
+
+int f_scrub_status(const char *label) {
+    fs_lock();
+    int volume = resolve_path(label != NULL ? label : "", &label);
+    if (volume == -1) {
+        fs_unlock();
+        return -1;
+    }
+    scrub_header *scrub = volumes[volume].scrub;
+    if (scrub == NULL || scrub->magic != SCRUB_MAGIC) {
+        fprintf(stderr, "%s has never been scrubbed\n", volumes[volume].label);
+        fs_unlock();
+        return 0;
+    }
+    if (scrub->phase == SCRUB_CHAINS) {
+        fprintf(stderr, "%s: walking chains, at directory slot %u\n", volumes[volume].label, scrub->cursor);
+    } else if (scrub->phase == SCRUB_BLOCKS) {
+        fprintf(stderr, "%s: reading blocks, at block %u of %d\n", volumes[volume].label, scrub->cursor, fat_num_entries() - 1);
+    } else {
+        fprintf(stderr, "%s: idle\n", volumes[volume].label);
+    }
+    if (scrub->phase != SCRUB_IDLE) {
+        fprintf(stderr, "this pass: %u files, %u blocks read, %u bad chains, %u bad sizes, %u read errors, %u leaked blocks\n",
+            scrub->current.files, scrub->current.blocks, scrub->current.bad_chains, scrub->current.bad_sizes,
+            scrub->current.io_errors, scrub->current.leaked);
+    }
+    if (scrub->passes > 0) {
+        char finished[32];
+        strftime(finished, sizeof(finished), "%b %d %H:%M", gmtime(&scrub->finished));
+        fprintf(stderr, "last pass (%u so far, finished %s): %u files, %u blocks read, %u bad chains, %u bad sizes, %u read errors, %u leaked blocks\n",
+            scrub->passes, finished, scrub->last.files, scrub->last.blocks, scrub->last.bad_chains, scrub->last.bad_sizes,
+            scrub->last.io_errors, scrub->last.leaked);
+    }
+    fs_unlock();
+    return 0;
+}
+
+int f_fsstat(const char *arg) {
+    if (arg == NULL) {
+        fsstat_print(stderr);
+    } else if (strcmp(arg, "reset") == 0) {
+        fsstat_reset();
+    } else if (fsstat_find_op(arg) != -1) {
+        fsstat_print_histogram(stderr, fsstat_find_op(arg));
+    } else {
+        p_perror("fsstat [reset|OPERATION]", ArgumentNotFoundError);
+        return -1;
+    }
+    return 0;
+}
+
+int f_fstrace(const char *action, const char *path) {
+    if (action != NULL && strcmp(action, "start") == 0 && path != NULL) {
+        fs_lock();
+        // The geometry of the default volume goes in the trace, so a replay can format the same
+        int block_size_config = 0, fat_blocks = 0;
+        if (select_volume(default_volume) != -1) {
+            block_size_config = __builtin_ctz(block_size) - 8;
+            fat_blocks = fat_size / block_size;
+        }
+        int started = fstrace_start(path, block_size_config, fat_blocks);
+        fs_unlock();
+        if (started == -1) {
+            p_perror("fstrace: already recording, or cannot create the trace", FileWriteError);
+        }
+        return started;
+    } else if (action != NULL && strcmp(action, "stop") == 0) {
+        fs_lock();
+        long recorded = fstrace_stop();
+        fs_unlock();
+        if (recorded == -1) {
+            p_perror("fstrace: not recording", ArgumentNotFoundError);
+            return -1;
+        }
+        fprintf(stderr, "fstrace: %ld calls recorded\n", recorded);
+        return 0;
+    }
+    p_perror("fstrace start HOST_FILE|stop", ArgumentNotFoundError);
+    return -1;
+}
+
+int f_pack(const char *host_dir, const char *label) {
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int packed = -1;
+    int volume = writable_volume(resolve_path(label != NULL ? label : "", &label));
+    if (volume != -1) {
+        // Open files would keep writing to chains pack replaces
+        bool open = false;
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            open = open || (fd_table[i].fd_type == FD_FILE && fd_table[i].volume == volume);
+        }
+        if (open) {
+            p_perror("Files are open on the volume", FileIsOpenError);
+        } else {
+            packed = pack(host_dir);
+        }
+    }
+    fs_unlock();
+    return packed;
+}
+
+int f_unpack(const char *host_dir, const char *label) {
+    fs_lock();
+    wait_for_io(-1, NULL, false);
+    flush_dir_entries(0);
+    int unpacked = -1;
+    if (resolve_path(label != NULL ? label : "", &label) != -1) {
+        unpacked = unpack(host_dir);
+    }
+    fs_unlock();
+    return unpacked;
 }
 
 int f_chmod(const char* mode, const char* fs_name) {
-    return chmod(mode, fs_name);
+    fs_lock();
+    flush_dir_entries(0);
+    int changed = -1;
+    if (writable_volume(resolve_path(fs_name, &fs_name)) != -1) {
+        changed = chmod(mode, fs_name);
+    }
+    fs_unlock();
+    return changed;
 }
 
 int f_seek(FILE *stream, long int offset, int whence) {
@@ -584,7 +2157,14 @@ char* f_gets(char *str, int n, FILE *stream) {
 }
 
 int f_find_file(const char *fname, directory_entry *result) {
-    return find_file(fname, result);
+    fs_lock();
+    flush_dir_entries(0);
+    int position = -1;
+    if (resolve_path(fname, &fname) != -1) {
+        position = find_file(fname, result);
+    }
+    fs_unlock();
+    return position;
 }
 
 char* f_strtok(char *str, const char *delim) {
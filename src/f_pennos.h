@@ -16,9 +16,11 @@
 #include <sys/types.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/file.h>   // LOCK_SH, LOCK_EX, LOCK_NB, LOCK_UN
 #include "pcb.h"
 #include "parser.h"
 #include "pennfat.h"
+#include "iopool.h"
 
 /**
  * @def MAX_OPEN_FILES
@@ -26,6 +28,18 @@
  */
 #define MAX_OPEN_FILES 128
 
+/**
+ * @def MAX_MAPPINGS
+ * @brief Maximum number of file ranges mapped with f_mmap at once.
+ */
+#define MAX_MAPPINGS 64
+
+/**
+ * @def MAX_ASYNC_IO
+ * @brief Maximum number of asynchronous reads and writes in flight at once.
+ */
+#define MAX_ASYNC_IO 64
+
 /**
  * @def STDIN_FD
  * @brief File descriptor value for standard input.
@@ -74,6 +88,72 @@
  */
 #define F_SEEK_END 2
 
+/**
+ * @def F_FADV_NORMAL
+ * @brief f_fadvise: no particular access pattern, the default.
+ */
+#define F_FADV_NORMAL 0
+
+/**
+ * @def F_FADV_SEQUENTIAL
+ * @brief f_fadvise: the file is read front to back, so reads are followed by read-ahead.
+ */
+#define F_FADV_SEQUENTIAL 1
+
+/**
+ * @def F_FADV_RANDOM
+ * @brief f_fadvise: the file is read at random, so nothing is read ahead.
+ */
+#define F_FADV_RANDOM 2
+
+/**
+ * @def F_FADV_WILLNEED
+ * @brief f_fadvise: the range is read soon, start loading it now.
+ */
+#define F_FADV_WILLNEED 3
+
+/**
+ * @def F_FADV_DONTNEED
+ * @brief f_fadvise: the range is not needed again, drop it from the cache now.
+ */
+#define F_FADV_DONTNEED 4
+
+/**
+ * @def F_FADV_NOREUSE
+ * @brief f_fadvise: data is used once, so whatever is read or written is dropped from the cache right after.
+ */
+#define F_FADV_NOREUSE 5
+
+/**
+ * @def READAHEAD_BYTES
+ * @brief How far past the offset reads of an F_FADV_SEQUENTIAL file keep the host loading.
+ */
+#define READAHEAD_BYTES (128 * 1024)
+
+/**
+ * @def FLUSHD_INTERVAL
+ * @brief Seconds flushd sleeps between writeback passes.
+ */
+#define FLUSHD_INTERVAL 1
+
+/**
+ * @def FLUSHD_DIRTY_AGE
+ * @brief Default number of seconds changes may stay dirty before flushd writes them back.
+ */
+#define FLUSHD_DIRTY_AGE 5
+
+/**
+ * @def FLUSHD_DIRTY_BYTES
+ * @brief Default number of dirty bytes on a volume that makes flushd write it back early.
+ */
+#define FLUSHD_DIRTY_BYTES 65536
+
+/**
+ * @def SCRUB_RATE
+ * @brief Default number of blocks the scrubber walks or reads per quantum.
+ */
+#define SCRUB_RATE 16
+
 /**
  * @enum fd_type
  * @brief Enumeration representing the type of file descriptor.
@@ -91,8 +171,67 @@ typedef struct {
     uint8_t mode;             /**< File access mode (1 for read, 2 for write, 3 for append). */
     fd_type fd_type;          /**< Type of file descriptor. */
     int ref_count;            /**< Reference count for the file descriptor. */
+    int volume;               /**< Mount table slot of the volume holding the file. */
+    time_t dirty_since;       /**< When dir_entry's mtime or size within its last block changed without being written back, or 0. */
+    uint8_t advice;           /**< Access pattern set with f_fadvise: F_FADV_NORMAL, SEQUENTIAL, RANDOM or NOREUSE. */
+    int readahead;            /**< File offset the read-ahead of an F_FADV_SEQUENTIAL file has reached. */
 } FileDescriptor;
 
+/**
+ * @brief An advisory lock a process holds on, or is waiting for on, an open file.
+ */
+typedef struct {
+    int global_fd;  /**< Global fd table slot of the file, shared by every process that has it open. */
+    pid_t pid;      /**< Process holding or waiting for the lock. */
+    int operation;  /**< LOCK_SH or LOCK_EX. */
+    PCB *pcb;       /**< PCB of a waiting process, woken when the lock is handed to it. */
+} file_lock;
+
+/**
+ * @brief A file range mapped with f_mmap.
+ */
+typedef struct {
+    char *addr;     /**< Address handed to the process, NULL while the slot is free. */
+    int length;     /**< Length of the range. */
+    int offset;     /**< File offset of the range. */
+    int prot;       /**< PROT_READ, PROT_WRITE or both. */
+    int global_fd;  /**< Global fd table slot of the file, kept open while it is mapped. */
+    pid_t pid;      /**< Process that mapped it. */
+    bool direct;    /**< Whether addr points into a mapping of the image itself rather than a private copy. */
+    size_t delta;   /**< Bytes the image mapping starts before addr, which it needs to be page aligned. */
+} file_mapping;
+
+/**
+ * @def OFFLOAD_MIN_BYTES
+ * @brief f_read and f_write calls, and f_cp copies, of at least this many bytes have an I/O worker do their host transfers.
+ */
+#define OFFLOAD_MIN_BYTES (64 * 1024)
+
+/**
+ * @brief Work an I/O worker does for a process: a read or write from f_read_async or f_write_async
+ * until f_await, an f_read or f_write the process is blocked in, or an f_cp.
+ */
+typedef struct {
+    io_request *request;  /**< Its host transfers, NULL while the slot is free. */
+    int global_fd;        /**< Global fd table slot of the file, kept open until the transfers are done; -1 for f_cp. */
+    pid_t pid;            /**< Process that started it, -1 once it is gone and the slot only waits for its transfers. */
+    int bytes;            /**< Bytes to return if the transfers succeed. */
+    bool async;           /**< Started by f_read_async or f_write_async. */
+} async_io;
+
+/**
+ * @brief Thresholds and counters of the flushd writeback daemon.
+ */
+typedef struct {
+    int dirty_age;              /**< Seconds a change may stay dirty before it is written back. */
+    int dirty_bytes;            /**< Dirty bytes on a volume that trigger a writeback regardless of age. */
+    unsigned long passes;       /**< Writeback passes flushd has made. */
+    unsigned long dir_entries;  /**< Held back directory entries written back. */
+    unsigned long writebacks;   /**< Volumes synced. */
+    unsigned long bytes;        /**< Dirty bytes written back. */
+    time_t started;             /**< When flushd started. */
+} writeback_state;
+
 // Function prototypes
 
 /**
@@ -117,6 +256,29 @@ int f_open(const char *fname, int mode);
  */
 int f_close(int fd);
 
+/**
+ * @brief Apply or remove an advisory lock on an open file.
+ *
+ * Locks belong to the calling process and the file, so every descriptor the process has on the file
+ * shares one lock. Any number of processes may hold LOCK_SH, only one may hold LOCK_EX. A process that
+ * cannot have the lock is BLOCKED in the scheduler until it is handed over; waiters are served in FIFO
+ * order, so a queued LOCK_EX is not starved by later LOCK_SH requests. Converting a held lock releases
+ * it first. Locks are released by LOCK_UN, by closing the file and when the process exits or is killed.
+ *
+ * @param fd The file descriptor of the open file.
+ * @param operation LOCK_SH, LOCK_EX or LOCK_UN, with LOCK_NB to fail instead of blocking.
+ *
+ * @return Returns 0 on success, or -1 on failure or if LOCK_NB was given and the lock is held.
+ */
+int f_flock(int fd, int operation);
+
+/**
+ * @brief Release every lock a process holds or waits for, handing them to the next waiters.
+ *
+ * @param pid The process that exited or was killed.
+ */
+void f_flock_release(pid_t pid);
+
 /**
  * @brief Remove the specified file.
  *
@@ -129,6 +291,9 @@ int f_unlink(const char* fname);
 /**
  * @brief Read bytes from the file referenced by the file descriptor.
  *
+ * Reads of at least OFFLOAD_MIN_BYTES are done by an I/O worker while the
+ * process is BLOCKED, so the scheduler runs other processes meanwhile.
+ *
  * @param fd The file descriptor of the open file.
  * @param n The number of bytes to read.
  * @param buf The buffer to store the read bytes.
@@ -141,6 +306,8 @@ int f_read(int fd, int n, char *buf);
 /**
  * @brief Write bytes to the file referenced by the file descriptor.
  *
+ * Writes of at least OFFLOAD_MIN_BYTES are done by an I/O worker, as for f_read.
+ *
  * @param fd The file descriptor of the open file.
  * @param str The string containing the bytes to write.
  * @param n The number of bytes to write.
@@ -149,6 +316,175 @@ int f_read(int fd, int n, char *buf);
  */
 int f_write(int fd, const char *str, int n);
 
+/**
+ * @brief Reserve blocks for the file referenced by the file descriptor.
+ *
+ * The chain is extended (contiguously when possible) to cover length bytes
+ * without writing any data, so later writes up to that length never allocate.
+ * The file size is unchanged; the reserved length is kept in allocSize.
+ *
+ * @param fd The file descriptor of a file open for writing or appending.
+ * @param length The number of bytes to reserve.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_fallocate(int fd, int length);
+
+/**
+ * @brief Maps a range of an open file into memory.
+ *
+ * When the blocks of the range are consecutive on the image and belong to the
+ * file alone, the image itself is mapped: reads cost no copy and writes land in
+ * the file directly. Otherwise the range is copied into a private buffer, which
+ * f_munmap writes back for PROT_WRITE mappings; prot is not enforced on such a
+ * copy, writes to a read-only one are just dropped. The file stays open until the
+ * range is unmapped. While a volume has writable mappings of the image it can
+ * be neither snapshotted nor deduplicated.
+ *
+ * @param fd The file descriptor of the open file, open for writing for PROT_WRITE.
+ * @param offset The file offset of the range.
+ * @param length The length of the range, which must lie within the file.
+ * @param prot PROT_READ, PROT_WRITE or both.
+ *
+ * @return Returns the address of the range, or NULL on failure.
+ */
+void *f_mmap(int fd, int offset, int length, int prot);
+
+/**
+ * @brief Unmaps a range mapped with f_mmap, writing a private copy back to the file if it was writable.
+ *
+ * @param addr The address f_mmap returned.
+ * @param length The length passed to f_mmap.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_munmap(void *addr, int length);
+
+/**
+ * @brief Tells the file system how a range of an open file will be used, so it can cache it accordingly.
+ *
+ * F_FADV_NORMAL, F_FADV_SEQUENTIAL, F_FADV_RANDOM and F_FADV_NOREUSE set the access pattern of
+ * the open file, shared by every process that has it open, until it is closed: SEQUENTIAL reads
+ * keep READAHEAD_BYTES past the offset loading, and NOREUSE drops what f_read and f_write move
+ * from the cache once they are done. F_FADV_WILLNEED and F_FADV_DONTNEED load or drop the range
+ * right away. The hints go on to the image blocks of the range with posix_fadvise, and to the
+ * ranges of the file mapped with f_mmap with madvise.
+ *
+ * @param fd The file descriptor of the file.
+ * @param offset The start of the range.
+ * @param length The length of the range, or 0 for the rest of the file.
+ * @param advice One of the F_FADV_ constants.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_fadvise(int fd, int offset, int length, int advice);
+
+/**
+ * @brief Starts reading from the file referenced by the file descriptor without waiting for the data.
+ *
+ * The bytes to read and the new file offset are settled right away, as by f_read;
+ * the host reads are done by the I/O worker threads while the process goes on.
+ *
+ * @param fd The file descriptor of an open file.
+ * @param n The number of bytes to read.
+ * @param buf Where to read them, left alone until f_await returns.
+ *
+ * @return Returns a handle to pass to f_await, or a negative value on error.
+ */
+int f_read_async(int fd, int n, char *buf);
+
+/**
+ * @brief Starts writing to the file referenced by the file descriptor without waiting for the data.
+ *
+ * Blocks are allocated and the file size and offset updated right away, as by
+ * f_write; the host writes are done by the I/O worker threads. The range should
+ * not be read until f_await returns, and f_sync only makes it durable after that.
+ *
+ * @param fd The file descriptor of a file open for writing or appending.
+ * @param str The data, left alone until f_await returns.
+ * @param n The number of bytes to write.
+ *
+ * @return Returns a handle to pass to f_await, or a negative value on error.
+ */
+int f_write_async(int fd, const char *str, int n);
+
+/**
+ * @brief Waits for an asynchronous read or write, BLOCKED in the scheduler so that other processes run.
+ *
+ * @param handle A handle from f_read_async or f_write_async of this process.
+ *
+ * @return Returns the number of bytes read or written, or a negative value on error.
+ */
+int f_await(int handle);
+
+/**
+ * @brief Frees the I/O a worker did for a process that exited or was killed.
+ *
+ * I/O still in flight is not waited for: process stacks are never freed, so the
+ * workers finish it into the process's buffers, and the next file system call
+ * that waits for I/O frees it.
+ *
+ * @param pid The process that exited or was killed.
+ */
+void f_async_release(pid_t pid);
+
+/**
+ * @brief Sets how many I/O workers take blocking transfers off the processes and prints what they are doing.
+ *
+ * @param workers The new number of workers, 0 to do every transfer inline, or a negative value to keep it.
+ *
+ * @return Returns the number of workers, or a negative value on failure.
+ */
+int f_ioworkers(int workers);
+
+/**
+ * @brief Unmaps every range a process mapped, as f_munmap would.
+ *
+ * @param pid The process that exited or was killed.
+ */
+void f_munmap_release(pid_t pid);
+
+/**
+ * @brief Makes every mounted volume durable.
+ *
+ * Only what changed since the last sync is written back: the dirty pages of the
+ * FAT and the blocks written since then. The journals are emptied afterwards.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_sync();
+
+/**
+ * @brief Makes the file referenced by the file descriptor durable.
+ *
+ * Writes back the dirty pages of the FAT, the dirty blocks of the file and its
+ * directory entry, leaving the rest of the volume alone.
+ *
+ * @param fd The file descriptor of an open file.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_fsync(int fd);
+
+/**
+ * @brief Body of the flushd process, spawned by the kernel at priority 1.
+ *
+ * Every FLUSHD_INTERVAL seconds it writes back the directory entries open files
+ * have held back for longer than the dirty age, and syncs every volume that has
+ * been dirty for longer than the dirty age or holds more than the dirty bytes.
+ */
+void flushd();
+
+/**
+ * @brief Adjusts the flushd thresholds and prints its writeback statistics.
+ *
+ * @param dirty_age The new dirty age in seconds, or a negative value to keep it.
+ * @param dirty_bytes The new dirty byte threshold, or a negative value to keep it.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_writeback(int dirty_age, int dirty_bytes);
+
 /**
  * @brief Reposition the file pointer for the specified file descriptor.
  *
@@ -163,11 +499,27 @@ int f_lseek(int fd, int offset, int whence);
 /**
  * @brief Mounts a PennFAT filesystem by loading its FAT into memory.
  *
+ * Files on the volume are addressed as LABEL:NAME. The first volume mounted is
+ * the default volume, used for names without a label. Opening a file of a
+ * read-only volume for writing, and every other change to it, fails with
+ * PermissionError before anything is done.
+ *
  * @param fs_name The name of the filesystem to be mounted.
+ * @param label The label of the volume, or NULL to use the base name of fs_name.
+ * @param read_only Whether to mount the image read-only.
  *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int f_mount(const char *fs_name);
+int f_mount(const char *fs_name, const char *label, bool read_only);
+
+/**
+ * @brief Unmounts a volume that has no open files.
+ *
+ * @param label The label of the volume, or NULL for the default volume.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_umount(const char *label);
 
 /**
  * @brief Creates or updates the timestamp of the specified files.
@@ -190,6 +542,9 @@ int f_rm(const char *fs_name);
 /**
  * @brief Renames a source file to a destination file in the filesystem.
  *
+ * If the two paths are on different volumes the file is copied and the
+ * source removed.
+ *
  * @param src The source file to be renamed.
  * @param dst The destination file name.
  *
@@ -200,6 +555,10 @@ int f_mv(const char *src, const char *dst);
 /**
  * @brief Copies files from the filesystem to a destination in the host OS.
  *
+ * The chain and the entry are set up right away; the data of a copy of at least
+ * OFFLOAD_MIN_BYTES is then moved by an I/O worker while the process is BLOCKED.
+ * Other processes keep running, but wait for it before they touch any file.
+ *
  * @param cmd A parsed command structure containing information about the 'cp' command.
  *
  * @return Returns 0 on success, or a negative value on failure.
@@ -218,9 +577,116 @@ int f_cat(struct parsed_command *cmd);
 /**
  * @brief List the specified file or all files in the current directory.
  *
+ * @param label The label of the volume to list (with or without the trailing
+ * colon), or NULL for the default volume.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_ls(const char *label);
+
+/**
+ * @brief Prints the layout of every file and of the whole image of the default volume, see fragstat().
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_fragstat();
+
+/**
+ * @brief Creates, lists, deletes or rolls back to a snapshot of a volume.
+ *
+ * A snapshot freezes the FAT and the root directory; data blocks stay shared
+ * with the live filesystem until they are written, when the file gets its own
+ * copy. Rolling back needs every file of the volume to be closed.
+ *
+ * @param action One of create, list, delete or rollback.
+ * @param name The snapshot as [LABEL:]NAME, or the volume as LABEL: for list.
+ *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int f_ls();
+int f_snapshot(const char *action, const char *name);
+
+/**
+ * @brief Deduplicates a volume and prints the space reclaimed.
+ *
+ * Files storing the same data share the blocks holding it, copy-on-write. The
+ * first run leaves a fingerprint index on the volume, after which files are
+ * also deduplicated when they are copied, or closed after writing if they are
+ * at most DEDUP_CLOSE_BLOCKS blocks long. Fails while files of the volume are
+ * open.
+ *
+ * @param label The volume as LABEL:, or NULL for the default volume.
+ *
+ * @return Returns the number of blocks freed, or a negative value on failure.
+ */
+int f_dedup(const char *label);
+
+/**
+ * @brief Scrubs a volume, as a process of priority 1 that does a few blocks per quantum.
+ *
+ * Every chain and directory entry is checked and every allocated block read,
+ * a pass spreading over as many quanta as it takes. The progress is kept on
+ * the volume, so a pass cut short by a kill or a restart resumes where it
+ * stopped. Problems and the summary of the pass go to the log.
+ *
+ * @param label The volume as LABEL:, or NULL for the default volume.
+ * @param rate The number of blocks per quantum, or 0 for SCRUB_RATE.
+ *
+ * @return Returns the number of problems found by the pass, or a negative value on failure.
+ */
+int f_scrub(const char *label, int rate);
+
+/**
+ * @brief Prints the progress of the scrub pass under way and the findings of the last one.
+ *
+ * @param label The volume as LABEL:, or NULL for the default volume.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_scrub_status(const char *label);
+
+/**
+ * @brief Prints the file system operation counters and latency percentiles, one operation's
+ * latency histogram, or resets them.
+ *
+ * @param arg NULL to print every operation, "reset" to zero the counters, or an operation name
+ *            (open, read, write, lseek, close, unlink, cp, cat, ls, rm, mv, touch, falloc, flock, sync, fsync,
+ *            aread, awrite, await, mmap, munmap, fadvise) to print its histogram.
+ *
+ * @return Returns 0 on success, or a negative value if there is no such operation.
+ */
+int f_fsstat(const char *arg);
+
+/**
+ * @brief Starts or stops recording the file system calls to a trace on the host (see fstrace.h).
+ *
+ * @param action "start" or "stop".
+ * @param path The host file to record to, for start.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int f_fstrace(const char *action, const char *path);
+
+/**
+ * @brief Copies every regular file of a host directory into a volume in one pass, see pack().
+ *
+ * Files are replaced wholesale, so no file of the volume may be open.
+ *
+ * @param host_dir The host directory.
+ * @param label The volume as LABEL:, or NULL for the default volume.
+ *
+ * @return Returns the number of files packed, or a negative value on failure.
+ */
+int f_pack(const char *host_dir, const char *label);
+
+/**
+ * @brief Copies every file of a volume into a host directory, see unpack().
+ *
+ * @param host_dir The host directory, created if it does not exist.
+ * @param label The volume as LABEL:, or NULL for the default volume.
+ *
+ * @return Returns the number of files unpacked, or a negative value on failure.
+ */
+int f_unpack(const char *host_dir, const char *label);
 
 /**
  * @brief Changes the permissions of the specified filesystem.
@@ -0,0 +1,260 @@
+#include "fsstat.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+unsigned long fsstat_syscalls[NUM_SYSCALLS];
+const char *fsstat_syscall_names[NUM_SYSCALLS] = { "read", "write", "pread", "pwrite", "lseek", "sync", "other" };
+
+// Bytes the read and write syscalls moved, so that commands can report their traffic
+static unsigned long io_bytes;
+
+static fsstat_counters counters[FS_NUM_OPS];
+static const char *op_names[FS_NUM_OPS] = { "open", "read", "write", "lseek", "close", "unlink", "cp", "cat", "ls", "rm", "mv", "touch",
+    "falloc", "flock", "sync", "fsync", "aread", "awrite", "await", "mmap", "munmap", "fadvise" };
+
+// The I/O worker threads issue syscalls too, so the wrappers count atomically
+#define COUNT(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+// The linker points every call to read() etc. at the __wrap_ functions, which count it and call __real_
+ssize_t __real_read(int fd, void *buf, size_t n);
+ssize_t __real_write(int fd, const void *buf, size_t n);
+ssize_t __real_pread(int fd, void *buf, size_t n, off_t offset);
+ssize_t __real_pwrite(int fd, const void *buf, size_t n, off_t offset);
+off_t __real_lseek(int fd, off_t offset, int whence);
+int __real_fsync(int fd);
+int __real_fdatasync(int fd);
+int __real_msync(void *addr, size_t length, int flags);
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+int __real_ftruncate(int fd, off_t length);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+int __real_munmap(void *addr, size_t length);
+
+ssize_t __wrap_read(int fd, void *buf, size_t n) {
+    COUNT(fsstat_syscalls[SYSCALL_READ], 1);
+    ssize_t result = __real_read(fd, buf, n);
+    COUNT(io_bytes, result > 0 ? result : 0);
+    return result;
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t n) {
+    COUNT(fsstat_syscalls[SYSCALL_WRITE], 1);
+    ssize_t result = __real_write(fd, buf, n);
+    COUNT(io_bytes, result > 0 ? result : 0);
+    return result;
+}
+
+ssize_t __wrap_pread(int fd, void *buf, size_t n, off_t offset) {
+    COUNT(fsstat_syscalls[SYSCALL_PREAD], 1);
+    ssize_t result = __real_pread(fd, buf, n, offset);
+    COUNT(io_bytes, result > 0 ? result : 0);
+    return result;
+}
+
+ssize_t __wrap_pwrite(int fd, const void *buf, size_t n, off_t offset) {
+    COUNT(fsstat_syscalls[SYSCALL_PWRITE], 1);
+    ssize_t result = __real_pwrite(fd, buf, n, offset);
+    COUNT(io_bytes, result > 0 ? result : 0);
+    return result;
+}
+
+off_t __wrap_lseek(int fd, off_t offset, int whence) {
+    COUNT(fsstat_syscalls[SYSCALL_LSEEK], 1);
+    return __real_lseek(fd, offset, whence);
+}
+
+int __wrap_fsync(int fd) {
+    COUNT(fsstat_syscalls[SYSCALL_SYNC], 1);
+    return __real_fsync(fd);
+}
+
+int __wrap_fdatasync(int fd) {
+    COUNT(fsstat_syscalls[SYSCALL_SYNC], 1);
+    return __real_fdatasync(fd);
+}
+
+int __wrap_msync(void *addr, size_t length, int flags) {
+    COUNT(fsstat_syscalls[SYSCALL_SYNC], 1);
+    return __real_msync(addr, length, flags);
+}
+
+int __wrap_open(const char *path, int flags, ...) {
+    COUNT(fsstat_syscalls[SYSCALL_OTHER], 1);
+    mode_t mode = 0;
+    if (flags & O_CREAT) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd) {
+    COUNT(fsstat_syscalls[SYSCALL_OTHER], 1);
+    return __real_close(fd);
+}
+
+int __wrap_ftruncate(int fd, off_t length) {
+    COUNT(fsstat_syscalls[SYSCALL_OTHER], 1);
+    return __real_ftruncate(fd, length);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    COUNT(fsstat_syscalls[SYSCALL_OTHER], 1);
+    return __real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int __wrap_munmap(void *addr, size_t length) {
+    COUNT(fsstat_syscalls[SYSCALL_OTHER], 1);
+    return __real_munmap(addr, length);
+}
+
+static unsigned long total_syscalls() {
+    unsigned long total = 0;
+    for (int i = 0; i < NUM_SYSCALLS; i++) {
+        total += fsstat_syscalls[i];
+    }
+    return total;
+}
+
+// Bucket of a latency: values below FSSTAT_SUB_BUCKETS get one bucket each, every power of two above is split linearly
+static int bucket_of(uint64_t ns) {
+    if (ns < FSSTAT_SUB_BUCKETS) {
+        return ns;
+    }
+    int magnitude = 63 - __builtin_clzll(ns); // 3 or more
+    int sub_bucket = (ns >> (magnitude - 3)) & (FSSTAT_SUB_BUCKETS - 1);
+    int bucket = (magnitude - 2) * FSSTAT_SUB_BUCKETS + sub_bucket;
+    return bucket < FSSTAT_BUCKETS ? bucket : FSSTAT_BUCKETS - 1;
+}
+
+// Smallest latency that falls in a bucket
+static uint64_t bucket_floor(int bucket) {
+    if (bucket < FSSTAT_SUB_BUCKETS) {
+        return bucket;
+    }
+    int magnitude = bucket / FSSTAT_SUB_BUCKETS + 2;
+    return (uint64_t)(FSSTAT_SUB_BUCKETS + bucket % FSSTAT_SUB_BUCKETS) << (magnitude - 3);
+}
+
+void fsstat_begin(fsstat_timer *timer) {
+    clock_gettime(CLOCK_MONOTONIC, &timer->started);
+    timer->syscalls = total_syscalls();
+    timer->io_bytes = io_bytes;
+}
+
+void fsstat_end(fs_op op, const fsstat_timer *timer, int result, long bytes) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (now.tv_sec - timer->started.tv_sec) * 1000000000ULL + now.tv_nsec - timer->started.tv_nsec;
+
+    fsstat_counters *op_counters = &counters[op];
+    op_counters->calls++;
+    op_counters->errors += result < 0;
+    // Counters reset while the operation ran leave nothing to attribute to it
+    unsigned long syscalls = total_syscalls();
+    op_counters->bytes += bytes >= 0 ? (unsigned long)bytes : (io_bytes >= timer->io_bytes ? io_bytes - timer->io_bytes : 0);
+    op_counters->syscalls += syscalls >= timer->syscalls ? syscalls - timer->syscalls : 0;
+    op_counters->total_ns += ns;
+    op_counters->max_ns = ns > op_counters->max_ns ? ns : op_counters->max_ns;
+    op_counters->histogram[bucket_of(ns)]++;
+}
+
+const char *fsstat_op_name(fs_op op) {
+    return op >= 0 && op < FS_NUM_OPS ? op_names[op] : NULL;
+}
+
+int fsstat_find_op(const char *name) {
+    for (int op = 0; op < FS_NUM_OPS; op++) {
+        if (strcmp(op_names[op], name) == 0) {
+            return op;
+        }
+    }
+    return -1;
+}
+
+// Latency under which a fraction of the calls finished, read off the histogram
+static uint64_t percentile(const fsstat_counters *op_counters, double fraction) {
+    unsigned long wanted = (unsigned long)(fraction * op_counters->calls + 0.5);
+    unsigned long seen = 0;
+    for (int bucket = 0; bucket < FSSTAT_BUCKETS; bucket++) {
+        seen += op_counters->histogram[bucket];
+        if (seen >= wanted && seen > 0) {
+            // The top of the bucket, but no more than the largest sample
+            uint64_t top = bucket + 1 < FSSTAT_BUCKETS ? bucket_floor(bucket + 1) - 1 : op_counters->max_ns;
+            return top < op_counters->max_ns ? top : op_counters->max_ns;
+        }
+    }
+    return op_counters->max_ns;
+}
+
+// Formats a latency with a unit that keeps it short
+static const char *format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 10000) {
+        snprintf(buf, size, "%luns", (unsigned long)ns);
+    } else if (ns < 10000000) {
+        snprintf(buf, size, "%.1fus", ns / 1e3);
+    } else if (ns < 10000000000ULL) {
+        snprintf(buf, size, "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, size, "%.1fs", ns / 1e9);
+    }
+    return buf;
+}
+
+void fsstat_print(FILE *stream) {
+    char avg[16], p50[16], p90[16], p99[16], p999[16], max[16];
+    fprintf(stream, "%-7s %9s %7s %12s %10s %9s %9s %9s %9s %9s %9s\n",
+        "op", "calls", "errors", "bytes", "syscalls", "avg", "p50", "p90", "p99", "p99.9", "max");
+    for (int op = 0; op < FS_NUM_OPS; op++) {
+        const fsstat_counters *op_counters = &counters[op];
+        if (op_counters->calls == 0) {
+            continue;
+        }
+        fprintf(stream, "%-7s %9lu %7lu %12lu %10lu %9s %9s %9s %9s %9s %9s\n",
+            op_names[op], op_counters->calls, op_counters->errors, op_counters->bytes, op_counters->syscalls,
+            format_ns(avg, sizeof(avg), op_counters->total_ns / op_counters->calls),
+            format_ns(p50, sizeof(p50), percentile(op_counters, 0.5)),
+            format_ns(p90, sizeof(p90), percentile(op_counters, 0.9)),
+            format_ns(p99, sizeof(p99), percentile(op_counters, 0.99)),
+            format_ns(p999, sizeof(p999), percentile(op_counters, 0.999)),
+            format_ns(max, sizeof(max), op_counters->max_ns));
+    }
+    fprintf(stream, "host syscalls:");
+    for (int i = 0; i < NUM_SYSCALLS; i++) {
+        fprintf(stream, " %s %lu", fsstat_syscall_names[i], fsstat_syscalls[i]);
+    }
+    fprintf(stream, "\n");
+}
+
+void fsstat_print_histogram(FILE *stream, fs_op op) {
+    const fsstat_counters *op_counters = &counters[op];
+    unsigned long peak = 0;
+    for (int bucket = 0; bucket < FSSTAT_BUCKETS; bucket++) {
+        peak = op_counters->histogram[bucket] > peak ? op_counters->histogram[bucket] : peak;
+    }
+    fprintf(stream, "%s: %lu calls\n", op_names[op], op_counters->calls);
+    char low[16], high[16];
+    for (int bucket = 0; bucket < FSSTAT_BUCKETS; bucket++) {
+        unsigned long count = op_counters->histogram[bucket];
+        if (count == 0) {
+            continue;
+        }
+        uint64_t top = bucket + 1 < FSSTAT_BUCKETS ? bucket_floor(bucket + 1) : op_counters->max_ns;
+        int bar = (int)(40 * count / peak);
+        fprintf(stream, "%9s - %-9s %9lu %.*s\n", format_ns(low, sizeof(low), bucket_floor(bucket)),
+            format_ns(high, sizeof(high), top), count, bar > 0 ? bar : 1,
+            "########################################");
+    }
+}
+
+void fsstat_reset() {
+    memset(counters, 0, sizeof(counters));
+    memset(fsstat_syscalls, 0, sizeof(fsstat_syscalls));
+    io_bytes = 0;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file fsstat.h
+ * @brief Counters and latency histograms of the file system operations.
+ *
+ * Every f_ entry point and file system command records its calls, errors, bytes,
+ * the host syscalls it issued and its latency. Latencies go to log-bucketed
+ * histograms in the style of HdrHistogram: every power of two is split into
+ * FSSTAT_SUB_BUCKETS linear buckets, so percentiles are within 12.5% of the
+ * true value from nanoseconds up to minutes at a fixed cost per sample.
+ * Latencies are wall clock time, so they include the quanta other processes
+ * ran while the operation was preempted or blocked.
+ *
+ * Host syscalls are counted by wrappers installed with the linker's --wrap
+ * option (see SYSCALL_WRAP in the Makefile).
+ */
+
+#ifndef FSSTAT_H
+#define FSSTAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/**
+ * @def FSSTAT_SUB_BUCKETS
+ * @brief Linear buckets every power of two of a latency is split into.
+ */
+#define FSSTAT_SUB_BUCKETS 8
+
+/**
+ * @def FSSTAT_BUCKETS
+ * @brief Buckets of a latency histogram, enough for latencies up to 2^40 ns.
+ */
+#define FSSTAT_BUCKETS (38 * FSSTAT_SUB_BUCKETS)
+
+/**
+ * @brief The instrumented file system operations.
+ */
+typedef enum {
+    FS_OP_OPEN,
+    FS_OP_READ,
+    FS_OP_WRITE,
+    FS_OP_LSEEK,
+    FS_OP_CLOSE,
+    FS_OP_UNLINK,
+    FS_OP_CP,
+    FS_OP_CAT,
+    FS_OP_LS,
+    FS_OP_RM,
+    FS_OP_MV,
+    FS_OP_TOUCH,
+    FS_OP_FALLOCATE,
+    FS_OP_FLOCK,
+    FS_OP_SYNC,
+    FS_OP_FSYNC,
+    FS_OP_READ_ASYNC,
+    FS_OP_WRITE_ASYNC,
+    FS_OP_AWAIT,
+    FS_OP_MMAP,
+    FS_OP_MUNMAP,
+    FS_OP_FADVISE,
+    FS_NUM_OPS
+} fs_op;
+
+/**
+ * @brief The kinds of host syscalls counted.
+ */
+typedef enum {
+    SYSCALL_READ,
+    SYSCALL_WRITE,
+    SYSCALL_PREAD,
+    SYSCALL_PWRITE,
+    SYSCALL_LSEEK,
+    SYSCALL_SYNC,   /**< fsync, fdatasync and msync. */
+    SYSCALL_OTHER,  /**< open, close, ftruncate, mmap and munmap. */
+    NUM_SYSCALLS
+} syscall_kind;
+
+/**
+ * @brief Counters of one operation.
+ */
+typedef struct {
+    unsigned long calls;
+    unsigned long errors;
+    unsigned long bytes;        /**< Bytes returned by f_read/f_write, host bytes moved by the others. */
+    unsigned long syscalls;     /**< Host syscalls issued while the operation ran. */
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned long histogram[FSSTAT_BUCKETS];
+} fsstat_counters;
+
+/**
+ * @brief Snapshot taken when an operation starts.
+ */
+typedef struct {
+    struct timespec started;
+    unsigned long syscalls;
+    unsigned long io_bytes;
+} fsstat_timer;
+
+/**
+ * @brief Host syscalls issued since the program started, by kind.
+ */
+extern unsigned long fsstat_syscalls[NUM_SYSCALLS];
+
+/**
+ * @brief Names of the syscall kinds, for reports.
+ */
+extern const char *fsstat_syscall_names[NUM_SYSCALLS];
+
+/**
+ * @brief Starts timing an operation.
+ *
+ * @param timer Where the start is recorded.
+ */
+void fsstat_begin(fsstat_timer *timer);
+
+/**
+ * @brief Records an operation that finished.
+ *
+ * @param op The operation.
+ * @param timer The timer passed to fsstat_begin.
+ * @param result What the operation returned, negative values count as errors.
+ * @param bytes The bytes it transferred, or -1 to use the host bytes read and written meanwhile.
+ */
+void fsstat_end(fs_op op, const fsstat_timer *timer, int result, long bytes);
+
+/**
+ * @brief Returns the name of an operation, or NULL.
+ *
+ * @param op The operation.
+ */
+const char *fsstat_op_name(fs_op op);
+
+/**
+ * @brief Looks an operation up by name.
+ *
+ * @param name Name as printed by fsstat_print, e.g. "read" or "cp".
+ * @return The operation, or -1 if there is none of that name.
+ */
+int fsstat_find_op(const char *name);
+
+/**
+ * @brief Prints a table of every operation that ran: calls, errors, bytes, syscalls and latency percentiles.
+ *
+ * @param stream Where to print.
+ */
+void fsstat_print(FILE *stream);
+
+/**
+ * @brief Prints the latency histogram of one operation, one line per bucket that has samples.
+ *
+ * @param stream Where to print.
+ * @param op The operation.
+ */
+void fsstat_print_histogram(FILE *stream, fs_op op);
+
+/**
+ * @brief Zeroes the counters and histograms of every operation, the syscall totals included.
+ */
+void fsstat_reset();
+
+#endif
@@ -0,0 +1,104 @@
+#include "fstrace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FSTRACE_BUFFER_SIZE (64 * 1024)
+
+static FILE *trace_file;
+static char *trace_buffer;
+static struct timespec trace_started;
+static long num_records;
+
+static uint64_t ns_between(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec - from->tv_nsec;
+}
+
+int fstrace_start(const char *path, int block_size_config, int fat_blocks) {
+    if (trace_file != NULL) {
+        return -1;
+    }
+    trace_file = fopen(path, "w");
+    if (trace_file == NULL) {
+        return -1;
+    }
+    // Calls are written out a buffer at a time rather than one host write each
+    trace_buffer = malloc(FSTRACE_BUFFER_SIZE);
+    setvbuf(trace_file, trace_buffer, _IOFBF, FSTRACE_BUFFER_SIZE);
+
+    fstrace_header header = { FSTRACE_MAGIC, FSTRACE_VERSION, block_size_config, fat_blocks, time(NULL) };
+    fwrite(&header, sizeof(header), 1, trace_file);
+    clock_gettime(CLOCK_MONOTONIC, &trace_started);
+    num_records = 0;
+    return 0;
+}
+
+long fstrace_stop() {
+    if (trace_file == NULL) {
+        return -1;
+    }
+    fclose(trace_file);
+    free(trace_buffer);
+    trace_file = NULL;
+    trace_buffer = NULL;
+    return num_records;
+}
+
+bool fstrace_active() {
+    return trace_file != NULL;
+}
+
+void fstrace_add(fs_op op, const fsstat_timer *timer, pid_t pid, int result, int fd, int offset, int count, int whence, char *const *names) {
+    if (trace_file == NULL) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t duration = ns_between(&timer->started, &now);
+
+    fstrace_record record = { 0 };
+    // A call that started before recording did is placed at its start
+    bool started_before = timer->started.tv_sec < trace_started.tv_sec
+        || (timer->started.tv_sec == trace_started.tv_sec && timer->started.tv_nsec < trace_started.tv_nsec);
+    record.start_ns = started_before ? 0 : ns_between(&trace_started, &timer->started);
+    record.duration_ns = duration > UINT32_MAX ? UINT32_MAX : duration;
+    record.pid = pid;
+    record.result = result;
+    record.fd = fd;
+    record.offset = offset;
+    record.count = count;
+    record.op = op;
+    record.whence = whence;
+    int num_names = 0;
+    for (; names != NULL && names[num_names] != NULL; num_names++) {
+        int name_len = strlen(names[num_names]) + 1;
+        if (record.names_len + name_len > FSTRACE_NAMES_MAX) {
+            break;
+        }
+        record.names_len += name_len;
+    }
+
+    fwrite(&record, sizeof(record), 1, trace_file);
+    for (int i = 0; i < num_names; i++) {
+        fwrite(names[i], strlen(names[i]) + 1, 1, trace_file);
+    }
+    num_records++;
+}
+
+int fstrace_read_header(FILE *trace, fstrace_header *header) {
+    if (fread(header, sizeof(*header), 1, trace) != 1 || header->magic != FSTRACE_MAGIC || header->version != FSTRACE_VERSION) {
+        return -1;
+    }
+    return 0;
+}
+
+int fstrace_next(FILE *trace, fstrace_record *record, char *names) {
+    if (fread(record, sizeof(*record), 1, trace) != 1) {
+        return feof(trace) ? 0 : -1;
+    }
+    if (record->names_len > FSTRACE_NAMES_MAX || fread(names, 1, record->names_len, trace) != record->names_len) {
+        return -1;
+    }
+    return 1;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file fstrace.h
+ * @brief Recording of the file system calls to a binary trace, for replay with fsreplay.
+ *
+ * While recording, every call fsstat instruments is appended to a host file:
+ * which process made it, when it started and how long it took, its arguments,
+ * the byte counts it asked for and what it returned. The data read and written
+ * is not kept, so traces stay small and carry no file contents. A trace is an
+ * fstrace_header followed by fstrace_records, each followed by the
+ * NUL-terminated names it carries.
+ */
+
+#ifndef FSTRACE_H
+#define FSTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "fsstat.h"
+
+/**
+ * @def FSTRACE_MAGIC
+ * @brief First four bytes of a trace, "PFTR".
+ */
+#define FSTRACE_MAGIC 0x52544650
+
+/**
+ * @def FSTRACE_VERSION
+ * @brief Version of the trace format.
+ */
+#define FSTRACE_VERSION 2
+
+/**
+ * @def FSTRACE_NAMES_MAX
+ * @brief Most bytes of names a record carries, longer argument lists are cut short.
+ */
+#define FSTRACE_NAMES_MAX 1024
+
+/**
+ * @brief Start of a trace.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t block_size_config;  /**< Geometry of the volume recorded, for a replay on the same geometry. */
+    uint8_t fat_blocks;         /**< 0 if no volume was mounted. */
+    uint64_t started;           /**< Wall clock time recording started, in seconds since the epoch. */
+} fstrace_header;
+
+/**
+ * @brief One call.
+ */
+typedef struct {
+    uint64_t start_ns;      /**< When the call started, since recording started. */
+    uint32_t duration_ns;
+    int32_t pid;
+    int32_t result;         /**< What the call returned, the slot of the mapping for an mmap. */
+    int32_t fd;             /**< The file descriptor of the call, the mode of an open, the handle of an await or the mapping of an munmap. */
+    int32_t offset;         /**< Offset of an fadvise or an mmap. */
+    int32_t count;          /**< Bytes asked for by a read, write or fallocate, the length of an fadvise, mmap or munmap, or an lseek's offset. */
+    uint8_t op;             /**< An fs_op. */
+    uint8_t whence;         /**< Whence of an lseek, operation of an flock, advice of an fadvise or protection of an mmap. */
+    uint16_t names_len;     /**< Bytes of NUL-terminated names that follow the record. */
+} fstrace_record;
+
+/**
+ * @brief Starts recording to a host file, replacing it.
+ *
+ * @param path The host file.
+ * @param block_size_config Block size configuration of the volume being recorded.
+ * @param fat_blocks FAT blocks of the volume being recorded, or 0 if none is mounted.
+ * @return 0 on success, -1 if already recording or the file could not be created.
+ */
+int fstrace_start(const char *path, int block_size_config, int fat_blocks);
+
+/**
+ * @brief Stops recording and closes the trace.
+ *
+ * @return The number of calls recorded, or -1 if not recording.
+ */
+long fstrace_stop();
+
+/**
+ * @brief Whether calls are being recorded.
+ */
+bool fstrace_active();
+
+/**
+ * @brief Appends a call that finished to the trace, if recording.
+ *
+ * @param op The operation.
+ * @param timer The timer the call was timed with.
+ * @param pid The process that made the call.
+ * @param result What the call returned.
+ * @param fd See fstrace_record.
+ * @param offset See fstrace_record.
+ * @param count See fstrace_record.
+ * @param whence See fstrace_record.
+ * @param names NULL-terminated list of the names the call took, or NULL.
+ */
+void fstrace_add(fs_op op, const fsstat_timer *timer, pid_t pid, int result, int fd, int offset, int count, int whence, char *const *names);
+
+/**
+ * @brief Reads the header of a trace.
+ *
+ * @param trace The trace, positioned at its start.
+ * @param header Where the header is stored.
+ * @return 0 on success, -1 if it is not a trace of a version this build reads.
+ */
+int fstrace_read_header(FILE *trace, fstrace_header *header);
+
+/**
+ * @brief Reads the next call of a trace.
+ *
+ * @param trace The trace, positioned after the header or the previous call.
+ * @param record Where the call is stored.
+ * @param names Where its names are stored, FSTRACE_NAMES_MAX bytes.
+ * @return 1 if a call was read, 0 at the end of the trace, -1 if the trace is cut short.
+ */
+int fstrace_next(FILE *trace, fstrace_record *record, char *names);
+
+#endif
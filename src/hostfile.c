@@ -0,0 +1,29 @@
+#include "hostfile.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+
+int host_file_info(const char *path, uint32_t *size, uint8_t *perm, time_t *mtime) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) || st.st_size > UINT32_MAX) {
+        return 0;
+    }
+    *size = st.st_size;
+    // PennFAT has no execute-only permissions, x comes with r
+    *perm = (st.st_mode & S_IRUSR ? 4 : 0) | (st.st_mode & S_IWUSR ? 2 : 0) | ((st.st_mode & S_IRUSR) && (st.st_mode & S_IXUSR) ? 1 : 0);
+    *mtime = st.st_mtime;
+    return 1;
+}
+
+int host_make_dir(const char *path) {
+    return mkdir(path, 0755) == -1 && errno != EEXIST ? -1 : 0;
+}
+
+int host_file_finish(int fd, uint8_t perm, time_t mtime) {
+    mode_t mode = (perm & 4 ? S_IRUSR | S_IRGRP | S_IROTH : 0) | (perm & 2 ? S_IWUSR : 0) | (perm & 1 ? S_IXUSR | S_IXGRP | S_IXOTH : 0);
+    struct timespec times[2] = { { mtime, 0 }, { mtime, 0 } };
+    return futimens(fd, times) == -1 || fchmod(fd, mode) == -1 ? -1 : 0;
+}
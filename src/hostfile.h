@@ -0,0 +1,47 @@
+/**
+ * @file hostfile.h
+ * @brief Host file metadata for pack and unpack.
+ *
+ * Kept apart from pennfat.c, whose chmod command clashes with the one
+ * <sys/stat.h> declares.
+ */
+
+#ifndef HOSTFILE_H
+#define HOSTFILE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * @brief Looks up a host file for pack.
+ *
+ * @param path The host file.
+ * @param size Set to its size.
+ * @param perm Set to its owner permissions as PennFAT perm bits (4 read, 2 write, 1 execute).
+ * @param mtime Set to its modification time.
+ *
+ * @return Returns 1 for a regular file that fits in PennFAT, 0 for anything else, or -1 if it cannot be read.
+ */
+int host_file_info(const char *path, uint32_t *size, uint8_t *perm, time_t *mtime);
+
+/**
+ * @brief Creates a host directory, unless it already exists.
+ *
+ * @param path The host directory.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int host_make_dir(const char *path);
+
+/**
+ * @brief Gives a host file the permissions and modification time of a PennFAT file, for unpack.
+ *
+ * @param fd The open host file.
+ * @param perm PennFAT perm bits, applied for owner (and read and execute for everyone).
+ * @param mtime The modification time.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int host_file_finish(int fd, uint8_t perm, time_t mtime);
+
+#endif
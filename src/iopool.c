@@ -0,0 +1,338 @@
+#include "iopool.h"
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+extern PCB* current_pcb;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static io_request *queue_head = NULL;
+static io_request *queue_tail = NULL;
+static bool live_workers[IOPOOL_MAX_WORKERS]; // Worker ids that have a thread
+static int num_workers = 0;
+static int target_workers = IOPOOL_WORKERS;
+static bool pool_failed = false; // No thread could be started, requests are done inline
+static __thread bool on_worker = false; // Set on the worker threads
+
+// Requests done so far, and how many of them io_poll has seen
+static unsigned long completions = 0;
+static unsigned long polled = 0;
+
+// Requests processes are blocked on, and processes blocked in io_sleep, only touched on the scheduler's thread
+static io_request *waited = NULL;
+// Length of waited, read by the workers without the list so they never touch a request once it is done
+static int num_waited = 0;
+static PCB **sleepers = NULL;
+static int num_sleepers = 0;
+static int max_sleepers = 0;
+
+io_request *io_request_create() {
+    io_request *request = calloc(1, sizeof(io_request));
+    if (request != NULL) {
+        request->host_fd = -1;
+    }
+    return request;
+}
+
+int io_request_add(io_request *request, int fd, bool write, char *buf, size_t length, off_t offset) {
+    if (request->num_segments > 0) {
+        io_segment *last = &request->segments[request->num_segments - 1];
+        if (last->fd == fd && last->write == write && last->buf + last->length == buf && last->offset + (off_t)last->length == offset) {
+            last->length += length;
+            return 0;
+        }
+    }
+    if (request->num_segments == request->capacity) {
+        int capacity = request->capacity == 0 ? 4 : 2 * request->capacity;
+        io_segment *segments = realloc(request->segments, capacity * sizeof(io_segment));
+        if (segments == NULL) {
+            return -1;
+        }
+        request->segments = segments;
+        request->capacity = capacity;
+    }
+    request->segments[request->num_segments++] = (io_segment) { fd, write, buf, length, offset };
+    return 0;
+}
+
+// Does the transfers of a request and marks it done
+static void io_run(io_request *request) {
+    ssize_t total = 0;
+    for (int i = 0; i < request->num_segments && total != -1; i++) {
+        io_segment *segment = &request->segments[i];
+        size_t moved = 0;
+        while (moved < segment->length) {
+            ssize_t n = segment->write ? pwrite(segment->fd, segment->buf + moved, segment->length - moved, segment->offset + moved)
+                : pread(segment->fd, segment->buf + moved, segment->length - moved, segment->offset + moved);
+            if (n <= 0) {
+                break;
+            }
+            moved += n;
+        }
+        total = moved == segment->length ? total + (ssize_t)moved : -1;
+    }
+    request->result = total;
+    __atomic_store_n(&request->done, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&completions, 1, __ATOMIC_RELEASE);
+}
+
+static void *io_worker(void *arg) {
+    int id = (int)(long)arg;
+    on_worker = true;
+    while (true) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_head == NULL && id < target_workers) {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        }
+        if (queue_head == NULL) {
+            // The pool shrank, the highest workers leave once nothing is queued
+            live_workers[id] = false;
+            num_workers--;
+            pthread_mutex_unlock(&queue_mutex);
+            return NULL;
+        }
+        io_request *request = queue_head;
+        queue_head = request->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_mutex);
+
+        io_run(request);
+        // A blocked process should not have to wait for the rest of the quantum
+        if (__atomic_load_n(&num_waited, __ATOMIC_RELAXED) > 0 || __atomic_load_n(&num_sleepers, __ATOMIC_RELAXED) > 0) {
+            kill(getpid(), SIGALRM);
+        }
+    }
+}
+
+// Brings the pool up to target_workers, with every signal blocked so that they only reach the scheduler's thread
+static void start_workers() {
+    sigset_t all, saved;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &saved);
+    pthread_mutex_lock(&queue_mutex);
+    for (int id = 0; id < target_workers; id++) {
+        pthread_t thread;
+        if (live_workers[id]) {
+            continue;
+        }
+        if (pthread_create(&thread, NULL, io_worker, (void *)(long)id) != 0) {
+            pool_failed = num_workers == 0;
+            break;
+        }
+        pthread_detach(thread);
+        live_workers[id] = true;
+        num_workers++;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+void io_submit(io_request *request) {
+    request->next = NULL;
+    if (num_workers < target_workers && !pool_failed) {
+        start_workers();
+    }
+    if (num_workers == 0 || target_workers == 0) {
+        io_run(request);
+        return;
+    }
+    pthread_mutex_lock(&queue_mutex);
+    if (queue_tail == NULL) {
+        queue_head = request;
+    } else {
+        queue_tail->next = request;
+    }
+    queue_tail = request;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+bool io_done(io_request *request) {
+    return __atomic_load_n(&request->done, __ATOMIC_ACQUIRE) != 0;
+}
+
+unsigned long io_completions() {
+    return __atomic_load_n(&completions, __ATOMIC_ACQUIRE);
+}
+
+// Whether a process the scheduler runs is calling, and could be blocked with the given signal mask
+static bool process_can_block(const sigset_t *mask) {
+    return !on_worker && current_pcb != NULL && current_pcb->status == RUNNING && !sigismember(mask, SIGALRM);
+}
+
+bool io_can_block() {
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    return process_can_block(&mask);
+}
+
+// Blocks SIGALRM, returns whether the caller cannot be blocked in the scheduler and has to spin instead
+static bool block_alarm(sigset_t *saved) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, saved);
+    return !process_can_block(saved);
+}
+
+// Waits with SIGALRM blocked until a condition holds, blocked in the scheduler meanwhile
+static void block_until(bool (*ready)(void *arg), void *arg, const sigset_t *saved) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGALRM);
+    while (!ready(arg)) {
+        current_pcb->status = BLOCKED;
+        sigprocmask(SIG_SETMASK, saved, NULL);
+        while (current_pcb->status == BLOCKED);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+    }
+}
+
+static bool request_done(void *request) {
+    return io_done(request);
+}
+
+static bool completed_since(void *seen) {
+    return io_completions() != *(unsigned long *)seen;
+}
+
+ssize_t io_wait(io_request *request) {
+    sigset_t saved;
+    if (block_alarm(&saved)) {
+        // Only without a process to block, e.g. before the scheduler starts
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        while (!io_done(request)) {
+            sched_yield();
+        }
+        return request->result;
+    }
+    if (!io_done(request)) {
+        // Like a file lock waiter: blocked until io_poll sees the request done
+        request->next_waited = waited;
+        waited = request;
+        __atomic_store_n(&num_waited, num_waited + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&request->waiter, current_pcb, __ATOMIC_RELEASE);
+        block_until(request_done, request, &saved);
+        // io_poll takes it off the list once it has seen it done, unless the waiter ran first
+        for (io_request **link = &waited; *link != NULL; link = &(*link)->next_waited) {
+            if (*link == request) {
+                *link = request->next_waited;
+                __atomic_store_n(&num_waited, num_waited - 1, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    return request->result;
+}
+
+void io_sleep(unsigned long seen) {
+    sigset_t saved;
+    if (block_alarm(&saved)) {
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        while (io_completions() == seen) {
+            sched_yield();
+        }
+        return;
+    }
+    if (io_completions() == seen) {
+        if (num_sleepers == max_sleepers) {
+            int capacity = max_sleepers == 0 ? 8 : 2 * max_sleepers;
+            PCB **grown = realloc(sleepers, capacity * sizeof(PCB *));
+            if (grown == NULL) {
+                // Polling still gets there, a quantum at a time
+                sigprocmask(SIG_SETMASK, &saved, NULL);
+                return;
+            }
+            sleepers = grown;
+            max_sleepers = capacity;
+        }
+        sleepers[num_sleepers] = current_pcb;
+        __atomic_store_n(&num_sleepers, num_sleepers + 1, __ATOMIC_RELAXED);
+        block_until(completed_since, &seen, &saved);
+        io_cancel_wait(current_pcb);
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+void io_cancel_wait(PCB *pcb) {
+    sigset_t saved;
+    block_alarm(&saved);
+    for (int i = 0; i < num_sleepers; i++) {
+        if (sleepers[i] == pcb) {
+            sleepers[i] = sleepers[num_sleepers - 1];
+            __atomic_store_n(&num_sleepers, num_sleepers - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    for (io_request **link = &waited; *link != NULL; link = &(*link)->next_waited) {
+        if (__atomic_load_n(&(*link)->waiter, __ATOMIC_ACQUIRE) == pcb) {
+            __atomic_store_n(&(*link)->waiter, NULL, __ATOMIC_RELEASE);
+            *link = (*link)->next_waited;
+            __atomic_store_n(&num_waited, num_waited - 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+void io_poll() {
+    io_request **link = &waited;
+    while (*link != NULL) {
+        io_request *request = *link;
+        if (io_done(request)) {
+            *link = request->next_waited;
+            __atomic_store_n(&num_waited, num_waited - 1, __ATOMIC_RELAXED);
+            unblock_process(request->waiter);
+        } else {
+            link = &request->next_waited;
+        }
+    }
+
+    // Sleepers look again for what they wait for whenever anything is done
+    unsigned long done = io_completions();
+    if (done != polled) {
+        polled = done;
+        for (int i = 0; i < num_sleepers; i++) {
+            unblock_process(sleepers[i]);
+        }
+        __atomic_store_n(&num_sleepers, 0, __ATOMIC_RELAXED);
+    }
+}
+
+int io_set_workers(int count) {
+    if (count < 0 || count > IOPOOL_MAX_WORKERS) {
+        return -1;
+    }
+    // Workers above the target exit on their own once they are idle
+    pthread_mutex_lock(&queue_mutex);
+    target_workers = count;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    pool_failed = false;
+    start_workers();
+    return pool_failed && count > 0 ? -1 : count;
+}
+
+int io_get_workers() {
+    return pool_failed ? 0 : target_workers;
+}
+
+void io_request_free(io_request *request) {
+    if (request != NULL) {
+        if (request->host_fd != -1) {
+            close(request->host_fd);
+        }
+        free(request->buffer);
+        free(request->segments);
+        free(request);
+    }
+}
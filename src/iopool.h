@@ -0,0 +1,162 @@
+/**
+ * @file iopool.h
+ * @brief Host threads that do the I/O of PennOS processes off the scheduler's thread.
+ *
+ * Every PennOS process runs on the one host thread that runs the scheduler, so
+ * a process waiting in read() or write() stalls all of them. An io_request
+ * collects the host transfers of a file system call; io_submit hands it to a
+ * pool of worker threads, and io_wait blocks the calling process in the
+ * scheduler until a worker has done them, so other processes keep running.
+ *
+ * Workers only ever move data: the FAT, the directory and every other bit of
+ * file system state are changed on the scheduler's thread before a request is
+ * submitted. Workers block every signal, so SIGALRM always preempts a process.
+ */
+
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "pcb.h"
+
+/**
+ * @def IOPOOL_WORKERS
+ * @brief Worker threads the pool starts with.
+ */
+#define IOPOOL_WORKERS 4
+
+/**
+ * @def IOPOOL_MAX_WORKERS
+ * @brief Most worker threads the pool can have.
+ */
+#define IOPOOL_MAX_WORKERS 64
+
+/**
+ * @brief One host pread or pwrite of a request.
+ */
+typedef struct {
+    int fd;         /**< Host file, the image of a volume. */
+    bool write;     /**< pwrite if set, pread otherwise. */
+    char *buf;      /**< Data to write or where to read it, owned by the caller. */
+    size_t length;  /**< Bytes to transfer. */
+    off_t offset;   /**< Host file offset. */
+} io_segment;
+
+/**
+ * @brief The host transfers of one file system call.
+ */
+typedef struct io_request {
+    io_segment *segments;       /**< The transfers, adjacent ones merged. */
+    int num_segments;
+    int capacity;
+    ssize_t result;             /**< Bytes transferred once done, or -1 if a transfer failed. */
+    int done;                   /**< Set by the worker once every transfer is through, accessed atomically. */
+    PCB *waiter;                /**< Process blocked in io_wait, accessed atomically. */
+    char *buffer;               /**< Data the transfers go through that no caller keeps, freed with the request. */
+    int host_fd;                /**< Host file only the transfers use, closed with the request, or -1. */
+    struct io_request *next;    /**< Next request in the worker queue. */
+    struct io_request *next_waited; /**< Next request in the waited for list, apart from next as it may still be queued. */
+} io_request;
+
+/**
+ * @brief Allocates an empty request.
+ *
+ * @return Returns the request, or NULL on failure.
+ */
+io_request *io_request_create();
+
+/**
+ * @brief Adds a transfer to a request, merging it into the previous one when they are adjacent.
+ *
+ * @param request The request, not submitted yet.
+ * @param fd The host file.
+ * @param write Whether to write rather than read.
+ * @param buf The data, which must stay valid until the request is done.
+ * @param length The bytes to transfer.
+ * @param offset The host file offset.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int io_request_add(io_request *request, int fd, bool write, char *buf, size_t length, off_t offset);
+
+/**
+ * @brief Hands a request to the workers, or does it right away if the pool cannot run.
+ *
+ * Called with SIGALRM blocked (under fs_lock()), as the queue is shared with the workers.
+ *
+ * @param request The request.
+ */
+void io_submit(io_request *request);
+
+/**
+ * @brief Whether a worker is through with a request.
+ *
+ * @param request A submitted request.
+ */
+bool io_done(io_request *request);
+
+/**
+ * @brief Blocks the calling process until a request is done; the scheduler runs others meanwhile.
+ *
+ * @param request A submitted request.
+ *
+ * @return Returns the bytes transferred, or -1 if a transfer failed.
+ */
+ssize_t io_wait(io_request *request);
+
+/**
+ * @brief Counts the requests done so far, for io_sleep.
+ */
+unsigned long io_completions();
+
+/**
+ * @brief Blocks the calling process until a request is done after io_completions() returned seen.
+ *
+ * Spins instead where no process can block, e.g. while SIGALRM is blocked.
+ *
+ * @param seen What io_completions() returned before the caller looked for requests it has to wait for.
+ */
+void io_sleep(unsigned long seen);
+
+/**
+ * @brief Forgets a process that is killed while blocked in io_wait or io_sleep.
+ *
+ * @param pcb The process.
+ */
+void io_cancel_wait(PCB *pcb);
+
+/**
+ * @brief Whether the calling process would be blocked in the scheduler by io_wait, rather than spin.
+ *
+ * It has to be running under the scheduler with SIGALRM unblocked, i.e. outside fs_lock().
+ */
+bool io_can_block();
+
+/**
+ * @brief Changes the number of worker threads. Called with SIGALRM blocked, like io_submit.
+ *
+ * @param workers The new number of workers, from 0 (requests are done inline) to IOPOOL_MAX_WORKERS.
+ *
+ * @return Returns the new number of workers, or -1 on failure.
+ */
+int io_set_workers(int workers);
+
+/**
+ * @brief Returns the number of worker threads the pool runs, or 0 if it does everything inline.
+ */
+int io_get_workers();
+
+/**
+ * @brief Unblocks the processes whose requests are done. Called by the scheduler every quantum.
+ */
+void io_poll();
+
+/**
+ * @brief Frees a request that is done, or was never submitted, with its buffer and host file.
+ *
+ * @param request The request.
+ */
+void io_request_free(io_request *request);
+
+#endif
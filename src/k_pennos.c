@@ -5,6 +5,7 @@
 #include <string.h>
 #define MAX_OPEN_FILES 128
 #include "scheduler.h"
+#include "f_pennos.h"
 
 // maybe have to include global variables for init process?
 
@@ -142,6 +143,11 @@ void k_process_kill(PCB* process, pennos_signal signal) {
             // terminate the process
             process -> status = ZOMBIE;
             process->e_status = EXIT_SIGNAL;
+            // its file locks go to the next waiters instead of dying with it
+            f_flock_release(process->pid);
+            f_munmap_release(process->pid);
+            io_cancel_wait(process);
+            f_async_release(process->pid);
             if (strcmp(process->process_name, "sleep") == 0) {
                 schedule_sleep_process(process, S_SIGTERM);
             }
@@ -9,7 +9,7 @@
 #include <termios.h>
 
 #define MAX_LINE_LENGTH 4096
-#define NUM_CMDS 27
+#define NUM_CMDS 40
 pid_t shell_pid = 2;
 FILE* logFile;
 
@@ -72,7 +72,7 @@ void register_sigtstp_handler() {
 
 //function array
 void (*func_array[])() = { egg, bash_sleep, busy, bash_echo, bash_kill, zombify, orphanify, bash_ps, bash_nice, nice_pid, jobs, fg, bg, egg, egg,
-    egg, egg, bash_touch, bash_rm, bash_mv, bash_cp, bash_cat, bash_ls, bash_chmod, nohang, hang, recur};
+    bash_mount_volume, bash_umount, bash_touch, bash_rm, bash_mv, bash_cp, bash_cat, bash_ls, bash_chmod, nohang, hang, recur, bash_fragstat, bash_sync, bash_writeback, crashtest, bash_snapshot, bash_dedup, bash_scrub, bash_fsstat, bash_fstrace, fsstress, bash_pack, bash_unpack, bash_ioworkers};
 
 //function descriptions for man command array
 const char *func_names[] = { 
@@ -91,18 +91,31 @@ const char *func_names[] = {
     "fg [job_id] (S) bring the last stopped or backgrounded job to the foreground, or the job specified by job_id.", 
     "bg [job_id] (S) continue the last stopped job, or the job specified by job_id. Note that this does mean you will need to implement the & operator in your shell.", 
     "mkfs FS_NAME BLOCKS_IN_FAT BLOCK_SIZE_CONFIG Creates a PennFAT filesystem in the file named FS_NAME. The number of blocks in the FAT region is BLOCKS_IN_FAT (ranging from 1 through 32), and the block size is 256, 512, 1024, 2048, or 4096 bytes corresponding to the value (0 through 4) of BLOCK_SIZE_CONFIG.",
-    "mount FS_NAME Mounts the filesystem named FS_NAME by loading its FAT into memory.", 
-    "umount Unmounts the currently mounted filesystem.", 
+    "mount [-r] FS_NAME [LABEL] (S*) Mounts the filesystem named FS_NAME next to the ones already mounted. Its files are addressed as LABEL:NAME, LABEL defaults to the base name of FS_NAME. With -r the image is mounted read-only, so other PennOS instances can mount it at the same time; anything that would change it fails.", 
+    "umount [LABEL] (S*) Unmounts the volume LABEL, or the default volume (the first one mounted).", 
     "touch file ... (S*) create an empty file if it does not exist, or update its timestamp otherwise.", 
     "mv SOURCE DEST Renames SOURCE to DEST.", 
     "rm FILE ... Removes the files.",
     "cp src dest (S*) copy src to dest", 
     "cat (S*) The usual cat from bash, etc.", 
-    "ls (S*) list all files in the working directory (similar to ls -il in bash), same formatting as ls in the standalone PennFAT.", 
+    "ls [LABEL] (S*) list all files in the working directory (similar to ls -il in bash), same formatting as ls in the standalone PennFAT. LABEL selects another mounted volume.", 
     "chmod (S*) similar to chmod(1) in the VM",
     "nohang (S) uses Stress.c to test our p_waitpid function with nohang", 
     "hang (S) uses Stress.c to test our p_waitpid function with nohang", 
-    "recur (S) uses Stress.c to test our p_waitpid function that spawns generations A-Z and reaps accordingly"
+    "recur (S) uses Stress.c to test our p_waitpid function that spawns generations A-Z and reaps accordingly",
+    "fragstat (S*) print the extents, average run length and span of every file, the free run histogram and a block map of the image.",
+    "sync (S*) write back everything that changed on the mounted filesystems since the last sync.",
+    "writeback [DIRTY_AGE [DIRTY_BYTES]] (S*) set how many seconds changes may stay dirty and how many dirty bytes make flushd write a volume back early, and print what flushd has written back.",
+    "crashtest [OPS [SEED]] (S) run OPS random file operations on the default filesystem, crash each one at a random write and check the crashed image.",
+    "snapshot create|list|delete|rollback [LABEL:]NAME (S*) take a copy-on-write snapshot of a volume, list its snapshots with the blocks only they hold, delete one, or return the volume to one (its files must be closed).",
+    "dedup [LABEL:] (S*) share the blocks of files storing the same data, copy-on-write, and print the space reclaimed. Afterwards files on the volume are deduplicated as they are written.",
+    "scrub [status] [LABEL:] [BLOCKS_PER_QUANTUM] (S*) check every chain and directory entry of a volume and read every allocated block, a few blocks per quantum at the lowest priority (run it with &). An interrupted pass resumes where it stopped; problems and the summary go to the log. status prints how far the pass got and what the last one found.",
+    "fsstat [reset|OPERATION] (S*) print the calls, errors, bytes, host syscalls and latency percentiles of every file system operation since the last reset, the latency histogram of one OPERATION (open, read, write, lseek, close, unlink, cp, cat, ls, rm, mv, touch, falloc, flock, sync, fsync, aread, awrite, await, mmap, munmap, fadvise), or reset the counters.",
+    "fstrace start HOST_FILE|stop (S*) record every file system call with its arguments, result and timing to a binary trace on the host, for replay against a fresh image with fsreplay.",
+    "fsstress [N [OPS [SEED]]] (S) run N processes doing OPS seeded random opens, reads, writes, appends, truncates, removes, moves and listings each on shared and private files of the default filesystem, check every file against its expected checksum and print the ops/s of each process.",
+    "pack HOST_DIR [LABEL:] (S*) copy every regular file of a host directory into a volume in one pass, each file in one contiguous extent, replacing files of the same name. Use tar on the host to pack an archive.",
+    "unpack HOST_DIR [LABEL:] (S*) copy every file of a volume into a host directory, created if needed, with its permissions and modification time.",
+    "ioworkers [N] (S*) set how many host threads move the data of the reads, writes and cp copies of 64KB or more of the processes, which are blocked meanwhile so the others keep running (0 does them inline), and print the transfers in flight."
 };
 
 // returns a negative if the function takes in the parsed cmd struct as input
@@ -136,9 +149,9 @@ int get_func_idx(char* name_str) {
     } else if (strcmp(name_str, "mkfs") == 0) {
         return 14;
     } else if (strcmp(name_str, "mount") == 0) {
-        return 15;
+        return -15;
     } else if (strcmp(name_str, "umount") == 0) {
-        return 16;
+        return -16;
     } else if (strcmp(name_str, "touch") == 0) {
         return -17;
     } else if (strcmp(name_str, "rm") == 0) {
@@ -150,7 +163,7 @@ int get_func_idx(char* name_str) {
     } else if (strcmp(name_str, "cat") == 0) {
         return -21;
     } else if (strcmp(name_str, "ls") == 0) {
-        return 22;
+        return -22;
     } else if (strcmp(name_str, "chmod") == 0) {
         return 23;
     } else if (strcmp(name_str, "nohang") == 0) {
@@ -159,6 +172,32 @@ int get_func_idx(char* name_str) {
         return 25;
     } else if (strcmp(name_str, "recur") == 0) {
         return 26;
+    } else if (strcmp(name_str, "fragstat") == 0) {
+        return 27;
+    } else if (strcmp(name_str, "sync") == 0) {
+        return 28;
+    } else if (strcmp(name_str, "writeback") == 0) {
+        return -29;
+    } else if (strcmp(name_str, "crashtest") == 0) {
+        return -30;
+    } else if (strcmp(name_str, "snapshot") == 0) {
+        return -31;
+    } else if (strcmp(name_str, "dedup") == 0) {
+        return -32;
+    } else if (strcmp(name_str, "scrub") == 0) {
+        return -33;
+    } else if (strcmp(name_str, "fsstat") == 0) {
+        return -34;
+    } else if (strcmp(name_str, "fstrace") == 0) {
+        return -35;
+    } else if (strcmp(name_str, "fsstress") == 0) {
+        return -36;
+    } else if (strcmp(name_str, "pack") == 0) {
+        return -37;
+    } else if (strcmp(name_str, "unpack") == 0) {
+        return -38;
+    } else if (strcmp(name_str, "ioworkers") == 0) {
+        return -39;
     } else {
         return -100;
     }
@@ -49,10 +49,11 @@ static ucontext_t* make_exitcontext() {
 }
 
 // move to a separate file later on
+// As large as the idle process's: the file system keeps block sized buffers on the stack, which overflow SIGSTKSZ
 static void setStack(stack_t *stack) {
-    void *sp = malloc(SIGSTKSZ);
-    VALGRIND_STACK_REGISTER(sp, sp + SIGSTKSZ);
-    *stack = (stack_t) { .ss_sp = sp, .ss_size = SIGSTKSZ };
+    void *sp = malloc(SIGSTKSZ * 100);
+    VALGRIND_STACK_REGISTER(sp, sp + SIGSTKSZ * 100);
+    *stack = (stack_t) { .ss_sp = sp, .ss_size = SIGSTKSZ * 100 };
 }
 
 static int get_num_args(char* argv[]) {
@@ -101,6 +102,10 @@ void p_system_init(void (*shell_func)()) {
     init_scheduler();
     char* argv[] = { NULL };
     p_spawn(shell_func, argv, STDIN_FILENO, STDOUT_FILENO, "shell");
+
+    // Background writeback, after the shell so that it keeps pid 2
+    pid_t flushd_pid = p_spawn(flushd, argv, STDIN_FILENO, STDOUT_FILENO, "flushd");
+    p_nice(flushd_pid, 1);
 }
 
 void make_context_cmd(ucontext_t *ucp, void (*func)(), struct parsed_command *cmd) {
@@ -291,6 +296,8 @@ void p_exit() {
             f_close(i);
         }
     }
+    f_munmap_release(current_pcb->pid);
+    f_async_release(current_pcb->pid);
     while(1);
 }
 
@@ -441,6 +448,7 @@ void start_os() {
 }
 
 void p_logout() {
+    f_sync(); // Open files may still hold back their directory entries
     k_logout();
 }
 
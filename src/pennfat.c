@@ -1,5 +1,7 @@
 #include "pennfat.h"
 #include "f_pennos.h"
+#include "hostfile.h"
+#include "iopool.h"
 
 #define MAX_LINE_LENGTH 4096
 
@@ -7,10 +9,90 @@ int fs_fd = -1;
 uint16_t *fat = NULL; // Pointer to the FAT in memory
 size_t fat_size = 0; // Size of the currently mounted FAT
 int block_size = 0; // Size of a block in the currently mounted FAT
+int alloc_cursor = 2; // Where the next new chain starts looking for a free block
+uint8_t *hole_map = NULL; // One bit per block, NULL until the image has a hole
+bool read_only = false; // Whether the mounted image is read-only
+
+pennfat_volume volumes[MAX_VOLUMES]; // Mount table, a slot is free while its label is empty
+int current_volume = -1; // Slot whose state is loaded into the globals above
+int default_volume = -1; // Slot used for paths without a LABEL: prefix
+int fs_lock_depth = 0;
+sigset_t fs_saved_mask;
 //extern FileDescriptor fd_table[MAX_OPEN_FILES];
 
 
+// Hash of a file name for the directory index
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(((directory_entry *)0)->name) && name[i] != '\0'; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Looks a name up in the directory index of the selected read-only volume
+int dir_index_find(const char *fname, directory_entry *result) {
+    pennfat_volume *volume = &volumes[current_volume];
+    uint32_t mask = volume->dir_index_capacity - 1;
+    for (uint32_t i = name_hash(fname) & mask; volume->dir_index[i].position != 0; i = (i + 1) & mask) {
+        if (strncmp(volume->dir_index[i].entry.name, fname, sizeof(volume->dir_index[i].entry.name)) == 0) {
+            *result = volume->dir_index[i].entry;
+            // Like the scan, leave the image offset right after the entry
+            lseek(fs_fd, volume->dir_index[i].position + sizeof(directory_entry), SEEK_SET);
+            return volume->dir_index[i].position;
+        }
+    }
+    return -1;
+}
+
+// Indexes the directory of the selected read-only volume, which cannot change while it is mounted
+int dir_index_build() {
+    pennfat_volume *volume = &volumes[current_volume];
+    int num_entries = block_size / sizeof(directory_entry);
+    int num_files = 0;
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        num_files += num_entries;
+    }
+    volume->dir_index_capacity = 16;
+    while (volume->dir_index_capacity < 2 * (uint32_t)num_files) {
+        volume->dir_index_capacity *= 2;
+    }
+    volume->dir_index = calloc(volume->dir_index_capacity, sizeof(dir_index_slot));
+    directory_entry *dir_entries = malloc(block_size);
+    if (volume->dir_index == NULL || dir_entries == NULL) {
+        fprintf(stderr, "Failed to allocate the directory index\n");
+        free(dir_entries);
+        return -1;
+    }
+
+    uint32_t mask = volume->dir_index_capacity - 1;
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        off_t block_offset = fat_size + (root_block - 1) * block_size;
+        if (dir_pread(dir_entries, block_size, block_offset) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            free(dir_entries);
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            if (dir_entries[i].name[0] == '\0') {
+                continue;
+            }
+            uint32_t bucket = name_hash(dir_entries[i].name) & mask;
+            while (volume->dir_index[bucket].position != 0) {
+                bucket = (bucket + 1) & mask;
+            }
+            volume->dir_index[bucket].position = block_offset + i * sizeof(directory_entry);
+            volume->dir_index[bucket].entry = dir_entries[i];
+        }
+    }
+    free(dir_entries);
+    return 0;
+}
+
 int find_file(const char* fname, directory_entry *result) {
+    if (read_only && current_volume != -1 && volumes[current_volume].dir_index != NULL) {
+        return dir_index_find(fname, result);
+    }
     directory_entry dir_entry;
     int fat_value = 1;
     size_t num_entries = block_size / sizeof(directory_entry);
@@ -23,7 +105,7 @@ int find_file(const char* fname, directory_entry *result) {
             return -1;
         }
         for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
             if (read_bytes == -1) {
                 fprintf(stderr, "Error reading directory entry\n");
                 return -1;
@@ -72,6 +154,53 @@ int initialize_fat(int fs_fd, int blocks_in_fat, int block_size_config) {
     return 0;
 }
 
+// Helper to lay out the journal in the blocks right after the root directory
+int initialize_journal(int fs_fd, int block_size, size_t fat_size, int num_fat_entries) {
+    // Room for every FAT entry to change once, but never more than a quarter of the data
+    int journal_blocks = (4 * fat_size + block_size - 1) / block_size;
+    if (journal_blocks < 4) {
+        journal_blocks = 4;
+    }
+    if (journal_blocks > (num_fat_entries - 2) / 4) {
+        journal_blocks = (num_fat_entries - 2) / 4;
+    }
+    if (journal_blocks < 2) {
+        return 0; // Too small to spare a journal, mount runs without one
+    }
+
+    // Chain blocks 2 .. 2 + journal_blocks - 1
+    for (int i = 0; i < journal_blocks; i++) {
+        uint16_t next_fat_value = i == journal_blocks - 1 ? 0xFFFF : 2 + i + 1;
+        if (pwrite(fs_fd, &next_fat_value, sizeof(uint16_t), (2 + i) * sizeof(uint16_t)) != sizeof(uint16_t)) {
+            fprintf(stderr, "Failed to write journal FAT entries\n");
+            return -1;
+        }
+    }
+
+    // First slot of the root directory
+    directory_entry dir_entry;
+    memset(&dir_entry, 0, sizeof(directory_entry));
+    strncpy(dir_entry.name, JOURNAL_NAME, sizeof(dir_entry.name));
+    dir_entry.size = journal_blocks * block_size;
+    dir_entry.allocSize = dir_entry.size;
+    dir_entry.firstBlock = 2;
+    dir_entry.lastBlock = 2 + journal_blocks - 1;
+    dir_entry.type = FT_SYSTEM;
+    dir_entry.perm = 0;
+    dir_entry.mtime = time(NULL);
+    if (pwrite(fs_fd, &dir_entry, sizeof(directory_entry), fat_size) != sizeof(directory_entry)) {
+        fprintf(stderr, "Failed to write journal directory entry\n");
+        return -1;
+    }
+
+    journal_header header = { JOURNAL_MAGIC, 0 };
+    if (pwrite(fs_fd, &header, sizeof(journal_header), fat_size + block_size) != sizeof(journal_header)) {
+        fprintf(stderr, "Failed to write journal header\n");
+        return -1;
+    }
+    return 0;
+}
+
 /*
 Creates a PennFAT filesystem in the file named FS_NAME. 
 The number of blocks in the FAT region is BLOCKS_IN_FAT (ranging from 1 through 32), 
@@ -118,6 +247,11 @@ int mkfs(const char *fs_name, int blocks_in_fat, int block_size_config) {
         return -1;
     }
 
+    if (initialize_journal(fs_fd, block_size, fat_size, num_fat_entries) != 0) {
+        close(fs_fd);
+        return -1;
+    }
+
     close(fs_fd);
     return 0;
 }
@@ -133,15 +267,15 @@ size_t get_fat_size_from_metadata(uint16_t metadata) {
     return fat_size;
 }
 
-// Mounts the file system specified at fs_name
-int mount(const char *fs_name) {
+// Opens the image at fs_name and loads it into the (cleared) globals
+int mount_image(const char *fs_name, bool mount_read_only) {
     if (fs_fd != -1) {
         fprintf(stderr, "A filesystem is already mounted.\n");
         return -1;
     }
 
     // Open the file system file
-    fs_fd = open(fs_name, O_RDWR);
+    fs_fd = open(fs_name, mount_read_only ? O_RDONLY : O_RDWR);
     if (fs_fd == -1) {
         fprintf(stderr, "Failed to open file system file\n");
         return -1;
@@ -152,32 +286,45 @@ int mount(const char *fs_name) {
     if (read(fs_fd, &metadata, sizeof(metadata)) != sizeof(metadata)) {
         fprintf(stderr, "Failed to read FAT metadata\n");
         close(fs_fd);
+        fs_fd = -1;
         return -1;
     }
 
     // Calculate fat_size from metadata (fat[0])
     fat_size = get_fat_size_from_metadata(metadata);
 
-    // Use mmap to map the FAT region into memory
-    fat = mmap(NULL, fat_size, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, 0);
+    // Use mmap to map the FAT region into memory, a read-only FAT is faulted in up front.
+    // The mapping is private either way: changes reach the image through sync_fat(), after the journal.
+    read_only = mount_read_only;
+    fat = read_only ? mmap(NULL, fat_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fs_fd, 0)
+        : mmap(NULL, fat_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fs_fd, 0);
     if (fat == MAP_FAILED) {
         fprintf(stderr, "Failed to map FAT into memory\n");
         close(fs_fd);
         fs_fd = -1;
+        fat = NULL;
         fat_size = 0;
         block_size = 0;
+        read_only = false;
         return -1;
     }
+    alloc_cursor = 2;
+    hole_map = sysfile_map(HOLEMAP_NAME, (fat_num_entries() + 7) / 8, false);
     return 0;
 }
 
-// Unmounts current file system FAT
-int umount() {
+// Unmaps and closes the image loaded into the globals
+int umount_image() {
     if (fs_fd == -1) {
         fprintf(stderr, "No filesystem is mounted.\n");
         return -1;
     }
 
+    if (hole_map != NULL) {
+        sysfile_unmap(hole_map, (fat_num_entries() + 7) / 8);
+        hole_map = NULL;
+    }
+
     // Unmap the FAT from memory
     if (munmap(fat, fat_size) == -1) {
         fprintf(stderr, "Failed to unmap FAT from memory\n");
@@ -190,613 +337,1341 @@ int umount() {
     fat = NULL;
     fat_size = 0;
     block_size = 0;
+    read_only = false;
     return 0;
 }
 
-int find_new_fat() {
-    int fat_no = 2;
-    char fat_entry[3];
-    fat_entry[2] = '\0';
+void fs_lock() {
+    if (fs_lock_depth++ == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGALRM);
+        sigprocmask(SIG_BLOCK, &mask, &fs_saved_mask);
+    }
+}
 
-    int offset = lseek(fs_fd, fat_no * 2, SEEK_SET);
-    if (offset == -1) {
-        fprintf(stderr, "No more space left\n");
-        return -1;
+void fs_unlock() {
+    if (--fs_lock_depth == 0) {
+        journal_commit();
+        sigprocmask(SIG_SETMASK, &fs_saved_mask, NULL);
     }
+}
 
-    int read_bytes = read(fs_fd, fat_entry, 2);
-    if (read_bytes == -1) {
-        fprintf(stderr, "Error reading directory entry for destination\n");
-        return -1;
+// Length of a journal record, including the entries that follow a JOURNAL_DIR
+size_t journal_record_length(const journal_record *record) {
+    return sizeof(journal_record) + (record->type == JOURNAL_DIR ? 2 * sizeof(directory_entry) : 0);
+}
+
+void journal_append(pennfat_volume *volume, const void *data, size_t length) {
+    char *records = (char *)(volume->journal + 1);
+    memcpy(records + volume->journal->used, data, length);
+    volume->journal->used += length;
+}
+
+// Bytes the journal of volume has left for records, keeping room for a COMMIT
+size_t journal_room(pennfat_volume *volume) {
+    size_t capacity = volume->journal_size - sizeof(journal_header) - sizeof(journal_record);
+    return volume->journal->used < capacity ? capacity - volume->journal->used : 0;
+}
+
+// Whether changes of the selected volume are being journaled
+static bool journal_active() {
+    return fs_lock_depth != 0 && current_volume != -1 && volumes[current_volume].journal != NULL;
+}
+
+// Logs a change of the selected volume, opening its transaction if needed
+void journal_log(const journal_record *record, const directory_entry *old_dir_entry, const directory_entry *new_dir_entry) {
+    if (!journal_active()) {
+        return;
     }
+    pennfat_volume *volume = &volumes[current_volume];
+    size_t length = journal_record_length(record);
+    journal_record marker = { JOURNAL_BEGIN };
+
+    if (!volume->in_transaction) {
+        // Nothing of this transaction has been changed yet, so the volume is consistent: checkpoint
+        // now if need be, so the transaction has at least half of the journal
+        if (volume->journal->used > (volume->journal_size - sizeof(journal_header)) / 2) {
+            journal_checkpoint();
+        }
+        journal_append(volume, &marker, sizeof(journal_record));
+        volume->in_transaction = true;
+    }
+    if (length > journal_room(volume)) {
+        // Operations reserve what they log with journal_reserve(), so this is a bug: the rest of
+        // the transaction goes on in a new one, and a crash may leave it half done
+        fprintf(stderr, "%s: journal overflow, the operation is not crash safe\n", volume->label);
+        marker.type = JOURNAL_COMMIT;
+        journal_append(volume, &marker, sizeof(journal_record));
+        volume->in_transaction = false;
+        journal_checkpoint();
+        marker.type = JOURNAL_BEGIN;
+        journal_append(volume, &marker, sizeof(journal_record));
+        volume->in_transaction = true;
+    }
+    journal_append(volume, record, sizeof(journal_record));
+    if (record->type == JOURNAL_DIR) {
+        journal_append(volume, old_dir_entry, sizeof(directory_entry));
+        journal_append(volume, new_dir_entry, sizeof(directory_entry));
+    }
+}
 
-    while (strcmp(fat_entry, "") != 0) {
-        fat_no++;
-        int offset = lseek(fs_fd, fat_no * 2, SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
-            return -1;
+// Commits the open transaction of every volume, syncing the journal once per group
+void journal_commit() {
+    int previous_volume = current_volume;
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (volumes[i].label[0] == '\0' || !volumes[i].in_transaction) {
+            continue;
         }
-        int read_bytes = read(fs_fd, fat_entry, 2);
-        if (read_bytes == -1) {
-            fprintf(stderr, "Error reading directory entry for destination\n");
-            return -1;
+        select_volume(i);
+        journal_record marker = { JOURNAL_COMMIT };
+        journal_append(&volumes[i], &marker, sizeof(journal_record));
+        volumes[i].in_transaction = false;
+
+        if (++volumes[i].commits >= JOURNAL_GROUP_COMMIT) {
+            journal_sync();
         }
     }
-    return fat_no;
+    if (previous_volume != -1) {
+        select_volume(previous_volume);
+    }
 }
 
+int journal_checkpoint() {
+    if (current_volume == -1 || read_only) {
+        return 0;
+    }
+    pennfat_volume *volume = &volumes[current_volume];
 
-int touch_single(const char *fs_name) {
-    int fat_value = 1;
-    size_t num_entries = block_size / sizeof(directory_entry);
-    directory_entry dir_entry;
-
-    // seek to the start of root directory
-    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-    if (root_dir_offset == -1) {
-        fprintf(stderr, "Failed to seek to root directory\n");
+    // Everything the journal describes must be on disk before it is forgotten
+    if (sync_volume() == -1) {
+        fprintf(stderr, "Failed to checkpoint the journal\n");
         return -1;
     }
+    if (volume->journal == NULL) {
+        return 0;
+    }
+    volume->journal->used = 0;
+    volume->journal_synced = 0;
+    volume->commits = 0;
+    volume->in_transaction = false;
+    return sysfile_sync(volume->journal, sizeof(journal_header));
+}
 
-    // traverse to see if file exists
-    while (fat_value != 0xFFFF) {
-        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
-            return -1;
-        }
-        for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-            if (read_bytes == -1) {
-                fprintf(stderr, "Error reading directory entry\n");
-                return -1;
-            }
-
-            // Check if the current entry is the source file
-            if (strcmp(dir_entry.name, fs_name) == 0) {
-                // source file already exists, update timestamp to current time
-                dir_entry.mtime = time(NULL);
-                return 0;
-            }
+// Whether block is still part of the root directory
+static bool in_root_dir(uint16_t block) {
+    int num_fat_entries = fat_num_entries();
+    int steps = 0;
+    for (int root_block = 1; root_block > 0 && root_block != 0xFFFF && root_block < num_fat_entries && steps < num_fat_entries; root_block = fat[root_block], steps++) {
+        if (root_block == block) {
+            return true;
         }
-        fat_value = fat[fat_value];
     }
+    return false;
+}
 
-    // final block
-    for (int i = 0; i < num_entries; i++) {
-        int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-        if (read_bytes == -1) {
-            fprintf(stderr, "Error reading directory entry\n");
-            return -1;
+// Writes the directory blocks held back by dir_pwrite() to the image, once their records are on disk
+static int write_held_dir_blocks() {
+    pennfat_volume *volume = &volumes[current_volume];
+    for (int i = 0; i < volume->num_held_dir_blocks; i++) {
+        // A block that left the directory since it was held, to a snapshot rollback, may hold file data by now
+        if (!in_root_dir(volume->held_dir_blocks[i])) {
+            continue;
         }
-
-        // Check if the current entry is the source file
-        if (strcmp(dir_entry.name, fs_name) == 0) {
-            // source file already exists, update timestamp to current time
-            dir_entry.mtime = time(NULL);
-            return 0;
+        off_t block_offset = fat_size + (off_t)(volume->held_dir_blocks[i] - 1) * block_size;
+        if (pwrite(fs_fd, volume->held_dir_data + (size_t)i * block_size, block_size, block_offset) != block_size) {
+            return -1;
         }
     }
-    // create new directory entry
-    directory_entry new_dir_entry;
-    strncpy(new_dir_entry.name, fs_name, sizeof(new_dir_entry.name));
-    new_dir_entry.size = 0;
-    new_dir_entry.firstBlock = 0xFFFF;
-    new_dir_entry.type = 1;
-    new_dir_entry.perm = 6;
-    new_dir_entry.mtime = time(NULL);
+    volume->num_held_dir_blocks = 0;
+    return 0;
+}
 
-    // seek to the start of root directory
-    root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-    if (root_dir_offset == -1) {
-        fprintf(stderr, "Failed to seek to root directory\n");
-        return -1;
+int journal_sync() {
+    if (current_volume == -1 || volumes[current_volume].journal == NULL) {
+        return 0;
     }
-
-    // navigate to next available space in root directory
-    fat_value = 1;
-    int final_block = fat_value;
-    while (fat_value != 0xFFFF) {
-        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
+    pennfat_volume *volume = &volumes[current_volume];
+    if (volume->journal->used != volume->journal_synced) {
+        // The header goes too, replay reads only as far as it says
+        if (sysfile_sync(volume->journal, sizeof(journal_header) + volume->journal->used) == -1) {
             return -1;
         }
-        // one block
-        for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-            if (read_bytes == -1) {
-                fprintf(stderr, "Error reading directory entry\n");
-                return -1;
-            }
-
-            // check if current entry is empty
-            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) == 0) {
-                // found empty entry, write new entry here
-                int offset = lseek(fs_fd, fat_size + (fat_value - 1) * block_size + i * sizeof(directory_entry), SEEK_SET); // seek to empty entry since we overshot
-                if (offset == -1) {
-                    fprintf(stderr, "Failed to seek to empty entry\n");
-                    return -1;
-                }
+        volume->journal_synced = volume->journal->used;
+        volume->commits = 0;
+    }
+    return write_held_dir_blocks();
+}
 
-                int write_bytes = write(fs_fd, &new_dir_entry, sizeof(directory_entry));
-                if (write_bytes == -1) {
-                    fprintf(stderr, "Error writing directory entry\n");
-                    return -1;
-                }
-                return 0;
-            }
-        }
+// Bytes the records of a step take in the journal
+size_t journal_step_length(int num_fat, int num_dir) {
+    return (size_t)num_fat * sizeof(journal_record) + (size_t)num_dir * (sizeof(journal_record) + 2 * sizeof(directory_entry));
+}
 
-        if (fat[fat_value] == 0xFFFF) {
-            final_block = fat_value;
-        } // save last block of root directory
-        fat_value = fat[fat_value];
+bool journal_fits(int num_fat, int num_dir) {
+    if (current_volume == -1 || volumes[current_volume].journal == NULL) {
+        return true;
+    }
+    pennfat_volume *volume = &volumes[current_volume];
+    size_t length = journal_step_length(num_fat, num_dir);
+    if (fs_lock_depth > 0 && volume->in_transaction) {
+        return length <= journal_room(volume);
     }
+    // A new transaction starts with at least half of the journal, less its BEGIN and COMMIT
+    return length + 2 * sizeof(journal_record) <= (volume->journal_size - sizeof(journal_header)) / 2;
+}
 
-    // if we reach here, there is no more space in current block--find new block
-    int new_fat = find_new_fat();
-    fat[final_block] = new_fat;
-    fat[new_fat] = 0xFFFF;
+int journal_split() {
+    if (current_volume == -1 || volumes[current_volume].journal == NULL || !volumes[current_volume].in_transaction) {
+        return 0;
+    }
+    journal_record marker = { JOURNAL_COMMIT };
+    journal_append(&volumes[current_volume], &marker, sizeof(journal_record));
+    volumes[current_volume].in_transaction = false;
+    return journal_checkpoint();
+}
 
-    int offset = lseek(fs_fd, fat_size + block_size * (new_fat - 1), SEEK_SET);
-    if (offset == -1) {
-        fprintf(stderr, "No more space left\n");
+int journal_reserve(int num_fat, int num_dir) {
+    if (journal_fits(num_fat, num_dir)) {
+        return 0;
+    }
+    if (journal_split() == -1) {
         return -1;
     }
-    
-    int write_bytes = write(fs_fd, &new_dir_entry, sizeof(directory_entry));
-    if (write_bytes == -1) {
-        fprintf(stderr, "Error writing directory entry\n");
+    if (!journal_fits(num_fat, num_dir)) {
+        fprintf(stderr, "%s: operation too large for the journal\n", volumes[current_volume].label);
         return -1;
     }
-    
     return 0;
 }
 
-int touch(struct parsed_command *cmd) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
-        return -1;
-    }
+// Crash injection: the image is copied to crash_path once crash_countdown writes have been made
+int crash_countdown = 0;
+const char *crash_path = NULL;
+bool crash_taken = false;
 
-    int length = 1;
-    while (cmd->commands[0][length] != NULL) {
-        if (touch_single(cmd->commands[0][length]) != 0) {
-            return -1;
-        }
-        length++;
-    }
+void crash_arm(int writes, const char *path) {
+    crash_countdown = writes;
+    crash_path = path;
+    crash_taken = false;
+}
 
-    return 0;
+bool crash_disarm() {
+    crash_countdown = 0;
+    return crash_taken;
 }
 
-int rm(const char *fs_name) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
-        return -1;
+// Copies the image as it is on disk right now, the FAT and the journal included
+void crash_point() {
+    if (crash_countdown == 0 || --crash_countdown > 0) {
+        return;
     }
-
-    directory_entry dir_entry;
-    off_t current_pos = find_file(fs_name, &dir_entry);
-    if (current_pos == -1) {
-        fprintf(stderr, "File not found\n");
-        return -1;
+    int crash_fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (crash_fd == -1) {
+        fprintf(stderr, "Failed to create %s\n", crash_path);
+        return;
     }
-
-    // Delete the destination FAT chain in the FAT
-    uint16_t fat_value = dir_entry.firstBlock;
-    while (fat_value != 0xFFFF) {
-        lseek(fs_fd, fat_size + ((fat_value - 1) * block_size), SEEK_SET); // Seek to the block to delete
-        char zero_block[block_size];
-        memset(zero_block, 0, block_size);
-        write(fs_fd, zero_block, block_size); // Zero out the block
-
-        // Update FAT entries
-        uint16_t next_fat_value = fat[fat_value];
-        fat[fat_value] = 0;
-        fat_value = next_fat_value;
+    char buffer[4096];
+    ssize_t read_bytes;
+    off_t offset = 0;
+    while ((read_bytes = pread(fs_fd, buffer, sizeof(buffer), offset)) > 0) {
+        write(crash_fd, buffer, read_bytes);
+        offset += read_bytes;
     }
+    close(crash_fd);
+    crash_taken = true;
+}
 
-    // Zero our root directory entry
-    directory_entry dir_entry_zero;
-    lseek(fs_fd, current_pos, SEEK_SET); // Go back to the file entry
-    memset(&dir_entry_zero, 0, sizeof(directory_entry)); // Zero out entry
-    ssize_t bytes_written = write(fs_fd, &dir_entry_zero, sizeof(directory_entry));
-    if (bytes_written == -1) {
-        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
-        return -1;
+// Sets or clears a dirty bit, keeping the volume's dirty byte count and age up to date
+bool set_dirty(uint8_t *bitmap, int bit, bool dirty, uint32_t bytes) {
+    pennfat_volume *volume = &volumes[current_volume];
+    bool was_dirty = bitmap[bit / 8] & (1 << (bit % 8));
+    if (dirty && !was_dirty) {
+        bitmap[bit / 8] |= 1 << (bit % 8);
+        volume->dirty_bytes += bytes;
+        if (volume->dirty_since == 0) {
+            volume->dirty_since = time(NULL);
+        }
+    } else if (!dirty && was_dirty) {
+        bitmap[bit / 8] &= ~(1 << (bit % 8));
+        volume->dirty_bytes -= bytes;
+        if (volume->dirty_bytes == 0) {
+            volume->dirty_since = 0;
+        }
     }
-    return 0;
+    return was_dirty;
 }
 
-int find_open_fat() {
-    int open_fat_value = -1;
-    int blocks_in_fat = fat_size / block_size;
-    int num_fat_entries = block_size * blocks_in_fat / 2;
+// Remembers that the FAT page holding entry index has to be synced
+void mark_fat_dirty(uint16_t index) {
+    if (current_volume != -1 && volumes[current_volume].dirty_fat != NULL) {
+        set_dirty(volumes[current_volume].dirty_fat, index * sizeof(uint16_t) / sysconf(_SC_PAGESIZE), true, sysconf(_SC_PAGESIZE));
+    }
+}
 
-    for (int i = 1; i < num_fat_entries; i++) {
-        if (fat[i] == 0) {
-            open_fat_value = i;
-            break;
+void fat_set(uint16_t index, uint16_t value) {
+    if (fat[index] == value) {
+        return;
+    }
+    journal_record record = { JOURNAL_FAT, index, fat[index], value, 0 };
+    journal_log(&record, NULL, NULL);
+    fat[index] = value;
+    mark_fat_dirty(index);
+    if (current_volume != -1) {
+        volumes[current_volume].fat_writes++;
+        // A block allocated during a scrub pass may join a chain the pass has walked already
+        scrub_header *scrub = volumes[current_volume].scrub;
+        if (scrub != NULL && scrub->phase != SCRUB_IDLE && value != 0) {
+            ((uint8_t *)(scrub + 1))[index / 8] |= 1 << (index % 8);
         }
     }
-    
-    return open_fat_value;
+    crash_point();
 }
 
+void mark_block_dirty(uint16_t block) {
+    if (current_volume != -1 && volumes[current_volume].dirty_blocks != NULL) {
+        set_dirty(volumes[current_volume].dirty_blocks, block, true, block_size);
+    }
+    crash_point();
+}
 
-int mv(const char *src, const char *dst) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+// Syncs [offset, offset + length) of the image. fdatasync() would flush the whole
+// image, but msync() of a shared mapping syncs just the mapped range.
+int sync_range(off_t offset, size_t length) {
+    off_t delta = offset % sysconf(_SC_PAGESIZE);
+    void *range = mmap(NULL, length + delta, PROT_READ, MAP_SHARED, fs_fd, offset - delta);
+    if (range == MAP_FAILED) {
         return -1;
     }
+    int synced = msync(range, length + delta, MS_SYNC);
+    munmap(range, length + delta);
+    return synced;
+}
 
-    size_t num_entries = block_size / sizeof(directory_entry);
-    directory_entry dir_entry;
-    int root_fat_value = 1;
+int sync_fat() {
+    uint8_t *dirty_fat = volumes[current_volume].dirty_fat;
+    long page_size = sysconf(_SC_PAGESIZE);
+    int num_pages = (fat_size + page_size - 1) / page_size;
 
-    while(root_fat_value != 0xFFFF) {
-        off_t root_dir_offset = lseek(fs_fd, fat_size + ((root_fat_value - 1) * block_size), SEEK_SET);
-        if (root_dir_offset == (off_t)-1) {
-            fprintf(stderr, "Failed to seek to root directory\n");
+    // Write-ahead: the FAT on disk must never run ahead of the journal
+    if (journal_sync() == -1) {
+        return -1;
+    }
+    for (int page = 0; page < num_pages; page++) {
+        if (!set_dirty(dirty_fat, page, false, page_size)) {
+            continue;
+        }
+        int run = 1;
+        while (page + run < num_pages && set_dirty(dirty_fat, page + run, false, page_size)) {
+            run++;
+        }
+        size_t length = page + run == num_pages ? fat_size - page * page_size : run * page_size;
+        if (pwrite(fs_fd, (char *)fat + page * page_size, length, page * page_size) != (ssize_t)length
+            || sync_range(page * page_size, length) == -1) {
             return -1;
         }
+        page += run - 1;
+    }
+    return 0;
+}
 
-        for (size_t i = 0; i < num_entries; i++) {
-            ssize_t read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-            if (read_bytes == -1) {
-                fprintf(stderr, "Error reading directory entry\n");
+// Syncs the dirty blocks of the chain starting at first_block, or of the whole image if it is 0
+int sync_blocks(uint16_t first_block) {
+    uint8_t *dirty_blocks = volumes[current_volume].dirty_blocks;
+    int num_fat_entries = fat_num_entries();
+    uint16_t block = first_block == 0 ? 1 : first_block;
+    int run_start = 0, run_length = 0;
+
+    while (block != 0 && block != 0xFFFF && block < num_fat_entries) {
+        bool dirty = set_dirty(dirty_blocks, block, false, block_size);
+
+        // Extend the run while the dirty blocks are adjacent on disk
+        if (dirty && run_length > 0 && block == run_start + run_length) {
+            run_length++;
+        } else if (dirty || run_length > 0) {
+            if (run_length > 0 && sync_range(fat_size + (run_start - 1) * block_size, run_length * block_size) == -1) {
                 return -1;
             }
-
-            // Search for source file
-            if (strncmp(dir_entry.name, src, sizeof(dir_entry.name)) == 0) {
-                
-                // Save position of source
-                off_t current_pos = lseek(fs_fd, 0, SEEK_CUR);
-
-                int root_fat_value_dst = 1;
-                directory_entry dst_entry;
-                int found_dst = 0;
-
-                while(root_fat_value_dst != 0xFFFF && !found_dst) {
-                    root_dir_offset = lseek(fs_fd, fat_size + ((root_fat_value_dst - 1) * block_size), SEEK_SET);
-
-                    // Search for an existing destination file
-                    for (size_t j = 0; j < num_entries; j++) {
-                        ssize_t read_bytes_dst = read(fs_fd, &dst_entry, sizeof(directory_entry));
-                        if (read_bytes_dst == -1) {
-                            fprintf(stderr, "Error reading directory entry for destination\n");
-                            return -1;
-                        }
-
-                        // Remove destination file if it exists
-                        if (strncmp(dst_entry.name, dst, sizeof(dst_entry.name)) == 0) {
-                            rm(dst);
-                            found_dst = 1;
-                            break;
-                        }
-                    }
-                    root_fat_value_dst = fat[root_fat_value_dst];
-                }
-
-                // Rename the source file to the destination
-                lseek(fs_fd, current_pos - sizeof(directory_entry), SEEK_SET); // Go back to the source file entry
-                strncpy(dir_entry.name, dst, sizeof(dir_entry.name));
-                dir_entry.name[sizeof(dir_entry.name) - 1] = '\0';
-                dir_entry.mtime = time(NULL);
-                write(fs_fd, &dir_entry, sizeof(directory_entry)); // Write back updated entry back
-                return 0;
-            }
+            run_start = block;
+            run_length = dirty ? 1 : 0;
         }
-        root_fat_value = fat[root_fat_value];
+        block = first_block == 0 ? block + 1 : fat[block];
+    }
+    if (run_length > 0) {
+        return sync_range(fat_size + (run_start - 1) * block_size, run_length * block_size);
     }
+    return 0;
+}
 
-    fprintf(stderr, "Source file not found\n");
-    return -1;
+int sync_volume() {
+    if (volumes[current_volume].dirty_fat == NULL) {
+        return 0;
+    }
+    if (sync_fat() == -1 || sync_blocks(0) == -1) {
+        return -1;
+    }
+    if (hole_map != NULL) {
+        return sysfile_sync(hole_map, (fat_num_entries() + 7) / 8);
+    }
+    return 0;
 }
 
-int cp(struct parsed_command *cmd) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+int sync_file(const char *fs_name) {
+    directory_entry dir_entry;
+    int dir_position = find_file(fs_name, &dir_entry);
+    if (dir_position == -1) {
+        fprintf(stderr, "File %s not found\n", fs_name);
         return -1;
     }
+    if (volumes[current_volume].dirty_fat == NULL) {
+        return 0;
+    }
 
-    const char *src = NULL, *dst = NULL;
-    int host_src = -1, host_dst = -1;
+    // The chain and the directory entry first, so the data is reachable once synced
+    uint16_t dir_block = (dir_position - fat_size) / block_size + 1;
+    if (sync_fat() == -1 || sync_blocks(dir_entry.firstBlock) == -1) {
+        return -1;
+    }
+    if (set_dirty(volumes[current_volume].dirty_blocks, dir_block, false, block_size)) {
+        if (sync_range(fat_size + (dir_block - 1) * block_size, block_size) == -1) {
+            return -1;
+        }
+    }
+    if (hole_map != NULL) {
+        return sysfile_sync(hole_map, (fat_num_entries() + 7) / 8);
+    }
+    return 0;
+}
 
-    if (cmd->commands[0][3] != NULL) {
-        if (cmd->commands[0][1] != NULL && strcmp(cmd->commands[0][1], "-h") == 0) {
-            src = cmd->commands[0][2], dst = cmd->commands[0][3], host_src = 1, host_dst = 0;
-        } else if (cmd->commands[0][2] != NULL && strcmp(cmd->commands[0][2], "-h") == 0) {
-            src = cmd->commands[0][1], dst = cmd->commands[0][3], host_src = 0, host_dst = 1;
+// The held back copy of a directory block, read from the image the first time it is held
+static char *hold_dir_block(uint16_t block) {
+    pennfat_volume *volume = &volumes[current_volume];
+    for (int i = 0; i < volume->num_held_dir_blocks; i++) {
+        if (volume->held_dir_blocks[i] == block) {
+            return volume->held_dir_data + (size_t)i * block_size;
         }
-    } else {
-        if (cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL) {
-            src = cmd->commands[0][1], dst = cmd->commands[0][2], host_src = 0, host_dst = 0;
+    }
+    if (volume->num_held_dir_blocks == volume->held_dir_capacity) {
+        int capacity = volume->held_dir_capacity == 0 ? 4 : 2 * volume->held_dir_capacity;
+        uint16_t *blocks = realloc(volume->held_dir_blocks, capacity * sizeof(uint16_t));
+        if (blocks == NULL) {
+            return NULL;
         }
+        volume->held_dir_blocks = blocks;
+        char *data = realloc(volume->held_dir_data, (size_t)capacity * block_size);
+        if (data == NULL) {
+            return NULL;
+        }
+        volume->held_dir_data = data;
+        volume->held_dir_capacity = capacity;
     }
-
-    if (src == NULL || dst == NULL || host_src == -1 || host_dst == -1) {
-        fprintf(stderr, "Error: cp usage.\n");
-        return -1;
+    char *held = volume->held_dir_data + (size_t)volume->num_held_dir_blocks * block_size;
+    if (pread(fs_fd, held, block_size, fat_size + (off_t)(block - 1) * block_size) != block_size) {
+        return NULL;
     }
+    volume->held_dir_blocks[volume->num_held_dir_blocks++] = block;
+    return held;
+}
 
-    if (host_src && !host_dst) {
-        int src_fd = open(src, O_RDONLY);
-        if (src_fd == -1) {
-            if (errno == ENOENT) {
-                fprintf(stderr, "Source file does not exist\n");
-            } else {
-                fprintf(stderr, "Error opening file\n");
-            }
+ssize_t dir_pwrite(const void *buf, size_t n, off_t position) {
+    uint16_t block = (position - fat_size) / block_size + 1;
+    if (!journal_active()) {
+        // Nothing was logged to wait for
+        if (journal_sync() == -1 || pwrite(fs_fd, buf, n, position) != (ssize_t)n) {
             return -1;
         }
+        mark_block_dirty(block);
+        return n;
+    }
+    char *held = hold_dir_block(block);
+    if (held == NULL) {
+        return -1;
+    }
+    memcpy(held + (position - fat_size) % block_size, buf, n);
+    mark_block_dirty(block);
+    return n;
+}
 
-        directory_entry dir_entry;
-        if (find_file(dst, &dir_entry) == -1) {
-            // Create the destination file (if it doesn't exist)
-            touch_single(dst);
-        } else { // Remove the destination file (if it exists)
-            rm(dst);
-            touch_single(dst);
+// Copies the held back directory blocks over what was read from [position, position + n) of the image
+static void read_held_dir_blocks(void *buf, size_t n, off_t position) {
+    pennfat_volume *volume = &volumes[current_volume];
+    for (int i = 0; i < volume->num_held_dir_blocks; i++) {
+        off_t block_offset = fat_size + (off_t)(volume->held_dir_blocks[i] - 1) * block_size;
+        off_t start = block_offset > position ? block_offset : position;
+        off_t end = block_offset + block_size < position + (off_t)n ? block_offset + block_size : position + (off_t)n;
+        if (start < end) {
+            memcpy((char *)buf + (start - position), volume->held_dir_data + (size_t)i * block_size + (start - block_offset), end - start);
         }
+    }
+}
 
-        int current_pos = find_file(dst, &dir_entry);
+ssize_t dir_read(void *buf, size_t n, off_t position) {
+    ssize_t read_bytes = read(fs_fd, buf, n);
+    if (current_volume != -1 && read_bytes > 0) {
+        read_held_dir_blocks(buf, read_bytes, position);
+    }
+    return read_bytes;
+}
 
-        uint16_t fat_value = find_open_fat();
-        uint16_t prev_fat_value = 0xFFFF;
-        (dir_entry).firstBlock = fat_value;
-        fat[fat_value] = 0xFFFF;
-        char buffer[block_size];
-        ssize_t bytes_read, bytes_written;
-        uint32_t total_written = 0;
+ssize_t dir_pread(void *buf, size_t n, off_t position) {
+    ssize_t read_bytes = pread(fs_fd, buf, n, position);
+    if (current_volume != -1 && read_bytes > 0) {
+        read_held_dir_blocks(buf, read_bytes, position);
+    }
+    return read_bytes;
+}
 
-        while ((bytes_read = read(src_fd, buffer, block_size)) > 0) {
-            if (fat_value == 0xFFFF) {
-                // Allocate a new block
-                int open_fat_value = find_open_fat();
-                if (open_fat_value == -1) {
-                    fprintf(stderr, "No more space in FAT\n");
-                    close(src_fd);
-                    return -1;
-                }
-                fat_value = open_fat_value;
-                if (prev_fat_value != 0xFFFF) {
-                    fat[prev_fat_value] = fat_value;
-                }
-                fat[fat_value] = 0xFFFF;
-            }
+ssize_t write_dir_entry(const directory_entry *dir_entry) {
+    off_t position = lseek(fs_fd, 0, SEEK_CUR);
+    directory_entry old_dir_entry;
+    if (position == -1 || dir_pread(&old_dir_entry, sizeof(directory_entry), position) != sizeof(directory_entry)) {
+        return -1;
+    }
+    journal_record record = { JOURNAL_DIR, 0, 0, 0, position };
+    journal_log(&record, &old_dir_entry, dir_entry);
+    if (dir_pwrite(dir_entry, sizeof(directory_entry), position) == -1
+        || lseek(fs_fd, position + sizeof(directory_entry), SEEK_SET) == -1) {
+        return -1;
+    }
+    return sizeof(directory_entry);
+}
 
-            off_t write_position = lseek(fs_fd, fat_size + ((fat_value - 1) * block_size), SEEK_SET);
-            bytes_written = write(fs_fd, buffer, bytes_read);
-            if (bytes_written == -1) {
-                fprintf(stderr, "Error writing to destination file\n");
-                close(src_fd);
-                return -1;
-            }
-            total_written += bytes_written;
-            prev_fat_value = fat_value;
-            fat_value = fat[fat_value];
-        }
+// Applies the FAT and directory changes of the records in [start, end), forwards or backwards
+int journal_apply(char *records, uint32_t start, uint32_t end, bool undo) {
+    uint32_t *offsets = malloc(((end - start) / sizeof(journal_record) + 1) * sizeof(uint32_t));
+    if (offsets == NULL) {
+        fprintf(stderr, "Failed to allocate journal replay buffer\n");
+        return -1;
+    }
+    int num_records = 0;
+    for (uint32_t position = start; position < end; position += journal_record_length((journal_record *)(records + position))) {
+        offsets[num_records++] = position;
+    }
 
-        lseek(fs_fd, current_pos, SEEK_SET);
-        dir_entry.mtime = time(NULL);
-        dir_entry.size = total_written;
-        write(fs_fd, &dir_entry, sizeof(directory_entry));
-        close(src_fd);
-        return 0;
-    } else if (!host_src && host_dst) {
-        int dst_fd = open(dst, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        if (dst_fd == -1) {
-            fprintf(stderr, "Error opening destination file\n");
-            return -1;
+    for (int i = 0; i < num_records; i++) {
+        journal_record *record = (journal_record *)(records + offsets[undo ? num_records - 1 - i : i]);
+        if (record->type == JOURNAL_FAT) {
+            fat[record->fat_index] = undo ? record->old_value : record->new_value;
+            mark_fat_dirty(record->fat_index);
+        } else if (record->type == JOURNAL_DIR) {
+            directory_entry *dir_entries = (directory_entry *)(record + 1);
+            pwrite(fs_fd, &dir_entries[undo ? 0 : 1], sizeof(directory_entry), record->dir_position);
+            mark_block_dirty((record->dir_position - fat_size) / block_size + 1);
         }
+    }
+    free(offsets);
+    return 0;
+}
 
-        directory_entry dir_entry;
-        int current_pos = find_file(src, &dir_entry);
-        if (current_pos == -1) {
-            fprintf(stderr, "Source file not found\n");
+// Maps the journal of the selected volume and replays it
+int journal_open() {
+    pennfat_volume *volume = &volumes[current_volume];
+    directory_entry dir_entry;
+    if (find_file(JOURNAL_NAME, &dir_entry) == -1) {
+        return 0; // Made before the journal existed
+    }
+    volume->journal = sysfile_map(JOURNAL_NAME, dir_entry.size, false);
+    if (volume->journal == NULL) {
+        return -1;
+    }
+    volume->journal_size = dir_entry.size;
+    if (read_only) {
+        // Replaying would write to the image, so a journal with anything in it keeps it from being mounted
+        bool pending = volume->journal->magic == JOURNAL_MAGIC && volume->journal->used != 0;
+        sysfile_unmap(volume->journal, volume->journal_size);
+        volume->journal = NULL;
+        if (pending) {
+            fprintf(stderr, "%s has a journal to replay, mount it read-write first\n", volume->label);
             return -1;
         }
+        return 0;
+    }
+    if (volume->journal->magic != JOURNAL_MAGIC || volume->journal->used > volume->journal_size - sizeof(journal_header)) {
+        fprintf(stderr, "Journal of %s is corrupt, mounting without it\n", volume->label);
+        sysfile_unmap(volume->journal, volume->journal_size);
+        volume->journal = NULL;
+        return 0;
+    }
 
-        uint16_t fat_value = dir_entry.firstBlock;
-        uint32_t size_to_read = dir_entry.size;
-        char buffer[block_size];
-
-        while (fat_value != 0xFFFF) {
-            int buffer_read_size = size_to_read > block_size ? block_size : size_to_read;
-            off_t block_to_read = lseek(fs_fd, fat_size + ((fat_value - 1) * block_size), SEEK_SET);
-            ssize_t bytes_read = read(fs_fd, buffer, buffer_read_size);
-            if (bytes_read == -1) {
-                fprintf(stderr, "Error reading from source\n");
-                close(dst_fd);
-                return -1;
-            }
-            ssize_t bytes_written = write(dst_fd, buffer, bytes_read);
-            if (bytes_written == -1) {
-                fprintf(stderr, "Error writing to destination file\n");
-                close(dst_fd);
+    // Redo committed transactions in order, then roll back one that never committed
+    char *records = (char *)(volume->journal + 1);
+    uint32_t used = volume->journal->used;
+    uint32_t position = 0;
+    int64_t transaction_start = -1;
+    int redone = 0, rolled_back = 0;
+    while (position + sizeof(journal_record) <= used) {
+        journal_record *record = (journal_record *)(records + position);
+        size_t length = journal_record_length(record);
+        if (position + length > used) {
+            break;
+        }
+        if (record->type == JOURNAL_BEGIN) {
+            transaction_start = position;
+        } else if (record->type == JOURNAL_COMMIT && transaction_start != -1) {
+            if (journal_apply(records, transaction_start, position, false) == -1) {
                 return -1;
             }
-
-            uint16_t next_fat_value = fat[fat_value];
-            size_to_read -= bytes_read;
-            if (size_to_read <= 0) {
-                break;
-            }
-            fat_value = next_fat_value;
+            transaction_start = -1;
+            redone++;
         }
+        position += length;
+    }
+    if (transaction_start != -1) {
+        if (journal_apply(records, transaction_start, position, true) == -1) {
+            return -1;
+        }
+        rolled_back++;
+    }
 
-        close(dst_fd);
+    if (redone > 0 || rolled_back > 0) {
+        fprintf(stderr, "%s: replayed %d transactions, rolled back %d\n", volume->label, redone, rolled_back);
+    }
+    return journal_checkpoint();
+}
+
+// Saves the globals back into the mount table and clears them
+void save_volume() {
+    if (current_volume != -1) {
+        volumes[current_volume].fs_fd = fs_fd;
+        volumes[current_volume].fat = fat;
+        volumes[current_volume].fat_size = fat_size;
+        volumes[current_volume].block_size = block_size;
+        volumes[current_volume].alloc_cursor = alloc_cursor;
+        volumes[current_volume].hole_map = hole_map;
+        volumes[current_volume].read_only = read_only;
+    }
+    current_volume = -1;
+    fs_fd = -1;
+    fat = NULL;
+    fat_size = 0;
+    block_size = 0;
+    alloc_cursor = 2;
+    hole_map = NULL;
+    read_only = false;
+}
+
+int select_volume(int volume) {
+    if (volume < 0 || volume >= MAX_VOLUMES || volumes[volume].label[0] == '\0') {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+    if (volume == current_volume) {
         return 0;
-    } else if (!host_src && !host_dst) {
-        directory_entry src_dir_entry;
-        directory_entry dst_dir_entry;
+    }
 
-        if (find_file(src, &src_dir_entry) == -1) {
-            fprintf(stderr, "Source file not found\n");
-            return -1;
-        }
+    save_volume();
+    fs_fd = volumes[volume].fs_fd;
+    fat = volumes[volume].fat;
+    fat_size = volumes[volume].fat_size;
+    block_size = volumes[volume].block_size;
+    alloc_cursor = volumes[volume].alloc_cursor;
+    hole_map = volumes[volume].hole_map;
+    read_only = volumes[volume].read_only;
+    current_volume = volume;
+    return 0;
+}
 
-        if (find_file(dst, &dst_dir_entry) == -1) {
-            // Create the destination file (if it doesn't exist)
-            touch_single(dst);
-        } else { // Remove the destination file (if it exists)
-            rm(dst);
-            touch_single(dst);
+int find_volume(const char *label) {
+    for (int i = 0; i < MAX_VOLUMES; i++) {
+        if (volumes[i].label[0] != '\0' && strcmp(volumes[i].label, label) == 0) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        // Find position and directory entry of source and dest
-        int current_src_pos = find_file(src, &src_dir_entry);
-        if (current_src_pos == -1) {
-            fprintf(stderr, "Source file not found\n");
+int resolve_path(const char *path, const char **name) {
+    int volume = default_volume;
+    *name = path;
+
+    const char *colon = strchr(path, ':');
+    if (colon != NULL) {
+        char label[VOLUME_LABEL_LEN];
+        size_t label_len = colon - path;
+        if (label_len >= VOLUME_LABEL_LEN) {
+            fprintf(stderr, "Unknown volume in %s\n", path);
             return -1;
         }
-        int current_dst_pos = find_file(dst, &dst_dir_entry);
-
-        uint16_t src_fat_value = src_dir_entry.firstBlock;
-        uint32_t size_to_read = src_dir_entry.size;
-        uint16_t dst_fat_value = find_open_fat();
-        uint16_t prev_dst_fat_value = dst_fat_value;
-        dst_dir_entry.firstBlock = dst_fat_value;
-        fat[dst_fat_value] = 0xFFFF;
-        char buffer[block_size];
-        uint32_t total_written = 0;
+        memcpy(label, path, label_len);
+        label[label_len] = '\0';
+        if ((volume = find_volume(label)) == -1) {
+            fprintf(stderr, "Unknown volume %s\n", label);
+            return -1;
+        }
+        *name = colon + 1;
+    }
 
-        while (src_fat_value != 0xFFFF) {
-            // Seek to source block and read it
-            int buffer_read_size = size_to_read > block_size ? block_size : size_to_read;
-            off_t block_to_read = lseek(fs_fd, fat_size + ((src_fat_value - 1) * block_size), SEEK_SET);
-            ssize_t bytes_read = read(fs_fd, buffer, buffer_read_size);
+    if (select_volume(volume) == -1) {
+        return -1;
+    }
+    return volume;
+}
 
-            // Allocate new block for destination if needed
-            if (dst_fat_value == 0xFFFF) {
-                int open_fat_value = find_open_fat();
-                if (open_fat_value == -1) {
-                    fprintf(stderr, "No more space in FAT\n");
-                    return -1;
-                }
-                dst_fat_value = open_fat_value;
-                fat[prev_dst_fat_value] = dst_fat_value;
-                fat[dst_fat_value] = 0xFFFF;
-            }
+// Mounts the file system specified at fs_name under label
+int mount(const char *fs_name, const char *label, bool mount_read_only) {
+    if (label == NULL) {
+        label = strrchr(fs_name, '/') != NULL ? strrchr(fs_name, '/') + 1 : fs_name;
+    }
+    if (label[0] == '\0' || strlen(label) >= VOLUME_LABEL_LEN || strchr(label, ':') != NULL) {
+        fprintf(stderr, "Invalid volume label %s\n", label);
+        return -1;
+    }
+    if (find_volume(label) != -1) {
+        fprintf(stderr, "A filesystem is already mounted as %s.\n", label);
+        return -1;
+    }
 
-            // Seek to destination block and write it
-            off_t block_to_write = lseek(fs_fd, fat_size + ((dst_fat_value - 1) * block_size), SEEK_SET);
-            ssize_t bytes_written = write(fs_fd, buffer, bytes_read);
-            total_written += bytes_written;
-            
-            // Update next blocks to read/write for src
-            src_fat_value = fat[src_fat_value];
-            size_to_read -= bytes_read;
-            if (size_to_read <= 0) {
-                break;
-            }
+    int slot = -1;
+    for (int i = 0; i < MAX_VOLUMES && slot == -1; i++) {
+        if (volumes[i].label[0] == '\0') {
+            slot = i;
+        }
+    }
+    if (slot == -1) {
+        fprintf(stderr, "Too many filesystems are mounted.\n");
+        return -1;
+    }
 
-            // Update next dst block to write to
-            prev_dst_fat_value = dst_fat_value;
-            dst_fat_value = fat[dst_fat_value];
+    int previous_volume = current_volume;
+    save_volume();
+    if (mount_image(fs_name, mount_read_only) == -1) {
+        if (previous_volume != -1) {
+            select_volume(previous_volume);
         }
+        return -1;
+    }
 
-        lseek(fs_fd, current_dst_pos, SEEK_SET);
-        dst_dir_entry.mtime = time(NULL);
-        dst_dir_entry.size = total_written;
-        write(fs_fd, &dst_dir_entry, sizeof(directory_entry));
+    strcpy(volumes[slot].label, label);
+    volumes[slot].read_only = mount_read_only;
+    current_volume = slot;
+    bool opened;
+    if (read_only) {
+        // Nothing is written: no dirty tracking, no sharing to count for copy-on-write
+        opened = journal_open() != -1 && dir_index_build() != -1;
+    } else {
+        long page_size = sysconf(_SC_PAGESIZE);
+        volumes[slot].dirty_fat = calloc(((fat_size + page_size - 1) / page_size + 7) / 8, 1);
+        volumes[slot].dirty_blocks = calloc((fat_num_entries() + 7) / 8, 1);
+        opened = volumes[slot].dirty_fat != NULL && volumes[slot].dirty_blocks != NULL
+            && journal_open() != -1 && dedup_open() != -1 && snapshot_load() != -1 && scrub_open() != -1;
+    }
+    if (!opened) {
+        umount_image();
+        free(volumes[slot].dirty_fat);
+        free(volumes[slot].dirty_blocks);
+        free(volumes[slot].snap_refs);
+        free(volumes[slot].dedup_refs);
+        free(volumes[slot].dir_index);
+        memset(&volumes[slot], 0, sizeof(pennfat_volume));
+        current_volume = -1;
+        return -1;
+    }
+    if (default_volume == -1) {
+        default_volume = slot;
     }
     return 0;
 }
 
-// cat FILE ... [ -w OUTPUT_FILE ]
-// Concatenates the files and overwrites OUTPUT_FILE. 
-// If OUTPUT_FILE does not exist, it will be created. (Same for OUTPUT_FILE in the commands below.)
-int cat_f_w(struct parsed_command *cmd) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+// Unmounts the file system mounted under label
+int umount(const char *label) {
+    int volume = label == NULL ? default_volume : find_volume(label);
+    if (select_volume(volume) == -1) {
+        return -1;
+    }
+    journal_checkpoint();
+    if (volumes[volume].journal != NULL) {
+        sysfile_unmap(volumes[volume].journal, volumes[volume].journal_size);
+        volumes[volume].journal = NULL;
+    }
+    if (volumes[volume].dedup_index != NULL) {
+        sysfile_unmap(volumes[volume].dedup_index, volumes[volume].dedup_size);
+        volumes[volume].dedup_index = NULL;
+    }
+    if (volumes[volume].scrub != NULL) {
+        sysfile_unmap(volumes[volume].scrub, volumes[volume].scrub_size);
+        volumes[volume].scrub = NULL;
+    }
+    if (umount_image() == -1) {
         return -1;
     }
+    free(volumes[volume].dirty_fat);
+    free(volumes[volume].dirty_blocks);
+    free(volumes[volume].held_dir_blocks);
+    free(volumes[volume].held_dir_data);
+    free(volumes[volume].snap_refs);
+    free(volumes[volume].dedup_refs);
+    free(volumes[volume].dir_index);
+
+    memset(&volumes[volume], 0, sizeof(pennfat_volume));
+    current_volume = -1;
+    if (default_volume == volume) {
+        default_volume = -1;
+        for (int i = 0; i < MAX_VOLUMES && default_volume == -1; i++) {
+            if (volumes[i].label[0] != '\0') {
+                default_volume = i;
+            }
+        }
+    }
+    return 0;
+}
 
-    size_t data_region_size = block_size * (fat_size / 2 - 1);
-    char input[fat_size + data_region_size];
-    input[0] = '\0';
-    int length = 1;
-    int total_bytes_written = 0;
-    while (strcmp(cmd->commands[0][length], "-w") != 0) {
-        // find file in root directory
-        int fat_value = 1;
-        size_t num_entries = block_size / sizeof(directory_entry);
-        directory_entry dir_entry;
+int fat_num_entries() {
+    int num_fat_entries = fat_size / 2;
+    if (num_fat_entries > 0xFFFF) {
+        num_fat_entries = 0xFFFF; // 0xFFFF itself is the end-of-chain marker
+    }
+    return num_fat_entries;
+}
 
-        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-        if (root_dir_offset == -1) {
-            fprintf(stderr, "Failed to seek to root directory\n");
+int fat_alloc(int goal) {
+    int num_fat_entries = fat_num_entries();
+    int num_data_blocks = num_fat_entries - 2; // block 1 always holds the root directory
+    if (num_data_blocks <= 0) {
+        return -1;
+    }
+
+    // A goal outside the data region means we are starting a new chain
+    bool new_chain = goal < 2 || goal >= num_fat_entries;
+    int start = new_chain ? alloc_cursor : goal;
+    if (start < 2 || start >= num_fat_entries) {
+        start = 2;
+    }
+
+    for (int i = 0; i < num_data_blocks; i++) {
+        int candidate = 2 + (start - 2 + i) % num_data_blocks;
+        if (fat[candidate] == 0 && !block_shared(candidate)) {
+            if (new_chain) {
+                // Leave room for this chain to grow before the next new file lands
+                alloc_cursor = 2 + (candidate - 2 + ALLOC_CHAIN_GAP) % num_data_blocks;
+            }
+            return candidate;
+        }
+    }
+    return -1;
+}
+
+int fat_alloc_extent(int goal, int count) {
+    int num_fat_entries = fat_num_entries();
+    if (count <= 0 || count > num_fat_entries - 2) {
+        return -1;
+    }
+
+    bool new_chain = goal < 2 || goal >= num_fat_entries;
+    int start = new_chain ? alloc_cursor : goal;
+    if (start < 2 || start >= num_fat_entries) {
+        start = 2;
+    }
+
+    // Runs cannot wrap past the end of the FAT, so scan [start, end) then [2, start)
+    for (int pass = 0; pass < 2; pass++) {
+        int from = pass == 0 ? start : 2;
+        int to = pass == 0 ? num_fat_entries : start + count - 1;
+        if (to > num_fat_entries) {
+            to = num_fat_entries;
+        }
+        int run_start = from;
+        int run_length = 0;
+        for (int candidate = from; candidate < to; candidate++) {
+            if (fat[candidate] != 0 || block_shared(candidate)) {
+                run_start = candidate + 1;
+                run_length = 0;
+                continue;
+            }
+            if (++run_length == count) {
+                if (new_chain) {
+                    alloc_cursor = 2 + (run_start + count - 2 + ALLOC_CHAIN_GAP) % (num_fat_entries - 2);
+                }
+                return run_start;
+            }
+        }
+    }
+    return -1;
+}
+
+int fallocate_chain(directory_entry *dir_entry, uint32_t length) {
+    int blocks_needed = (length + block_size - 1) / block_size;
+
+    // Find the end of the current chain
+    int num_blocks = 0;
+    uint16_t last_fat_value = 0xFFFF;
+    uint16_t fat_value = dir_entry->firstBlock;
+    while (fat_value != 0xFFFF) {
+        num_blocks++;
+        last_fat_value = fat_value;
+        fat_value = fat[fat_value];
+    }
+
+    int missing = blocks_needed - num_blocks;
+    if (missing > 0 && last_fat_value != 0xFFFF && block_deduped(last_fat_value)) {
+        // The files sharing the last block must not grow along with this one
+        int own_last_fat_value = unshare_last_block(dir_entry);
+        if (own_last_fat_value == -1) {
             return -1;
         }
-        // find the file in root directory (directory may be multiple blocks)
-        while (fat_value != 0xFFFF) {
-            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-            if (offset == -1) {
-                fprintf(stderr, "No more space left\n");
+        last_fat_value = own_last_fat_value;
+    }
+    if (missing > 0) {
+        // Prefer one extent right after the current tail, otherwise grow block by block
+        int extent = fat_alloc_extent(last_fat_value + 1, missing);
+        uint16_t prev_fat_value = last_fat_value;
+        for (int i = 0; i < missing; i++) {
+            int new_fat_value = extent != -1 ? extent + i : fat_alloc(prev_fat_value + 1);
+            if (new_fat_value == -1) {
+                // Give back what we took so the chain is unchanged
+                uint16_t undo_fat_value = last_fat_value == 0xFFFF ? dir_entry->firstBlock : fat[last_fat_value];
+                while (undo_fat_value != 0xFFFF) {
+                    uint16_t next_fat_value = fat[undo_fat_value];
+                    fat_set(undo_fat_value, 0);
+                    undo_fat_value = next_fat_value;
+                }
+                if (last_fat_value == 0xFFFF) {
+                    dir_entry->firstBlock = 0xFFFF;
+                } else {
+                    fat_set(last_fat_value, 0xFFFF);
+                }
+                dir_entry->lastBlock = last_fat_value;
                 return -1;
             }
-            for (int i = 0; i < num_entries; i++) {
-                int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-                if (read_bytes == -1) {
-                    fprintf(stderr, "Error reading directory entry\n");
-                    return -1;
-                }
+            if (prev_fat_value == 0xFFFF) {
+                dir_entry->firstBlock = new_fat_value;
+            } else {
+                fat_set(prev_fat_value, new_fat_value);
+            }
+            fat_set(new_fat_value, 0xFFFF);
+            prev_fat_value = new_fat_value;
+        }
+        last_fat_value = prev_fat_value;
+    }
 
-                // found the file in root directory
-                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
-                    total_bytes_written += dir_entry.size;
-                    int new_fat_value = dir_entry.firstBlock; // find first block of file
-                    if (dir_entry.firstBlock == 0xFFFF) {
-                        break; // nothing written to file yet
-                    }
+    dir_entry->lastBlock = last_fat_value;
+    if (length > dir_entry->allocSize) {
+        dir_entry->allocSize = length;
+    }
+    return 0;
+}
 
-                    // traverse through blocks of file
-                    while (new_fat_value != 0xFFFF) {
-                        char block[block_size];
-                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
-                            return -1;
-                        }
+// Drops a system file sysfile_map() failed to create: its chain, which the entry does not point to, then the entry
+static void sysfile_discard(const char *name, uint16_t first_block) {
+    release_chain(first_block);
+    rm(name);
+}
 
-                        int read_bytes = read(fs_fd, block, block_size);
-                        if (read_bytes == -1) {
-                            fprintf(stderr, "Error reading directory entry for destination\n");
-                            return -1;
-                        }
+void *sysfile_map(const char *name, uint32_t length, bool create) {
+    directory_entry dir_entry;
+    int dir_position = find_file(name, &dir_entry);
+    if (dir_position == -1) {
+        if (!create) {
+            return NULL;
+        }
 
-                        strcat(input, block);
-                        new_fat_value = fat[new_fat_value];
-                    }
-                }
+        // Create the entry first, it may need a block of its own
+        int num_blocks = (length + block_size - 1) / block_size;
+        if (journal_reserve(num_blocks + 2, 2) == -1) {
+            return NULL;
+        }
+        if (touch_single(name) != 0 || (dir_position = find_file(name, &dir_entry)) == -1) {
+            fprintf(stderr, "Error creating %s\n", name);
+            return NULL;
+        }
+        int first_block = fat_alloc_extent(0, num_blocks);
+        if (first_block == -1) {
+            fprintf(stderr, "No contiguous space left for %s\n", name);
+            rm(name);
+            return NULL;
+        }
+        for (int i = 0; i < num_blocks; i++) {
+            fat_set(first_block + i, i == num_blocks - 1 ? 0xFFFF : first_block + i + 1);
+        }
+
+        // The blocks may hold stale data, the file must start out zeroed
+        char *zero_blocks = calloc(num_blocks, block_size);
+        if (zero_blocks == NULL) {
+            fprintf(stderr, "Failed to allocate buffer for %s\n", name);
+            sysfile_discard(name, first_block);
+            return NULL;
+        }
+        ssize_t zeroed = pwrite(fs_fd, zero_blocks, num_blocks * block_size, fat_size + (first_block - 1) * block_size);
+        free(zero_blocks);
+        if (zeroed != (ssize_t)num_blocks * block_size) {
+            fprintf(stderr, "Failed to zero %s\n", name);
+            sysfile_discard(name, first_block);
+            return NULL;
+        }
+
+        dir_entry.firstBlock = first_block;
+        dir_entry.lastBlock = first_block + num_blocks - 1;
+        dir_entry.size = length;
+        dir_entry.allocSize = length;
+        dir_entry.type = FT_SYSTEM;
+        dir_entry.perm = 0;
+        lseek(fs_fd, dir_position, SEEK_SET);
+        if (write_dir_entry(&dir_entry) != sizeof(directory_entry)) {
+            fprintf(stderr, "Error writing directory entry\n");
+            sysfile_discard(name, first_block);
+            return NULL;
+        }
+    }
+
+    if (dir_entry.type != FT_SYSTEM || dir_entry.size < length || dir_entry.firstBlock == 0xFFFF) {
+        fprintf(stderr, "%s is not a valid system file\n", name);
+        return NULL;
+    }
+
+    // mmap wants a page aligned offset, blocks are only block aligned
+    off_t offset = fat_size + (dir_entry.firstBlock - 1) * block_size;
+    off_t delta = offset % sysconf(_SC_PAGESIZE);
+    char *base = read_only ? mmap(NULL, length + delta, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fs_fd, offset - delta)
+        : mmap(NULL, length + delta, PROT_READ | PROT_WRITE, MAP_SHARED, fs_fd, offset - delta);
+    if (base == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s into memory\n", name);
+        return NULL;
+    }
+    return base + delta;
+}
+
+int sysfile_sync(void *addr, uint32_t length) {
+    uintptr_t delta = (uintptr_t)addr % sysconf(_SC_PAGESIZE);
+    return msync((char *)addr - delta, length + delta, MS_SYNC);
+}
+
+int sysfile_unmap(void *addr, uint32_t length) {
+    uintptr_t delta = (uintptr_t)addr % sysconf(_SC_PAGESIZE);
+    return munmap((char *)addr - delta, length + delta);
+}
+
+bool block_is_hole(uint16_t block) {
+    return hole_map != NULL && (hole_map[block / 8] & (1 << (block % 8)));
+}
+
+int set_block_hole(uint16_t block, bool hole) {
+    if (hole_map == NULL) {
+        if (!hole) {
+            return 0;
+        }
+        hole_map = sysfile_map(HOLEMAP_NAME, (fat_num_entries() + 7) / 8, true);
+        if (hole_map == NULL) {
+            return -1;
+        }
+    }
+
+    if (hole) {
+        hole_map[block / 8] |= 1 << (block % 8);
+    } else {
+        hole_map[block / 8] &= ~(1 << (block % 8));
+    }
+    return 0;
+}
+
+ssize_t block_read(uint16_t block, int offset, void *buf, size_t n) {
+    if (block_is_hole(block)) {
+        memset(buf, 0, n);
+        return n;
+    }
+    return pread(fs_fd, buf, n, fat_size + (block - 1) * block_size + offset);
+}
+
+ssize_t block_write(uint16_t block, int offset, const void *buf, size_t n) {
+    // Holes are zero on disk (freed blocks are zeroed), so a partial write needs no padding.
+    // Clear the bit first so a crash can never leave written data marked as a hole.
+    set_block_hole(block, false);
+    mark_block_dirty(block);
+    return pwrite(fs_fd, buf, n, fat_size + (block - 1) * block_size + offset);
+}
+
+bool block_shared(uint16_t block) {
+    if (current_volume == -1) {
+        return false;
+    }
+    pennfat_volume *volume = &volumes[current_volume];
+    return (volume->snap_refs != NULL && volume->snap_refs[block] != 0) || (volume->dedup_refs != NULL && volume->dedup_refs[block] != 0);
+}
+
+bool block_deduped(uint16_t block) {
+    return current_volume != -1 && volumes[current_volume].dedup_refs != NULL && volumes[current_volume].dedup_refs[block] != 0;
+}
+
+int cow_block(directory_entry *dir_entry, uint16_t prev_block, uint16_t block) {
+    int copy = fat_alloc(block + 1);
+    if (copy == -1) {
+        return -1;
+    }
+
+    // Free blocks are zero, so a hole stays a hole without writing anything
+    if (block_is_hole(block)) {
+        if (set_block_hole(copy, true) == -1) {
+            return -1;
+        }
+    } else {
+        char data[block_size];
+        if (block_read(block, 0, data, block_size) != block_size || block_write(copy, 0, data, block_size) != block_size) {
+            return -1;
+        }
+    }
+
+    fat_set(copy, fat[block]);
+    if (prev_block == 0xFFFF) {
+        dir_entry->firstBlock = copy;
+    } else {
+        fat_set(prev_block, copy);
+    }
+    if (fat[copy] == 0xFFFF) {
+        dir_entry->lastBlock = copy;
+    }
+    if (block_deduped(block)) {
+        volumes[current_volume].dedup_refs[block]--; // The other files keep it
+    } else {
+        fat_set(block, 0); // Still held by the snapshot, so it is not reused
+    }
+    return copy;
+}
+
+int unshare_last_block(directory_entry *dir_entry) {
+    // Every copy logs up to three FAT records, and the copies go in one transaction
+    int copies = 0;
+    for (uint16_t block = dir_entry->firstBlock; block != 0xFFFF; block = fat[block]) {
+        if (copies > 0 || block_deduped(block) || (fat[block] == 0xFFFF && block_shared(block))) {
+            copies++;
+        }
+    }
+    if (copies > 0 && journal_reserve(3 * copies, 1) == -1) {
+        return -1;
+    }
+
+    uint16_t prev_block = 0xFFFF;
+    uint16_t block = dir_entry->firstBlock;
+    while (block != 0xFFFF) {
+        // Past the first block shared with other files the rest of the chain is theirs too
+        if (block_deduped(block) || (fat[block] == 0xFFFF && block_shared(block))) {
+            int copy = cow_block(dir_entry, prev_block, block);
+            if (copy == -1) {
+                return -1;
             }
-            if (dir_entry.firstBlock == 0xFFFF) {
-                break;
+            block = copy;
+        }
+        if (fat[block] == 0xFFFF) {
+            dir_entry->lastBlock = block;
+            return block;
+        }
+        prev_block = block;
+        block = fat[block];
+    }
+    dir_entry->lastBlock = 0xFFFF;
+    return 0xFFFF;
+}
+
+// Zeroes a block that just became free, unless a snapshot still reads it
+void clear_block(uint16_t block) {
+    if (block_shared(block)) {
+        return;
+    }
+    if (block_is_hole(block)) { // Never written, already zero
+        set_block_hole(block, false);
+    } else {
+        char zero_block[block_size];
+        memset(zero_block, 0, block_size);
+        pwrite(fs_fd, zero_block, block_size, fat_size + (block - 1) * block_size);
+        mark_block_dirty(block);
+    }
+}
+
+// Frees one block of a chain, unless other files share it
+void release_block(uint16_t block) {
+    if (block_deduped(block)) {
+        volumes[current_volume].dedup_refs[block]--;
+    } else {
+        clear_block(block);
+        fat_set(block, 0);
+    }
+}
+
+void release_chain(uint16_t first_block) {
+    uint16_t fat_value = first_block;
+    while (fat_value != 0xFFFF) {
+        uint16_t next_fat_value = fat[fat_value];
+        release_block(fat_value);
+        fat_value = next_fat_value;
+    }
+}
+
+int release_file(directory_entry *dir_entry, off_t dir_position) {
+    while (dir_entry->firstBlock != 0xFFFF) {
+        if (!journal_fits(1, 1)) {
+            // What is left of the file goes to the entry, which ends the transaction at a consistent point
+            if (lseek(fs_fd, dir_position, SEEK_SET) == -1 || write_dir_entry(dir_entry) == -1 || journal_split() == -1) {
+                fprintf(stderr, "Error writing directory entry\n");
+                return -1;
             }
-            fat_value = fat[fat_value];
-        }    
-        length++; 
+        }
+        uint16_t block = dir_entry->firstBlock;
+        dir_entry->firstBlock = fat[block];
+        dir_entry->size = dir_entry->size > (uint32_t)block_size ? dir_entry->size - block_size : 0;
+        dir_entry->allocSize = dir_entry->allocSize > (uint32_t)block_size ? dir_entry->allocSize - block_size : 0;
+        release_block(block);
     }
-    
-    
-    // find file in root directory
+    dir_entry->lastBlock = 0xFFFF;
+    return 0;
+}
+
+int append_chain_block(directory_entry *dir_entry, off_t dir_position) {
+    if (!journal_fits(2, 1)) {
+        if (lseek(fs_fd, dir_position, SEEK_SET) == -1 || write_dir_entry(dir_entry) == -1 || journal_split() == -1) {
+            fprintf(stderr, "Error writing directory entry\n");
+            return -1;
+        }
+    }
+    uint16_t last_block = dir_entry->lastBlock;
+    int block = fat_alloc(last_block + 1); // past the end of the FAT for an empty file
+    if (block == -1) {
+        return -1;
+    }
+    if (last_block == 0xFFFF) {
+        dir_entry->firstBlock = block;
+    } else {
+        fat_set(last_block, block);
+    }
+    fat_set(block, 0xFFFF);
+    dir_entry->lastBlock = block;
+    return block;
+}
+
+int chain_runs(uint16_t first_block, int *num_blocks) {
+    int runs = 0;
+    int blocks = 0;
+    int num_fat_entries = fat_num_entries();
+    uint16_t prev_fat_value = 0xFFFF;
+    uint16_t fat_value = first_block;
+
+    // A new run starts whenever a block is not physically right after its predecessor
+    while (fat_value != 0xFFFF && fat_value != 0 && fat_value < num_fat_entries && blocks < num_fat_entries) {
+        if (prev_fat_value == 0xFFFF || fat_value != prev_fat_value + 1) {
+            runs++;
+        }
+        blocks++;
+        prev_fat_value = fat_value;
+        fat_value = fat[fat_value];
+    }
+    *num_blocks = blocks;
+    return runs;
+}
+
+int chain_span(uint16_t first_block) {
+    int num_fat_entries = fat_num_entries();
+    int lowest = num_fat_entries, highest = 0, blocks = 0;
+    for (uint16_t fat_value = first_block; fat_value != 0xFFFF && fat_value != 0 && fat_value < num_fat_entries && blocks < num_fat_entries; fat_value = fat[fat_value]) {
+        lowest = fat_value < lowest ? fat_value : lowest;
+        highest = fat_value > highest ? fat_value : highest;
+        blocks++;
+    }
+    return blocks > 0 ? highest - lowest + 1 : 0;
+}
+
+int chain_extent(uint16_t first_block, uint32_t offset, uint32_t length) {
+    int num_fat_entries = fat_num_entries();
+    uint16_t fat_value = first_block;
+    for (uint32_t i = 0; i < offset / block_size && fat_value != 0xFFFF; i++) {
+        fat_value = fat[fat_value];
+    }
+    int first = fat_value;
+    int num_blocks = (offset % block_size + length + block_size - 1) / block_size;
+    for (int i = 0; i < num_blocks; i++) {
+        if (fat_value == 0xFFFF || fat_value == 0 || fat_value >= num_fat_entries || fat_value != first + i
+            || block_is_hole(fat_value) || block_shared(fat_value) || block_deduped(fat_value)) {
+            return -1;
+        }
+        fat_value = fat[fat_value];
+    }
+    return first;
+}
+
+uint16_t chain_last(uint16_t first_block) {
+    int num_fat_entries = fat_num_entries();
+    uint16_t last = 0xFFFF;
+    int blocks = 0;
+    for (uint16_t fat_value = first_block; fat_value != 0xFFFF && fat_value != 0 && fat_value < num_fat_entries && blocks < num_fat_entries; fat_value = fat[fat_value]) {
+        last = fat_value;
+        blocks++;
+    }
+    return last;
+}
+
+int refresh_last_block(const char *fs_name) {
+    directory_entry dir_entry;
+    off_t dir_position = find_file(fs_name, &dir_entry);
+    if (dir_position == -1) {
+        return -1;
+    }
+    uint16_t last = chain_last(dir_entry.firstBlock);
+    if (dir_entry.lastBlock == last) {
+        return 0;
+    }
+    dir_entry.lastBlock = last;
+    if (lseek(fs_fd, dir_position, SEEK_SET) == -1 || write_dir_entry(&dir_entry) != sizeof(directory_entry)) {
+        fprintf(stderr, "Error writing directory entry\n");
+        return -1;
+    }
+    return 0;
+}
+
+int advise_chain(uint16_t first_block, uint32_t offset, uint32_t length, int advice) {
+    advice = advice == F_FADV_WILLNEED ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+    int num_fat_entries = fat_num_entries();
+    uint16_t fat_value = first_block;
+    for (uint32_t i = 0; i < offset / block_size && fat_value != 0xFFFF && fat_value != 0 && fat_value < num_fat_entries; i++) {
+        fat_value = fat[fat_value];
+    }
+    uint32_t num_blocks = length == 0 ? num_fat_entries : (offset % block_size + length + block_size - 1) / block_size;
+    off_t run_start = 0;
+    size_t run_length = 0;
+    int advised = 0;
+
+    // Adjacent blocks are merged so a contiguous file costs one syscall
+    for (uint32_t i = 0; i <= num_blocks; i++) {
+        bool end = i == num_blocks || fat_value == 0xFFFF || fat_value == 0 || fat_value >= num_fat_entries;
+        off_t position = end ? 0 : fat_size + (off_t)(fat_value - 1) * block_size;
+        if (run_length > 0 && (end || block_is_hole(fat_value) || position != run_start + (off_t)run_length)) {
+            if (posix_fadvise(fs_fd, run_start, run_length, advice) != 0) {
+                advised = -1;
+            }
+            run_length = 0;
+        }
+        if (end) {
+            break;
+        }
+        if (!block_is_hole(fat_value)) {
+            run_start = run_length == 0 ? position : run_start;
+            run_length += block_size;
+        }
+        fat_value = fat[fat_value];
+    }
+    return advised;
+}
+
+int advise_mapping(void *addr, size_t length, int advice) {
+    static const int madvice[] = {
+        [F_FADV_NORMAL] = MADV_NORMAL, [F_FADV_SEQUENTIAL] = MADV_SEQUENTIAL, [F_FADV_RANDOM] = MADV_RANDOM,
+        [F_FADV_WILLNEED] = MADV_WILLNEED, [F_FADV_DONTNEED] = MADV_DONTNEED,
+#ifdef MADV_COLD
+        [F_FADV_NOREUSE] = MADV_COLD,  // first in line for reclaim, without losing the data
+#else
+        [F_FADV_NOREUSE] = MADV_NORMAL,
+#endif
+    };
+    return madvise(addr, length, madvice[advice]);
+}
+
+int touch_single(const char *fs_name) {
     int fat_value = 1;
     size_t num_entries = block_size / sizeof(directory_entry);
     directory_entry dir_entry;
 
+    // seek to the start of root directory
     int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
     if (root_dir_offset == -1) {
         fprintf(stderr, "Failed to seek to root directory\n");
         return -1;
     }
-    // traverse through entire root directory (may be multiple blocks)
-    bool file_found = false;
+
+    // traverse to see if file exists
     while (fat_value != 0xFFFF) {
         int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
         if (offset == -1) {
@@ -804,785 +1679,3196 @@ int cat_f_w(struct parsed_command *cmd) {
             return -1;
         }
         for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
             if (read_bytes == -1) {
                 fprintf(stderr, "Error reading directory entry\n");
                 return -1;
             }
 
-            // found the file in root directory
-            if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0) {   
-                file_found = true;
-                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
-                if (directory_pos == -1) {
-                    fprintf(stderr, "Failed to seek to root directory\n");
-                    return -1;
-                }
-                int curr_fat_block = dir_entry.firstBlock;
-                if (curr_fat_block == 0xFFFF) {
-                    curr_fat_block = find_new_fat();
-                    fat[curr_fat_block] = 0xFFFF;
-                    dir_entry.firstBlock = curr_fat_block;
-                    
-                    // update directory
-                    directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
-                    if (directory_pos == -1) {
-                        fprintf(stderr, "Failed to seek to root directory\n");
-                        return -1;
-                    }
-                    int write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
-                }
-                int next_fat_block = fat[curr_fat_block];
-
-                // get input
-                int i = 0;
-                bool nullify = false;
-                while (input[i] != '\0' && input[i] != '\n') {
-                    char block[block_size];
-                    for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
-                        if (input[i] == '\0' || input[i] == '\n') {
-                            block[j] = '\0';
-                            nullify = true;
-                            i++;
-                        } else if (nullify) {
-                            block[j] = '\0';
-                            i++;
-                        } else {
-                            block[j] = input[i];
-                            i++;
-                        }
-                    }
-
-                    // write to curr_fat_block
-                    int offset = lseek(fs_fd, fat_size + block_size * (curr_fat_block - 1), SEEK_SET);
-                    if (offset == -1) {
-                        fprintf(stderr, "No more space left\n");
-                        return -1;
-                    }
-                    int write_bytes = write(fs_fd, block, block_size);
-                    if (write_bytes == -1) {
-                        fprintf(stderr, "Error writing directory entry\n");
-                        return -1;
-                    }
-
-                    // update FAT
-                    if (next_fat_block == 0xFFFF) { // no next block
-                        next_fat_block = find_new_fat();
-                        fat[curr_fat_block] = next_fat_block;
-                        fat[next_fat_block] = 0xFFFF;
-                        curr_fat_block = next_fat_block;
-                        next_fat_block = 0xFFFF;
-                    } else { // available next block
-                        fat[curr_fat_block] = next_fat_block;
-                        curr_fat_block = next_fat_block;
-                        next_fat_block = fat[curr_fat_block];
-                    }
-                }
+            // Check if the current entry is the source file
+            if (strcmp(dir_entry.name, fs_name) == 0) {
+                // source file already exists, update timestamp to current time
+                dir_entry.mtime = time(NULL);
+                return 0;
             }
         }
         fat_value = fat[fat_value];
     }
 
-    if (file_found) {
-        return 0;
-    } else {
-        // not found in directory, create and write
-        touch_single(cmd->commands[0][length + 1]);
+    // The entry, and a root block if the root is full, go into one transaction
+    if (journal_reserve(2, 1) == -1) {
+        return -1;
+    }
 
-        // find file we just created in root directory
-        int fat_value = 1;
-        size_t num_entries = block_size / sizeof(directory_entry);
-        directory_entry dir_entry;
+    // create new directory entry
+    directory_entry new_dir_entry;
+    memset(&new_dir_entry, 0, sizeof(directory_entry));
+    strncpy(new_dir_entry.name, fs_name, sizeof(new_dir_entry.name));
+    new_dir_entry.size = 0;
+    new_dir_entry.firstBlock = 0xFFFF;
+    new_dir_entry.lastBlock = 0xFFFF;
+    new_dir_entry.type = FT_REGULAR;
+    new_dir_entry.perm = 6;
+    new_dir_entry.mtime = time(NULL);
 
-        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-        if (root_dir_offset == -1) {
-            fprintf(stderr, "Failed to seek to root directory\n");
+    // seek to the start of root directory
+    root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+    if (root_dir_offset == -1) {
+        fprintf(stderr, "Failed to seek to root directory\n");
+        return -1;
+    }
+
+    // navigate to next available space in root directory
+    fat_value = 1;
+    int final_block = fat_value;
+    while (fat_value != 0xFFFF) {
+        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+        if (offset == -1) {
+            fprintf(stderr, "No more space left\n");
             return -1;
         }
-        // traverse through entire root directory (may be multiple blocks)
-        while (fat_value != 0xFFFF) {
-            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-            if (offset == -1) {
-                fprintf(stderr, "No more space left\n");
+        // one block
+        for (int i = 0; i < num_entries; i++) {
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+            if (read_bytes == -1) {
+                fprintf(stderr, "Error reading directory entry\n");
                 return -1;
             }
-            for (int i = 0; i < num_entries; i++) {
-                int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-                if (read_bytes == -1) {
-                    fprintf(stderr, "Error reading directory entry\n");
+
+            // check if current entry is empty
+            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) == 0) {
+                // found empty entry, write new entry here
+                int offset = lseek(fs_fd, fat_size + (fat_value - 1) * block_size + i * sizeof(directory_entry), SEEK_SET); // seek to empty entry since we overshot
+                if (offset == -1) {
+                    fprintf(stderr, "Failed to seek to empty entry\n");
                     return -1;
                 }
-                // found the file in root directory
-                if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0) {
-                    int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
-                    if (directory_pos == -1) {
-                        fprintf(stderr, "Failed to seek to root directory\n");
-                        return -1;
-                    }
-                    int curr_fat_block = dir_entry.firstBlock;
-                    if (curr_fat_block == 0xFFFF) {
-                        curr_fat_block = find_new_fat();
-                        fat[curr_fat_block] = 0xFFFF;
-                        dir_entry.firstBlock = curr_fat_block;
-                    }
-                    dir_entry.mtime = time(NULL);
-                    dir_entry.size = total_bytes_written;
-                        
-                    // update directory
-                    directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
-                    if (directory_pos == -1) {
-                        fprintf(stderr, "Failed to seek to root directory\n");
-                        return -1;
-                    }
-                    int write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
-                    if (write_bytes == -1) {
-                        fprintf(stderr, "Error writing directory entry\n");
-                        return -1;
-                    }
-
-                    int next_fat_block = fat[curr_fat_block];
-
-                    // get input
-                    int i = 0;
-                    bool nullify = false;
-                    while (input[i] != '\0' && input[i] != '\n') {
-                        char block[block_size];
-                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
-                            if (input[i] == '\0' || input[i] == '\n') {
-                                block[j] = '\0';
-                                nullify = true;
-                                i++;
-                            } else if (nullify) {
-                                block[j] = '\0';
-                                i++;
-                            } else {
-                                block[j] = input[i];
-                                i++;
-                            }
-                        }
-
-                        // write to curr_fat_block
-                        int offset = lseek(fs_fd, fat_size + block_size * (curr_fat_block - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
-                            return -1;
-                        }
-                        int write_bytes = write(fs_fd, block, block_size);
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
 
-                        // update FAT
-                        if (next_fat_block == 0xFFFF) { // no next block
-                            next_fat_block = find_new_fat();
-                            fat[curr_fat_block] = next_fat_block;
-                            fat[next_fat_block] = 0xFFFF;
-                            curr_fat_block = next_fat_block;
-                            next_fat_block = 0xFFFF;
-                        } else { // available next block
-                            fat[curr_fat_block] = next_fat_block;
-                            curr_fat_block = next_fat_block;
-                            next_fat_block = fat[curr_fat_block];
-                        }
-                    }
+                int write_bytes = write_dir_entry(&new_dir_entry);
+                if (write_bytes == -1) {
+                    fprintf(stderr, "Error writing directory entry\n");
+                    return -1;
                 }
+                return 0;
             }
-            fat_value = fat[fat_value];
         }
+
+        if (fat[fat_value] == 0xFFFF) {
+            final_block = fat_value;
+        } // save last block of root directory
+        fat_value = fat[fat_value];
+    }
+
+    // if we reach here, there is no more space in current block--find new block
+    int new_fat = fat_alloc(final_block + 1);
+    if (new_fat == -1) {
+        fprintf(stderr, "No more space left\n");
+        return -1;
+    }
+    fat_set(final_block, new_fat);
+    fat_set(new_fat, 0xFFFF);
+
+    int offset = lseek(fs_fd, fat_size + block_size * (new_fat - 1), SEEK_SET);
+    if (offset == -1) {
+        fprintf(stderr, "No more space left\n");
+        return -1;
+    }
+    
+    int write_bytes = write_dir_entry(&new_dir_entry);
+    if (write_bytes == -1) {
+        fprintf(stderr, "Error writing directory entry\n");
+        return -1;
     }
+    
     return 0;
 }
 
-// cat FILE ... -a OUTPUT_FILE
-// Concatenates the files and appends to OUTPUT_FILE.
-int cat_f_a(struct parsed_command *cmd) {
+int touch(struct parsed_command *cmd) {
     if (fs_fd == -1) {
         fprintf(stderr, "No filesystem is mounted\n");
         return -1;
     }
 
-    size_t data_region_size = block_size * (fat_size / 2 - 1);
-    char str[data_region_size]; // malloc instead
-    str[0] = '\0';
     int length = 1;
-    int total_bytes_written = 0;
-    while (strcmp(cmd->commands[0][length], "-a") != 0) {
-        // find file in root directory
-        int fat_value = 1;
-        size_t num_entries = block_size / sizeof(directory_entry);
-        directory_entry dir_entry;
-
-        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-        if (root_dir_offset == -1) {
-            fprintf(stderr, "Failed to seek to root directory\n");
+    while (cmd->commands[0][length] != NULL) {
+        if (touch_single(cmd->commands[0][length]) != 0) {
             return -1;
         }
-        // find the file in root directory (directory may be multiple blocks)
-        while (fat_value != 0xFFFF) {
-            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-            if (offset == -1) {
-                fprintf(stderr, "No more space left\n");
-                return -1;
-            }
-            for (int i = 0; i < num_entries; i++) {
-                int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-                if (read_bytes == -1) {
-                    fprintf(stderr, "Error reading directory entry\n");
-                    return -1;
-                }
-
-                // found the file in root directory
-                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
-                    total_bytes_written += dir_entry.size;
-                    int new_fat_value = dir_entry.firstBlock; // find first block of file
-                    if (dir_entry.firstBlock == 0xFFFF) {
-                        return 0; // nothing written to file yet
-                    }
+        length++;
+    }
 
-                    // traverse through blocks of file
-                    while (new_fat_value != 0xFFFF) {
-                        char b[block_size + 1];
-                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
-                            return -1;
-                        }
+    return 0;
+}
 
-                        int read_bytes = read(fs_fd, b, block_size);
-                        if (read_bytes == -1) {
-                            fprintf(stderr, "Error reading directory entry for destination\n");
-                            return -1;
-                        }
-
-                        // null terminate block
-                        b[block_size] = '\0';
-                        strcat(str, b);
-                        new_fat_value = fat[new_fat_value];
-                    }
-                }
-            }
-            fat_value = fat[fat_value];
-        }    
-        length++; 
+int rm(const char *fs_name) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
     }
 
-    // find output file in root directory
-    int fat_value = 1;
-    size_t num_entries = block_size / sizeof(directory_entry);
     directory_entry dir_entry;
+    off_t current_pos = find_file(fs_name, &dir_entry);
+    if (current_pos == -1) {
+        fprintf(stderr, "File not found\n");
+        return -1;
+    }
+    if (dir_entry.type == FT_SYSTEM) {
+        fprintf(stderr, "Permission denied\n");
+        return -1;
+    }
 
-    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-    if (root_dir_offset == -1) {
-        fprintf(stderr, "Failed to seek to root directory\n");
+    // Delete the destination FAT chain in the FAT
+    if (release_file(&dir_entry, current_pos) == -1) {
         return -1;
     }
-    // traverse through entire root directory (may be multiple blocks)
-    while (fat_value != 0xFFFF) {
-        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
+
+    // Zero our root directory entry
+    directory_entry dir_entry_zero;
+    lseek(fs_fd, current_pos, SEEK_SET); // Go back to the file entry
+    memset(&dir_entry_zero, 0, sizeof(directory_entry)); // Zero out entry
+    ssize_t bytes_written = write_dir_entry(&dir_entry_zero);
+    if (bytes_written == -1) {
+        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int mv(const char *src, const char *dst) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    // System files can neither be renamed nor replaced
+    directory_entry dir_entry;
+    if ((find_file(src, &dir_entry) != -1 && dir_entry.type == FT_SYSTEM)
+        || (find_file(dst, &dir_entry) != -1 && dir_entry.type == FT_SYSTEM)) {
+        fprintf(stderr, "Permission denied\n");
+        return -1;
+    }
+
+    size_t num_entries = block_size / sizeof(directory_entry);
+    int root_fat_value = 1;
+
+    while(root_fat_value != 0xFFFF) {
+        off_t root_dir_offset = lseek(fs_fd, fat_size + ((root_fat_value - 1) * block_size), SEEK_SET);
+        if (root_dir_offset == (off_t)-1) {
+            fprintf(stderr, "Failed to seek to root directory\n");
             return -1;
         }
-        for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
+
+        for (size_t i = 0; i < num_entries; i++) {
+            ssize_t read_bytes = dir_read(&dir_entry, sizeof(directory_entry), root_dir_offset + i * sizeof(directory_entry));
             if (read_bytes == -1) {
                 fprintf(stderr, "Error reading directory entry\n");
                 return -1;
             }
 
-            // found the file in root directory
-            if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0 && read_bytes != 0) {  
-                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
-                if (directory_pos == -1) {
-                    fprintf(stderr, "Failed to seek to root directory\n");
-                    return -1;
-                }
-                int last_fat_block = dir_entry.firstBlock; // find first block of file
-                if (dir_entry.firstBlock != 0xFFFF) {
-                    while (fat[last_fat_block] != 0xFFFF) {
-                        // navigate to end of file
-                        last_fat_block = fat[last_fat_block];
-                    }
-                }
+            // Search for source file
+            if (strncmp(dir_entry.name, src, sizeof(dir_entry.name)) == 0) {
+                
+                // Save position of source
+                off_t current_pos = lseek(fs_fd, 0, SEEK_CUR);
 
-                // get input
-                size_t len = 0;
-                int i = 0;
-                bool nullify = false;
-                bool append = dir_entry.firstBlock != 0xFFFF;
+                int root_fat_value_dst = 1;
+                directory_entry dst_entry;
+                int found_dst = 0;
 
-                // print str
-                while (str[i] != '\0') {
-                    char block[block_size];
-                    if (append) {
-                        lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
-                        read(fs_fd, &block, block_size);
-                        int writeFrom = 0;
-                        while (block[writeFrom] != '\0') {
-                            writeFrom++;
-                        }
-                        for (int k = writeFrom; k < block_size / sizeof(char) - 1; k++) {
-                            if (str[i] == '\0') {
-                                block[k] = '\0';
-                                nullify = true;
-                                i++;
-                            } else if (nullify) {
-                                block[k] = '\0';
-                                i++;
-                            } else {
-                                block[k] = str[i];
-                                i++;
-                            }
-                        }
-                        lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
-                        write(fs_fd, block, block_size);
+                while(root_fat_value_dst != 0xFFFF && !found_dst) {
+                    root_dir_offset = lseek(fs_fd, fat_size + ((root_fat_value_dst - 1) * block_size), SEEK_SET);
 
-                        append = false;
-                    } else {
-                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
-                            if (str[i] == '\0') {
-                                block[j] = '\0';
-                                nullify = true;
-                                i++;
-                            } else if (nullify) {
-                                block[j] = '\0';
-                                i++;
-                            } else {
-                                block[j] = str[i];
-                                i++;
-                            }
-                        }
-                        int new_fat_block = find_new_fat();
-                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_block - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
+                    // Search for an existing destination file
+                    for (size_t j = 0; j < num_entries; j++) {
+                        ssize_t read_bytes_dst = dir_read(&dst_entry, sizeof(directory_entry), root_dir_offset + j * sizeof(directory_entry));
+                        if (read_bytes_dst == -1) {
+                            fprintf(stderr, "Error reading directory entry for destination\n");
                             return -1;
                         }
 
-                        int write_bytes = write(fs_fd, block, block_size);
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
-                        // update FAT
-                        if (last_fat_block != 0xFFFF) { // not first entry
-                            fat[last_fat_block] = new_fat_block;
-                        } else { // first entry
-                            dir_entry.firstBlock = new_fat_block;
-                        }
-                        dir_entry.mtime = time(NULL);   
-                        dir_entry.size += total_bytes_written;
-                        // update directory
-                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
-                        if (directory_pos == -1) {
-                            fprintf(stderr, "Failed to seek to root directory\n");
-                            return -1;
-                        }
-                        write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
+                        // Remove destination file if it exists
+                        if (strncmp(dst_entry.name, dst, sizeof(dst_entry.name)) == 0) {
+                            rm(dst);
+                            found_dst = 1;
+                            break;
                         }
-
-
-                        fat[new_fat_block] = 0xFFFF; // end of file
-                        last_fat_block = new_fat_block;
                     }
+                    root_fat_value_dst = fat[root_fat_value_dst];
                 }
+
+                // Rename the source file to the destination
+                lseek(fs_fd, current_pos - sizeof(directory_entry), SEEK_SET); // Go back to the source file entry
+                strncpy(dir_entry.name, dst, sizeof(dir_entry.name));
+                dir_entry.name[sizeof(dir_entry.name) - 1] = '\0';
+                dir_entry.mtime = time(NULL);
+                write_dir_entry(&dir_entry); // Write back updated entry back
+                return 0;
             }
         }
-        fat_value = fat[fat_value];
+        root_fat_value = fat[root_fat_value];
     }
-    return 0;
+
+    fprintf(stderr, "Source file not found\n");
+    return -1;
 }
 
-// cat -a OUTPUT_FILE
-// Reads from the terminal and appends to OUTPUT_FILE.
-int cat_a_f(struct parsed_command *cmd) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+// While set, cp queues the data it copies on it instead of copying it, see cp_queued()
+static io_request *copy_io = NULL;
+
+// Has copy_io take the size bytes a copy moves through a buffer it owns, or has the copy done right away
+// if it is smaller than an offloaded transfer or there is no memory for it
+static void copy_io_buffer(size_t size) {
+    if (copy_io != NULL && (size < OFFLOAD_MIN_BYTES || (copy_io->buffer = malloc(size)) == NULL)) {
+        copy_io = NULL;
+    }
+}
+
+// Reads the start of a block for cp, or queues the read on copy_io
+static ssize_t copy_block_read(uint16_t block, char *buf, size_t n) {
+    if (copy_io == NULL || block_is_hole(block)) {
+        return block_read(block, 0, buf, n);
+    }
+    off_t position = fat_size + (off_t)(block - 1) * block_size;
+    return io_request_add(copy_io, fs_fd, false, buf, n, position) == -1 ? -1 : (ssize_t)n;
+}
+
+// Writes to a block for cp, or queues the write on copy_io
+static ssize_t copy_block_write(uint16_t block, int offset, const char *buf, size_t n) {
+    if (copy_io == NULL) {
+        return block_write(block, offset, buf, n);
+    }
+    set_block_hole(block, false);
+    mark_block_dirty(block);
+    off_t position = fat_size + (off_t)(block - 1) * block_size + offset;
+    return io_request_add(copy_io, fs_fd, true, (char *)buf, n, position) == -1 ? -1 : (ssize_t)n;
+}
+
+// Reads the next bytes of a host file for cp, or queues the read on copy_io up to the size the file had; returns 0 at its end
+static ssize_t copy_host_read(int fd, char *buf, size_t n, off_t offset, off_t size) {
+    if (copy_io == NULL) {
+        return read(fd, buf, n);
+    }
+    if (offset + (off_t)n > size) {
+        n = size - offset;
+    }
+    return n == 0 ? 0 : io_request_add(copy_io, fd, false, buf, n, offset) == -1 ? -1 : (ssize_t)n;
+}
+
+// Writes the next bytes of a host file for cp, or queues the write on copy_io
+static ssize_t copy_host_write(int fd, const char *buf, size_t n, off_t offset) {
+    if (copy_io == NULL) {
+        return write(fd, buf, n);
+    }
+    return io_request_add(copy_io, fd, true, (char *)buf, n, offset) == -1 ? -1 : (ssize_t)n;
+}
+
+// Closes a host file cp is through with, or leaves it to copy_io until the transfers queued on it are done
+static void copy_host_close(int fd) {
+    if (copy_io != NULL) {
+        copy_io->host_fd = fd;
+    } else {
+        close(fd);
+    }
+}
+
+int copy_file(int src_volume, const char *src, int dst_volume, const char *dst) {
+    directory_entry src_dir_entry;
+    directory_entry dst_dir_entry;
+
+    if (src_volume == dst_volume && strcmp(src, dst) == 0) {
+        fprintf(stderr, "Source and destination are the same file\n");
         return -1;
     }
 
-    // find file in root directory
-    int fat_value = 1;
-    size_t num_entries = block_size / sizeof(directory_entry);
-    directory_entry dir_entry;
-    char input[block_size];
-    int total_bytes_written = 0;
+    // Find the source
+    if (select_volume(src_volume) == -1) {
+        return -1;
+    }
+    if (find_file(src, &src_dir_entry) == -1) {
+        fprintf(stderr, "Source file not found\n");
+        return -1;
+    }
+    if (src_dir_entry.type == FT_SYSTEM) {
+        fprintf(stderr, "Permission denied\n");
+        return -1;
+    }
+    int src_block_size = block_size;
 
-    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-    if (root_dir_offset == -1) {
-        fprintf(stderr, "Failed to seek to root directory\n");
+    // Create the destination, removing it first if it exists
+    if (select_volume(dst_volume) == -1) {
         return -1;
     }
-    // traverse through entire root directory (may be multiple blocks)
-    while (fat_value != 0xFFFF) {
-        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
+    if (find_file(dst, &dst_dir_entry) != -1 && rm(dst) == -1) {
+        return -1;
+    }
+    // touch_single() reports a full directory
+    if (touch_single(dst) == -1) {
+        return -1;
+    }
+    int current_dst_pos = find_file(dst, &dst_dir_entry);
+    int dst_block_size = block_size;
+
+    // Reserve the destination chain up front so the copy lands in one extent if possible,
+    // unless the journal cannot take it at once: then it grows block by block
+    int dst_blocks = (src_dir_entry.size + dst_block_size - 1) / dst_block_size;
+    if (!journal_fits(2 * dst_blocks, 1) && journal_split() == -1) {
+        fprintf(stderr, "Failed to checkpoint the journal\n");
+        return -1;
+    }
+    if (journal_fits(2 * dst_blocks, 1) && fallocate_chain(&dst_dir_entry, src_dir_entry.size) == -1) {
+        fprintf(stderr, "No more space in FAT\n");
+        return -1;
+    }
+
+    uint16_t src_fat_value = src_dir_entry.firstBlock;
+    uint16_t dst_fat_value = dst_dir_entry.firstBlock;
+    int dst_offset = 0;
+    uint32_t total_written = 0;
+    char buffer[src_block_size];
+    copy_io_buffer(src_dir_entry.size);
+
+    while (total_written < src_dir_entry.size && src_fat_value != 0xFFFF) {
+        // Read one source block
+        select_volume(src_volume);
+        char *chunk = copy_io != NULL ? copy_io->buffer + total_written : buffer;
+        int bytes_to_copy = src_dir_entry.size - total_written;
+        if (bytes_to_copy > src_block_size) {
+            bytes_to_copy = src_block_size;
+        }
+        if (copy_block_read(src_fat_value, chunk, bytes_to_copy) != bytes_to_copy) {
+            fprintf(stderr, "Error reading from source\n");
             return -1;
         }
-        for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-            if (read_bytes == -1) {
-                fprintf(stderr, "Error reading directory entry\n");
-                return -1;
+        src_fat_value = fat[src_fat_value];
+
+        // Spread it over the destination blocks, whose size may differ
+        select_volume(dst_volume);
+        for (int copied = 0; copied < bytes_to_copy;) {
+            int bytes_to_write = bytes_to_copy - copied;
+            if (bytes_to_write > dst_block_size - dst_offset) {
+                bytes_to_write = dst_block_size - dst_offset;
             }
-
-            // found the file in root directory
-            if (strncmp(dir_entry.name, cmd->commands[0][2], sizeof(dir_entry.name)) == 0) {   
-                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
-                if (directory_pos == -1) {
-                    fprintf(stderr, "Failed to seek to root directory\n");
+            if (dst_fat_value == 0xFFFF) {
+                dst_dir_entry.size = total_written + copied;
+                int block = append_chain_block(&dst_dir_entry, current_dst_pos);
+                if (block == -1) {
+                    // Keep what was copied, the entry still has to cover the chain
+                    fprintf(stderr, "No more space in FAT\n");
+                    lseek(fs_fd, current_dst_pos, SEEK_SET);
+                    write_dir_entry(&dst_dir_entry);
                     return -1;
                 }
-                int last_fat_block = dir_entry.firstBlock; // find first block of file
-                if (dir_entry.firstBlock != 0xFFFF) {
+                dst_fat_value = block;
+            }
+            if (copy_block_write(dst_fat_value, dst_offset, chunk + copied, bytes_to_write) != bytes_to_write) {
+                fprintf(stderr, "Error writing to destination file\n");
+                return -1;
+            }
+            copied += bytes_to_write;
+            dst_offset += bytes_to_write;
+            if (dst_offset == dst_block_size) {
+                dst_fat_value = fat[dst_fat_value];
+                dst_offset = 0;
+            }
+        }
+        total_written += bytes_to_copy;
+    }
+
+    dst_dir_entry.mtime = time(NULL);
+    dst_dir_entry.size = total_written;
+    lseek(fs_fd, current_dst_pos, SEEK_SET);
+    write_dir_entry(&dst_dir_entry);
+    if (copy_io != NULL) {
+        // The data is not there yet, cp_queued_done() finishes the copy
+        return 0;
+    }
+
+    // A copy is read and written once, its blocks should not push hotter ones out of the page cache
+    select_volume(src_volume);
+    advise_chain(src_dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+    select_volume(dst_volume);
+    advise_chain(dst_dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+    return dedup_name(dst) == -1 ? -1 : 0;
+}
+
+// Picks the source and destination of a cp command and which of them are host files, returns -1 on bad usage
+static int cp_args(struct parsed_command *cmd, const char **src, const char **dst, int *host_src, int *host_dst) {
+    *src = NULL, *dst = NULL;
+    *host_src = -1, *host_dst = -1;
+
+    if (cmd->commands[0][3] != NULL) {
+        if (cmd->commands[0][1] != NULL && strcmp(cmd->commands[0][1], "-h") == 0) {
+            *src = cmd->commands[0][2], *dst = cmd->commands[0][3], *host_src = 1, *host_dst = 0;
+        } else if (cmd->commands[0][2] != NULL && strcmp(cmd->commands[0][2], "-h") == 0) {
+            *src = cmd->commands[0][1], *dst = cmd->commands[0][3], *host_src = 0, *host_dst = 1;
+        }
+    } else {
+        if (cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL) {
+            *src = cmd->commands[0][1], *dst = cmd->commands[0][2], *host_src = 0, *host_dst = 0;
+        }
+    }
+
+    if (*src == NULL || *dst == NULL || *host_src == -1 || *host_dst == -1) {
+        fprintf(stderr, "Error: cp usage.\n");
+        return -1;
+    }
+    return 0;
+}
+
+int cp(struct parsed_command *cmd) {
+    const char *src, *dst;
+    int host_src, host_dst;
+    if (cp_args(cmd, &src, &dst, &host_src, &host_dst) == -1) {
+        return -1;
+    }
+
+    // Resolve the PennFAT side(s), the last one resolved stays selected
+    int src_volume = -1, dst_volume = -1;
+    if (!host_src && (src_volume = resolve_path(src, &src)) == -1) {
+        return -1;
+    }
+    if (!host_dst && (dst_volume = resolve_path(dst, &dst)) == -1) {
+        return -1;
+    }
+    if (!host_dst && read_only) {
+        fprintf(stderr, "%s is mounted read-only\n", volumes[dst_volume].label);
+        return -1;
+    }
+    if (!host_src && !host_dst) {
+        return copy_file(src_volume, src, dst_volume, dst);
+    }
+
+    if (host_src && !host_dst) {
+        int src_fd = open(src, O_RDONLY);
+        if (src_fd == -1) {
+            if (errno == ENOENT) {
+                fprintf(stderr, "Source file does not exist\n");
+            } else {
+                fprintf(stderr, "Error opening file\n");
+            }
+            return -1;
+        }
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        directory_entry dir_entry;
+        // Remove the destination file (if it exists)
+        if (find_file(dst, &dir_entry) != -1 && rm(dst) == -1) {
+            close(src_fd);
+            return -1;
+        }
+
+        // touch_single() reports a full directory
+        if (touch_single(dst) == -1) {
+            close(src_fd);
+            return -1;
+        }
+        int current_pos = find_file(dst, &dir_entry);
+
+        // Reserve the whole chain up front so the copy lands in one extent if possible,
+        // unless the journal cannot take it at once: then it grows block by block
+        off_t src_size = lseek(src_fd, 0, SEEK_END);
+        lseek(src_fd, 0, SEEK_SET);
+        int blocks = (src_size + block_size - 1) / block_size;
+        if (!journal_fits(2 * blocks, 1) && journal_split() == -1) {
+            fprintf(stderr, "Failed to checkpoint the journal\n");
+            close(src_fd);
+            return -1;
+        }
+        if (src_size > 0 && journal_fits(2 * blocks, 1)) {
+            if (fallocate_chain(&dir_entry, src_size) == -1) {
+                fprintf(stderr, "No more space in FAT\n");
+                close(src_fd);
+                return -1;
+            }
+        }
+
+        uint16_t fat_value = dir_entry.firstBlock;
+        uint16_t prev_fat_value = 0xFFFF;
+        char buffer[block_size];
+        ssize_t bytes_read, bytes_written;
+        uint32_t total_written = 0;
+        copy_io_buffer(src_size);
+        char *chunk = copy_io != NULL ? copy_io->buffer : buffer;
+
+        while ((bytes_read = copy_host_read(src_fd, chunk, block_size, total_written, src_size)) > 0) {
+            if (fat_value == 0xFFFF) {
+                // Allocate a new block, preferably right after the previous one
+                dir_entry.lastBlock = prev_fat_value;
+                dir_entry.size = total_written;
+                int open_fat_value = append_chain_block(&dir_entry, current_pos);
+                if (open_fat_value == -1) {
+                    // Keep what was copied, the entry still has to cover the chain
+                    fprintf(stderr, "No more space in FAT\n");
+                    lseek(fs_fd, current_pos, SEEK_SET);
+                    write_dir_entry(&dir_entry);
+                    copy_host_close(src_fd);
+                    return -1;
+                }
+                fat_value = open_fat_value;
+            }
+
+            bytes_written = copy_block_write(fat_value, 0, chunk, bytes_read);
+            if (bytes_written == -1) {
+                fprintf(stderr, "Error writing to destination file\n");
+                copy_host_close(src_fd);
+                return -1;
+            }
+            total_written += bytes_written;
+            prev_fat_value = fat_value;
+            fat_value = fat[fat_value];
+            chunk = copy_io != NULL ? copy_io->buffer + total_written : buffer;
+        }
+
+        lseek(fs_fd, current_pos, SEEK_SET);
+        dir_entry.lastBlock = chain_last(dir_entry.firstBlock);
+        dir_entry.mtime = time(NULL);
+        dir_entry.size = total_written;
+        write_dir_entry(&dir_entry);
+        if (copy_io != NULL) {
+            // cp_queued_done() finishes the copy once the data is there
+            copy_host_close(src_fd);
+            return 0;
+        }
+
+        // Neither side is read again soon, so the copy should not stay in the page cache
+        posix_fadvise(src_fd, 0, 0, POSIX_FADV_DONTNEED);
+        advise_chain(dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+        close(src_fd);
+        return 0;
+    } else if (!host_src && host_dst) {
+        int dst_fd = open(dst, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (dst_fd == -1) {
+            fprintf(stderr, "Error opening destination file\n");
+            return -1;
+        }
+
+        directory_entry dir_entry;
+        int current_pos = find_file(src, &dir_entry);
+        if (current_pos == -1) {
+            fprintf(stderr, "Source file not found\n");
+            return -1;
+        }
+
+        uint16_t fat_value = dir_entry.firstBlock;
+        uint32_t size_to_read = dir_entry.size;
+        char buffer[block_size];
+        copy_io_buffer(dir_entry.size);
+
+        while (fat_value != 0xFFFF) {
+            int buffer_read_size = size_to_read > block_size ? block_size : size_to_read;
+            off_t offset = dir_entry.size - size_to_read;
+            char *chunk = copy_io != NULL ? copy_io->buffer + offset : buffer;
+            ssize_t bytes_read = copy_block_read(fat_value, chunk, buffer_read_size);
+            if (bytes_read == -1) {
+                fprintf(stderr, "Error reading from source\n");
+                copy_host_close(dst_fd);
+                return -1;
+            }
+            ssize_t bytes_written = copy_host_write(dst_fd, chunk, bytes_read, offset);
+            if (bytes_written == -1) {
+                fprintf(stderr, "Error writing to destination file\n");
+                copy_host_close(dst_fd);
+                return -1;
+            }
+
+            uint16_t next_fat_value = fat[fat_value];
+            size_to_read -= bytes_read;
+            if (size_to_read <= 0) {
+                break;
+            }
+            fat_value = next_fat_value;
+        }
+
+        if (copy_io != NULL) {
+            // cp_queued_done() finishes the copy once the data is there
+            copy_host_close(dst_fd);
+            return 0;
+        }
+
+        // Neither side is read again soon, so the copy should not stay in the page cache
+        advise_chain(dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+        posix_fadvise(dst_fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(dst_fd);
+        return 0;
+    }
+    return 0;
+}
+
+int cp_queued(struct parsed_command *cmd, io_request *request) {
+    copy_io = request;
+    int copied = cp(cmd);
+    copy_io = NULL;
+    return copied;
+}
+
+int cp_queued_done(struct parsed_command *cmd) {
+    const char *src, *dst;
+    int host_src, host_dst;
+    if (cp_args(cmd, &src, &dst, &host_src, &host_dst) == -1) {
+        return -1;
+    }
+
+    // A copy is read and written once, its blocks should not push hotter ones out of the page cache
+    directory_entry dir_entry;
+    if (!host_src && resolve_path(src, &src) != -1 && find_file(src, &dir_entry) != -1) {
+        advise_chain(dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+    }
+    if (host_dst || resolve_path(dst, &dst) == -1 || find_file(dst, &dir_entry) == -1) {
+        return 0;
+    }
+    advise_chain(dir_entry.firstBlock, 0, 0, F_FADV_DONTNEED);
+    return !host_src && dedup_name(dst) == -1 ? -1 : 0;
+}
+
+// A regular file of the host directory being packed
+typedef struct {
+    char name[32];
+    uint32_t size;
+    uint8_t perm;
+    time_t mtime;
+} pack_file;
+
+// Reads the root directory into memory with one read per block, the blocks in chain order
+directory_entry *read_root_dir(uint16_t **dir_blocks, int *num_dir_blocks) {
+    int num_fat_entries = fat_num_entries();
+    int count = 0;
+    for (int root_block = 1; root_block != 0xFFFF && count < num_fat_entries; root_block = fat[root_block]) {
+        count++;
+    }
+    *dir_blocks = malloc(count * sizeof(uint16_t));
+    directory_entry *entries = malloc((size_t)count * block_size);
+    if (*dir_blocks == NULL || entries == NULL) {
+        fprintf(stderr, "Failed to allocate the directory\n");
+        free(*dir_blocks);
+        free(entries);
+        return NULL;
+    }
+    int i = 0;
+    for (int root_block = 1; i < count; root_block = fat[root_block], i++) {
+        (*dir_blocks)[i] = root_block;
+        if (dir_pread((char *)entries + (size_t)i * block_size, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            free(*dir_blocks);
+            free(entries);
+            return NULL;
+        }
+    }
+    *num_dir_blocks = count;
+    return entries;
+}
+
+// Copies a host file into the blocks of a new chain, a run of consecutive blocks per write
+int pack_data(int host_fd, directory_entry *dir_entry, uint32_t size, char *buffer, int *goal) {
+    int blocks_needed = (size + block_size - 1) / block_size;
+    if (blocks_needed == 0) {
+        return 0;
+    }
+
+    // Files go back to back, without the gap left after files that are expected to grow
+    int extent = fat_alloc_extent(*goal, blocks_needed);
+    if (extent != -1) {
+        dir_entry->firstBlock = extent;
+        dir_entry->lastBlock = extent + blocks_needed - 1;
+        for (int i = 0; i < blocks_needed; i++) {
+            fat_set(extent + i, i + 1 < blocks_needed ? extent + i + 1 : 0xFFFF);
+        }
+        dir_entry->allocSize = size;
+        *goal = extent + blocks_needed;
+    } else if (fallocate_chain(dir_entry, size) == -1) {
+        fprintf(stderr, "No more space in FAT\n");
+        return -1;
+    }
+
+    int max_run = PACK_BUFFER_SIZE / block_size;
+    uint32_t total_written = 0;
+    uint16_t fat_value = dir_entry->firstBlock;
+    while (fat_value != 0xFFFF && total_written < size) {
+        int run = 1;
+        while (run < max_run && fat[fat_value + run - 1] == fat_value + run) {
+            run++;
+        }
+        size_t length = size - total_written < (uint32_t)run * block_size ? size - total_written : (size_t)run * block_size;
+        size_t bytes_read = 0;
+        ssize_t n;
+        while (bytes_read < length && (n = read(host_fd, buffer + bytes_read, length - bytes_read)) > 0) {
+            bytes_read += n;
+        }
+        if (bytes_read > 0 && pwrite(fs_fd, buffer, bytes_read, fat_size + (fat_value - 1) * block_size) != (ssize_t)bytes_read) {
+            fprintf(stderr, "Error writing to destination file\n");
+            return -1;
+        }
+        for (int i = 0; i < run; i++) {
+            mark_block_dirty(fat_value + i);
+        }
+        total_written += bytes_read;
+        if (bytes_read < length) {
+            break; // The host file shrank while we read it
+        }
+        fat_value = fat[fat_value + run - 1];
+    }
+    dir_entry->size = total_written;
+    return 0;
+}
+
+int pack_write_dir(directory_entry *entries, directory_entry *old_entries, bool *changed, const uint16_t *dir_blocks, int num_dir_blocks) {
+    int num_entries = block_size / sizeof(directory_entry);
+    int result = 0;
+
+    // One write per changed directory block, each changed slot journaled as if written alone
+    for (int b = 0; b < num_dir_blocks; b++) {
+        if (!changed[b]) {
+            continue;
+        }
+        off_t block_offset = fat_size + (dir_blocks[b] - 1) * block_size;
+        for (int i = b * num_entries; i < (b + 1) * num_entries; i++) {
+            if (memcmp(&entries[i], &old_entries[i], sizeof(directory_entry)) != 0) {
+                journal_record record = { JOURNAL_DIR, 0, 0, 0, block_offset + (i - b * num_entries) * sizeof(directory_entry) };
+                journal_log(&record, &old_entries[i], &entries[i]);
+            }
+        }
+        if (dir_pwrite((char *)entries + (size_t)b * block_size, block_size, block_offset) == -1) {
+            fprintf(stderr, "Error writing directory entry\n");
+            result = -1;
+        }
+        memcpy((char *)old_entries + (size_t)b * block_size, (char *)entries + (size_t)b * block_size, block_size);
+        changed[b] = false;
+    }
+    return result;
+}
+
+int pack(const char *host_dir) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL) {
+        fprintf(stderr, "Cannot open %s\n", host_dir);
+        return -1;
+    }
+
+    // Everything that decides the layout is read up front: the host files, then the whole root directory
+    int num_files = 0, files_capacity = 64, skipped = 0;
+    pack_file *files = malloc(files_capacity * sizeof(pack_file));
+    char *path = malloc(PATH_MAX); // Process stacks are small
+    if (files == NULL || path == NULL) {
+        fprintf(stderr, "Failed to allocate the pack buffers\n");
+        free(files);
+        free(path);
+        closedir(dir);
+        return -1;
+    }
+    struct dirent *host_entry;
+    while ((host_entry = readdir(dir)) != NULL) {
+        if (strcmp(host_entry->d_name, ".") == 0 || strcmp(host_entry->d_name, "..") == 0) {
+            continue;
+        }
+        pack_file *file = &files[num_files];
+        snprintf(path, PATH_MAX, "%s/%s", host_dir, host_entry->d_name);
+        if (strlen(host_entry->d_name) >= sizeof(file->name) || host_file_info(path, &file->size, &file->perm, &file->mtime) != 1) {
+            fprintf(stderr, "%s: not a regular file, name too long or too large, skipped\n", host_entry->d_name);
+            skipped++;
+            continue;
+        }
+        strcpy(file->name, host_entry->d_name);
+        if (++num_files == files_capacity) {
+            pack_file *grown = realloc(files, files_capacity * 2 * sizeof(pack_file));
+            if (grown == NULL) {
+                fprintf(stderr, "Failed to allocate the pack buffers\n");
+                free(files);
+                free(path);
+                closedir(dir);
+                return -1;
+            }
+            files = grown;
+            files_capacity *= 2;
+        }
+    }
+    closedir(dir);
+
+    uint16_t *dir_blocks = NULL;
+    int num_dir_blocks = 0;
+    directory_entry *entries = read_root_dir(&dir_blocks, &num_dir_blocks);
+    directory_entry *old_entries = entries != NULL ? malloc((size_t)num_dir_blocks * block_size) : NULL;
+    bool *changed = old_entries != NULL ? calloc(num_dir_blocks, sizeof(bool)) : NULL;
+    int num_entries = block_size / sizeof(directory_entry);
+    uint32_t index_capacity = 16;
+    while (index_capacity < 2 * (uint32_t)(num_dir_blocks * num_entries + num_files)) {
+        index_capacity *= 2;
+    }
+    uint32_t *index = changed != NULL ? calloc(index_capacity, sizeof(uint32_t)) : NULL; // Entry number + 1, 0 when free
+    char *buffer = index != NULL ? malloc(PACK_BUFFER_SIZE) : NULL;
+    if (buffer == NULL) {
+        fprintf(stderr, "Failed to allocate the pack buffers\n");
+        free(files);
+        free(path);
+        free(dir_blocks);
+        free(entries);
+        free(old_entries);
+        free(changed);
+        free(index);
+        return -1;
+    }
+    memcpy(old_entries, entries, (size_t)num_dir_blocks * block_size);
+
+    // Name lookups stay O(1), however many files the directory ends up with
+    uint32_t mask = index_capacity - 1;
+    for (int i = 0; i < num_dir_blocks * num_entries; i++) {
+        if (entries[i].name[0] != '\0') {
+            uint32_t bucket = name_hash(entries[i].name) & mask;
+            while (index[bucket] != 0) {
+                bucket = (bucket + 1) & mask;
+            }
+            index[bucket] = i + 1;
+        }
+    }
+
+    int packed = 0, free_slot = 0, goal = alloc_cursor, pending = 0;
+    unsigned long packed_bytes = 0;
+    int result = 0;
+    for (int f = 0; f < num_files && result == 0; f++) {
+        pack_file *file = &files[f];
+        uint32_t bucket = name_hash(file->name) & mask;
+        while (index[bucket] != 0 && strncmp(entries[index[bucket] - 1].name, file->name, sizeof(file->name)) != 0) {
+            bucket = (bucket + 1) & mask;
+        }
+        int slot = (int)index[bucket] - 1;
+        if (slot != -1 && entries[slot].type == FT_SYSTEM) {
+            fprintf(stderr, "%s: Permission denied\n", file->name);
+            skipped++;
+            continue;
+        }
+
+        // The old chain, a new directory block and the new chain; the entries of the files
+        // packed so far are written before the journal is split, so the split is consistent
+        int num_fat = 2 + 2 * (int)((file->size + block_size - 1) / block_size);
+        for (uint16_t block = slot != -1 ? entries[slot].firstBlock : 0xFFFF; block != 0 && block != 0xFFFF; block = fat[block]) {
+            num_fat++;
+        }
+        if (!journal_fits(num_fat, pending + 1)) {
+            if (pack_write_dir(entries, old_entries, changed, dir_blocks, num_dir_blocks) == -1 || journal_split() == -1) {
+                result = -1;
+                break;
+            }
+            pending = 0;
+            if (!journal_fits(num_fat, 1)) {
+                fprintf(stderr, "%s: too large for the journal, skipped\n", file->name);
+                skipped++;
+                continue;
+            }
+        }
+        pending++;
+        if (slot != -1) {
+            // Replaced, like cp -h onto an existing file
+            if (entries[slot].firstBlock != 0 && entries[slot].firstBlock != 0xFFFF) {
+                release_chain(entries[slot].firstBlock);
+            }
+        } else {
+            while (free_slot < num_dir_blocks * num_entries && entries[free_slot].name[0] != '\0') {
+                free_slot++;
+            }
+            if (free_slot == num_dir_blocks * num_entries) {
+                // The directory is full, give it another block. The buffers grow first, whichever grew
+                // replaces the old one, so the cleanup below frees them either way.
+                uint16_t *grown_blocks = realloc(dir_blocks, (num_dir_blocks + 1) * sizeof(uint16_t));
+                dir_blocks = grown_blocks != NULL ? grown_blocks : dir_blocks;
+                directory_entry *grown_entries = realloc(entries, (size_t)(num_dir_blocks + 1) * block_size);
+                entries = grown_entries != NULL ? grown_entries : entries;
+                directory_entry *grown_old_entries = realloc(old_entries, (size_t)(num_dir_blocks + 1) * block_size);
+                old_entries = grown_old_entries != NULL ? grown_old_entries : old_entries;
+                bool *grown_changed = realloc(changed, (num_dir_blocks + 1) * sizeof(bool));
+                changed = grown_changed != NULL ? grown_changed : changed;
+                if (grown_blocks == NULL || grown_entries == NULL || grown_old_entries == NULL || grown_changed == NULL) {
+                    fprintf(stderr, "Failed to allocate the directory\n");
+                    result = -1;
+                    break;
+                }
+                int new_block = fat_alloc(dir_blocks[num_dir_blocks - 1] + 1);
+                if (new_block == -1) {
+                    fprintf(stderr, "No more space left\n");
+                    result = -1;
+                    break;
+                }
+                fat_set(dir_blocks[num_dir_blocks - 1], new_block);
+                fat_set(new_block, 0xFFFF);
+                dir_blocks[num_dir_blocks] = new_block;
+                memset((char *)entries + (size_t)num_dir_blocks * block_size, 0, block_size);
+                memset((char *)old_entries + (size_t)num_dir_blocks * block_size, 0, block_size);
+                changed[num_dir_blocks] = true;
+                num_dir_blocks++;
+            }
+            slot = free_slot;
+            index[bucket] = slot + 1;
+        }
+
+        directory_entry *dir_entry = &entries[slot];
+        memset(dir_entry, 0, sizeof(directory_entry));
+        strncpy(dir_entry->name, file->name, sizeof(dir_entry->name));
+        dir_entry->firstBlock = 0xFFFF;
+        dir_entry->lastBlock = 0xFFFF;
+        dir_entry->type = FT_REGULAR;
+        dir_entry->perm = file->perm;
+        dir_entry->mtime = file->mtime;
+        changed[slot / num_entries] = true;
+
+        snprintf(path, PATH_MAX, "%s/%s", host_dir, file->name);
+        int host_fd = open(path, O_RDONLY);
+        if (host_fd == -1) {
+            fprintf(stderr, "%s: cannot open, skipped\n", file->name);
+            skipped++;
+            continue;
+        }
+        result = pack_data(host_fd, dir_entry, file->size, buffer, &goal);
+        close(host_fd);
+        if (result == -1) {
+            // The entry stays, empty, so the directory never points at a partial chain
+            if (dir_entry->firstBlock != 0xFFFF) {
+                release_chain(dir_entry->firstBlock);
+            }
+            dir_entry->firstBlock = dir_entry->lastBlock = 0xFFFF;
+            dir_entry->size = dir_entry->allocSize = 0;
+            break;
+        }
+        packed++;
+        packed_bytes += dir_entry->size;
+    }
+    if (goal > alloc_cursor) {
+        alloc_cursor = goal < fat_num_entries() ? goal : 2;
+    }
+
+    if (pack_write_dir(entries, old_entries, changed, dir_blocks, num_dir_blocks) == -1) {
+        result = -1;
+    }
+    fprintf(stderr, "packed %d files (%lu bytes), %d skipped\n", packed, packed_bytes, skipped);
+
+    free(files);
+    free(path);
+    free(dir_blocks);
+    free(entries);
+    free(old_entries);
+    free(changed);
+    free(index);
+    free(buffer);
+    return result == -1 ? -1 : packed;
+}
+
+int unpack(const char *host_dir) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+    if (host_make_dir(host_dir) == -1) {
+        fprintf(stderr, "Cannot create %s\n", host_dir);
+        return -1;
+    }
+
+    uint16_t *dir_blocks = NULL;
+    int num_dir_blocks = 0;
+    directory_entry *entries = read_root_dir(&dir_blocks, &num_dir_blocks);
+    char *buffer = entries != NULL ? malloc(PACK_BUFFER_SIZE + PATH_MAX) : NULL;
+    if (buffer == NULL) {
+        free(dir_blocks);
+        free(entries);
+        return -1;
+    }
+    char *path = buffer + PACK_BUFFER_SIZE; // Process stacks are small
+
+    int num_entries = block_size / sizeof(directory_entry);
+    int num_fat_entries = fat_num_entries();
+    int max_run = PACK_BUFFER_SIZE / block_size;
+    int unpacked = 0, result = 0;
+    unsigned long unpacked_bytes = 0;
+    for (int i = 0; i < num_dir_blocks * num_entries; i++) {
+        directory_entry *dir_entry = &entries[i];
+        if (dir_entry->name[0] == '\0' || dir_entry->type == FT_SYSTEM) {
+            continue;
+        }
+        snprintf(path, PATH_MAX, "%s/%.*s", host_dir, (int)sizeof(dir_entry->name), dir_entry->name);
+        int host_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (host_fd == -1) {
+            fprintf(stderr, "Error opening destination file %s\n", path);
+            result = -1;
+            continue;
+        }
+
+        // Runs of consecutive blocks are read at once, holes come back as zeroes
+        uint32_t remaining = dir_entry->size;
+        uint16_t fat_value = dir_entry->firstBlock;
+        while (remaining > 0 && fat_value != 0xFFFF && fat_value != 0 && fat_value < num_fat_entries) {
+            int run = 1;
+            while (run < max_run && !block_is_hole(fat_value) && fat[fat_value + run - 1] == fat_value + run && !block_is_hole(fat_value + run)) {
+                run++;
+            }
+            size_t length = remaining < (uint32_t)run * block_size ? remaining : (size_t)run * block_size;
+            ssize_t bytes_read = run == 1 ? block_read(fat_value, 0, buffer, length) : pread(fs_fd, buffer, length, fat_size + (fat_value - 1) * block_size);
+            if (bytes_read != (ssize_t)length || write(host_fd, buffer, length) != (ssize_t)length) {
+                fprintf(stderr, "Error copying %s\n", path);
+                result = -1;
+                break;
+            }
+            remaining -= length;
+            fat_value = fat[fat_value + run - 1];
+        }
+
+        host_file_finish(host_fd, dir_entry->perm, dir_entry->mtime);
+        close(host_fd);
+        unpacked++;
+        unpacked_bytes += dir_entry->size - remaining;
+    }
+    fprintf(stderr, "unpacked %d files (%lu bytes)\n", unpacked, unpacked_bytes);
+
+    free(dir_blocks);
+    free(entries);
+    free(buffer);
+    return result == -1 ? -1 : unpacked;
+}
+
+// cat FILE ... [ -w OUTPUT_FILE ]
+// Concatenates the files and overwrites OUTPUT_FILE. 
+// If OUTPUT_FILE does not exist, it will be created. (Same for OUTPUT_FILE in the commands below.)
+int cat_f_w(struct parsed_command *cmd) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    size_t data_region_size = block_size * (fat_size / 2 - 1);
+    char input[fat_size + data_region_size];
+    input[0] = '\0';
+    int length = 1;
+    int total_bytes_written = 0;
+    while (strcmp(cmd->commands[0][length], "-w") != 0) {
+        // find file in root directory
+        int fat_value = 1;
+        size_t num_entries = block_size / sizeof(directory_entry);
+        directory_entry dir_entry;
+
+        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+        if (root_dir_offset == -1) {
+            fprintf(stderr, "Failed to seek to root directory\n");
+            return -1;
+        }
+        // find the file in root directory (directory may be multiple blocks)
+        while (fat_value != 0xFFFF) {
+            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+            if (offset == -1) {
+                fprintf(stderr, "No more space left\n");
+                return -1;
+            }
+            for (int i = 0; i < num_entries; i++) {
+                int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+                if (read_bytes == -1) {
+                    fprintf(stderr, "Error reading directory entry\n");
+                    return -1;
+                }
+
+                // found the file in root directory
+                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
+                    total_bytes_written += dir_entry.size;
+                    int new_fat_value = dir_entry.firstBlock; // find first block of file
+                    if (dir_entry.firstBlock == 0xFFFF) {
+                        break; // nothing written to file yet
+                    }
+
+                    // traverse through blocks of file
+                    while (new_fat_value != 0xFFFF) {
+                        char block[block_size];
+                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+
+                        int read_bytes = read(fs_fd, block, block_size);
+                        if (read_bytes == -1) {
+                            fprintf(stderr, "Error reading directory entry for destination\n");
+                            return -1;
+                        }
+
+                        strcat(input, block);
+                        new_fat_value = fat[new_fat_value];
+                    }
+                }
+            }
+            if (dir_entry.firstBlock == 0xFFFF) {
+                break;
+            }
+            fat_value = fat[fat_value];
+        }    
+        length++; 
+    }
+
+    // The output is written in one transaction
+    if (journal_reserve(2 * (strlen(input) / (block_size - 1) + 2), 3) == -1) {
+        return -1;
+    }
+    
+    // find file in root directory
+    int fat_value = 1;
+    size_t num_entries = block_size / sizeof(directory_entry);
+    directory_entry dir_entry;
+
+    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+    if (root_dir_offset == -1) {
+        fprintf(stderr, "Failed to seek to root directory\n");
+        return -1;
+    }
+    // traverse through entire root directory (may be multiple blocks)
+    bool file_found = false;
+    while (fat_value != 0xFFFF) {
+        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+        if (offset == -1) {
+            fprintf(stderr, "No more space left\n");
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+            if (read_bytes == -1) {
+                fprintf(stderr, "Error reading directory entry\n");
+                return -1;
+            }
+
+            // found the file in root directory
+            if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0) {   
+                file_found = true;
+                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
+                if (directory_pos == -1) {
+                    fprintf(stderr, "Failed to seek to root directory\n");
+                    return -1;
+                }
+                int curr_fat_block = dir_entry.firstBlock;
+                if (curr_fat_block == 0xFFFF) {
+                    curr_fat_block = fat_alloc(0);
+                    fat_set(curr_fat_block, 0xFFFF);
+                    dir_entry.firstBlock = curr_fat_block;
+                    
+                    // update directory
+                    directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
+                    if (directory_pos == -1) {
+                        fprintf(stderr, "Failed to seek to root directory\n");
+                        return -1;
+                    }
+                    int write_bytes = write_dir_entry(&dir_entry);
+                }
+                int next_fat_block = fat[curr_fat_block];
+
+                // get input
+                int i = 0;
+                bool nullify = false;
+                while (input[i] != '\0' && input[i] != '\n') {
+                    char block[block_size];
+                    for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
+                        if (input[i] == '\0' || input[i] == '\n') {
+                            block[j] = '\0';
+                            nullify = true;
+                            i++;
+                        } else if (nullify) {
+                            block[j] = '\0';
+                            i++;
+                        } else {
+                            block[j] = input[i];
+                            i++;
+                        }
+                    }
+
+                    // write to curr_fat_block
+                    int offset = lseek(fs_fd, fat_size + block_size * (curr_fat_block - 1), SEEK_SET);
+                    if (offset == -1) {
+                        fprintf(stderr, "No more space left\n");
+                        return -1;
+                    }
+                    int write_bytes = write(fs_fd, block, block_size);
+                    mark_block_dirty(curr_fat_block);
+                    if (write_bytes == -1) {
+                        fprintf(stderr, "Error writing directory entry\n");
+                        return -1;
+                    }
+
+                    // update FAT
+                    if (next_fat_block == 0xFFFF) { // no next block
+                        next_fat_block = fat_alloc(curr_fat_block + 1);
+                        fat_set(curr_fat_block, next_fat_block);
+                        fat_set(next_fat_block, 0xFFFF);
+                        curr_fat_block = next_fat_block;
+                        next_fat_block = 0xFFFF;
+                    } else { // available next block
+                        fat_set(curr_fat_block, next_fat_block);
+                        curr_fat_block = next_fat_block;
+                        next_fat_block = fat[curr_fat_block];
+                    }
+                }
+            }
+        }
+        fat_value = fat[fat_value];
+    }
+
+    if (file_found) {
+        return 0;
+    } else {
+        // not found in directory, create and write
+        touch_single(cmd->commands[0][length + 1]);
+
+        // find file we just created in root directory
+        int fat_value = 1;
+        size_t num_entries = block_size / sizeof(directory_entry);
+        directory_entry dir_entry;
+
+        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+        if (root_dir_offset == -1) {
+            fprintf(stderr, "Failed to seek to root directory\n");
+            return -1;
+        }
+        // traverse through entire root directory (may be multiple blocks)
+        while (fat_value != 0xFFFF) {
+            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+            if (offset == -1) {
+                fprintf(stderr, "No more space left\n");
+                return -1;
+            }
+            for (int i = 0; i < num_entries; i++) {
+                int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+                if (read_bytes == -1) {
+                    fprintf(stderr, "Error reading directory entry\n");
+                    return -1;
+                }
+                // found the file in root directory
+                if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0) {
+                    int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
+                    if (directory_pos == -1) {
+                        fprintf(stderr, "Failed to seek to root directory\n");
+                        return -1;
+                    }
+                    int curr_fat_block = dir_entry.firstBlock;
+                    if (curr_fat_block == 0xFFFF) {
+                        curr_fat_block = fat_alloc(0);
+                        fat_set(curr_fat_block, 0xFFFF);
+                        dir_entry.firstBlock = curr_fat_block;
+                    }
+                    dir_entry.mtime = time(NULL);
+                    dir_entry.size = total_bytes_written;
+                        
+                    // update directory
+                    directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
+                    if (directory_pos == -1) {
+                        fprintf(stderr, "Failed to seek to root directory\n");
+                        return -1;
+                    }
+                    int write_bytes = write_dir_entry(&dir_entry);
+                    if (write_bytes == -1) {
+                        fprintf(stderr, "Error writing directory entry\n");
+                        return -1;
+                    }
+
+                    int next_fat_block = fat[curr_fat_block];
+
+                    // get input
+                    int i = 0;
+                    bool nullify = false;
+                    while (input[i] != '\0' && input[i] != '\n') {
+                        char block[block_size];
+                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
+                            if (input[i] == '\0' || input[i] == '\n') {
+                                block[j] = '\0';
+                                nullify = true;
+                                i++;
+                            } else if (nullify) {
+                                block[j] = '\0';
+                                i++;
+                            } else {
+                                block[j] = input[i];
+                                i++;
+                            }
+                        }
+
+                        // write to curr_fat_block
+                        int offset = lseek(fs_fd, fat_size + block_size * (curr_fat_block - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+                        int write_bytes = write(fs_fd, block, block_size);
+                        mark_block_dirty(curr_fat_block);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+
+                        // update FAT
+                        if (next_fat_block == 0xFFFF) { // no next block
+                            next_fat_block = fat_alloc(curr_fat_block + 1);
+                            fat_set(curr_fat_block, next_fat_block);
+                            fat_set(next_fat_block, 0xFFFF);
+                            curr_fat_block = next_fat_block;
+                            next_fat_block = 0xFFFF;
+                        } else { // available next block
+                            fat_set(curr_fat_block, next_fat_block);
+                            curr_fat_block = next_fat_block;
+                            next_fat_block = fat[curr_fat_block];
+                        }
+                    }
+                }
+            }
+            fat_value = fat[fat_value];
+        }
+    }
+    return 0;
+}
+
+// cat FILE ... -a OUTPUT_FILE
+// Concatenates the files and appends to OUTPUT_FILE.
+int cat_f_a(struct parsed_command *cmd) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    size_t data_region_size = block_size * (fat_size / 2 - 1);
+    char str[data_region_size]; // malloc instead
+    str[0] = '\0';
+    int length = 1;
+    int total_bytes_written = 0;
+    while (strcmp(cmd->commands[0][length], "-a") != 0) {
+        // find file in root directory
+        int fat_value = 1;
+        size_t num_entries = block_size / sizeof(directory_entry);
+        directory_entry dir_entry;
+
+        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+        if (root_dir_offset == -1) {
+            fprintf(stderr, "Failed to seek to root directory\n");
+            return -1;
+        }
+        // find the file in root directory (directory may be multiple blocks)
+        while (fat_value != 0xFFFF) {
+            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+            if (offset == -1) {
+                fprintf(stderr, "No more space left\n");
+                return -1;
+            }
+            for (int i = 0; i < num_entries; i++) {
+                int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+                if (read_bytes == -1) {
+                    fprintf(stderr, "Error reading directory entry\n");
+                    return -1;
+                }
+
+                // found the file in root directory
+                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
+                    total_bytes_written += dir_entry.size;
+                    int new_fat_value = dir_entry.firstBlock; // find first block of file
+                    if (dir_entry.firstBlock == 0xFFFF) {
+                        return 0; // nothing written to file yet
+                    }
+
+                    // traverse through blocks of file
+                    while (new_fat_value != 0xFFFF) {
+                        char b[block_size + 1];
+                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+
+                        int read_bytes = read(fs_fd, b, block_size);
+                        if (read_bytes == -1) {
+                            fprintf(stderr, "Error reading directory entry for destination\n");
+                            return -1;
+                        }
+
+                        // null terminate block
+                        b[block_size] = '\0';
+                        strcat(str, b);
+                        new_fat_value = fat[new_fat_value];
+                    }
+                }
+            }
+            fat_value = fat[fat_value];
+        }    
+        length++; 
+    }
+
+    // The output is written in one transaction
+    if (journal_reserve(2 * (strlen(str) / (block_size - 1) + 2), 2) == -1) {
+        return -1;
+    }
+
+    // find output file in root directory
+    int fat_value = 1;
+    size_t num_entries = block_size / sizeof(directory_entry);
+    directory_entry dir_entry;
+
+    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+    if (root_dir_offset == -1) {
+        fprintf(stderr, "Failed to seek to root directory\n");
+        return -1;
+    }
+    // traverse through entire root directory (may be multiple blocks)
+    while (fat_value != 0xFFFF) {
+        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+        if (offset == -1) {
+            fprintf(stderr, "No more space left\n");
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+            if (read_bytes == -1) {
+                fprintf(stderr, "Error reading directory entry\n");
+                return -1;
+            }
+
+            // found the file in root directory
+            if (strncmp(dir_entry.name, cmd->commands[0][length + 1], sizeof(dir_entry.name)) == 0 && read_bytes != 0) {  
+                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
+                if (directory_pos == -1) {
+                    fprintf(stderr, "Failed to seek to root directory\n");
+                    return -1;
+                }
+                int last_fat_block = dir_entry.firstBlock; // find first block of file
+                if (dir_entry.firstBlock != 0xFFFF) {
+                    while (fat[last_fat_block] != 0xFFFF) {
+                        // navigate to end of file
+                        last_fat_block = fat[last_fat_block];
+                    }
+                }
+
+                // The last block is rewritten in place, which a snapshot or another file must not see
+                if (last_fat_block != 0xFFFF && block_shared(last_fat_block)) {
+                    uint16_t first_block = dir_entry.firstBlock;
+                    last_fat_block = unshare_last_block(&dir_entry);
+                    if (last_fat_block == -1) {
+                        fprintf(stderr, "No more space left\n");
+                        return -1;
+                    }
+                    if (dir_entry.firstBlock != first_block && (lseek(fs_fd, directory_pos, SEEK_SET) == -1 || write_dir_entry(&dir_entry) == -1)) {
+                        fprintf(stderr, "Error writing directory entry\n");
+                        return -1;
+                    }
+                }
+
+                // get input
+                size_t len = 0;
+                int i = 0;
+                bool nullify = false;
+                bool append = dir_entry.firstBlock != 0xFFFF;
+
+                // print str
+                while (str[i] != '\0') {
+                    char block[block_size];
+                    if (append) {
+                        lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
+                        read(fs_fd, &block, block_size);
+                        int writeFrom = 0;
+                        while (block[writeFrom] != '\0') {
+                            writeFrom++;
+                        }
+                        for (int k = writeFrom; k < block_size / sizeof(char) - 1; k++) {
+                            if (str[i] == '\0') {
+                                block[k] = '\0';
+                                nullify = true;
+                                i++;
+                            } else if (nullify) {
+                                block[k] = '\0';
+                                i++;
+                            } else {
+                                block[k] = str[i];
+                                i++;
+                            }
+                        }
+                        lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
+                        write(fs_fd, block, block_size);
+                        mark_block_dirty(last_fat_block);
+
+                        append = false;
+                    } else {
+                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
+                            if (str[i] == '\0') {
+                                block[j] = '\0';
+                                nullify = true;
+                                i++;
+                            } else if (nullify) {
+                                block[j] = '\0';
+                                i++;
+                            } else {
+                                block[j] = str[i];
+                                i++;
+                            }
+                        }
+                        int new_fat_block = fat_alloc(last_fat_block + 1); // past the end of the FAT for an empty file
+                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_block - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+
+                        int write_bytes = write(fs_fd, block, block_size);
+                        mark_block_dirty(new_fat_block);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+                        // update FAT
+                        if (last_fat_block != 0xFFFF) { // not first entry
+                            fat_set(last_fat_block, new_fat_block);
+                        } else { // first entry
+                            dir_entry.firstBlock = new_fat_block;
+                        }
+                        dir_entry.mtime = time(NULL);   
+                        dir_entry.size += total_bytes_written;
+                        // update directory
+                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
+                        if (directory_pos == -1) {
+                            fprintf(stderr, "Failed to seek to root directory\n");
+                            return -1;
+                        }
+                        write_bytes = write_dir_entry(&dir_entry);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+
+
+                        fat_set(new_fat_block, 0xFFFF); // end of file
+                        last_fat_block = new_fat_block;
+                    }
+                }
+            }
+        }
+        fat_value = fat[fat_value];
+    }
+    return 0;
+}
+
+int cat_read_input(char *input, int length) {
+    int bytes_read = f_read(0, length - 1, input);
+    if (bytes_read == -1) {
+        input[0] = '\0';
+        return -1;
+    }
+    input[bytes_read] = '\0';
+    return bytes_read;
+}
+
+// cat -a OUTPUT_FILE
+// Appends the line read from the terminal to OUTPUT_FILE.
+int cat_a_f(struct parsed_command *cmd, const char *input) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    // find file in root directory
+    int fat_value = 1;
+    size_t num_entries = block_size / sizeof(directory_entry);
+    directory_entry dir_entry;
+    int total_bytes_written = 0;
+
+    int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+    if (root_dir_offset == -1) {
+        fprintf(stderr, "Failed to seek to root directory\n");
+        return -1;
+    }
+    // traverse through entire root directory (may be multiple blocks)
+    while (fat_value != 0xFFFF) {
+        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+        if (offset == -1) {
+            fprintf(stderr, "No more space left\n");
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+            if (read_bytes == -1) {
+                fprintf(stderr, "Error reading directory entry\n");
+                return -1;
+            }
+
+            // found the file in root directory
+            if (strncmp(dir_entry.name, cmd->commands[0][2], sizeof(dir_entry.name)) == 0) {   
+                int directory_pos = lseek(fs_fd, -sizeof(directory_entry), SEEK_CUR);
+                if (directory_pos == -1) {
+                    fprintf(stderr, "Failed to seek to root directory\n");
+                    return -1;
+                }
+                int last_fat_block = dir_entry.firstBlock; // find first block of file
+                if (dir_entry.firstBlock != 0xFFFF) {
                     while (fat[last_fat_block] != 0xFFFF) {
                         // navigate to end of file
                         last_fat_block = fat[last_fat_block];
                     }
                 }
 
-                // get input from stdin
-                char input[MAX_LINE_LENGTH];
-                int bytes_read = f_read(0, MAX_LINE_LENGTH, input);
-                int i = 0;
-                bool nullify = false;
-                bool append = dir_entry.firstBlock != 0xFFFF;
-                while (input[i] != '\0' && input[i] != '\n') {
-                    char block[block_size];
-                    if (append) {
-                        int seek_bytes = lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
-                        if (seek_bytes == -1) {
-                            fprintf(stderr, "Failed to seek to root directory\n");
-                            return -1;
-                        }
-                        int read_bytes = read(fs_fd, &block, block_size);
-                        if (read_bytes == -1) {
-                            fprintf(stderr, "Error reading directory entry\n");
-                            return -1;
-                        }
+                // The last block is rewritten in place, which a snapshot or another file must not see
+                if (last_fat_block != 0xFFFF && block_shared(last_fat_block)) {
+                    uint16_t first_block = dir_entry.firstBlock;
+                    last_fat_block = unshare_last_block(&dir_entry);
+                    if (last_fat_block == -1) {
+                        fprintf(stderr, "No more space left\n");
+                        return -1;
+                    }
+                    if (dir_entry.firstBlock != first_block && (lseek(fs_fd, directory_pos, SEEK_SET) == -1 || write_dir_entry(&dir_entry) == -1)) {
+                        fprintf(stderr, "Error writing directory entry\n");
+                        return -1;
+                    }
+                }
+
+                int i = 0;
+                bool nullify = false;
+                bool append = dir_entry.firstBlock != 0xFFFF;
+                while (input[i] != '\0' && input[i] != '\n') {
+                    char block[block_size];
+                    if (append) {
+                        int seek_bytes = lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
+                        if (seek_bytes == -1) {
+                            fprintf(stderr, "Failed to seek to root directory\n");
+                            return -1;
+                        }
+                        int read_bytes = read(fs_fd, &block, block_size);
+                        if (read_bytes == -1) {
+                            fprintf(stderr, "Error reading directory entry\n");
+                            return -1;
+                        }
+
+                        int writeFrom = 0;
+                        while (block[writeFrom] != '\0') {
+                            writeFrom++;
+                        }
+                        for (int k = writeFrom; k < block_size / sizeof(char) - 1; k++) {
+                            if (input[i] == '\0') {
+                                block[k] = '\0';
+                                nullify = true;
+                                i++;
+                            } else if (nullify) {
+                                block[k] = '\0';
+                                i++;
+                            } else {
+                                block[k] = input[i];
+                                i++;
+                                total_bytes_written++;
+                            }
+                        }
+                        seek_bytes = lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
+                        if (seek_bytes == -1) {
+                            fprintf(stderr, "Failed to seek to root directory\n");
+                            return -1;
+                        }
+                        int write_bytes = write(fs_fd, block, block_size);
+                        mark_block_dirty(last_fat_block);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+                        append = false;
+
+                        dir_entry.mtime = time(NULL); 
+                        dir_entry.size += total_bytes_written;
+                        total_bytes_written = 0;
+
+                        // update directory
+                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
+                        if (directory_pos == -1) {
+                            fprintf(stderr, "Failed to seek to root directory\n");
+                            return -1;
+                        }
+                        write_bytes = write_dir_entry(&dir_entry);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+                    } else {
+                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
+                            if (input[i] == '\0' || input[i] == '\n') {
+                                block[j] = '\0';
+                                nullify = true;
+                                i++;
+                            } else if (nullify) {
+                                block[j] = '\0';
+                                i++;
+                            } else {
+                                block[j] = input[i];
+                                i++;
+                                total_bytes_written++;
+                            }
+                        }
+                        int new_fat_block = fat_alloc(last_fat_block + 1); // past the end of the FAT for an empty file
+                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_block - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+
+                        int write_bytes = write(fs_fd, block, block_size);
+                        mark_block_dirty(new_fat_block);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+                        // update FAT
+                        if (last_fat_block != 0xFFFF) { // not first entry
+                            fat_set(last_fat_block, new_fat_block);
+                        } else { // first entry
+                            dir_entry.firstBlock = new_fat_block;   
+                        }
+                        dir_entry.mtime = time(NULL); 
+                        dir_entry.size += total_bytes_written;
+                        total_bytes_written = 0;
+
+                        // update directory
+                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
+                        if (directory_pos == -1) {
+                            fprintf(stderr, "Failed to seek to root directory\n");
+                            return -1;
+                        }
+                        write_bytes = write_dir_entry(&dir_entry);
+                        if (write_bytes == -1) {
+                            fprintf(stderr, "Error writing directory entry\n");
+                            return -1;
+                        }
+
+                        fat_set(new_fat_block, 0xFFFF); // end of file
+                        last_fat_block = new_fat_block;
+                    }
+                }
+            }
+        }
+        fat_value = fat[fat_value];
+    }
+    return 0;
+}
+
+// cat -w OUTPUT_FILE
+// Overwrites OUTPUT_FILE with the line read from the terminal.
+int cat_w_f(struct parsed_command *cmd, const char *input) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    directory_entry dir_entry;
+    off_t current_pos = find_file(cmd->commands[0][2], &dir_entry);
+    if (current_pos == -1) {
+        fprintf(stderr, "File not found\n");
+        return -1;
+    }
+
+    if (dir_entry.type == FT_SYSTEM) {
+        fprintf(stderr, "Permission denied\n");
+        return -1;
+    }
+
+    // Delete the destination FAT chain in the FAT
+    if (release_file(&dir_entry, current_pos) == -1) {
+        return -1;
+    }
+
+    // Replace our root directory entry
+    directory_entry dir_entry_reset;
+    memset(&dir_entry_reset, 0, sizeof(directory_entry));
+    memcpy(dir_entry_reset.name, dir_entry.name, sizeof(dir_entry.name));
+    dir_entry_reset.size = 0;
+    dir_entry_reset.firstBlock = 0xFFFF;
+    dir_entry_reset.lastBlock = 0xFFFF;
+    dir_entry_reset.type = FT_REGULAR;
+    dir_entry_reset.perm = 6;
+    dir_entry_reset.mtime = time(NULL);
+    lseek(fs_fd, current_pos, SEEK_SET); // Go back to the file entry
+    ssize_t bytes_written = write_dir_entry(&dir_entry_reset);
+    if (bytes_written == -1) {
+        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    cmd->commands[0][1] = "-a";
+    return cat_a_f(cmd, input);
+}
+
+// cat FILE ...
+// Concatenates the files and prints them to stdout by default
+int cat_f(struct parsed_command *cmd) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+    bool fileFound = false;
+    int length = 1;
+    while (cmd->commands[0][length] != NULL) {
+        // find file in root directory
+        int fat_value = 1;
+        size_t num_entries = block_size / sizeof(directory_entry);
+        directory_entry dir_entry;
+
+        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
+        if (root_dir_offset == -1) {
+            fprintf(stderr, "Failed to seek to root directory\n");
+            return -1;
+        }
+        
+
+        // find the file in root directory (directory may be multiple blocks)
+        while (fat_value != 0xFFFF) {
+            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+            if (offset == -1) {
+                fprintf(stderr, "No more space left\n");
+                return -1;
+            }
+            for (int i = 0; i < num_entries; i++) {
+                int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+                if (read_bytes == -1) {
+                    fprintf(stderr, "Error reading directory entry\n");
+                    return -1;
+                }
+
+                // found the file in root directory
+                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
+                    fileFound = true;
+                    // print contents of the file
+                    int new_fat_value = dir_entry.firstBlock; // find first block of file
+                    if (dir_entry.firstBlock == 0xFFFF) {
+                        break; // nothing written to file yet
+                    }
+
+                    // traverse through blocks of file
+                    while (new_fat_value != 0xFFFF) {
+                        char block[block_size];
+                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
+                        if (offset == -1) {
+                            fprintf(stderr, "No more space left\n");
+                            return -1;
+                        }
+
+                        int read_bytes = read(fs_fd, block, block_size);
+                        if (read_bytes == -1) {
+                            fprintf(stderr, "Error reading directory entry for destination\n");
+                            return -1;
+                        }
+                        new_fat_value = fat[new_fat_value];
+                        if (new_fat_value == 0xFFFF) {
+                            f_write(STDOUT_FILENO, block, dir_entry.size % block_size);
+                        } else {
+                            f_write(STDOUT_FILENO, block, block_size);
+                        }
+                        //fprintf(stderr, "%s", block);
+                    }
+                }
+            }
+            if (dir_entry.firstBlock == 0xFFFF) {
+                break;
+            }
+            fat_value = fat[fat_value];
+        }    
+        length++; 
+    }
+    if (!fileFound) {
+        fprintf(stderr, "File not found\n");
+        return -1;
+    }
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+int cat_all(struct parsed_command *cmd) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    int length = 1;
+    char input[MAX_LINE_LENGTH];
+    if (strcmp(cmd->commands[0][1], "-w") == 0) {
+        cat_read_input(input, sizeof(input));
+        return cat_w_f(cmd, input);
+    } else if (strcmp(cmd->commands[0][1], "-a") == 0) {
+        cat_read_input(input, sizeof(input));
+        return cat_a_f(cmd, input);
+    }
+
+    // get the last argument
+    while (cmd->commands[0][length] != NULL) {
+        length++;
+    }
+    
+    if (strcmp(cmd->commands[0][length - 2], "-w") == 0) {
+        return cat_f_w(cmd);
+    } else if (strcmp(cmd->commands[0][length - 2], "-a") == 0) {
+        return cat_f_a(cmd);
+    } else {
+        return cat_f(cmd);
+    }
+}
+
+int ls() {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    // Initialize num_entries and dir_entry buffer
+    size_t num_entries = block_size / sizeof(directory_entry);
+    directory_entry dir_entry;
+
+    int fat_value = 1;
+    while (fat_value != 0xFFFF) {
+        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
+        if (offset == -1) {
+            fprintf(stderr, "No more space left\n");
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            int read_bytes = dir_read(&dir_entry, sizeof(directory_entry), offset + i * sizeof(directory_entry));
+            if (read_bytes == -1) {
+                fprintf(stderr, "Error reading directory entry\n");
+                return -1;
+            }
+
+            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) != 0 && read_bytes != 0 && dir_entry.type != FT_SYSTEM) {
+                // print entry: first block number, permissions, size, month, day, time, and name.
+                struct tm *time_info = gmtime(&dir_entry.mtime);
+
+                char time_str[20]; // Adjust the size as needed
+                strftime(time_str, sizeof(time_str), "%b %d %H:%M", time_info);
+                char perm[4];
+                char perm_value[3];
+                sprintf(perm_value, "%d", dir_entry.perm);
+
+                if (strcmp(perm_value, "0") == 0) {
+                    strcpy(perm, "---");
+                } else if (strcmp(perm_value, "2") == 0) {
+                    strcpy(perm, "-w-");
+                } else if (strcmp(perm_value, "4") == 0) {
+                    strcpy(perm, "r--");
+                } else if (strcmp(perm_value, "5") == 0) {
+                    strcpy(perm, "r-x");
+                } else if (strcmp(perm_value, "6") == 0) {
+                    strcpy(perm, "rw-");
+                } else if (strcmp(perm_value, "7") == 0) {
+                    strcpy(perm, "rwx");
+                }
+                fprintf(stderr, "%d %s %d %s %s\n", dir_entry.firstBlock, perm, dir_entry.size, time_str, dir_entry.name);
+            }
+        }
+        fat_value = fat[fat_value];
+    }
+
+    return 0;
+}
+
+int fragstat() {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    int num_fat_entries = fat_num_entries();
+    size_t num_entries = block_size / sizeof(directory_entry);
+    directory_entry *entries = malloc(block_size);
+    bool *dir_blocks = calloc(num_fat_entries, sizeof(bool));
+    if (entries == NULL || dir_blocks == NULL) {
+        free(entries);
+        free(dir_blocks);
+        fprintf(stderr, "Failed to allocate memory\n");
+        return -1;
+    }
+    int num_files = 0, total_blocks = 0, total_runs = 0, num_dir_blocks = 0;
+    double total_avg_run = 0;
+
+    // Whole directory blocks at a time, straight from the image
+    fprintf(stderr, "%-31s %7s %7s %8s %7s\n", "file", "blocks", "extents", "avg run", "span");
+    for (int fat_value = 1; fat_value != 0xFFFF && fat_value < num_fat_entries && num_dir_blocks < num_fat_entries; fat_value = fat[fat_value]) {
+        dir_blocks[fat_value] = true;
+        num_dir_blocks++;
+        if (dir_pread(entries, block_size, fat_size + block_size * (fat_value - 1)) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            free(entries);
+            free(dir_blocks);
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            directory_entry *dir_entry = &entries[i];
+            // Files without blocks have nothing to fragment
+            if (dir_entry->name[0] == '\0' || dir_entry->firstBlock == 0 || dir_entry->firstBlock == 0xFFFF
+                || dir_entry->type == FT_SYSTEM) {
+                continue;
+            }
+
+            int num_blocks;
+            int runs = chain_runs(dir_entry->firstBlock, &num_blocks);
+            double avg_run = runs > 0 ? (double)num_blocks / runs : 0;
+            fprintf(stderr, "%-31.31s %7d %7d %8.2f %7d\n", dir_entry->name, num_blocks, runs, avg_run, chain_span(dir_entry->firstBlock));
+            total_avg_run += avg_run;
+            total_blocks += num_blocks;
+            total_runs += runs;
+            num_files++;
+        }
+    }
+    free(entries);
+
+    fprintf(stderr, "average run length: %.2f blocks over %d files, %.2f blocks per extent over %d extents\n",
+        num_files > 0 ? total_avg_run / num_files : 0, num_files, total_runs > 0 ? (double)total_blocks / total_runs : 0, total_runs);
+
+    // Free space as runs of free FAT entries, binned by powers of two
+    int free_runs[FRAGSTAT_FREE_BINS] = { 0 };
+    int free_blocks[FRAGSTAT_FREE_BINS] = { 0 };
+    int num_free = 0, num_free_runs = 0, largest_run = 0, largest_start = 0;
+    for (int block = 2; block < num_fat_entries; ) {
+        if (fat[block] != 0) {
+            block++;
+            continue;
+        }
+        int start = block;
+        while (block < num_fat_entries && fat[block] == 0) {
+            block++;
+        }
+        int length = block - start;
+        int bin = 31 - __builtin_clz(length);
+        bin = bin < FRAGSTAT_FREE_BINS ? bin : FRAGSTAT_FREE_BINS - 1;
+        free_runs[bin]++;
+        free_blocks[bin] += length;
+        num_free += length;
+        num_free_runs++;
+        if (length > largest_run) {
+            largest_run = length;
+            largest_start = start;
+        }
+    }
+    fprintf(stderr, "%d of %d blocks used, %d directory blocks\n", num_fat_entries - 1 - num_free, num_fat_entries - 1, num_dir_blocks);
+    fprintf(stderr, "free space: %d blocks in %d runs, largest run %d blocks at block %d\n", num_free, num_free_runs, largest_run, largest_start);
+    for (int bin = 0; bin < FRAGSTAT_FREE_BINS; bin++) {
+        if (free_runs[bin] > 0) {
+            fprintf(stderr, "  runs of %5d-%-5d %6d runs %7d blocks\n", 1 << bin, (1 << (bin + 1)) - 1, free_runs[bin], free_blocks[bin]);
+        }
+    }
+
+    // One character per cell of blocks: D holds directory blocks, otherwise how full the cell is
+    int num_cells = FRAGSTAT_MAP_ROWS * FRAGSTAT_MAP_COLUMNS;
+    int cell_blocks = (num_fat_entries - 1 + num_cells - 1) / num_cells;
+    fprintf(stderr, "map: %d blocks per cell, D directory, . free, 1-9 tenths used, # full\n", cell_blocks);
+    char row[FRAGSTAT_MAP_COLUMNS + 1];
+    for (int cell = 0; cell < num_cells && 1 + cell * cell_blocks < num_fat_entries; cell++) {
+        int used = 0, in_cell = 0;
+        bool has_dir = false;
+        for (int block = 1 + cell * cell_blocks; block < 1 + (cell + 1) * cell_blocks && block < num_fat_entries; block++) {
+            used += fat[block] != 0;
+            has_dir |= dir_blocks[block];
+            in_cell++;
+        }
+        char mark = has_dir ? 'D' : used == 0 ? '.' : used == in_cell ? '#' : '1' + (used * 9 / in_cell < 8 ? used * 9 / in_cell : 8);
+        row[cell % FRAGSTAT_MAP_COLUMNS] = mark;
+        if (cell % FRAGSTAT_MAP_COLUMNS == FRAGSTAT_MAP_COLUMNS - 1 || 1 + (cell + 1) * cell_blocks >= num_fat_entries) {
+            row[cell % FRAGSTAT_MAP_COLUMNS + 1] = '\0';
+            fprintf(stderr, "  %6d %s\n", 1 + (cell - cell % FRAGSTAT_MAP_COLUMNS) * cell_blocks, row);
+        }
+    }
+    free(dir_blocks);
+    return 0;
+}
+
+// Counts for every block the regular files whose chains reach it beyond the first, the way
+// dedup_open() does. Returns the counts, or NULL if the volume is not deduplicated.
+uint8_t *check_shared_blocks() {
+    if (volumes[current_volume].dedup_index == NULL) {
+        return NULL;
+    }
+    int num_fat_entries = fat_num_entries();
+    int num_entries = block_size / sizeof(directory_entry);
+    uint8_t *seen = calloc(num_fat_entries, 1);
+    uint8_t *shared = calloc(num_fat_entries, 1);
+    if (seen == NULL || shared == NULL) {
+        free(seen);
+        free(shared);
+        return NULL;
+    }
+    int root_blocks = 0;
+    for (int root_block = 1; root_block != 0xFFFF && root_block != 0 && root_block < num_fat_entries && root_blocks++ < num_fat_entries; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        if (dir_pread(dir_entries, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            break;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            if (dir_entries[i].name[0] == '\0' || dir_entries[i].type != FT_REGULAR) {
+                continue;
+            }
+            uint16_t block = dir_entries[i].firstBlock;
+            for (int blocks = 0; block != 0xFFFF && block != 0 && block < num_fat_entries && blocks < num_fat_entries; blocks++) {
+                if (seen[block] && shared[block] < UINT8_MAX) {
+                    shared[block]++;
+                }
+                seen[block] = 1;
+                block = fat[block];
+            }
+        }
+    }
+    free(seen);
+
+    // Blocks the live counts miss would be written in place, under the other files
+    uint8_t *dedup_refs = volumes[current_volume].dedup_refs;
+    for (int block = 0; dedup_refs != NULL && block < num_fat_entries; block++) {
+        if (dedup_refs[block] == 0) {
+            shared[block] = 0;
+        }
+    }
+    return shared;
+}
+
+// Walks one chain for check_volume(), claiming its blocks for owner. A regular file (can_share)
+// may join a chain claimed before only at a block shared lists as shared by deduplication.
+int check_chain(const char *name, uint16_t first_block, int owner, int *owners, const uint8_t *shared, bool can_share,
+    int min_blocks, int max_blocks, bool verbose) {
+    int num_fat_entries = fat_num_entries();
+    int problems = 0;
+    int blocks = 0;
+    bool joined = false;
+    uint16_t block = first_block;
+    while (block != 0 && block != 0xFFFF) {
+        if (block >= num_fat_entries) {
+            if (verbose) {
+                fprintf(stderr, "%s: chain points past the FAT (%d)\n", name, block);
+            }
+            problems++;
+            break;
+        }
+        if (shared != NULL && shared[block] != 0 && !can_share) {
+            if (verbose) {
+                fprintf(stderr, "%s: block %d is shared with deduplicated files\n", name, block);
+            }
+            problems++;
+            break;
+        }
+        if (joined || (owners[block] > 1 && owners[block] != owner && shared != NULL && shared[block] != 0 && can_share)) {
+            // Deduplicated files share the tail of their chains, which its first owner claimed
+            if (shared[block] == 0) {
+                if (verbose) {
+                    fprintf(stderr, "%s: block %d is in a shared tail but not counted as shared\n", name, block);
+                }
+                problems++;
+                break;
+            }
+            joined = true;
+            if (++blocks > num_fat_entries) {
+                if (verbose) {
+                    fprintf(stderr, "%s: shared tail loops back to block %d\n", name, block);
+                }
+                problems++;
+                break;
+            }
+            if (fat[block] == 0) {
+                if (verbose) {
+                    fprintf(stderr, "%s: chain runs into free block %d\n", name, block);
+                }
+                problems++;
+                break;
+            }
+            block = fat[block];
+            continue;
+        }
+        if (owners[block] != 0) {
+            if (verbose) {
+                fprintf(stderr, owners[block] == owner ? "%s: chain loops back to block %d\n" : "%s: block %d is cross-linked\n", name, block);
+            }
+            problems++;
+            break;
+        }
+        owners[block] = owner;
+        blocks++;
+        if (fat[block] == 0) {
+            if (verbose) {
+                fprintf(stderr, "%s: chain runs into free block %d\n", name, block);
+            }
+            problems++;
+            break;
+        }
+        block = fat[block];
+    }
+
+    if (blocks < min_blocks || (max_blocks >= 0 && blocks > max_blocks)) {
+        if (verbose) {
+            fprintf(stderr, "%s: %d blocks in the chain, the size needs %d\n", name, blocks, min_blocks);
+        }
+        problems++;
+    }
+    return problems;
+}
+
+int check_volume(bool verbose) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    int num_fat_entries = fat_num_entries();
+    int *owners = calloc(num_fat_entries, sizeof(int));
+    if (owners == NULL) {
+        return -1;
+    }
+
+    // The root directory first, so a file cross-linked with it is the one reported
+    uint8_t *shared = check_shared_blocks();
+    int problems = check_chain("root directory", 1, 1, owners, shared, false, 1, -1, verbose);
+    int num_entries = block_size / sizeof(directory_entry);
+    int owner = 2;
+    int root_blocks = 0;
+    for (int root_block = 1; root_block != 0xFFFF && root_block < num_fat_entries && owners[root_block] == 1 && root_blocks++ < num_fat_entries; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        if (dir_pread(dir_entries, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            free(owners);
+            free(shared);
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            directory_entry *dir_entry = &dir_entries[i];
+            if (dir_entry->name[0] == '\0') {
+                continue;
+            }
+            char name[sizeof(dir_entry->name) + 1] = { 0 };
+            memcpy(name, dir_entry->name, sizeof(dir_entry->name));
+            int min_blocks = (dir_entry->size + block_size - 1) / block_size;
+            int max_blocks = (dir_entry->allocSize + block_size - 1) / block_size;
+            problems += check_chain(name, dir_entry->firstBlock, owner++, owners, shared, dir_entry->type == FT_REGULAR,
+                min_blocks, max_blocks > min_blocks ? max_blocks : min_blocks, verbose);
+            if (dir_entry->lastBlock != 0 && dir_entry->lastBlock != chain_last(dir_entry->firstBlock)) {
+                if (verbose) {
+                    fprintf(stderr, "%s: last block is %d, but its chain ends at %d\n", name, dir_entry->lastBlock, chain_last(dir_entry->firstBlock));
+                }
+                problems++;
+            }
+        }
+    }
+
+    // Whatever is allocated but owned by nobody has leaked
+    int leaked = 0;
+    for (int block = 2; block < num_fat_entries; block++) {
+        if (fat[block] != 0 && owners[block] == 0) {
+            leaked++;
+        }
+    }
+    if (leaked > 0) {
+        if (verbose) {
+            fprintf(stderr, "%d blocks are allocated but in no file\n", leaked);
+        }
+        problems++;
+    }
+    free(owners);
+    free(shared);
+    return problems;
+}
 
-                        int writeFrom = 0;
-                        while (block[writeFrom] != '\0') {
-                            writeFrom++;
-                        }
-                        for (int k = writeFrom; k < block_size / sizeof(char) - 1; k++) {
-                            if (input[i] == '\0') {
-                                block[k] = '\0';
-                                nullify = true;
-                                i++;
-                            } else if (nullify) {
-                                block[k] = '\0';
-                                i++;
-                            } else {
-                                block[k] = input[i];
-                                i++;
-                                total_bytes_written++;
-                            }
-                        }
-                        seek_bytes = lseek(fs_fd, fat_size + block_size * (last_fat_block - 1), SEEK_SET);
-                        if (seek_bytes == -1) {
-                            fprintf(stderr, "Failed to seek to root directory\n");
-                            return -1;
-                        }
-                        int write_bytes = write(fs_fd, block, block_size);
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
-                        append = false;
+// Collects the file names of the snapshots on the selected volume, returns how many there are
+int snapshot_files(char files[MAX_SNAPSHOTS][32]) {
+    int num_entries = block_size / sizeof(directory_entry);
+    int count = 0;
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        if (dir_pread(dir_entries, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            if (dir_entries[i].type == FT_SYSTEM && strncmp(dir_entries[i].name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) == 0
+                && count < MAX_SNAPSHOTS) {
+                memcpy(files[count], dir_entries[i].name, 32);
+                files[count++][31] = '\0';
+            }
+        }
+    }
+    return count;
+}
 
-                        dir_entry.mtime = time(NULL); 
-                        dir_entry.size += total_bytes_written;
-                        total_bytes_written = 0;
+// Maps a snapshot file, setting length to its size
+snapshot_header *snapshot_map(const char *file_name, uint32_t *length) {
+    directory_entry dir_entry;
+    if (find_file(file_name, &dir_entry) == -1 || dir_entry.type != FT_SYSTEM) {
+        fprintf(stderr, "No snapshot named %s\n", file_name + strlen(SNAPSHOT_PREFIX));
+        return NULL;
+    }
+    *length = dir_entry.size;
+    return sysfile_map(file_name, dir_entry.size, false);
+}
 
-                        // update directory
-                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
-                        if (directory_pos == -1) {
-                            fprintf(stderr, "Failed to seek to root directory\n");
-                            return -1;
-                        }
-                        write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
-                    } else {
-                        for (int j = 0; j < block_size / sizeof(char) - 1; j++) {
-                            if (input[i] == '\0' || input[i] == '\n') {
-                                block[j] = '\0';
-                                nullify = true;
-                                i++;
-                            } else if (nullify) {
-                                block[j] = '\0';
-                                i++;
-                            } else {
-                                block[j] = input[i];
-                                i++;
-                                total_bytes_written++;
-                            }
-                        }
-                        int new_fat_block = find_new_fat();
-                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_block - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
-                            return -1;
-                        }
+// Adds delta to the count of every block the FAT copy of a snapshot holds
+void snapshot_refs(const uint16_t *snap_fat, int delta) {
+    uint8_t *snap_refs = volumes[current_volume].snap_refs;
+    int num_fat_entries = fat_num_entries();
+    for (int block = 2; block < num_fat_entries; block++) {
+        if (snap_fat[block] != 0) {
+            snap_refs[block] += delta;
+        }
+    }
+}
 
-                        int write_bytes = write(fs_fd, block, block_size);
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
-                        // update FAT
-                        if (last_fat_block != 0xFFFF) { // not first entry
-                            fat[last_fat_block] = new_fat_block;
-                        } else { // first entry
-                            dir_entry.firstBlock = new_fat_block;   
-                        }
-                        dir_entry.mtime = time(NULL); 
-                        dir_entry.size += total_bytes_written;
-                        total_bytes_written = 0;
+// Turns a snapshot name into the name of its file
+int snapshot_file_name(const char *name, char file_name[32]) {
+    if (name == NULL || name[0] == '\0' || strlen(SNAPSHOT_PREFIX) + strlen(name) >= 32) {
+        fprintf(stderr, "Invalid snapshot name %s\n", name != NULL ? name : "");
+        return -1;
+    }
+    sprintf(file_name, "%s%s", SNAPSHOT_PREFIX, name);
+    return 0;
+}
 
-                        // update directory
-                        directory_pos = lseek(fs_fd, directory_pos, SEEK_SET); // seek back to entry
-                        if (directory_pos == -1) {
-                            fprintf(stderr, "Failed to seek to root directory\n");
-                            return -1;
-                        }
-                        write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
-                        if (write_bytes == -1) {
-                            fprintf(stderr, "Error writing directory entry\n");
-                            return -1;
-                        }
+int snapshot_load() {
+    char files[MAX_SNAPSHOTS][32];
+    int count = snapshot_files(files);
+    free(volumes[current_volume].snap_refs);
+    volumes[current_volume].snap_refs = NULL;
+    if (count <= 0) {
+        return count;
+    }
+
+    volumes[current_volume].snap_refs = calloc(fat_num_entries(), 1);
+    if (volumes[current_volume].snap_refs == NULL) {
+        fprintf(stderr, "Failed to allocate snapshot reference counts\n");
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        uint32_t length;
+        snapshot_header *header = snapshot_map(files[i], &length);
+        if (header == NULL) {
+            return -1;
+        }
+        // A crash while it was taken leaves a snapshot without its magic, which holds nothing
+        if (header->magic == SNAPSHOT_MAGIC) {
+            snapshot_refs((uint16_t *)(header + 1), 1);
+        } else {
+            fprintf(stderr, "Snapshot %s is incomplete\n", files[i] + strlen(SNAPSHOT_PREFIX));
+        }
+        sysfile_unmap(header, length);
+    }
+    return count;
+}
+
+int snapshot_create(const char *name) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    char file_name[32];
+    directory_entry dir_entry;
+    if (snapshot_file_name(name, file_name) == -1) {
+        return -1;
+    }
+    if (find_file(file_name, &dir_entry) != -1) {
+        fprintf(stderr, "Snapshot %s already exists\n", name);
+        return -1;
+    }
+    char files[MAX_SNAPSHOTS][32];
+    if (snapshot_files(files) >= MAX_SNAPSHOTS) {
+        fprintf(stderr, "Too many snapshots\n");
+        return -1;
+    }
+
+    // The hole map stays live, so its blocks have to be in the FAT copy as well
+    if (hole_map == NULL && (hole_map = sysfile_map(HOLEMAP_NAME, (fat_num_entries() + 7) / 8, true)) == NULL) {
+        return -1;
+    }
+
+    // Creating the snapshot file may add a block to the root directory
+    int root_blocks = 1;
+    for (int root_block = fat[1]; root_block != 0xFFFF; root_block = fat[root_block]) {
+        root_blocks++;
+    }
+    uint32_t length = sizeof(snapshot_header) + fat_size + (root_blocks + 1) * block_size;
+    snapshot_header *header = sysfile_map(file_name, length, true);
+    if (header == NULL) {
+        return -1;
+    }
+
+    memcpy(header + 1, fat, fat_size);
+    char *root_copy = (char *)(header + 1) + fat_size;
+    uint32_t root_size = 0;
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        if (dir_pread(root_copy + root_size, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            sysfile_unmap(header, length);
+            return -1;
+        }
+        root_size += block_size;
+    }
+    header->root_size = root_size;
+    header->created = time(NULL);
+
+    // The magic goes last, so only a complete copy is ever taken for a snapshot
+    sysfile_sync(header, length);
+    header->magic = SNAPSHOT_MAGIC;
+    sysfile_sync(header, sizeof(snapshot_header));
+
+    if (volumes[current_volume].snap_refs == NULL) {
+        volumes[current_volume].snap_refs = calloc(fat_num_entries(), 1);
+        if (volumes[current_volume].snap_refs == NULL) {
+            fprintf(stderr, "Failed to allocate snapshot reference counts\n");
+            sysfile_unmap(header, length);
+            return -1;
+        }
+    }
+    snapshot_refs((uint16_t *)(header + 1), 1);
+    sysfile_unmap(header, length);
+    return journal_checkpoint();
+}
+
+int snapshot_list() {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    char files[MAX_SNAPSHOTS][32];
+    int count = snapshot_files(files);
+    int num_fat_entries = fat_num_entries();
+    for (int i = 0; i < count; i++) {
+        uint32_t length;
+        snapshot_header *header = snapshot_map(files[i], &length);
+        if (header == NULL) {
+            return -1;
+        }
+        const char *name = files[i] + strlen(SNAPSHOT_PREFIX);
+        if (header->magic != SNAPSHOT_MAGIC) {
+            fprintf(stderr, "%s incomplete\n", name);
+            sysfile_unmap(header, length);
+            continue;
+        }
+
+        // Blocks the live filesystem let go of and no other snapshot holds come back on delete
+        uint16_t *snap_fat = (uint16_t *)(header + 1);
+        int held = 0;
+        for (int block = 2; block < num_fat_entries; block++) {
+            if (snap_fat[block] != 0 && fat[block] == 0 && volumes[current_volume].snap_refs[block] == 1) {
+                held++;
+            }
+        }
+        char time_str[20];
+        strftime(time_str, sizeof(time_str), "%b %d %H:%M", gmtime(&header->created));
+        fprintf(stderr, "%s %s %d blocks held\n", time_str, name, held);
+        sysfile_unmap(header, length);
+    }
+    return count < 0 ? -1 : 0;
+}
+
+int snapshot_delete(const char *name) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    char file_name[32];
+    uint32_t length;
+    snapshot_header *header;
+    if (snapshot_file_name(name, file_name) == -1 || (header = snapshot_map(file_name, &length)) == NULL) {
+        return -1;
+    }
+    bool complete = header->magic == SNAPSHOT_MAGIC;
+    uint16_t *snap_fat = malloc(fat_size);
+    if (snap_fat == NULL) {
+        fprintf(stderr, "Failed to allocate buffer for %s\n", file_name);
+        sysfile_unmap(header, length);
+        return -1;
+    }
+    memcpy(snap_fat, header + 1, fat_size);
+    sysfile_unmap(header, length);
+
+    if (complete) {
+        snapshot_refs(snap_fat, -1);
+    }
+    directory_entry dir_entry;
+    off_t dir_position = find_file(file_name, &dir_entry);
+    release_chain(dir_entry.firstBlock);
+    memset(&dir_entry, 0, sizeof(directory_entry));
+    lseek(fs_fd, dir_position, SEEK_SET);
+    if (write_dir_entry(&dir_entry) != sizeof(directory_entry)) {
+        fprintf(stderr, "Error writing directory entry\n");
+        free(snap_fat);
+        return -1;
+    }
+
+    // The blocks the live filesystem freed while only this snapshot held them are free now
+    if (complete) {
+        int num_fat_entries = fat_num_entries();
+        for (int block = 2; block < num_fat_entries; block++) {
+            if (snap_fat[block] != 0 && fat[block] == 0) {
+                clear_block(block);
+            }
+        }
+    }
+    free(snap_fat);
+    return snapshot_load() == -1 ? -1 : 0; // Drops the counts once the last snapshot is gone
+}
+
+int snapshot_rollback(const char *name) {
+    if (fs_fd == -1) {
+        fprintf(stderr, "No filesystem is mounted\n");
+        return -1;
+    }
+
+    char file_name[32];
+    uint32_t length;
+    snapshot_header *header;
+    if (snapshot_file_name(name, file_name) == -1 || (header = snapshot_map(file_name, &length)) == NULL) {
+        return -1;
+    }
+    if (header->magic != SNAPSHOT_MAGIC) {
+        fprintf(stderr, "Snapshot %s is incomplete\n", name);
+        sysfile_unmap(header, length);
+        return -1;
+    }
+    char files_before[MAX_SNAPSHOTS][32];
+    int count_before = snapshot_files(files_before);
+
+    int num_fat_entries = fat_num_entries();
+    uint32_t root_size = header->root_size;
+    uint16_t *snap_fat = malloc(fat_size);
+    char *root_copy = malloc(root_size);
+    uint8_t *freed = calloc(num_fat_entries, 1);
+    if (snap_fat == NULL || root_copy == NULL || freed == NULL) {
+        fprintf(stderr, "Failed to allocate buffer for %s\n", file_name);
+        free(snap_fat);
+        free(root_copy);
+        free(freed);
+        sysfile_unmap(header, length);
+        return -1;
+    }
+    memcpy(snap_fat, header + 1, fat_size);
+    memcpy(root_copy, (char *)(header + 1) + fat_size, root_size);
+    sysfile_unmap(header, length);
+
+    // The rollback is one transaction: the FAT entries and directory entries that differ, and
+    // the chains of the snapshots it brings back only to delete them again
+    int num_fat = 0, num_dir = 0;
+    for (int block = 1; block < num_fat_entries; block++) {
+        if (fat[block] != snap_fat[block]) {
+            num_fat++;
+        }
+    }
+    int num_entries = block_size / sizeof(directory_entry);
+    uint32_t compared = 0;
+    for (int root_block = 1; root_block != 0xFFFF && compared < root_size; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        if (dir_pread(dir_entries, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            break;
+        }
+        directory_entry *snap_entries = (directory_entry *)(root_copy + compared);
+        for (int i = 0; i < num_entries; i++) {
+            if (memcmp(&dir_entries[i], &snap_entries[i], sizeof(directory_entry)) != 0) {
+                num_dir++;
+            }
+            if (snap_entries[i].type == FT_SYSTEM && strncmp(snap_entries[i].name, SNAPSHOT_PREFIX, strlen(SNAPSHOT_PREFIX)) == 0) {
+                num_dir++;
+                for (uint16_t block = snap_entries[i].firstBlock; block > 1 && block < num_fat_entries; block = snap_fat[block]) {
+                    num_fat++;
+                }
+            }
+        }
+        compared += block_size;
+    }
+    if (journal_reserve(num_fat, num_dir) == -1) {
+        fprintf(stderr, "Snapshot %s is too far back to roll back to\n", name);
+        free(snap_fat);
+        free(root_copy);
+        free(freed);
+        return -1;
+    }
+
+    // The index may not survive the rollback, it is mapped again once the directory is back
+    if (volumes[current_volume].dedup_index != NULL) {
+        sysfile_unmap(volumes[current_volume].dedup_index, volumes[current_volume].dedup_size);
+        volumes[current_volume].dedup_index = NULL;
+    }
+    if (volumes[current_volume].scrub != NULL) {
+        sysfile_unmap(volumes[current_volume].scrub, volumes[current_volume].scrub_size);
+        volumes[current_volume].scrub = NULL;
+    }
+
+    // Whatever the snapshot does not hold is free afterwards, once no other snapshot holds it either
+    for (int block = 2; block < num_fat_entries; block++) {
+        if (snap_fat[block] == 0 && (fat[block] != 0 || block_shared(block))) {
+            freed[block] = 1;
+        }
+    }
+    for (int block = 1; block < num_fat_entries; block++) {
+        if (fat[block] != snap_fat[block]) {
+            fat_set(block, snap_fat[block]);
+        }
+    }
+
+    // Shared data blocks were never written, only the root directory has to be copied back
+    uint32_t restored = 0;
+    for (int root_block = 1; root_block != 0xFFFF && restored < root_size; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        off_t block_offset = fat_size + (root_block - 1) * block_size;
+        if (dir_pread(dir_entries, block_size, block_offset) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            break;
+        }
+        directory_entry *snap_entries = (directory_entry *)(root_copy + restored);
+        for (int i = 0; i < num_entries; i++) {
+            if (memcmp(&dir_entries[i], &snap_entries[i], sizeof(directory_entry)) != 0) {
+                lseek(fs_fd, block_offset + i * sizeof(directory_entry), SEEK_SET);
+                write_dir_entry(&snap_entries[i]);
+            }
+        }
+        restored += block_size;
+    }
+    free(snap_fat);
+    free(root_copy);
+
+    // Snapshots deleted since this one was taken are back in the directory, but their blocks are gone
+    free(volumes[current_volume].snap_refs);
+    volumes[current_volume].snap_refs = NULL;
+    char files_after[MAX_SNAPSHOTS][32];
+    int count_after = snapshot_files(files_after);
+    for (int i = 0; i < count_after; i++) {
+        bool kept = false;
+        for (int j = 0; j < count_before && !kept; j++) {
+            kept = strcmp(files_after[i], files_before[j]) == 0;
+        }
+        directory_entry dir_entry;
+        off_t dir_position = find_file(files_after[i], &dir_entry);
+        if (!kept && dir_position != -1) {
+            release_chain(dir_entry.firstBlock);
+            memset(&dir_entry, 0, sizeof(directory_entry));
+            lseek(fs_fd, dir_position, SEEK_SET);
+            write_dir_entry(&dir_entry);
+        }
+    }
+
+    int loaded = snapshot_load();
+    if (dedup_open() == -1 || scrub_open() == -1) {
+        loaded = -1;
+    }
+    // What a pass under way has walked is gone, it starts over
+    scrub_header *scrub = volumes[current_volume].scrub;
+    if (scrub != NULL && scrub->magic == SCRUB_MAGIC && scrub->phase != SCRUB_IDLE) {
+        scrub->phase = SCRUB_IDLE;
+        scrub_begin();
+    }
+    for (int block = 2; block < num_fat_entries; block++) {
+        if (freed[block]) {
+            clear_block(block);
+        }
+    }
+    free(freed);
+    alloc_cursor = 2;
+    if (loaded == -1 || restored < root_size) {
+        return -1;
+    }
+    return journal_checkpoint();
+}
+
+// 64-bit hash of a block, chained through seed to cover the blocks after it
+uint64_t block_hash(const void *data, size_t n, uint64_t seed) {
+    const uint8_t *bytes = data;
+    uint64_t hash = seed ^ (n * 0x9E3779B97F4A7C15ULL);
+    for (; n >= 8; bytes += 8, n -= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash ^= word * 0xFF51AFD7ED558CCDULL;
+        hash = ((hash << 31) | (hash >> 33)) * 0xC4CEB9FE1A85EC53ULL;
+    }
+    for (; n > 0; bytes++, n--) {
+        hash = (hash ^ *bytes) * 0x100000001B3ULL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    return hash;
+}
 
-                        fat[new_fat_block] = 0xFFFF; // end of file
-                        last_fat_block = new_fat_block;
-                    }
+int dedup_open() {
+    pennfat_volume *volume = &volumes[current_volume];
+    free(volume->dedup_refs);
+    volume->dedup_refs = NULL;
+    if (volume->dedup_index == NULL) {
+        directory_entry dir_entry;
+        if (find_file(DEDUP_NAME, &dir_entry) == -1) {
+            return 0;
+        }
+        volume->dedup_index = sysfile_map(DEDUP_NAME, dir_entry.size, false);
+        if (volume->dedup_index == NULL) {
+            return -1;
+        }
+        volume->dedup_size = dir_entry.size;
+    }
+
+    // Sharing is not recorded anywhere, every chain is walked to count it
+    int num_fat_entries = fat_num_entries();
+    int num_entries = block_size / sizeof(directory_entry);
+    uint8_t *seen = calloc(num_fat_entries, 1);
+    volume->dedup_refs = calloc(num_fat_entries, 1);
+    if (seen == NULL || volume->dedup_refs == NULL) {
+        fprintf(stderr, "Failed to allocate deduplication reference counts\n");
+        free(seen);
+        return -1;
+    }
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        if (dir_pread(dir_entries, block_size, fat_size + (root_block - 1) * block_size) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
+            free(seen);
+            return -1;
+        }
+        for (int i = 0; i < num_entries; i++) {
+            if (dir_entries[i].name[0] == '\0') {
+                continue;
+            }
+            uint16_t block = dir_entries[i].firstBlock;
+            for (int blocks = 0; block != 0xFFFF && block != 0 && block < num_fat_entries && blocks < num_fat_entries; blocks++) {
+                if (seen[block] && volume->dedup_refs[block] < UINT8_MAX) {
+                    volume->dedup_refs[block]++;
                 }
+                seen[block] = 1;
+                block = fat[block];
             }
         }
-        fat_value = fat[fat_value];
     }
+    free(seen);
     return 0;
 }
 
-// cat -w OUTPUT_FILE
-// Reads from the terminal and overwrites OUTPUT_FILE.
-int cat_w_f(struct parsed_command *cmd) {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+// Creates the fingerprint index of the selected volume
+int dedup_create() {
+    pennfat_volume *volume = &volumes[current_volume];
+    uint32_t capacity = 1;
+    while (capacity < fat_num_entries()) {
+        capacity *= 2;
+    }
+    uint32_t length = sizeof(dedup_header) + capacity * sizeof(dedup_entry);
+    dedup_header *index = sysfile_map(DEDUP_NAME, length, true);
+    if (index == NULL) {
         return -1;
     }
+    index->magic = DEDUP_MAGIC;
+    index->capacity = capacity;
+    sysfile_sync(index, sizeof(dedup_header));
+    volume->dedup_index = index;
+    volume->dedup_size = length;
+    return dedup_open();
+}
 
-    directory_entry dir_entry;
-    off_t current_pos = find_file(cmd->commands[0][2], &dir_entry);
-    if (current_pos == -1) {
-        fprintf(stderr, "File not found\n");
+// Whether the chain from other holds the same tail_blocks blocks as the chain from block, the last one up to last_length
+bool tail_equal(uint16_t block, uint16_t other, int tail_blocks, int last_length) {
+    int num_fat_entries = fat_num_entries();
+    char data[block_size], other_data[block_size];
+    for (int i = 0; i < tail_blocks; i++) {
+        if (other == 0xFFFF || other >= num_fat_entries || fat[other] == 0 || volumes[current_volume].dedup_refs[other] == UINT8_MAX) {
+            return false;
+        }
+        int length = i == tail_blocks - 1 ? last_length : block_size;
+        if (block_read(block, 0, data, length) != length || block_read(other, 0, other_data, length) != length
+            || memcmp(data, other_data, length) != 0) {
+            return false;
+        }
+        block = fat[block];
+        other = fat[other];
+    }
+    return other == 0xFFFF;
+}
+
+// Remembers block as the start of a tail with the given hash
+void dedup_insert(uint64_t hash, uint16_t block) {
+    dedup_header *index = volumes[current_volume].dedup_index;
+    dedup_entry *entries = (dedup_entry *)(index + 1);
+    dedup_entry *slot = &entries[hash & (index->capacity - 1)];
+    for (int probe = 0; probe < DEDUP_PROBES; probe++) {
+        dedup_entry *entry = &entries[(hash + probe) & (index->capacity - 1)];
+        if (entry->block == 0 || entry->block == block) {
+            slot = entry;
+            break;
+        }
+    }
+    slot->tag = hash >> 32;
+    slot->block = block;
+}
+
+// Deduplicates one file, returns the number of blocks freed
+int dedup_file(directory_entry *dir_entry, off_t dir_position) {
+    dedup_header *index = volumes[current_volume].dedup_index;
+    if (index == NULL || dir_entry->type != FT_REGULAR || dir_entry->firstBlock == 0xFFFF || dir_entry->size == 0) {
+        return 0;
+    }
+
+    // Only chains that end with the file are shared, preallocated blocks are left alone
+    int num_fat_entries = fat_num_entries();
+    int num_blocks = (dir_entry->size + block_size - 1) / block_size;
+    uint16_t *blocks = malloc(num_blocks * sizeof(uint16_t));
+    uint64_t *hashes = malloc(num_blocks * sizeof(uint64_t));
+    if (blocks == NULL || hashes == NULL) {
+        fprintf(stderr, "Failed to allocate buffer for %s\n", dir_entry->name);
+        free(blocks);
+        free(hashes);
         return -1;
     }
+    int chain_blocks = 0;
+    for (uint16_t block = dir_entry->firstBlock; block != 0xFFFF && block < num_fat_entries; block = fat[block]) {
+        if (chain_blocks == num_blocks) {
+            chain_blocks++;
+            break;
+        }
+        blocks[chain_blocks++] = block;
+    }
+    if (chain_blocks != num_blocks) {
+        free(blocks);
+        free(hashes);
+        return 0;
+    }
 
-    // Delete the destination FAT chain in the FAT
-    uint16_t fat_value = dir_entry.firstBlock;
-    while (fat_value != 0xFFFF) {
-        lseek(fs_fd, fat_size + ((fat_value - 1) * block_size), SEEK_SET); // Seek to the block to delete
-        char zero_block[block_size];
-        memset(zero_block, 0, block_size);
-        write(fs_fd, zero_block, block_size); // Zero out the block
+    // Hash from the end back, so that each hash covers the whole tail after its block
+    int last_length = dir_entry->size - (num_blocks - 1) * block_size;
+    char data[block_size];
+    uint64_t hash = 0;
+    for (int i = num_blocks - 1; i >= 0; i--) {
+        int length = i == num_blocks - 1 ? last_length : block_size;
+        if (block_read(blocks[i], 0, data, length) != length) {
+            fprintf(stderr, "Error reading %s\n", dir_entry->name);
+            free(blocks);
+            free(hashes);
+            return -1;
+        }
+        hash = hashes[i] = block_hash(data, length, hash);
+    }
 
-        // Update FAT entries
-        uint16_t next_fat_value = fat[fat_value];
-        fat[fat_value] = 0;
-        fat_value = next_fat_value;
+    // Find the longest tail another file already holds. Past a block shared with
+    // other files, relinking would change their chains as well.
+    dedup_entry *entries = (dedup_entry *)(index + 1);
+    int match = -1;
+    uint16_t match_block = 0;
+    for (int i = 0; i < num_blocks && match == -1 && (i == 0 || !block_deduped(blocks[i - 1])); i++) {
+        for (int probe = 0; probe < DEDUP_PROBES && match == -1; probe++) {
+            dedup_entry *entry = &entries[(hashes[i] + probe) & (index->capacity - 1)];
+            if (entry->block != 0 && entry->block != blocks[i] && entry->tag == (uint32_t)(hashes[i] >> 32)
+                && tail_equal(blocks[i], entry->block, num_blocks - i, last_length)) {
+                match = i;
+                match_block = entry->block;
+            }
+        }
+    }
+    for (int i = 0; i < (match == -1 ? num_blocks : match); i++) {
+        dedup_insert(hashes[i], blocks[i]);
+    }
+    if (match == -1) {
+        free(blocks);
+        free(hashes);
+        return 0;
     }
 
-    // Replace our root directory entry
-    directory_entry dir_entry_reset;
-    memcpy(dir_entry_reset.name, dir_entry.name, sizeof(dir_entry.name));
-    dir_entry_reset.size = 0;
-    dir_entry_reset.firstBlock = 0xFFFF;
-    dir_entry_reset.type = 1;
-    dir_entry_reset.perm = 6;
-    dir_entry_reset.mtime = time(NULL);
-    lseek(fs_fd, current_pos, SEEK_SET); // Go back to the file entry
-    ssize_t bytes_written = write(fs_fd, &dir_entry_reset, sizeof(directory_entry));
-    if (bytes_written == -1) {
-        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+    // The file takes the other tail, then lets go of its own
+    int freed = 0;
+    for (int i = match; i < num_blocks; i++) {
+        if (!block_deduped(blocks[i])) {
+            freed++;
+        }
+    }
+    if (!journal_fits(1 + freed, 1) && (journal_split() == -1 || !journal_fits(1 + freed, 1))) {
+        // Too long a tail to give back in one transaction, the file keeps it
+        free(blocks);
+        free(hashes);
+        return 0;
+    }
+    uint8_t *dedup_refs = volumes[current_volume].dedup_refs;
+    for (uint16_t block = match_block; block != 0xFFFF; block = fat[block]) {
+        dedup_refs[block]++;
+    }
+    uint16_t last_block = dir_entry->lastBlock;
+    if (match == 0) {
+        dir_entry->firstBlock = match_block;
+    } else {
+        fat_set(blocks[match - 1], match_block);
+    }
+    dir_entry->lastBlock = chain_last(match_block);
+    lseek(fs_fd, dir_position, SEEK_SET);
+    if (write_dir_entry(dir_entry) != sizeof(directory_entry)) {
+        // The entry may still name the old tail, which stays the file's
+        fprintf(stderr, "Error writing directory entry\n");
+        if (match == 0) {
+            dir_entry->firstBlock = blocks[0];
+        } else {
+            fat_set(blocks[match - 1], blocks[match]);
+        }
+        dir_entry->lastBlock = last_block;
+        for (uint16_t block = match_block; block != 0xFFFF; block = fat[block]) {
+            dedup_refs[block]--;
+        }
+        free(blocks);
+        free(hashes);
         return -1;
     }
+    release_chain(blocks[match]);
+    free(blocks);
+    free(hashes);
+    return freed;
+}
 
-    cmd->commands[0][1] = "-a";
-    return cat_a_f(cmd);
+int dedup_name(const char *fs_name) {
+    if (volumes[current_volume].dedup_index == NULL) {
+        return 0;
+    }
+    directory_entry dir_entry;
+    off_t dir_position = find_file(fs_name, &dir_entry);
+    if (dir_position == -1) {
+        return 0;
+    }
+    return dedup_file(&dir_entry, dir_position);
 }
 
-// cat FILE ...
-// Concatenates the files and prints them to stdout by default
-int cat_f(struct parsed_command *cmd) {
+int dedup() {
     if (fs_fd == -1) {
         fprintf(stderr, "No filesystem is mounted\n");
         return -1;
     }
-    bool fileFound = false;
-    int length = 1;
-    while (cmd->commands[0][length] != NULL) {
-        // find file in root directory
-        int fat_value = 1;
-        size_t num_entries = block_size / sizeof(directory_entry);
-        directory_entry dir_entry;
+    if (volumes[current_volume].dedup_index == NULL && dedup_create() == -1) {
+        return -1;
+    }
 
-        int root_dir_offset = lseek(fs_fd, fat_size, SEEK_SET);
-        if (root_dir_offset == -1) {
-            fprintf(stderr, "Failed to seek to root directory\n");
+    int num_entries = block_size / sizeof(directory_entry);
+    int num_files = 0;
+    int freed = 0;
+    for (int root_block = 1; root_block != 0xFFFF; root_block = fat[root_block]) {
+        directory_entry dir_entries[num_entries];
+        off_t block_offset = fat_size + (root_block - 1) * block_size;
+        if (dir_pread(dir_entries, block_size, block_offset) != block_size) {
+            fprintf(stderr, "Error reading directory entry\n");
             return -1;
         }
-        
-
-        // find the file in root directory (directory may be multiple blocks)
-        while (fat_value != 0xFFFF) {
-            int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-            if (offset == -1) {
-                fprintf(stderr, "No more space left\n");
+        for (int i = 0; i < num_entries; i++) {
+            if (dir_entries[i].name[0] == '\0' || dir_entries[i].type != FT_REGULAR) {
+                continue;
+            }
+            int file_freed = dedup_file(&dir_entries[i], block_offset + i * sizeof(directory_entry));
+            if (file_freed == -1) {
                 return -1;
             }
-            for (int i = 0; i < num_entries; i++) {
-                int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-                if (read_bytes == -1) {
-                    fprintf(stderr, "Error reading directory entry\n");
-                    return -1;
-                }
-
-                // found the file in root directory
-                if (strncmp(dir_entry.name, cmd->commands[0][length], sizeof(dir_entry.name)) == 0) {
-                    fileFound = true;
-                    // print contents of the file
-                    int new_fat_value = dir_entry.firstBlock; // find first block of file
-                    if (dir_entry.firstBlock == 0xFFFF) {
-                        break; // nothing written to file yet
-                    }
+            freed += file_freed;
+            num_files++;
+        }
+    }
 
-                    // traverse through blocks of file
-                    while (new_fat_value != 0xFFFF) {
-                        char block[block_size];
-                        int offset = lseek(fs_fd, fat_size + block_size * (new_fat_value - 1), SEEK_SET);
-                        if (offset == -1) {
-                            fprintf(stderr, "No more space left\n");
-                            return -1;
-                        }
+    // Every reference beyond the first is a block the volume would otherwise need
+    int shared = 0;
+    long saved = 0;
+    for (int block = 2; block < fat_num_entries(); block++) {
+        if (volumes[current_volume].dedup_refs[block] != 0) {
+            shared++;
+            saved += volumes[current_volume].dedup_refs[block];
+        }
+    }
+    fprintf(stderr, "%d files, %d blocks reclaimed (%d bytes), %d blocks shared saving %ld bytes in total\n",
+        num_files, freed, freed * block_size, shared, saved * block_size);
+    return freed;
+}
 
-                        int read_bytes = read(fs_fd, block, block_size);
-                        if (read_bytes == -1) {
-                            fprintf(stderr, "Error reading directory entry for destination\n");
-                            return -1;
-                        }
-                        new_fat_value = fat[new_fat_value];
-                        if (new_fat_value == 0xFFFF) {
-                            f_write(STDOUT_FILENO, block, dir_entry.size % block_size);
-                        } else {
-                            f_write(STDOUT_FILENO, block, block_size);
-                        }
-                        //fprintf(stderr, "%s", block);
-                    }
-                }
-            }
-            if (dir_entry.firstBlock == 0xFFFF) {
-                break;
-            }
-            fat_value = fat[fat_value];
-        }    
-        length++; 
+int scrub_open() {
+    pennfat_volume *volume = &volumes[current_volume];
+    // Nothing walked before the mount can be trusted to be unchanged
+    volume->scrub_fat_writes = volume->fat_writes - 1;
+    volume->scrub_restarts = 0;
+    if (volume->scrub != NULL) {
+        return 0;
     }
-    if (!fileFound) {
-        fprintf(stderr, "File not found\n");
+    directory_entry dir_entry;
+    if (find_file(SCRUB_NAME, &dir_entry) == -1) {
+        return 0;
+    }
+    volume->scrub = sysfile_map(SCRUB_NAME, dir_entry.size, false);
+    if (volume->scrub == NULL) {
         return -1;
     }
-    fprintf(stderr, "\n");
+    volume->scrub_size = dir_entry.size;
     return 0;
 }
 
-int cat_all(struct parsed_command *cmd) {
+scrub_header *scrub_begin() {
     if (fs_fd == -1) {
         fprintf(stderr, "No filesystem is mounted\n");
-        return -1;
+        return NULL;
     }
-
-    int length = 1;
-    if (strcmp(cmd->commands[0][1], "-w") == 0) {
-        return cat_w_f(cmd);
-    } else if (strcmp(cmd->commands[0][1], "-a") == 0) {
-        return cat_a_f(cmd);
+    pennfat_volume *volume = &volumes[current_volume];
+    uint32_t bitmap_size = (fat_num_entries() + 7) / 8;
+    if (volume->scrub == NULL) {
+        uint32_t length = sizeof(scrub_header) + bitmap_size;
+        if ((volume->scrub = sysfile_map(SCRUB_NAME, length, true)) == NULL) {
+            return NULL;
+        }
+        volume->scrub_size = length;
     }
 
-    // get the last argument
-    while (cmd->commands[0][length] != NULL) {
-        length++;
+    scrub_header *scrub = volume->scrub;
+    if (scrub->magic != SCRUB_MAGIC || volume->scrub_size < sizeof(scrub_header) + bitmap_size) {
+        if (volume->scrub_size < sizeof(scrub_header) + bitmap_size) {
+            fprintf(stderr, "%s is too small for the volume\n", SCRUB_NAME);
+            return NULL;
+        }
+        memset(scrub, 0, sizeof(scrub_header));
+        scrub->magic = SCRUB_MAGIC;
     }
-    
-    if (strcmp(cmd->commands[0][length - 2], "-w") == 0) {
-        return cat_f_w(cmd);
-    } else if (strcmp(cmd->commands[0][length - 2], "-a") == 0) {
-        return cat_f_a(cmd);
-    } else {
-        return cat_f(cmd);
+    if (scrub->phase == SCRUB_IDLE) {
+        memset(scrub + 1, 0, bitmap_size);
+        memset(&scrub->current, 0, sizeof(scrub_counts));
+        scrub->cursor = 0;
+        scrub->chain_block = 0;
+        scrub->chain_length = 0;
+        scrub->started = time(NULL);
+        volume->scrub_restarts = 0;
+        scrub->phase = SCRUB_CHAINS;
     }
+    return scrub;
 }
 
-int ls() {
-    if (fs_fd == -1) {
-        fprintf(stderr, "No filesystem is mounted\n");
+// Walks a chain from block for at most *budget blocks, or to its end if whole is set,
+// marking its blocks reached. Returns the block to resume at, 0xFFFF once the chain
+// ended, or -1 if it is broken.
+int scrub_chain(const char *name, uint16_t block, int *budget, bool whole, FILE *report) {
+    scrub_header *scrub = volumes[current_volume].scrub;
+    uint8_t *reached = (uint8_t *)(scrub + 1);
+    const char *label = volumes[current_volume].label;
+    int num_fat_entries = fat_num_entries();
+    while (block != 0 && block != 0xFFFF) {
+        if (*budget <= 0 && !whole) {
+            return block;
+        }
+        if (block >= num_fat_entries) {
+            fprintf(report, "%s:%s: chain points past the FAT (%d)\n", label, name, block);
+            return -1;
+        }
+        if (scrub->chain_length >= (uint32_t)num_fat_entries) {
+            fprintf(report, "%s:%s: chain never ends\n", label, name);
+            return -1;
+        }
+        reached[block / 8] |= 1 << (block % 8);
+        scrub->chain_length++;
+        (*budget)--;
+        if (fat[block] == 0) {
+            fprintf(report, "%s:%s: chain runs into free block %d\n", label, name, block);
+            return -1;
+        }
+        block = fat[block];
+    }
+    return 0xFFFF;
+}
+
+int scrub_step(int budget, FILE *report) {
+    pennfat_volume *volume = &volumes[current_volume];
+    scrub_header *scrub = volume->scrub;
+    if (fs_fd == -1 || scrub == NULL || scrub->magic != SCRUB_MAGIC || scrub->phase == SCRUB_IDLE) {
+        fprintf(stderr, "No scrub pass is under way\n");
         return -1;
     }
+    uint8_t *reached = (uint8_t *)(scrub + 1);
+    int num_fat_entries = fat_num_entries();
+    int num_entries = block_size / sizeof(directory_entry);
+
+    // The chain being walked may have been freed or relinked since the last step
+    if (volume->fat_writes != volume->scrub_fat_writes && scrub->chain_block != 0) {
+        scrub->chain_block = 0;
+        scrub->chain_length = 0;
+        volume->scrub_restarts++;
+    }
 
-    // Initialize num_entries and dir_entry buffer
-    size_t num_entries = block_size / sizeof(directory_entry);
-    directory_entry dir_entry;
+    // Slot 0 stands for the root directory itself, the directory slots follow
+    while (scrub->phase == SCRUB_CHAINS && budget > 0) {
+        directory_entry dir_entry;
+        if (scrub->cursor == 0) {
+            memset(&dir_entry, 0, sizeof(directory_entry));
+            strcpy(dir_entry.name, "root directory");
+            dir_entry.firstBlock = 1;
+        } else {
+            int slot = scrub->cursor - 1;
+            int root_block = 1;
+            for (int i = 0; i < slot / num_entries && root_block != 0 && root_block != 0xFFFF && root_block < num_fat_entries; i++) {
+                root_block = fat[root_block];
+            }
+            if (root_block == 0 || root_block == 0xFFFF || root_block >= num_fat_entries || slot / num_entries >= num_fat_entries) {
+                scrub->phase = SCRUB_BLOCKS;
+                scrub->cursor = 1;
+                break;
+            }
+            off_t position = fat_size + (root_block - 1) * block_size + (slot % num_entries) * sizeof(directory_entry);
+            if (dir_pread(&dir_entry, sizeof(directory_entry), position) != sizeof(directory_entry)) {
+                fprintf(report, "%s: cannot read directory slot %d: %s\n", volume->label, slot, strerror(errno));
+                scrub->current.io_errors++;
+                scrub->cursor++;
+                continue;
+            }
+            if (dir_entry.name[0] == '\0') {
+                scrub->cursor++;
+                continue;
+            }
+        }
 
-    int fat_value = 1;
-    while (fat_value != 0xFFFF) {
-        int offset = lseek(fs_fd, fat_size + block_size * (fat_value - 1), SEEK_SET);
-        if (offset == -1) {
-            fprintf(stderr, "No more space left\n");
-            return -1;
+        char name[sizeof(dir_entry.name) + 1] = { 0 };
+        memcpy(name, dir_entry.name, sizeof(dir_entry.name));
+        uint16_t block = scrub->chain_block != 0 ? scrub->chain_block : dir_entry.firstBlock;
+        // A chain that keeps changing under the walk is walked in one go
+        int next = scrub_chain(name, block, &budget, volume->scrub_restarts >= SCRUB_RESTARTS, report);
+        if (next != 0xFFFF && next != -1) {
+            scrub->chain_block = next;
+            break;
         }
-        for (int i = 0; i < num_entries; i++) {
-            int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-            if (read_bytes == -1) {
-                fprintf(stderr, "Error reading directory entry\n");
-                return -1;
-            }
 
-            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) != 0 && read_bytes != 0) {
-                // print entry: first block number, permissions, size, month, day, time, and name.
-                struct tm *time_info = gmtime(&dir_entry.mtime);
+        if (next == -1) {
+            scrub->current.bad_chains++;
+        } else if (scrub->cursor != 0) {
+            uint32_t min_blocks = (dir_entry.size + block_size - 1) / block_size;
+            uint32_t max_blocks = (dir_entry.allocSize + block_size - 1) / block_size;
+            if (scrub->chain_length < min_blocks || scrub->chain_length > (max_blocks > min_blocks ? max_blocks : min_blocks)) {
+                fprintf(report, "%s:%s: %u blocks in the chain, the size needs %u\n", volume->label, name, scrub->chain_length, min_blocks);
+                scrub->current.bad_sizes++;
+            }
+        }
+        if (scrub->cursor != 0) {
+            scrub->current.files++;
+        }
+        scrub->cursor++;
+        scrub->chain_block = 0;
+        scrub->chain_length = 0;
+        volume->scrub_restarts = 0;
+    }
 
-                char time_str[20]; // Adjust the size as needed
-                strftime(time_str, sizeof(time_str), "%b %d %H:%M", time_info);
-                char perm[4];
-                char perm_value[3];
-                sprintf(perm_value, "%d", dir_entry.perm);
+    // Runs of allocated blocks are read with one pread, the free entries in between cost little
+    if (scrub->phase == SCRUB_BLOCKS && budget > 0) {
+        char *buffer = malloc((size_t)budget * block_size);
+        if (buffer == NULL) {
+            fprintf(stderr, "Failed to allocate scrub buffer\n");
+            return -1;
+        }
+        for (int scanned = 0; budget > 0 && scrub->cursor < (uint32_t)num_fat_entries && scanned < budget * 64; ) {
+            uint32_t first = scrub->cursor;
+            int run = 0;
+            while (first + run < (uint32_t)num_fat_entries && fat[first + run] != 0 && run < budget) {
+                run++;
+            }
+            if (run == 0) {
+                scrub->cursor++;
+                scanned++;
+                continue;
+            }
 
-                if (strcmp(perm_value, "0") == 0) {
-                    strcpy(perm, "---");
-                } else if (strcmp(perm_value, "2") == 0) {
-                    strcpy(perm, "-w-");
-                } else if (strcmp(perm_value, "4") == 0) {
-                    strcpy(perm, "r--");
-                } else if (strcmp(perm_value, "5") == 0) {
-                    strcpy(perm, "r-x");
-                } else if (strcmp(perm_value, "6") == 0) {
-                    strcpy(perm, "rw-");
-                } else if (strcmp(perm_value, "7") == 0) {
-                    strcpy(perm, "rwx");
+            if (pread(fs_fd, buffer, (size_t)run * block_size, fat_size + (first - 1) * block_size) != (ssize_t)run * block_size) {
+                // Find out which blocks the host cannot read
+                for (int i = 0; i < run; i++) {
+                    if (pread(fs_fd, buffer, block_size, fat_size + (first + i - 1) * block_size) != block_size) {
+                        fprintf(report, "%s: cannot read block %u: %s\n", volume->label, first + i, strerror(errno));
+                        scrub->current.io_errors++;
+                    }
                 }
-                fprintf(stderr, "%d %s %d %s %s\n", dir_entry.firstBlock, perm, dir_entry.size, time_str, dir_entry.name);
             }
+            for (uint32_t block = first; block < first + run; block++) {
+                if (!(reached[block / 8] & (1 << (block % 8)))) {
+                    fprintf(report, "%s: block %u is allocated but in no file\n", volume->label, block);
+                    scrub->current.leaked++;
+                }
+            }
+            scrub->current.blocks += run;
+            scrub->cursor += run;
+            scanned += run;
+            budget -= run;
+        }
+        free(buffer);
+
+        if (scrub->cursor >= (uint32_t)num_fat_entries) {
+            scrub->last = scrub->current;
+            scrub->passes++;
+            scrub->finished = time(NULL);
+            scrub->phase = SCRUB_IDLE;
+            sysfile_sync(scrub, volume->scrub_size);
+            return 1;
         }
-        fat_value = fat[fat_value];
     }
-
+    volume->scrub_fat_writes = volume->fat_writes;
     return 0;
 }
 
@@ -1605,7 +4891,7 @@ int chmod(const char* mode, const char* fs_name) {
         }
 
         for (size_t i = 0; i < num_entries; i++) {
-            ssize_t read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
+            ssize_t read_bytes = dir_read(&dir_entry, sizeof(directory_entry), root_dir_offset + i * sizeof(directory_entry));
             if (read_bytes == -1) {
                 fprintf(stderr, "Error reading directory entry\n");
                 return -1;
@@ -1613,6 +4899,11 @@ int chmod(const char* mode, const char* fs_name) {
 
             // Found file
             if (strncmp(dir_entry.name, fs_name, sizeof(dir_entry.name)) == 0) {
+                if (dir_entry.type == FT_SYSTEM) {
+                    fprintf(stderr, "Permission denied\n");
+                    return -1;
+                }
+
                 // Save position of fs_name 
                 off_t current_pos = lseek(fs_fd, 0, SEEK_CUR);
 
@@ -1651,7 +4942,7 @@ int chmod(const char* mode, const char* fs_name) {
 
                 // Write out directory entry
                 lseek(fs_fd, current_pos - sizeof(directory_entry), SEEK_SET); // Go back to the file entry
-                write(fs_fd, &dir_entry, sizeof(directory_entry)); // Write to file to delete the entry
+                write_dir_entry(&dir_entry); // Write to file to delete the entry
                 return 0;
             }
         }
@@ -24,8 +24,10 @@
 #include <stdint.h>
 #include <sys/mman.h>
 #include <time.h>
+#include <dirent.h>
 #include "p_pennos.h"
 #include "parser.h"
+#include "iopool.h"
 
 /**
  * @struct directory_entry
@@ -38,11 +40,560 @@ typedef struct {
     uint8_t type;         /**< The type of the file. */
     uint8_t perm;         /**< File permissions. */
     time_t mtime;         /**< Creation/modification time. */
-    char reserved[16];    /**< Reserved for future use or extra credits. */
+    uint32_t allocSize;   /**< Bytes preallocated by f_fallocate, independent of size. */
+    uint16_t lastBlock;   /**< The last block of the chain, 0xFFFF for an empty file or 0 if not known (older images). */
+    char reserved[10];    /**< Reserved for future use or extra credits. */
 } directory_entry;
 
+/**
+ * @def FT_REGULAR
+ * @brief Directory entry type of an ordinary file.
+ */
+#define FT_REGULAR 1
+
+/**
+ * @def FT_SYSTEM
+ * @brief Directory entry type of a hidden file holding filesystem metadata. System
+ * files are contiguous, not listed by ls and cannot be removed, renamed or chmodded.
+ */
+#define FT_SYSTEM 8
+
+/**
+ * @def HOLEMAP_NAME
+ * @brief Name of the system file holding one bit per block, set while the block
+ * is a hole: linked into a sparse file but never written, so it reads as zeros.
+ */
+#define HOLEMAP_NAME ".holemap"
+
+/**
+ * @def JOURNAL_NAME
+ * @brief Name of the system file holding the metadata journal, created by mkfs.
+ */
+#define JOURNAL_NAME ".journal"
+
+/**
+ * @def JOURNAL_MAGIC
+ * @brief Marks a formatted journal ("PFJ1").
+ */
+#define JOURNAL_MAGIC 0x314A4650
+
+/**
+ * @def JOURNAL_GROUP_COMMIT
+ * @brief Number of committed transactions between two syncs of the journal.
+ */
+#define JOURNAL_GROUP_COMMIT 8
+
+/**
+ * @def JOURNAL_BEGIN
+ * @brief Journal record opening a transaction.
+ */
+#define JOURNAL_BEGIN 1
+
+/**
+ * @def JOURNAL_FAT
+ * @brief Journal record of a FAT entry change.
+ */
+#define JOURNAL_FAT 2
+
+/**
+ * @def JOURNAL_DIR
+ * @brief Journal record of a directory slot change, followed by the old and new entries.
+ */
+#define JOURNAL_DIR 3
+
+/**
+ * @def JOURNAL_COMMIT
+ * @brief Journal record closing a transaction.
+ */
+#define JOURNAL_COMMIT 4
+
+/**
+ * @struct journal_header
+ * @brief Start of the journal, followed by the records.
+ */
+typedef struct {
+    uint32_t magic;       /**< JOURNAL_MAGIC. */
+    uint32_t used;        /**< Bytes of records since the last checkpoint. */
+} journal_header;
+
+/**
+ * @struct journal_record
+ * @brief One entry of the metadata journal.
+ */
+typedef struct {
+    uint16_t type;          /**< JOURNAL_BEGIN, JOURNAL_FAT, JOURNAL_DIR or JOURNAL_COMMIT. */
+    uint16_t fat_index;     /**< FAT entry changed by a JOURNAL_FAT record. */
+    uint16_t old_value;     /**< Value of that entry before the change. */
+    uint16_t new_value;     /**< Value of that entry after the change. */
+    uint32_t dir_position;  /**< Image offset of the slot changed by a JOURNAL_DIR record. */
+} journal_record;
+
+/**
+ * @def SNAPSHOT_PREFIX
+ * @brief Prefix of the system files holding snapshots, followed by the snapshot name.
+ */
+#define SNAPSHOT_PREFIX ".snap."
+
+/**
+ * @def SNAPSHOT_MAGIC
+ * @brief Marks a complete snapshot ("PFS1").
+ */
+#define SNAPSHOT_MAGIC 0x31534650
+
+/**
+ * @def MAX_SNAPSHOTS
+ * @brief Maximum number of snapshots a volume can hold.
+ */
+#define MAX_SNAPSHOTS 16
+
+/**
+ * @struct snapshot_header
+ * @brief Start of a snapshot file, followed by a copy of the FAT and then a copy
+ * of the root directory blocks.
+ */
+typedef struct {
+    uint32_t magic;       /**< SNAPSHOT_MAGIC, written once the copies are complete. */
+    uint32_t root_size;   /**< Bytes of the root directory copy. */
+    time_t created;       /**< When the snapshot was taken. */
+} snapshot_header;
+
+/**
+ * @def DEDUP_NAME
+ * @brief Name of the system file holding the fingerprint index of deduplicated
+ * volumes. Once it exists, files are also deduplicated as they are written.
+ */
+#define DEDUP_NAME ".dedup"
+
+/**
+ * @def DEDUP_MAGIC
+ * @brief Marks a formatted fingerprint index ("PFD1").
+ */
+#define DEDUP_MAGIC 0x31444650
+
+/**
+ * @def DEDUP_PROBES
+ * @brief Slots of the fingerprint index searched for a hash before one is replaced.
+ */
+#define DEDUP_PROBES 8
+
+/**
+ * @def DEDUP_CLOSE_BLOCKS
+ * @brief Largest file, in blocks, deduplicated when it is closed after writing.
+ */
+#define DEDUP_CLOSE_BLOCKS 64
+
+/**
+ * @struct dedup_header
+ * @brief Start of the fingerprint index, followed by capacity entries.
+ */
+typedef struct {
+    uint32_t magic;       /**< DEDUP_MAGIC. */
+    uint32_t capacity;    /**< Number of entries, a power of two. */
+} dedup_header;
+
+/**
+ * @struct dedup_entry
+ * @brief A block and the hash of the chain from it to the end of its file.
+ *
+ * Entries are only hints: a block found through the index is compared byte by
+ * byte before it is shared.
+ */
+typedef struct {
+    uint32_t tag;         /**< High half of the 64-bit hash, the low half picks the slot. */
+    uint16_t block;       /**< The block, or 0 for an empty slot. */
+    uint16_t unused;      /**< Padding. */
+} dedup_entry;
+
+/**
+ * @def SCRUB_NAME
+ * @brief Name of the system file holding the progress of the scrubber, so that
+ * a pass interrupted by a restart resumes where it stopped.
+ */
+#define SCRUB_NAME ".scrub"
+
+/**
+ * @def SCRUB_MAGIC
+ * @brief Marks a formatted scrub progress file ("PFR1").
+ */
+#define SCRUB_MAGIC 0x31524650
+
+/**
+ * @def SCRUB_IDLE
+ * @brief Scrub phase between two passes.
+ */
+#define SCRUB_IDLE 0
+
+/**
+ * @def SCRUB_CHAINS
+ * @brief Scrub phase walking the chain of every directory entry.
+ */
+#define SCRUB_CHAINS 1
+
+/**
+ * @def SCRUB_BLOCKS
+ * @brief Scrub phase reading every allocated block in FAT order.
+ */
+#define SCRUB_BLOCKS 2
+
+/**
+ * @def SCRUB_RESTARTS
+ * @brief Times a chain walk spread over several steps is restarted because the
+ * FAT changed in between before the scrubber walks it in a single step.
+ */
+#define SCRUB_RESTARTS 3
+
+/**
+ * @struct scrub_counts
+ * @brief What a scrub pass has found so far.
+ */
+typedef struct {
+    uint32_t files;       /**< Directory entries whose chain was walked. */
+    uint32_t blocks;      /**< Allocated blocks read. */
+    uint32_t bad_chains;  /**< Chains that leave the FAT, run into a free block or never end. */
+    uint32_t bad_sizes;   /**< Files whose chain length does not match their size. */
+    uint32_t io_errors;   /**< Blocks or directory entries the host failed to read. */
+    uint32_t leaked;      /**< Allocated blocks that are in no chain. */
+} scrub_counts;
+
+/**
+ * @struct scrub_header
+ * @brief Start of the scrub progress file, followed by one bit per block, set
+ * once the pass has found the block in a chain or seen it allocated.
+ */
+typedef struct {
+    uint32_t magic;          /**< SCRUB_MAGIC. */
+    uint32_t phase;          /**< SCRUB_IDLE, SCRUB_CHAINS or SCRUB_BLOCKS. */
+    uint32_t cursor;         /**< Next directory slot to walk, or next block to read. */
+    uint16_t chain_block;    /**< Next block of the chain being walked, or 0 to start at its first block. */
+    uint16_t unused;         /**< Padding. */
+    uint32_t chain_length;   /**< Blocks of that chain walked so far. */
+    uint32_t passes;         /**< Passes completed. */
+    time_t started;          /**< When the current or last pass started. */
+    time_t finished;         /**< When the last pass finished, or 0. */
+    scrub_counts current;    /**< Findings of the current pass. */
+    scrub_counts last;       /**< Findings of the last completed pass. */
+} scrub_header;
+
+/**
+ * @struct dir_index_slot
+ * @brief A bucket of the directory index a read-only volume builds at mount time.
+ *
+ * The directory of a read-only volume never changes, so find_file() looks names
+ * up in this hash table instead of reading the root directory.
+ */
+typedef struct {
+    uint32_t position;        /**< Image offset of the directory slot, or 0 for an empty bucket. */
+    directory_entry entry;    /**< Copy of the directory entry. */
+} dir_index_slot;
+
+/**
+ * @def ALLOC_CHAIN_GAP
+ * @brief Number of blocks the allocation cursor skips past a newly started chain,
+ * leaving that file room to grow contiguously before the next new file lands.
+ */
+#define ALLOC_CHAIN_GAP 16
+
+/**
+ * @def MAX_VOLUMES
+ * @brief Maximum number of filesystems that can be mounted at the same time.
+ */
+#define MAX_VOLUMES 8
+
+/**
+ * @def VOLUME_LABEL_LEN
+ * @brief Size of a volume label, including the null terminator.
+ */
+#define VOLUME_LABEL_LEN 16
+
+/**
+ * @struct pennfat_volume
+ * @brief A mounted filesystem in the mount table.
+ *
+ * The selected volume's state lives in the fs_fd, fat, fat_size, block_size,
+ * alloc_cursor, hole_map and read_only globals so the filesystem code can keep
+ * using them; select_volume() saves it back here before loading another volume.
+ */
+typedef struct {
+    char label[VOLUME_LABEL_LEN]; /**< Path prefix of the volume, empty if the slot is free. */
+    int fs_fd;                    /**< Host file descriptor of the image. */
+    uint16_t *fat;                /**< The FAT, mapped private and written back by sync_fat(). */
+    size_t fat_size;              /**< Size of the FAT in bytes. */
+    int block_size;               /**< Block size of the image. */
+    int alloc_cursor;             /**< Where the next new chain starts looking for a free block. */
+    uint8_t *hole_map;            /**< The mapped hole map, or NULL if the image has no holes. */
+    bool read_only;               /**< Whether the image was mounted read-only, with its FAT mapped private. */
+    dir_index_slot *dir_index;    /**< Directory index of a read-only volume, or NULL. */
+    uint32_t dir_index_capacity;  /**< Number of buckets of the directory index, a power of two. */
+    journal_header *journal;      /**< The mapped journal, or NULL if the image has none. */
+    uint32_t journal_size;        /**< Size of the journal in bytes, header included. */
+    bool in_transaction;          /**< Whether a BEGIN has been logged without its COMMIT. */
+    uint32_t journal_synced;      /**< Bytes of records known to be on disk. */
+    int commits;                  /**< Transactions committed since the journal was last synced. */
+    uint8_t *dirty_fat;           /**< Bitmap of the FAT pages changed since the last sync. */
+    uint8_t *dirty_blocks;        /**< Bitmap of the blocks written since the last sync. */
+    uint32_t dirty_bytes;         /**< Bytes the dirty FAT pages and blocks amount to. */
+    time_t dirty_since;           /**< When the volume first became dirty, or 0 if it is clean. */
+    uint16_t *held_dir_blocks;    /**< Directory blocks changed since the journal was last synced, held back from the image. */
+    char *held_dir_data;          /**< Contents of the held back directory blocks, block_size bytes each. */
+    int num_held_dir_blocks;      /**< Number of held back directory blocks. */
+    int held_dir_capacity;        /**< Blocks held_dir_blocks and held_dir_data have room for. */
+    uint8_t *snap_refs;           /**< Number of snapshots holding each block, or NULL if there are none. */
+    dedup_header *dedup_index;    /**< The mapped fingerprint index, or NULL if the volume is not deduplicated. */
+    uint32_t dedup_size;          /**< Size of the fingerprint index in bytes. */
+    uint8_t *dedup_refs;          /**< Files beyond the first whose chain runs through each block. */
+    scrub_header *scrub;          /**< The mapped scrub progress, or NULL if the volume was never scrubbed. */
+    uint32_t scrub_size;          /**< Size of the scrub progress in bytes. */
+    uint32_t fat_writes;          /**< FAT entries changed since the volume was mounted. */
+    uint32_t scrub_fat_writes;    /**< fat_writes when the last scrub step ended. */
+    int scrub_restarts;           /**< Times the chain being scrubbed had to be restarted. */
+} pennfat_volume;
+
+/**
+ * @def FRAGSTAT_FREE_BINS
+ * @brief Power-of-two bins of the free run histogram printed by fragstat.
+ */
+#define FRAGSTAT_FREE_BINS 16
+
+/**
+ * @def FRAGSTAT_MAP_ROWS
+ * @brief Rows of the block map printed by fragstat.
+ */
+#define FRAGSTAT_MAP_ROWS 8
+
+/**
+ * @def FRAGSTAT_MAP_COLUMNS
+ * @brief Cells per row of the block map printed by fragstat.
+ */
+#define FRAGSTAT_MAP_COLUMNS 64
+
+/**
+ * @def PACK_BUFFER_SIZE
+ * @brief Bytes pack and unpack move between the host and the image per read or write.
+ */
+#define PACK_BUFFER_SIZE (1 << 20)
+
 // Helper functions
 
+/**
+ * @brief Makes a mounted volume the one the filesystem functions operate on.
+ *
+ * @param volume The mount table slot of the volume.
+ *
+ * @return Returns 0 on success, or -1 if no volume is mounted in that slot.
+ */
+int select_volume(int volume);
+
+/**
+ * @brief Looks up a mounted volume by label.
+ *
+ * @param label The label of the volume.
+ *
+ * @return Returns the mount table slot of the volume, or -1 if it is not mounted.
+ */
+int find_volume(const char *label);
+
+/**
+ * @brief Splits a LABEL:NAME path and selects its volume.
+ *
+ * Paths without a label refer to the default volume, which is the first volume
+ * that was mounted.
+ *
+ * @param path The path to resolve.
+ * @param name Set to the file name within the volume (a pointer into path).
+ *
+ * @return Returns the mount table slot of the selected volume, or -1 on failure.
+ */
+int resolve_path(const char *path, const char **name);
+
+/**
+ * @brief Keeps other processes from being scheduled while the filesystem is in use.
+ *
+ * Blocks SIGALRM so that the selected volume and the image cannot change under
+ * the caller. Calls nest; only the outermost fs_unlock() unblocks the alarm.
+ * Everything between the outermost fs_lock() and fs_unlock() is one journal
+ * transaction.
+ */
+void fs_lock();
+
+/**
+ * @brief Releases fs_lock(), committing the transaction on the outermost call.
+ */
+void fs_unlock();
+
+/**
+ * @brief Sets a FAT entry, logging the change to the journal.
+ *
+ * @param index The FAT entry.
+ * @param value The new value.
+ */
+void fat_set(uint16_t index, uint16_t value);
+
+/**
+ * @brief Writes a directory entry at the current offset of the image, logging
+ * the old and new slot to the journal.
+ *
+ * The entry never reaches the disk ahead of its journal record: while the
+ * journal is in use, the block holding it is held back in memory until the
+ * next journal_sync(), the way the FAT is. Like write(), this leaves the offset
+ * right after the entry.
+ *
+ * @param dir_entry The entry to write.
+ *
+ * @return Returns the number of bytes written, or -1 on failure.
+ */
+ssize_t write_dir_entry(const directory_entry *dir_entry);
+
+/**
+ * @brief Writes part of a directory block of the selected volume.
+ *
+ * Goes through the held back block like write_dir_entry(), without journaling.
+ *
+ * @param buf What to write, within one block.
+ * @param n Number of bytes to write.
+ * @param position Offset in the image.
+ *
+ * @return Returns n on success, or -1 on failure.
+ */
+ssize_t dir_pwrite(const void *buf, size_t n, off_t position);
+
+/**
+ * @brief Reads the directory of the selected volume at the offset of fs_fd, like read().
+ *
+ * Directory blocks held back from the image are read from memory, so every
+ * reader of the directory goes through dir_read() or dir_pread().
+ *
+ * @param buf Where to read into.
+ * @param n Number of bytes to read.
+ * @param position The offset of fs_fd, which the caller keeps track of rather than asking lseek().
+ *
+ * @return Returns the number of bytes read, or -1 on failure.
+ */
+ssize_t dir_read(void *buf, size_t n, off_t position);
+
+/**
+ * @brief Reads the directory of the selected volume at position, like pread().
+ *
+ * @param buf Where to read into.
+ * @param n Number of bytes to read.
+ * @param position Offset in the image.
+ *
+ * @return Returns the number of bytes read, or -1 on failure.
+ */
+ssize_t dir_pread(void *buf, size_t n, off_t position);
+
+/**
+ * @brief Remembers that a block of the selected volume has to be synced.
+ *
+ * @param block The block that was written.
+ */
+void mark_block_dirty(uint16_t block);
+
+/**
+ * @brief Syncs the dirty FAT pages of the selected volume.
+ *
+ * The FAT is a private mapping, so its pages reach the image only here, and
+ * only after the journal records describing them are on disk.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int sync_fat();
+
+/**
+ * @brief Syncs what changed on the selected volume since the last sync.
+ *
+ * Only the dirty FAT pages and the dirty blocks are written back, so the cost
+ * follows the size of the change rather than the size of the image.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int sync_volume();
+
+/**
+ * @brief Syncs one file of the selected volume.
+ *
+ * Writes back the dirty FAT pages, the dirty blocks of the file and the block
+ * holding its directory entry.
+ *
+ * @param fs_name The name of the file.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int sync_file(const char *fs_name);
+
+/**
+ * @brief Makes the selected volume durable and empties its journal.
+ *
+ * The volume is synced with sync_volume(), and only then is the journal reset.
+ * A transaction still open is on disk in full afterwards, so it is closed as
+ * well; callers checkpoint only between operations.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int journal_checkpoint();
+
+/**
+ * @brief Syncs the records of the selected volume's journal that are not on disk yet.
+ *
+ * Whatever the records describe may be written to the image afterwards, so
+ * the directory blocks held back since the last sync are written then.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int journal_sync();
+
+/**
+ * @brief Returns whether the open transaction of the selected volume has room for a step.
+ *
+ * @param num_fat The most FAT records the step logs.
+ * @param num_dir The most directory records the step logs.
+ *
+ * @return Returns true if the step fits the open transaction, or a new one if
+ * none is open; a new transaction always starts with at least half of the
+ * journal free. Always true without a journal.
+ */
+bool journal_fits(int num_fat, int num_dir);
+
+/**
+ * @brief Commits the open transaction of the selected volume and checkpoints the journal.
+ *
+ * Splits an operation too large for one transaction. The caller makes sure
+ * the volume is consistent first: a crash keeps what was done up to here.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int journal_split();
+
+/**
+ * @brief Makes room in the journal for the next step of an operation.
+ *
+ * Called where the volume is consistent, before a step that logs at most
+ * num_fat FAT and num_dir directory records. If the open transaction has no
+ * room left for them, it is split with journal_split().
+ *
+ * @param num_fat The most FAT records the step logs.
+ * @param num_dir The most directory records the step logs.
+ *
+ * @return Returns 0, or -1 after reporting it if the step does not fit a new transaction.
+ */
+int journal_reserve(int num_fat, int num_dir);
+
+/**
+ * @brief Commits the open transaction of every mounted volume.
+ *
+ * Only every JOURNAL_GROUP_COMMIT-th commit syncs the journal.
+ */
+void journal_commit();
+
+/**
+ * @brief Maps the journal of the selected volume and replays it.
+ *
+ * Committed transactions are redone and a trailing one that never committed is
+ * rolled back, after which the journal is checkpointed.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int journal_open();
+
 /**
  * @brief Find a file in the PennFAT filesystem by name.
  *
@@ -57,6 +608,302 @@ typedef struct {
  */
 int find_file(const char* fname, directory_entry *result);
 
+/**
+ * @brief Returns the number of usable FAT entries of the mounted filesystem.
+ *
+ * @return The number of FAT entries, capped below the 0xFFFF end-of-chain marker.
+ */
+int fat_num_entries();
+
+/**
+ * @brief Allocates a free block, preferring locality.
+ *
+ * The search starts at goal and scans forward (wrapping around) for a free FAT
+ * entry. Extensions should pass the block right after the file's current last
+ * block. A goal outside the data region (e.g. 0) starts a new chain at the
+ * rotating allocation cursor, which then moves ALLOC_CHAIN_GAP blocks ahead.
+ * The caller is responsible for linking the block and setting its FAT entry.
+ *
+ * @param goal The preferred block number.
+ *
+ * @return Returns the allocated block number, or -1 if the filesystem is full.
+ */
+int fat_alloc(int goal);
+
+/**
+ * @brief Allocates a run of contiguous free blocks.
+ *
+ * Like fat_alloc(), the search starts at goal (or at the allocation cursor for a
+ * goal outside the data region) and wraps around, but only a run of count free
+ * blocks is accepted. The blocks are not linked or marked; the caller does that.
+ *
+ * @param goal The preferred first block of the run.
+ * @param count The number of contiguous blocks wanted.
+ *
+ * @return Returns the first block of the run, or -1 if no such run exists.
+ */
+int fat_alloc_extent(int goal, int count);
+
+/**
+ * @brief Reserves blocks for a file without writing any data.
+ *
+ * Extends the file's chain until it covers length bytes, contiguously after the
+ * current last block when possible, and records length in allocSize. The size
+ * of the file is left untouched. The caller writes the directory entry back.
+ *
+ * @param dir_entry The directory entry of the file to extend.
+ * @param length The number of bytes the chain should cover.
+ *
+ * @return Returns 0 on success, or -1 if there is not enough space (in which case
+ * the chain is left as it was).
+ */
+int fallocate_chain(directory_entry *dir_entry, uint32_t length);
+
+/**
+ * @brief Returns whether a snapshot or another file holds a block of the selected volume.
+ *
+ * Shared blocks are never allocated, zeroed or written in place: the live
+ * filesystem gets its own copy with cow_block() before writing one.
+ *
+ * @param block The block number.
+ */
+bool block_shared(uint16_t block);
+
+/**
+ * @brief Returns whether the chains of several files run through a block.
+ *
+ * Deduplicated files share the tail of their chains, so such a block cannot be
+ * followed by a new block either without giving the file its own copy first.
+ *
+ * @param block The block number.
+ */
+bool block_deduped(uint16_t block);
+
+/**
+ * @brief Gives a file its own copy of a block it shares with a snapshot.
+ *
+ * The copy takes the block's place in the file's chain. A block shared with
+ * other files stays theirs; one held by a snapshot is freed in the live FAT and
+ * kept by the snapshot. The caller writes the directory entry back if the
+ * first block changed.
+ *
+ * @param dir_entry The directory entry of the file.
+ * @param prev_block The block before block in the chain, or 0xFFFF for the first block.
+ * @param block The shared block.
+ *
+ * @return Returns the copy, or -1 if there is no space left.
+ */
+int cow_block(directory_entry *dir_entry, uint16_t prev_block, uint16_t block);
+
+/**
+ * @brief Gives a file its own last block, and its own copy of every block on the way.
+ *
+ * Blocks shared with other files are copied along the whole chain, as other files
+ * run through every block after one they share; a snapshot only needs the last
+ * block copied. The caller writes the directory entry back if the first block changed.
+ *
+ * @param dir_entry The directory entry of the file.
+ *
+ * @return Returns the last block, 0xFFFF for an empty file, or -1 if there is no space left.
+ */
+int unshare_last_block(directory_entry *dir_entry);
+
+/**
+ * @brief Frees a chain, zeroing the blocks no snapshot holds so free blocks read as zero.
+ *
+ * The blocks other files share are left to them.
+ *
+ * @param first_block The first block of the chain, or 0xFFFF for an empty chain.
+ */
+void release_chain(uint16_t first_block);
+
+/**
+ * @brief Frees the chain of a file whose directory entry is about to be cleared or reset.
+ *
+ * A chain too long for one journal transaction loses its head in steps: the
+ * entry at dir_position is written with what is left before each split, so a
+ * crash leaves a shorter file rather than a half freed chain. Room is kept in
+ * the last transaction for the caller to write the entry.
+ *
+ * @param dir_entry The directory entry of the file, left with an empty chain.
+ * @param dir_position The offset of the entry in the image.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int release_file(directory_entry *dir_entry, off_t dir_position);
+
+/**
+ * @brief Appends a new block to the chain of a file being written block by block.
+ *
+ * If the journal has no room left for the block, the entry is written at
+ * dir_position first and the transaction split, so the caller keeps the size
+ * and lastBlock of dir_entry current.
+ *
+ * @param dir_entry The directory entry of the file.
+ * @param dir_position The offset of the entry in the image.
+ *
+ * @return Returns the new block, or -1 if there is no space left.
+ */
+int append_chain_block(directory_entry *dir_entry, off_t dir_position);
+
+/**
+ * @brief Maps a system file into memory.
+ *
+ * The file's blocks are contiguous, so its whole content is mapped MAP_SHARED and
+ * stores through the returned pointer go straight to the image. If create is set
+ * and the file does not exist yet, it is created with length zeroed bytes.
+ *
+ * @param name The name of the system file.
+ * @param length The number of bytes to map.
+ * @param create Whether to create the file if it does not exist.
+ *
+ * @return Returns the mapped content, or NULL if the file does not exist (and
+ * create is not set) or could not be created.
+ */
+void *sysfile_map(const char *name, uint32_t length, bool create);
+
+/**
+ * @brief Flushes a range of a system file mapped by sysfile_map() to disk.
+ *
+ * @param addr The start of the range, within a mapping returned by sysfile_map().
+ * @param length The length of the range.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int sysfile_sync(void *addr, uint32_t length);
+
+/**
+ * @brief Unmaps a system file mapped by sysfile_map().
+ *
+ * @param addr The pointer returned by sysfile_map().
+ * @param length The length passed to sysfile_map().
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int sysfile_unmap(void *addr, uint32_t length);
+
+/**
+ * @brief Checks whether a block is a hole.
+ *
+ * @param block The block number.
+ *
+ * @return Returns true if the block is linked but has never been written.
+ */
+bool block_is_hole(uint16_t block);
+
+/**
+ * @brief Marks or unmarks a block as a hole.
+ *
+ * The hole map is created the first time a block is marked.
+ *
+ * @param block The block number.
+ * @param hole Whether the block is now a hole.
+ *
+ * @return Returns 0 on success, or -1 if the hole map could not be created.
+ */
+int set_block_hole(uint16_t block, bool hole);
+
+/**
+ * @brief Reads from a data block, returning zeros for holes without any I/O.
+ *
+ * @param block The block number.
+ * @param offset The offset within the block.
+ * @param buf The buffer to read into.
+ * @param n The number of bytes to read (offset + n must not exceed the block).
+ *
+ * @return Returns the number of bytes read, or -1 on failure.
+ */
+ssize_t block_read(uint16_t block, int offset, void *buf, size_t n);
+
+/**
+ * @brief Writes to a data block, which stops being a hole.
+ *
+ * @param block The block number.
+ * @param offset The offset within the block.
+ * @param buf The bytes to write.
+ * @param n The number of bytes to write (offset + n must not exceed the block).
+ *
+ * @return Returns the number of bytes written, or -1 on failure.
+ */
+ssize_t block_write(uint16_t block, int offset, const void *buf, size_t n);
+
+/**
+ * @brief Counts the contiguous runs in a FAT chain.
+ *
+ * A run is a maximal sequence of blocks where each block is physically right
+ * after its predecessor.
+ *
+ * @param first_block The first block of the chain.
+ * @param num_blocks Set to the number of blocks in the chain.
+ *
+ * @return Returns the number of runs in the chain.
+ */
+int chain_runs(uint16_t first_block, int *num_blocks);
+
+/**
+ * @brief Measures how far a FAT chain is spread over the image.
+ *
+ * @param first_block The first block of the chain.
+ *
+ * @return Returns the number of blocks from the lowest to the highest block of the chain, or 0 for an empty chain.
+ */
+int chain_span(uint16_t first_block);
+
+/**
+ * @brief Finds the blocks holding a byte range of a file, if they can be used in place.
+ *
+ * @param first_block The first block of the file's chain.
+ * @param offset The file offset of the range.
+ * @param length The length of the range.
+ *
+ * @return Returns the block holding offset if the blocks of the range are consecutive on
+ *         the image, written and used by this file alone, or -1 otherwise.
+ */
+int chain_extent(uint16_t first_block, uint32_t offset, uint32_t length);
+
+/**
+ * @brief Walks a FAT chain to its end, for the lastBlock of a directory entry.
+ *
+ * @param first_block The first block of the chain.
+ *
+ * @return Returns the last block of the chain, or 0xFFFF for an empty chain.
+ */
+uint16_t chain_last(uint16_t first_block);
+
+/**
+ * @brief Sets the lastBlock of a file's directory entry from its chain, after a write that did not keep it.
+ *
+ * @param fs_name The name of the file.
+ *
+ * @return Returns 0 on success, or -1 if the file is not found or the entry cannot be written.
+ */
+int refresh_last_block(const char *fs_name);
+
+/**
+ * @brief Passes a page cache hint for a byte range of a file on to the host, one posix_fadvise() per run of consecutive blocks.
+ *
+ * Holes are skipped, they are never read from the image.
+ *
+ * @param first_block The first block of the file's chain.
+ * @param offset The file offset of the range.
+ * @param length The length of the range, or 0 for the rest of the chain.
+ * @param advice F_FADV_WILLNEED or F_FADV_DONTNEED; Linux keeps the other hints for the whole image.
+ *
+ * @return Returns 0 on success, or -1 if the host rejected a hint.
+ */
+int advise_chain(uint16_t first_block, uint32_t offset, uint32_t length, int advice);
+
+/**
+ * @brief Passes a page cache hint for part of a mapping of the image on to the host with madvise().
+ *
+ * @param addr The start of the range, page aligned.
+ * @param length The length of the range.
+ * @param advice One of the F_FADV_ constants.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int advise_mapping(void *addr, size_t length, int advice);
+
 /**
  * @brief Creates a single file in the PennFAT filesystem.
  *
@@ -92,29 +939,43 @@ int cat_f_w(struct parsed_command *cmd);
 int cat_f_a(struct parsed_command *cmd);
 
 /**
- * @brief Reads from the terminal and appends to a specified output file.
+ * @brief Reads the line cat -a and cat -w take from the terminal.
  *
- * This function reads from the terminal and appends the input to the
- * specified output file. If the output file does not exist, it will be created.
+ * Called before fs_lock(), so other processes keep running while the user types.
+ *
+ * @param input Where the line is stored, NUL-terminated.
+ * @param length Size of input.
+ *
+ * @return Returns the bytes read, or -1 on failure (input is then empty).
+ */
+int cat_read_input(char *input, int length);
+
+/**
+ * @brief Appends a line read from the terminal to a specified output file.
+ *
+ * This function appends the input to the specified output file. If the output
+ * file does not exist, it will be created.
  *
  * @param cmd A parsed command structure containing information about the 'cat' command.
+ * @param input The line read with cat_read_input().
  *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int cat_a_f(struct parsed_command *cmd);
+int cat_a_f(struct parsed_command *cmd, const char *input);
 
 
 /**
- * @brief Reads from the terminal and overwrites a specified output file.
+ * @brief Overwrites a specified output file with a line read from the terminal.
  *
- * This function reads from the terminal and overwrites the specified output file.
+ * This function overwrites the specified output file with the input.
  * If the output file does not exist, it will be created.
  *
  * @param cmd A parsed command structure containing information about the 'cat' command.
+ * @param input The line read with cat_read_input().
  *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int cat_w_f(struct parsed_command *cmd);
+int cat_w_f(struct parsed_command *cmd, const char *input);
 
 /**
  * @brief Concatenates files and prints the result to stdout.
@@ -135,6 +996,7 @@ int cat_f(struct parsed_command *cmd);
  * The number of blocks in the FAT region is BLOCKS_IN_FAT 
  * and the block size is 256, 512, 1024, 2048, or 4096 bytes 
  * corresponding to the value (0 through 4) of BLOCK_SIZE_CONFIG.
+ * The metadata journal is laid out right after the root directory.
  *
  * @param fs_name The name of the filesystem to be created.
  * @param blocks_in_fat The number of blocks in the FAT region (1-32)
@@ -147,18 +1009,31 @@ int mkfs(const char *fs_name, int blocks_in_fat, int block_size_config);
 /**
  * @brief Mounts a PennFAT filesystem by loading its FAT into memory.
  *
+ * The filesystem is added to the mount table and selected. The first volume
+ * mounted becomes the default volume. Transactions left in the journal are
+ * replayed: committed ones are redone and an unfinished one is rolled back.
+ *
+ * A read-only mount opens the image O_RDONLY and maps it private and populated,
+ * so several PennOS instances can share one image. Nothing is journaled, tracked
+ * or written back, and the directory is indexed once for find_file(). An image
+ * with a journal left to replay cannot be mounted read-only.
+ *
  * @param fs_name The name of the filesystem to be mounted.
+ * @param label The label used to address the volume, or NULL to use the base name of fs_name.
+ * @param read_only Whether to mount the image read-only.
  *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int mount(const char *fs_name);
+int mount(const char *fs_name, const char *label, bool read_only);
 
 /**
- * @brief Unmounts the currently mounted filesystem.
+ * @brief Unmounts a mounted filesystem.
+ *
+ * @param label The label of the volume, or NULL for the default volume.
  *
  * @return Returns 0 on success, or a negative value on failure.
  */
-int umount();
+int umount(const char *label);
 
 /**
  * @brief Creates or updates the timestamp of the specified files.
@@ -188,6 +1063,21 @@ int rm(const char *fs_name);
  */
 int mv(const char *src, const char *dst);
 
+/**
+ * @brief Copies a file from one volume to another (or within one volume).
+ *
+ * The destination is replaced if it exists and preallocated to the size of the
+ * source. The volumes may have different block sizes.
+ *
+ * @param src_volume The mount table slot of the source.
+ * @param src The name of the source file.
+ * @param dst_volume The mount table slot of the destination.
+ * @param dst The name of the destination file.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int copy_file(int src_volume, const char *src, int dst_volume, const char *dst);
+
 /**
  * @brief Copies files from the filesystem to a destination in the host OS.
  *
@@ -197,6 +1087,32 @@ int mv(const char *src, const char *dst);
  */
 int cp(struct parsed_command *cmd);
 
+/**
+ * @brief Runs a cp command but queues the data of a copy of at least OFFLOAD_MIN_BYTES on a request.
+ *
+ * The chain, the entry and the FAT are set up as by cp(); the reads and writes that move the data are
+ * added to the request, which takes a buffer for them and the host file of the copy, if any. Smaller
+ * copies are done right away and leave the request without a buffer.
+ *
+ * @param cmd A parsed command structure containing information about the 'cp' command.
+ * @param request The request to queue the data transfers on.
+ *
+ * @return Returns 0 on success, or a negative value on failure. The transfers of a request that got
+ *         a buffer still have to run on failure, they cover what the entry already claims.
+ */
+int cp_queued(struct parsed_command *cmd, io_request *request);
+
+/**
+ * @brief Finishes a copy queued by cp_queued() once its transfers are done.
+ *
+ * Drops the copied blocks from the page cache and deduplicates the destination of a copy within the filesystem.
+ *
+ * @param cmd The cp command given to cp_queued().
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int cp_queued_done(struct parsed_command *cmd);
+
 /**
  * @brief Concatenates and prints files to stdout or overwrites/creates an output file.
  *
@@ -213,6 +1129,234 @@ int cat_all(struct parsed_command *cmd);
  */
 int ls();
 
+/**
+ * @brief Prints the layout of every file and of the whole image.
+ *
+ * For each file: its blocks, extents (contiguous runs), average run length and
+ * the span of its chain. The average run length of a file is its block count
+ * divided by its number of runs, so a fully contiguous file scores its own
+ * length. For the image: the free space as a histogram of free run lengths,
+ * the largest free run, and a map of where directory and data blocks are.
+ * Everything is read from the FAT and the directory blocks directly.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int fragstat();
+
+/**
+ * @brief Reads the whole root directory with one read per block.
+ *
+ * @param dir_blocks Set to a malloc'd array of the directory blocks, in chain order.
+ * @param num_dir_blocks Set to the number of directory blocks.
+ *
+ * @return Returns the malloc'd entries of every directory block, or NULL on failure.
+ */
+directory_entry *read_root_dir(uint16_t **dir_blocks, int *num_dir_blocks);
+
+/**
+ * @brief Gives an empty entry a chain of its own and fills it from a host file.
+ *
+ * The chain is one extent at or after goal if there is room, so packed files
+ * land back to back; consecutive blocks are written with one pwrite each.
+ *
+ * @param host_fd The host file, read from its current offset.
+ * @param dir_entry The entry, with no chain yet; its chain, allocSize and size are set.
+ * @param size The bytes to copy.
+ * @param buffer A buffer of PACK_BUFFER_SIZE bytes.
+ * @param goal Where to look for the extent, moved past it.
+ *
+ * @return Returns 0 on success, or a negative value on failure.
+ */
+int pack_data(int host_fd, directory_entry *dir_entry, uint32_t size, char *buffer, int *goal);
+
+/**
+ * @brief Writes the changed blocks of a directory read with read_root_dir(), journaling each changed entry.
+ *
+ * @param entries The entries as they should be.
+ * @param old_entries The entries as they are in the image, brought up to date.
+ * @param changed Which directory blocks changed, cleared.
+ * @param dir_blocks The directory blocks, in chain order.
+ * @param num_dir_blocks The number of directory blocks.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int pack_write_dir(directory_entry *entries, directory_entry *old_entries, bool *changed, const uint16_t *dir_blocks, int num_dir_blocks);
+
+/**
+ * @brief Copies every regular file of a host directory into the root directory in one pass.
+ *
+ * Unlike one cp -h per file, the directory is read once and looked up through
+ * a hash of the names, each file gets a contiguous extent sized up front, and
+ * each changed directory block is written once at the end, or whenever the
+ * journal has to be split before the next file. Files of the same
+ * name are replaced; the mode and modification time come from the host.
+ *
+ * @param host_dir The host directory.
+ *
+ * @return Returns the number of files packed, or a negative value on failure.
+ */
+int pack(const char *host_dir);
+
+/**
+ * @brief Copies every file of the root directory to a host directory, the reverse of pack.
+ *
+ * @param host_dir The host directory, created if it does not exist.
+ *
+ * @return Returns the number of files unpacked, or a negative value on failure.
+ */
+int unpack(const char *host_dir);
+
+/**
+ * @brief Checks the selected volume for inconsistencies.
+ *
+ * Every chain is walked from the directory: chains that leave the FAT, loop,
+ * share blocks with another chain or run into a free block are reported, as
+ * are files whose chain length does not match their size and blocks that are
+ * allocated but belong to no file.
+ *
+ * @param verbose Whether to print each problem found.
+ *
+ * @return Returns the number of problems found, or -1 on failure.
+ */
+int check_volume(bool verbose);
+
+/**
+ * @brief Counts the blocks held by the snapshots of the selected volume.
+ *
+ * Called by mount() once the journal is replayed.
+ *
+ * @return Returns the number of snapshots, or -1 on failure.
+ */
+int snapshot_load();
+
+/**
+ * @brief Takes a snapshot of the selected volume.
+ *
+ * The FAT and the root directory are copied into a system file; the data blocks
+ * are not copied but shared until the live filesystem writes or frees them.
+ *
+ * @param name The name of the snapshot.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int snapshot_create(const char *name);
+
+/**
+ * @brief Lists the snapshots of the selected volume with the blocks only they hold.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int snapshot_list();
+
+/**
+ * @brief Deletes a snapshot, freeing the blocks only it held.
+ *
+ * @param name The name of the snapshot.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int snapshot_delete(const char *name);
+
+/**
+ * @brief Returns the selected volume to the state of a snapshot.
+ *
+ * Snapshots taken after it are discarded. The caller makes sure no file of the
+ * volume is open.
+ *
+ * @param name The name of the snapshot.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int snapshot_rollback(const char *name);
+
+/**
+ * @brief Maps the fingerprint index of the selected volume and counts the shared blocks.
+ *
+ * Called by mount() once the journal is replayed.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int dedup_open();
+
+/**
+ * @brief Deduplicates one file of the selected volume against the fingerprint index.
+ *
+ * Every block is hashed together with the rest of the chain after it. The longest
+ * tail of the file that some other file already stores, byte for byte, is replaced
+ * by that file's blocks, and the file's remaining blocks are added to the index.
+ * Does nothing unless the volume has a fingerprint index.
+ *
+ * @param fs_name The name of the file.
+ *
+ * @return Returns the number of blocks freed, or -1 on failure.
+ */
+int dedup_name(const char *fs_name);
+
+/**
+ * @brief Deduplicates every file of the selected volume and prints the space reclaimed.
+ *
+ * The fingerprint index is created on the first run, after which files are also
+ * deduplicated when they are closed after writing or copied.
+ *
+ * @return Returns the number of blocks freed, or -1 on failure.
+ */
+int dedup();
+
+/**
+ * @brief Maps the scrub progress of the selected volume, if it was ever scrubbed.
+ *
+ * Called by mount() once the journal is replayed.
+ *
+ * @return Returns 0 on success, or -1 on failure.
+ */
+int scrub_open();
+
+/**
+ * @brief Starts a scrub pass on the selected volume unless one is under way.
+ *
+ * The progress file is created on the first call. A pass interrupted by an
+ * unmount or a restart is resumed rather than started over.
+ *
+ * @return Returns the progress of the pass, or NULL on failure.
+ */
+scrub_header *scrub_begin();
+
+/**
+ * @brief Advances the scrub pass of the selected volume by about budget blocks.
+ *
+ * The pass first walks the chain of every directory entry, checking that it
+ * stays in the FAT, ends and matches the size of the file, then reads every
+ * allocated block to surface host I/O errors and counts the allocated blocks
+ * no chain reached. Blocks allocated while the pass runs count as reached, so
+ * the filesystem may change between two steps. Each problem is written to
+ * report as a line.
+ *
+ * @param budget The number of blocks to walk or read.
+ * @param report Where to write the problems found.
+ *
+ * @return Returns 1 if the pass finished, 0 if it has more to do, or -1 on failure.
+ */
+int scrub_step(int budget, FILE *report);
+
+/**
+ * @brief Arms crash injection for testing.
+ *
+ * After writes more FAT entries or blocks have been written, the image of the
+ * volume being written is copied to path, as a crash at that moment would
+ * leave it on disk.
+ *
+ * @param writes The number of writes before the crash.
+ * @param path The host file receiving the crashed image.
+ */
+void crash_arm(int writes, const char *path);
+
+/**
+ * @brief Disarms crash injection.
+ *
+ * @return Returns whether the crashed image was taken since crash_arm().
+ */
+bool crash_disarm();
+
 /**
  * @brief Changes the permissions of the specified filesystem.
  *
@@ -1,6 +1,7 @@
 #include "Deque.h"
 #include "scheduler.h"
 #include "k_pennos.h"
+#include "iopool.h"
 
 #include <time.h>
 
@@ -94,6 +95,17 @@ Deque* get_pq_from_priority(int priority) {
 }
 
 static void alarmHandler(int signum) {  // SIGALARM
+    // Only a process on its own stack is preempted. A SIGALRM can also land in the scheduler, e.g. from an I/O
+    // worker, or as swapcontext sets a new process's empty mask before switching stacks: saving that as the
+    // process's context would resume the scheduler in its place
+    if (current_pcb == NULL) {
+        return;
+    }
+    char *here = (char *)&signum;
+    stack_t *stack = &current_pcb->uc->uc_stack;
+    if (here < (char *)stack->ss_sp || here >= (char *)stack->ss_sp + stack->ss_size) {
+        return;
+    }
     swapcontext(current_pcb->uc, &schedulerContext);
 }
 
@@ -263,6 +275,19 @@ bool waitpid_checks(PCB* pcb) {
     return false;
 }
 
+// wakes a process blocked on something other than a child, e.g. a file lock handed to it
+void unblock_process(PCB* pcb) {
+    if (pcb->status != BLOCKED) {
+        // stopped or killed while waiting, it picks the wakeup up when it runs again
+        return;
+    }
+    Deque_Pop_PID(blocked_pcbs, pcb->pid);
+    pcb->status = READY;
+    fprintf(logFile, "[%d] UNBLOCKED\t\t\t%d\t%d\t%s\n", current_quantum, pcb->pid, pcb->priority, pcb->process_name);
+    fflush(logFile);
+    schedule_ready_process(pcb);
+}
+
 pid_t get_last_stopped_pcb() {
     DequeNode* last_stopped = stopped_pcbs->back;
     while (last_stopped) {
@@ -408,6 +433,9 @@ void scheduler_main() {
             printf("unexpected status in scheduler main: %s\n", status_to_string(current_pcb->status));
         }
 
+        // wake the processes whose host I/O the workers finished
+        io_poll();
+
         // sleep checks
         DequeNode* sleep_node = blocked_pcbs->front;
         clock_t curr_time = clock();
@@ -79,4 +79,13 @@ void schedule_sleep_process(PCB* pcb, pennos_signal sig);
  * **/
 bool waitpid_checks(PCB* pcb);
 
+/**
+ * @brief Wakes a process that blocked itself waiting for something other than a child, such as a file lock.
+ * The process is moved from the blocked queue back to its priority queue. Processes that are no longer
+ * blocked (stopped or killed while waiting) are left alone.
+ *
+ * @param pcb The PCB of the blocked process.
+ * **/
+void unblock_process(PCB* pcb);
+
 #endif /* SCHEDULER_H */
\ No newline at end of file
@@ -0,0 +1,175 @@
+/*
+fragstat reports how the files and the free space of a PennFAT image are laid
+out, reading the FAT and the directory straight from a read-only mapping of the
+image:
+ - for every file its blocks, extents (contiguous runs), average run length
+   and the span of its chain from lowest to highest block,
+ - the free space as a histogram of free run lengths and the largest free run,
+ - a map of the image, one character per cell of blocks: D for cells holding
+   directory blocks, otherwise how full the cell is.
+
+The report is the same as the fragstat builtin of PennOS prints.
+*/
+
+#include <stdbool.h>
+#include "pennfat.h"
+
+// Power-of-two bins of the free run histogram
+#define FREE_BINS 16
+#define MAP_ROWS 8
+#define MAP_COLUMNS 64
+
+uint16_t *fat;
+char *image;
+size_t image_size;
+size_t fat_size;
+int block_size;
+int num_fat_entries;
+
+// Counts the contiguous runs of a chain and its blocks, and measures its span
+int chain_layout(uint16_t first_block, int *num_blocks, int *span) {
+    int runs = 0, lowest = num_fat_entries, highest = 0;
+    uint16_t prev = 0;
+    *num_blocks = 0;
+    for (uint16_t block = first_block; block != 0 && block != 0xFFFF && block < num_fat_entries && *num_blocks < num_fat_entries; block = fat[block]) {
+        if (*num_blocks == 0 || block != prev + 1) {
+            runs++;
+        }
+        lowest = block < lowest ? block : lowest;
+        highest = block > highest ? block : highest;
+        prev = block;
+        (*num_blocks)++;
+    }
+    *span = *num_blocks > 0 ? highest - lowest + 1 : 0;
+    return runs;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: fragstat FS_NAME\n");
+        return 1;
+    }
+    const char *fs_name = argv[1];
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fs_fd = open(fs_name, O_RDONLY);
+    if (fs_fd == -1) {
+        fprintf(stderr, "Failed to open file system file\n");
+        return 1;
+    }
+    uint16_t metadata;
+    off_t file_size = lseek(fs_fd, 0, SEEK_END);
+    if (pread(fs_fd, &metadata, sizeof(metadata), 0) != sizeof(metadata)) {
+        fprintf(stderr, "Failed to read FAT metadata\n");
+        return 1;
+    }
+    block_size = 1 << ((metadata & 0xFF) + 8);
+    fat_size = block_size * (metadata >> 8);
+    num_fat_entries = fat_size / 2 > 0xFFFF ? 0xFFFF : fat_size / 2;
+    image_size = fat_size + (num_fat_entries - 1) * block_size;
+    if ((metadata >> 8) < 1 || (metadata >> 8) > 32 || (metadata & 0xFF) > 4 || file_size < image_size) {
+        fprintf(stderr, "%s is not a PennFAT image\n", fs_name);
+        return 1;
+    }
+
+    image = mmap(NULL, image_size, PROT_READ, MAP_SHARED, fs_fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s into memory\n", fs_name);
+        return 1;
+    }
+    fat = (uint16_t *)image;
+    bool *dir_blocks = calloc(num_fat_entries, sizeof(bool));
+
+    int per_block = block_size / sizeof(directory_entry);
+    int num_files = 0, total_blocks = 0, total_runs = 0, num_dir_blocks = 0;
+    double total_avg_run = 0;
+    printf("%-31s %7s %7s %8s %7s\n", "file", "blocks", "extents", "avg run", "span");
+    for (int block = 1; block != 0xFFFF && block < num_fat_entries && num_dir_blocks < num_fat_entries; block = fat[block]) {
+        dir_blocks[block] = true;
+        num_dir_blocks++;
+        directory_entry *block_entries = (directory_entry *)(image + fat_size + (block - 1) * block_size);
+        for (int i = 0; i < per_block; i++) {
+            directory_entry *dir_entry = &block_entries[i];
+            // Files without blocks have nothing to fragment
+            if (dir_entry->name[0] == '\0' || dir_entry->firstBlock == 0 || dir_entry->firstBlock == 0xFFFF
+                || dir_entry->type == FT_SYSTEM) {
+                continue;
+            }
+
+            int num_blocks, span;
+            int runs = chain_layout(dir_entry->firstBlock, &num_blocks, &span);
+            double avg_run = runs > 0 ? (double)num_blocks / runs : 0;
+            printf("%-31.31s %7d %7d %8.2f %7d\n", dir_entry->name, num_blocks, runs, avg_run, span);
+            total_avg_run += avg_run;
+            total_blocks += num_blocks;
+            total_runs += runs;
+            num_files++;
+        }
+    }
+    printf("average run length: %.2f blocks over %d files, %.2f blocks per extent over %d extents\n",
+        num_files > 0 ? total_avg_run / num_files : 0, num_files, total_runs > 0 ? (double)total_blocks / total_runs : 0, total_runs);
+
+    // Free space as runs of free FAT entries, binned by powers of two
+    int free_runs[FREE_BINS] = { 0 };
+    int free_blocks[FREE_BINS] = { 0 };
+    int num_free = 0, num_free_runs = 0, largest_run = 0, largest_start = 0;
+    for (int block = 2; block < num_fat_entries; ) {
+        if (fat[block] != 0) {
+            block++;
+            continue;
+        }
+        int run_start = block;
+        while (block < num_fat_entries && fat[block] == 0) {
+            block++;
+        }
+        int length = block - run_start;
+        int bin = 31 - __builtin_clz(length);
+        bin = bin < FREE_BINS ? bin : FREE_BINS - 1;
+        free_runs[bin]++;
+        free_blocks[bin] += length;
+        num_free += length;
+        num_free_runs++;
+        if (length > largest_run) {
+            largest_run = length;
+            largest_start = run_start;
+        }
+    }
+    printf("%d of %d blocks used, %d directory blocks\n", num_fat_entries - 1 - num_free, num_fat_entries - 1, num_dir_blocks);
+    printf("free space: %d blocks in %d runs, largest run %d blocks at block %d\n", num_free, num_free_runs, largest_run, largest_start);
+    for (int bin = 0; bin < FREE_BINS; bin++) {
+        if (free_runs[bin] > 0) {
+            printf("  runs of %5d-%-5d %6d runs %7d blocks\n", 1 << bin, (1 << (bin + 1)) - 1, free_runs[bin], free_blocks[bin]);
+        }
+    }
+
+    int num_cells = MAP_ROWS * MAP_COLUMNS;
+    int cell_blocks = (num_fat_entries - 1 + num_cells - 1) / num_cells;
+    printf("map: %d blocks per cell, D directory, . free, 1-9 tenths used, # full\n", cell_blocks);
+    char row[MAP_COLUMNS + 1];
+    for (int cell = 0; cell < num_cells && 1 + cell * cell_blocks < num_fat_entries; cell++) {
+        int used = 0, in_cell = 0;
+        bool has_dir = false;
+        for (int block = 1 + cell * cell_blocks; block < 1 + (cell + 1) * cell_blocks && block < num_fat_entries; block++) {
+            used += fat[block] != 0;
+            has_dir |= dir_blocks[block];
+            in_cell++;
+        }
+        char mark = has_dir ? 'D' : used == 0 ? '.' : used == in_cell ? '#' : '1' + (used * 9 / in_cell < 8 ? used * 9 / in_cell : 8);
+        row[cell % MAP_COLUMNS] = mark;
+        if (cell % MAP_COLUMNS == MAP_COLUMNS - 1 || 1 + (cell + 1) * cell_blocks >= num_fat_entries) {
+            row[cell % MAP_COLUMNS + 1] = '\0';
+            printf("  %6d %s\n", 1 + (cell - cell % MAP_COLUMNS) * cell_blocks, row);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%s: %d blocks examined in %.3f s\n", fs_name, num_fat_entries - 1, seconds);
+
+    free(dir_blocks);
+    munmap(image, image_size);
+    close(fs_fd);
+    return 0;
+}
@@ -74,6 +74,54 @@ int initialize_fat(int fs_fd, int blocks_in_fat, int block_size_config) {
     return 0;
 }
 
+// Helper to lay out the journal in the blocks right after the root directory, as PennOS's mkfs does
+int initialize_journal(int fs_fd, int block_size, size_t fat_size, int num_fat_entries) {
+    // Room for every FAT entry to change once, but never more than a quarter of the data
+    int journal_blocks = (4 * fat_size + block_size - 1) / block_size;
+    if (journal_blocks < 4) {
+        journal_blocks = 4;
+    }
+    if (journal_blocks > (num_fat_entries - 2) / 4) {
+        journal_blocks = (num_fat_entries - 2) / 4;
+    }
+    if (journal_blocks < 2) {
+        return 0; // Too small to spare a journal, PennOS runs without one
+    }
+
+    // Chain blocks 2 .. 2 + journal_blocks - 1
+    for (int i = 0; i < journal_blocks; i++) {
+        uint16_t next_fat_value = i == journal_blocks - 1 ? 0xFFFF : 2 + i + 1;
+        if (pwrite(fs_fd, &next_fat_value, sizeof(uint16_t), (2 + i) * sizeof(uint16_t)) != sizeof(uint16_t)) {
+            fprintf(stderr, "Failed to write journal FAT entries\n");
+            return -1;
+        }
+    }
+
+    // First slot of the root directory
+    directory_entry dir_entry;
+    memset(&dir_entry, 0, sizeof(directory_entry));
+    strncpy(dir_entry.name, JOURNAL_NAME, sizeof(dir_entry.name));
+    dir_entry.size = journal_blocks * block_size;
+    dir_entry.allocSize = dir_entry.size;
+    dir_entry.firstBlock = 2;
+    dir_entry.lastBlock = 2 + journal_blocks - 1;
+    dir_entry.type = FT_SYSTEM;
+    dir_entry.perm = 0;
+    dir_entry.mtime = time(NULL);
+    if (pwrite(fs_fd, &dir_entry, sizeof(directory_entry), fat_size) != sizeof(directory_entry)) {
+        fprintf(stderr, "Failed to write journal directory entry\n");
+        return -1;
+    }
+
+    // The magic, then the bytes of records logged, none yet
+    uint32_t header[2] = { JOURNAL_MAGIC, 0 };
+    if (pwrite(fs_fd, header, sizeof(header), fat_size + block_size) != sizeof(header)) {
+        fprintf(stderr, "Failed to write journal header\n");
+        return -1;
+    }
+    return 0;
+}
+
 /*
 Creates a PennFAT filesystem in the file named FS_NAME. 
 The number of blocks in the FAT region is BLOCKS_IN_FAT (ranging from 1 through 32), 
@@ -120,6 +168,11 @@ int mkfs(const char *fs_name, int blocks_in_fat, int block_size_config) {
         return -1;
     }
 
+    if (initialize_journal(fs_fd, block_size, fat_size, num_fat_entries) != 0) {
+        close(fs_fd);
+        return -1;
+    }
+
     close(fs_fd);
     return 0;
 }
@@ -171,6 +224,17 @@ int mount(const char *fs_name) {
         return -1;
     }
 
+    // These commands do not log to the journal, so one PennOS has yet to replay would undo them later
+    directory_entry journal_entry;
+    uint32_t header[2];
+    if (find_file(JOURNAL_NAME, &journal_entry) != -1 && journal_entry.type == FT_SYSTEM
+        && pread(fs_fd, header, sizeof(header), fat_size + (journal_entry.firstBlock - 1) * block_size) == sizeof(header)
+        && header[0] == JOURNAL_MAGIC && header[1] != 0) {
+        fprintf(stderr, "The journal has changes to replay, mount the image in PennOS first\n");
+        umount();
+        return -1;
+    }
+
     /* memset(fd_table, 0, sizeof(fd_table));
     fd_table[0].fd_type = FD_STDIN;
     fd_table[0].mode = F_READ;
@@ -271,26 +335,12 @@ int touch_single(const char *fs_name) {
         fat_value = fat[fat_value];
     }
 
-    // final block
-    for (int i = 0; i < num_entries; i++) {
-        int read_bytes = read(fs_fd, &dir_entry, sizeof(directory_entry));
-        if (read_bytes == -1) {
-            fprintf(stderr, "Error reading directory entry\n");
-            return -1;
-        }
-
-        // Check if the current entry is the source file
-        if (strcmp(dir_entry.name, fs_name) == 0) {
-            // source file already exists, update timestamp to current time
-            dir_entry.mtime = time(NULL);
-            return 0;
-        }
-    }
     // create new directory entry
     directory_entry new_dir_entry;
     strncpy(new_dir_entry.name, fs_name, sizeof(new_dir_entry.name));
     new_dir_entry.size = 0;
     new_dir_entry.firstBlock = 0xFFFF;
+    new_dir_entry.lastBlock = 0xFFFF;
     new_dir_entry.type = 1;
     new_dir_entry.perm = 6;
     new_dir_entry.mtime = time(NULL);
@@ -392,6 +442,10 @@ int rm(const char *fs_name) {
         fprintf(stderr, "File not found\n");
         return -1;
     }
+    if (dir_entry.type == FT_SYSTEM) {
+        fprintf(stderr, "Permission denied\n");
+        return -1;
+    }
 
     // Delete the destination FAT chain in the FAT
     uint16_t fat_value = dir_entry.firstBlock;
@@ -593,6 +647,7 @@ int cp(struct parsed_command *cmd) {
         lseek(fs_fd, current_pos, SEEK_SET);
         dir_entry.mtime = time(NULL);
         dir_entry.size = total_written;
+        dir_entry.lastBlock = 0; // Not known, the next write through PennOS finds the tail
         write(fs_fd, &dir_entry, sizeof(directory_entry));
         close(src_fd);
         return 0;
@@ -712,6 +767,7 @@ int cp(struct parsed_command *cmd) {
         lseek(fs_fd, current_dst_pos, SEEK_SET);
         dst_dir_entry.mtime = time(NULL);
         dst_dir_entry.size = total_written;
+        dst_dir_entry.lastBlock = 0;
         write(fs_fd, &dst_dir_entry, sizeof(directory_entry));
     }
     return 0;
@@ -838,6 +894,7 @@ int cat_f_w(struct parsed_command *cmd) {
                         fprintf(stderr, "Failed to seek to root directory\n");
                         return -1;
                     }
+                    dir_entry.lastBlock = 0;
                     int write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
                 }
                 int next_fat_block = fat[curr_fat_block];
@@ -942,6 +999,7 @@ int cat_f_w(struct parsed_command *cmd) {
                         fprintf(stderr, "Failed to seek to root directory\n");
                         return -1;
                     }
+                    dir_entry.lastBlock = 0;
                     int write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
                     if (write_bytes == -1) {
                         fprintf(stderr, "Error writing directory entry\n");
@@ -1200,6 +1258,7 @@ int cat_f_a(struct parsed_command *cmd) {
                             fprintf(stderr, "Failed to seek to root directory\n");
                             return -1;
                         }
+                        dir_entry.lastBlock = 0;
                         write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
                         if (write_bytes == -1) {
                             fprintf(stderr, "Error writing directory entry\n");
@@ -1328,6 +1387,7 @@ int cat_a_f(struct parsed_command *cmd) {
                             fprintf(stderr, "Failed to seek to root directory\n");
                             return -1;
                         }
+                        dir_entry.lastBlock = 0;
                         write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
                         if (write_bytes == -1) {
                             fprintf(stderr, "Error writing directory entry\n");
@@ -1376,6 +1436,7 @@ int cat_a_f(struct parsed_command *cmd) {
                             fprintf(stderr, "Failed to seek to root directory\n");
                             return -1;
                         }
+                        dir_entry.lastBlock = 0;
                         write_bytes = write(fs_fd, &dir_entry, sizeof(directory_entry));
                         if (write_bytes == -1) {
                             fprintf(stderr, "Error writing directory entry\n");
@@ -1427,6 +1488,7 @@ int cat_w_f(struct parsed_command *cmd) {
     memcpy(dir_entry_reset.name, dir_entry.name, sizeof(dir_entry.name));
     dir_entry_reset.size = 0;
     dir_entry_reset.firstBlock = 0xFFFF;
+    dir_entry_reset.lastBlock = 0xFFFF;
     dir_entry_reset.type = 1;
     dir_entry_reset.perm = 6;
     dir_entry_reset.mtime = time(NULL);
@@ -1570,7 +1632,7 @@ int ls() {
                 return -1;
             }
 
-            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) != 0 && read_bytes != 0) {
+            if (strncmp(dir_entry.name, "", sizeof(dir_entry.name)) != 0 && read_bytes != 0 && dir_entry.type != FT_SYSTEM) {
                 // print entry: first block number, permissions, size, month, day, time, and name.
                 struct tm *time_info = gmtime(&dir_entry.mtime);
 
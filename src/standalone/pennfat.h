@@ -37,9 +37,42 @@ typedef struct {
     uint8_t type;         /**< The type of the file. */
     uint8_t perm;         /**< File permissions. */
     time_t mtime;         /**< Creation/modification time. */
-    char reserved[16];    /**< Reserved for future use or extra credits. */
+    uint32_t allocSize;   /**< Bytes of blocks reserved for the file (at least size once preallocated). */
+    uint16_t lastBlock;   /**< The last block of the chain, 0xFFFF for an empty file or 0 if not known. */
+    char reserved[10];    /**< Reserved for future use or extra credits. */
 } directory_entry;
 
+/**
+ * @def FT_SYSTEM
+ * @brief Directory entry type of a hidden file holding filesystem metadata.
+ */
+#define FT_SYSTEM 8
+
+/**
+ * @def HOLEMAP_NAME
+ * @brief Name of the system file holding the bitmap of blocks that are holes.
+ */
+#define HOLEMAP_NAME ".holemap"
+
+/**
+ * @def JOURNAL_NAME
+ * @brief Name of the system file holding the metadata journal.
+ */
+#define JOURNAL_NAME ".journal"
+
+/**
+ * @def JOURNAL_MAGIC
+ * @brief First word of a valid journal.
+ */
+#define JOURNAL_MAGIC 0x314A4650
+
+/**
+ * @def DEDUP_NAME
+ * @brief Name of the system file holding the fingerprint index of a deduplicated
+ * image, whose files may share the tail of their chains.
+ */
+#define DEDUP_NAME ".dedup"
+
 // Helper functions
 
 /**
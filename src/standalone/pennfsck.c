@@ -0,0 +1,403 @@
+/*
+pennfsck checks a PennFAT image for inconsistencies, and with -r reclaims the
+blocks that belong to no file.
+
+The work is split over threads in three passes:
+ 1. the FAT is partitioned and every slice counts its allocated blocks and
+    the entries pointing outside the FAT,
+ 2. the directory entries are handed out to the threads, which walk their
+    chains and claim each block, so cross-links and cycles show up as claims
+    that fail,
+ 3. the FAT is partitioned again to find the allocated blocks nobody claimed.
+
+Exit status follows fsck(8): 0 if the image is clean, 1 if every problem was
+repaired, 4 if problems were left, 8 on an operational error.
+*/
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include "pennfat.h"
+
+#define MAX_THREADS 16
+
+// Image being checked
+uint16_t *fat;
+char *image;
+size_t image_size;
+size_t fat_size;
+int block_size;
+int num_fat_entries;
+
+// Entry the chain starting at each block belongs to (0 for none, 1 for the root directory)
+atomic_int *owners;
+
+directory_entry *entries;
+int num_dir_entries;
+atomic_int next_entry;
+
+int num_threads;
+bool repair;
+uint8_t *shared; // Deduplicated images: the files reaching each block beyond the first, or NULL
+
+typedef struct {
+    int index;          // Which slice of the FAT the thread owns
+    int allocated;      // Allocated blocks in the slice
+    int bad_pointers;   // Entries pointing outside the FAT
+    int leaked;         // Allocated blocks in no chain
+    int problems;       // Problems found walking chains
+} fsck_thread;
+
+// Returns the first and one past the last FAT entry of a slice
+void slice(int index, int *start, int *end) {
+    int per_thread = (num_fat_entries - 2 + num_threads - 1) / num_threads;
+    *start = 2 + index * per_thread;
+    *end = *start + per_thread < num_fat_entries ? *start + per_thread : num_fat_entries;
+}
+
+void *fat_pass(void *arg) {
+    fsck_thread *thread = arg;
+    int start, end;
+    slice(thread->index, &start, &end);
+    for (int block = start; block < end; block++) {
+        if (fat[block] == 0) {
+            continue;
+        }
+        thread->allocated++;
+        if (fat[block] != 0xFFFF && fat[block] >= num_fat_entries) {
+            thread->bad_pointers++;
+        }
+    }
+    return NULL;
+}
+
+// Whether the chain of owner is a file's that deduplication may share
+bool can_share(int owner) {
+    return shared != NULL && owner > 1 && entries[owner - 2].type != FT_SYSTEM;
+}
+
+// Bytes of its last block a file uses
+int last_length(int owner) {
+    return entries[owner - 2].size == 0 ? 0 : (entries[owner - 2].size - 1) % block_size + 1;
+}
+
+// Counts the files whose chains reach each block beyond the first, the way mounting a deduplicated
+// image does, so that only blocks deduplication can have shared are accepted as joins; returns -1 without memory
+int count_shared() {
+    uint8_t *seen = calloc(num_fat_entries, 1);
+    shared = calloc(num_fat_entries, 1);
+    if (seen == NULL || shared == NULL) {
+        free(seen);
+        return -1;
+    }
+    for (int i = 0; i < num_dir_entries; i++) {
+        if (entries[i].type == FT_SYSTEM) {
+            continue;
+        }
+        uint16_t block = entries[i].firstBlock;
+        for (int blocks = 0; block != 0xFFFF && block != 0 && block < num_fat_entries && blocks < num_fat_entries; blocks++) {
+            if (seen[block] && shared[block] < UINT8_MAX) {
+                shared[block]++;
+            }
+            seen[block] = 1;
+            block = fat[block];
+        }
+    }
+    free(seen);
+    return 0;
+}
+
+// Walks one chain, claiming its blocks for owner; returns the number of problems.
+// last_block is the tail the directory entry records, 0 if it records none.
+int walk_chain(const char *name, uint16_t first_block, uint16_t last_block, int owner, int min_blocks, int max_blocks) {
+    int problems = 0;
+    int blocks = 0;
+    bool joined = false;
+    uint16_t last = 0xFFFF;
+    uint16_t block = first_block;
+    while (block != 0 && block != 0xFFFF) {
+        if (block >= num_fat_entries) {
+            fprintf(stderr, "%s: chain points past the FAT (%d)\n", name, block);
+            problems++;
+            break;
+        }
+        if (shared != NULL && shared[block] != 0 && !can_share(owner)) {
+            fprintf(stderr, "%s: block %d is shared with deduplicated files\n", name, block);
+            problems++;
+            break;
+        }
+        int expected = 0;
+        if (joined || !atomic_compare_exchange_strong(&owners[block], &expected, owner)) {
+            // Deduplication only hands out a tail that ends the same way as the one it replaces
+            if (joined || (expected > 1 && expected != owner && can_share(owner) && can_share(expected) && shared[block] != 0
+                && last_length(owner) == last_length(expected))) {
+                // Joining another file's tail, which its owner claims; the rest of the chain has to be shared too
+                if (shared[block] == 0) {
+                    fprintf(stderr, "%s: block %d is in a shared tail but not shared\n", name, block);
+                    problems++;
+                    break;
+                }
+                joined = true;
+                if (++blocks > num_fat_entries) {
+                    fprintf(stderr, "%s: shared tail loops back to block %d\n", name, block);
+                    problems++;
+                    break;
+                }
+                if (fat[block] == 0) {
+                    fprintf(stderr, "%s: chain runs into free block %d\n", name, block);
+                    problems++;
+                    break;
+                }
+                last = block;
+                block = fat[block];
+                continue;
+            }
+            if (expected == owner) {
+                fprintf(stderr, "%s: chain loops back to block %d\n", name, block);
+            } else {
+                fprintf(stderr, "%s: block %d is cross-linked with %s\n", name, block,
+                    expected == 1 ? "the root directory" : entries[expected - 2].name);
+            }
+            problems++;
+            break;
+        }
+        blocks++;
+        if (fat[block] == 0) {
+            fprintf(stderr, "%s: chain runs into free block %d\n", name, block);
+            problems++;
+            break;
+        }
+        last = block;
+        block = fat[block];
+    }
+
+    // A broken chain has no meaningful length
+    if (problems == 0 && (blocks < min_blocks || (max_blocks >= 0 && blocks > max_blocks))) {
+        fprintf(stderr, "%s: %d blocks in the chain, the size needs %d\n", name, blocks, min_blocks);
+        problems++;
+    }
+    if (problems == 0 && last_block != 0 && last_block != last) {
+        fprintf(stderr, "%s: last block is %d, but its chain ends at %d\n", name, last_block, last);
+        problems++;
+    }
+    return problems;
+}
+
+void *chain_pass(void *arg) {
+    fsck_thread *thread = arg;
+    int i;
+    while ((i = atomic_fetch_add(&next_entry, 1)) < num_dir_entries) {
+        directory_entry *dir_entry = &entries[i];
+        int min_blocks = (dir_entry->size + block_size - 1) / block_size;
+        int max_blocks = (dir_entry->allocSize + block_size - 1) / block_size;
+        thread->problems += walk_chain(dir_entry->name, dir_entry->firstBlock, dir_entry->lastBlock, i + 2,
+            min_blocks, max_blocks > min_blocks ? max_blocks : min_blocks);
+    }
+    return NULL;
+}
+
+void *leak_pass(void *arg) {
+    fsck_thread *thread = arg;
+    int start, end;
+    slice(thread->index, &start, &end);
+    for (int block = start; block < end; block++) {
+        if (fat[block] == 0 || atomic_load(&owners[block]) != 0) {
+            continue;
+        }
+        thread->leaked++;
+        if (repair) {
+            // Free blocks read as zero, which is what holes rely on
+            memset(image + fat_size + (block - 1) * block_size, 0, block_size);
+            fat[block] = 0;
+        }
+    }
+    return NULL;
+}
+
+// Returns -1 if a thread could not be started, once the ones that were have finished
+int run_pass(void *(*pass)(void *), fsck_thread *threads) {
+    pthread_t ids[MAX_THREADS];
+    int started = 0;
+    while (started < num_threads && pthread_create(&ids[started], NULL, pass, &threads[started]) == 0) {
+        started++;
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    return started == num_threads ? 0 : -1;
+}
+
+// Reads the root directory into entries, walking its chain on the way; returns -1 without memory
+int read_directory() {
+    int problems = walk_chain("root directory", 1, 0, 1, 1, -1);
+    int per_block = block_size / sizeof(directory_entry);
+    int capacity = per_block;
+    entries = malloc(capacity * sizeof(directory_entry));
+    if (entries == NULL) {
+        return -1;
+    }
+
+    int root_blocks = 0;
+    for (int block = 1; block != 0xFFFF && block < num_fat_entries && atomic_load(&owners[block]) == 1 && root_blocks++ < num_fat_entries; block = fat[block]) {
+        directory_entry *block_entries = (directory_entry *)(image + fat_size + (block - 1) * block_size);
+        for (int i = 0; i < per_block; i++) {
+            if (block_entries[i].name[0] == '\0') {
+                continue;
+            }
+            if (num_dir_entries == capacity) {
+                directory_entry *grown = realloc(entries, capacity * 2 * sizeof(directory_entry));
+                if (grown == NULL) {
+                    return -1;
+                }
+                entries = grown;
+                capacity *= 2;
+            }
+            entries[num_dir_entries] = block_entries[i];
+            entries[num_dir_entries].name[sizeof(entries[num_dir_entries].name) - 1] = '\0';
+            num_dir_entries++;
+        }
+    }
+    return problems;
+}
+
+// Whether the image has a system file of that name
+bool has_system_file(const char *name) {
+    for (int i = 0; i < num_dir_entries; i++) {
+        if (entries[i].type == FT_SYSTEM && strcmp(entries[i].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the number of bytes the journal still has to replay
+uint32_t journal_pending() {
+    for (int i = 0; i < num_dir_entries; i++) {
+        if (entries[i].type == FT_SYSTEM && strcmp(entries[i].name, JOURNAL_NAME) == 0 && entries[i].firstBlock != 0) {
+            uint32_t *header = (uint32_t *)(image + fat_size + (entries[i].firstBlock - 1) * block_size);
+            return header[0] == JOURNAL_MAGIC ? header[1] : 0;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *fs_name = NULL;
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0) {
+            repair = true;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            num_threads = atoi(argv[++i]);
+        } else {
+            fs_name = argv[i];
+        }
+    }
+    if (fs_name == NULL) {
+        fprintf(stderr, "usage: pennfsck [-r] [-j THREADS] FS_NAME\n");
+        return 8;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    } else if (num_threads > MAX_THREADS) {
+        num_threads = MAX_THREADS;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int fs_fd = open(fs_name, repair ? O_RDWR : O_RDONLY);
+    if (fs_fd == -1) {
+        fprintf(stderr, "Failed to open file system file\n");
+        return 8;
+    }
+    uint16_t metadata;
+    off_t file_size = lseek(fs_fd, 0, SEEK_END);
+    if (pread(fs_fd, &metadata, sizeof(metadata), 0) != sizeof(metadata)) {
+        fprintf(stderr, "Failed to read FAT metadata\n");
+        return 8;
+    }
+    block_size = 1 << ((metadata & 0xFF) + 8);
+    fat_size = block_size * (metadata >> 8);
+    num_fat_entries = fat_size / 2 > 0xFFFF ? 0xFFFF : fat_size / 2;
+    image_size = fat_size + (num_fat_entries - 1) * block_size;
+    if ((metadata >> 8) < 1 || (metadata >> 8) > 32 || (metadata & 0xFF) > 4 || file_size < image_size) {
+        fprintf(stderr, "%s is not a PennFAT image\n", fs_name);
+        return 8;
+    }
+
+    image = mmap(NULL, image_size, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fs_fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Failed to map %s into memory\n", fs_name);
+        return 8;
+    }
+    fat = (uint16_t *)image;
+    owners = calloc(num_fat_entries, sizeof(atomic_int));
+    if (owners == NULL) {
+        fprintf(stderr, "Failed to allocate the block owners\n");
+        return 8;
+    }
+
+    fsck_thread threads[MAX_THREADS];
+    memset(threads, 0, sizeof(threads));
+    for (int i = 0; i < num_threads; i++) {
+        threads[i].index = i;
+    }
+
+    if (run_pass(fat_pass, threads) == -1) {
+        fprintf(stderr, "Failed to start the threads\n");
+        return 8;
+    }
+    int problems = read_directory();
+    if (problems == -1) {
+        fprintf(stderr, "Failed to allocate the directory\n");
+        return 8;
+    }
+
+    uint32_t pending = journal_pending();
+    if (pending != 0) {
+        fprintf(stderr, "The journal holds %u bytes that were never replayed, mount the image to replay them first\n", pending);
+        if (repair) {
+            return 8;
+        }
+    }
+
+    if (has_system_file(DEDUP_NAME) && count_shared() == -1) {
+        fprintf(stderr, "Failed to allocate the shared block counts\n");
+        return 8;
+    }
+    if (run_pass(chain_pass, threads) == -1 || run_pass(leak_pass, threads) == -1) {
+        fprintf(stderr, "Failed to start the threads\n");
+        return 8;
+    }
+
+    int allocated = 0, bad_pointers = 0, leaked = 0;
+    for (int i = 0; i < num_threads; i++) {
+        allocated += threads[i].allocated;
+        bad_pointers += threads[i].bad_pointers;
+        leaked += threads[i].leaked;
+        problems += threads[i].problems;
+    }
+    if (bad_pointers > 0) {
+        fprintf(stderr, "%d FAT entries point past the FAT\n", bad_pointers);
+        problems++;
+    }
+    if (leaked > 0) {
+        fprintf(stderr, "%d blocks are allocated but in no file%s\n", leaked, repair ? ", reclaimed" : "");
+    }
+    if (repair) {
+        msync(image, image_size, MS_SYNC);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%s: %d files, %d/%d blocks allocated, %d problems, %d leaked blocks (%d threads, %.3f s)\n",
+        fs_name, num_dir_entries, allocated - (repair ? leaked : 0), num_fat_entries - 2, problems, leaked, num_threads, seconds);
+
+    munmap(image, image_size);
+    close(fs_fd);
+    if (problems > 0) {
+        return 4;
+    }
+    return leaked > 0 ? (repair ? 1 : 4) : 0;
+}
@@ -20,6 +20,10 @@
  ******************************************************************************/
 
 #include "p_pennos.h"
+#include "f_pennos.h"
+
+#include <fcntl.h>
+#include <time.h>
 
 
 static void nap(void)
@@ -134,4 +138,564 @@ void nohang(void)
 void recur(void)
 {
   spawn_r();
-}
\ No newline at end of file
+}
+
+
+/*
+ * The functions below run a random workload of f_ calls against the default
+ * volume and crash it at a random write inside each operation: the image is
+ * copied as it is on disk at that moment, then mounted (replaying its journal)
+ * and checked for cross-links, leaked blocks and size mismatches.
+ */
+
+#define CRASHTEST_FILES 6
+#define CRASHTEST_IMAGE "crashtest.img"
+#define CRASHTEST_LABEL "crashtest"
+
+extern pennfat_volume volumes[MAX_VOLUMES];
+extern int default_volume;
+
+static const char *crashtest_ops[] = { "create", "write", "append", "truncate", "rm", "mv", "cp" };
+
+static bool crashtest_exists(const char *name)
+{
+  directory_entry dir_entry;
+  return f_find_file(name, &dir_entry) != -1;
+}
+
+static void crashtest_fill(int fd, int length)
+{
+  char buffer[256];
+  for (int i = 0; i < sizeof buffer; i++)
+    buffer[i] = 'a' + rand() % 26;
+
+  while (length > 0) {
+    int n = length < sizeof buffer ? length : sizeof buffer;
+    f_write(fd, buffer, n);
+    length -= n;
+  }
+}
+
+static void crashtest_op(int op, const char *name, const char *other)
+{
+  int fd;
+  switch (op) {
+    case 0:  // create (or replace) a file
+      fd = f_open(name, F_WRITE);
+      crashtest_fill(fd, rand() % 8192);
+      f_close(fd);
+      break;
+    case 1:  // overwrite part of an existing file
+      fd = f_open(name, F_APPEND);
+      f_lseek(fd, rand() % 4096, F_SEEK_SET);
+      crashtest_fill(fd, rand() % 4096);
+      f_close(fd);
+      break;
+    case 2:
+      fd = f_open(name, F_APPEND);
+      crashtest_fill(fd, rand() % 4096);
+      f_close(fd);
+      break;
+    case 3:  // truncate to a short file
+      fd = f_open(name, F_WRITE);
+      crashtest_fill(fd, rand() % 128);
+      f_close(fd);
+      break;
+    case 4:
+      f_rm(name);
+      break;
+    case 5:
+      f_mv(name, other);
+      break;
+    case 6: {
+      char *argv[] = { "cp", (char *)name, (char *)other, NULL };
+      struct parsed_command *cmd = malloc(sizeof(struct parsed_command) + sizeof(char **));
+      cmd->num_commands = 1;
+      cmd->commands[0] = argv;
+      f_cp(cmd);
+      free(cmd);
+      break;
+    }
+  }
+}
+
+void crashtest(struct parsed_command *cmd)
+{
+  int num_ops = cmd->commands[0][1] != NULL ? atoi(cmd->commands[0][1]) : 200;
+  unsigned int seed = cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL ? atoi(cmd->commands[0][2]) : time(NULL);
+  srand(seed);
+  if (default_volume == -1) {
+    dprintf(STDERR_FILENO, "No filesystem is mounted\n");
+    p_exit();
+  }
+
+  int crashes = 0;
+  int inconsistent = 0;
+  double op_seconds = 0;
+  for (int i = 0; i < num_ops; i++) {
+    char name[16], other[16];
+    snprintf(name, sizeof name, "crash_%d", rand() % CRASHTEST_FILES);
+    snprintf(other, sizeof other, "crash_%d", rand() % CRASHTEST_FILES);
+
+    // Everything but create needs an existing source
+    int op = rand() % 7;
+    if (!crashtest_exists(name))
+      op = 0;
+    if (op >= 5 && strcmp(name, other) == 0)
+      op = 2;
+
+    struct timespec start, end;
+    crash_arm(1 + rand() % 64, CRASHTEST_IMAGE);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    crashtest_op(op, name, other);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    op_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if (!crash_disarm())
+      continue;
+
+    // Mount the crashed image as the next boot would and check it
+    crashes++;
+    if (f_mount(CRASHTEST_IMAGE, CRASHTEST_LABEL, false) == 0) {
+      fs_lock();
+      select_volume(find_volume(CRASHTEST_LABEL));
+      int problems = check_volume(false);
+      fs_unlock();
+      if (problems != 0) {
+        inconsistent++;
+        dprintf(STDERR_FILENO, "op %d (%s %s): %d problems after the crash\n", i, crashtest_ops[op], name, problems);
+      }
+      f_umount(CRASHTEST_LABEL);
+    }
+    unlink(CRASHTEST_IMAGE);
+  }
+
+  for (int i = 0; i < CRASHTEST_FILES; i++) {
+    char name[16];
+    snprintf(name, sizeof name, "crash_%d", i);
+    if (crashtest_exists(name))
+      f_rm(name);
+  }
+
+  dprintf(STDERR_FILENO, "seed %u, journal %s\n", seed, volumes[default_volume].journal != NULL ? "on" : "off");
+  dprintf(STDERR_FILENO, "%d ops in %.3f s (%.0f ops/s)\n", num_ops, op_seconds, op_seconds > 0 ? num_ops / op_seconds : 0);
+  dprintf(STDERR_FILENO, "%d crashes, %d inconsistent (%.1f%%)\n", crashes, inconsistent, crashes > 0 ? 100.0 * inconsistent / crashes : 0);
+  p_exit();
+}
+
+
+/*
+ * The functions below run N PennOS processes that each do a seeded random mix
+ * of file system operations on files shared by all of them and on files of
+ * their own, without holding fs_lock between the f_ calls, so the scheduler
+ * interleaves them mid-operation. Private files are checked exactly against a
+ * shadow copy, and some of their reads and writes are large enough to go to
+ * the I/O workers. Shared files are only ever written one record at a time at
+ * record boundaries, so every record they hold must be zeros or one a writer
+ * wrote whole.
+ */
+
+#define FSSTRESS_MAX_PROCESSES 16
+#define FSSTRESS_SHARED_FILES 4
+#define FSSTRESS_PRIVATE_FILES 2
+#define FSSTRESS_MAX_SIZE (2 * OFFLOAD_MIN_BYTES)
+#define FSSTRESS_SHARED_SIZE 8192
+#define FSSTRESS_RECORD 64
+
+typedef struct {
+  char name[32];
+  bool exists;
+  int size;
+  char *data;  // What a private file should hold, FSSTRESS_MAX_SIZE bytes
+} fsstress_file;
+
+typedef struct {
+  pid_t pid;
+  int id;          // Written into the records of the shared files, counted from 1
+  unsigned int seed;
+  int ops;
+  int errors;      // Calls on private files that failed, after which the shadow copy is reloaded
+  int contended;   // Calls on shared files that lost a race with another process
+  int mismatches;  // Reads that found other data than expected
+  unsigned int records;  // Records written to the shared files so far
+  double seconds;
+  char *buffer;
+} fsstress_worker;
+
+static const char *fsstress_ops[] = { "create", "read", "write", "append", "truncate", "rm", "mv", "ls" };
+
+static fsstress_file fsstress_files[FSSTRESS_SHARED_FILES + FSSTRESS_MAX_PROCESSES * FSSTRESS_PRIVATE_FILES];
+static fsstress_worker fsstress_workers[FSSTRESS_MAX_PROCESSES];
+static int fsstress_num_processes;
+static int fsstress_num_ops;
+static int fsstress_dev_null = -1;
+static int fsstress_report = -1;  // The terminal, while stdout and stderr go to /dev/null
+
+static uint64_t fsstress_checksum(const char *data, int size)
+{
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < size; i++)
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  return hash;
+}
+
+// Reads what a private file really holds into worker->buffer; returns its size, or -1 if it does not exist
+static int fsstress_read_file(fsstress_worker *worker, const char *name)
+{
+  directory_entry dir_entry;
+  if (f_find_file(name, &dir_entry) == -1)
+    return -1;
+  int fd = f_open(name, F_READ);
+  if (fd == -1)
+    return -1;
+  int size = 0, n;
+  while (size < FSSTRESS_MAX_SIZE && (n = f_read(fd, FSSTRESS_MAX_SIZE - size, worker->buffer + size)) > 0)
+    size += n;
+  f_close(fd);
+  return size;
+}
+
+// Makes the shadow copy of a private file what the file holds, after a call failed
+static void fsstress_reload(fsstress_worker *worker, fsstress_file *file)
+{
+  int size = fsstress_read_file(worker, file->name);
+  file->exists = size != -1;
+  file->size = size != -1 ? size : 0;
+  if (size > 0)
+    memcpy(file->data, worker->buffer, size);
+}
+
+// Length of a write to a private file: mostly below small, sometimes one the I/O workers do
+static int fsstress_length(fsstress_worker *worker, int small)
+{
+  if (rand_r(&worker->seed) % 16 == 0)
+    return OFFLOAD_MIN_BYTES + rand_r(&worker->seed) % (OFFLOAD_MIN_BYTES / 2);
+  return rand_r(&worker->seed) % small;
+}
+
+static void fsstress_fill(fsstress_worker *worker, int length)
+{
+  for (int i = 0; i < length; i++)
+    worker->buffer[i] = 'a' + rand_r(&worker->seed) % 26;
+}
+
+// Writes length bytes of worker->buffer at offset, mirroring them in the shadow copy; returns false if the write fell short
+static bool fsstress_write(fsstress_worker *worker, fsstress_file *file, int fd, int offset, int length)
+{
+  if (fd == -1 || (offset != file->size && f_lseek(fd, offset, F_SEEK_SET) != offset)
+      || f_write(fd, worker->buffer, length) != length) {
+    if (fd != -1)
+      f_close(fd);
+    return false;
+  }
+  memcpy(file->data + offset, worker->buffer, length);
+  file->size = offset + length > file->size ? offset + length : file->size;
+  file->exists = true;
+  return f_close(fd) == 0;
+}
+
+// Fills record with the one writer id wrote as its seq-th, which names both and is otherwise determined by them
+static void fsstress_record(char *record, int id, unsigned int seq)
+{
+  unsigned int seed = id * 1000003u + seq;
+  int header = snprintf(record, FSSTRESS_RECORD, "w%02d s%08u ", id, seq);
+  for (int i = header; i < FSSTRESS_RECORD - 1; i++)
+    record[i] = 'a' + rand_r(&seed) % 26;
+  record[FSSTRESS_RECORD - 1] = '\n';
+}
+
+// Whether a record read from a shared file is zeros, or one a writer has written whole
+static bool fsstress_record_valid(const char *record)
+{
+  static const char zeros[FSSTRESS_RECORD];
+  if (memcmp(record, zeros, FSSTRESS_RECORD) == 0)
+    return true;
+  int id;
+  unsigned int seq;
+  if (sscanf(record, "w%2d s%8u ", &id, &seq) != 2 || id < 1 || id > fsstress_num_processes
+      || seq >= fsstress_workers[id - 1].records)
+    return false;
+  char expected[FSSTRESS_RECORD];
+  fsstress_record(expected, id, seq);
+  return memcmp(record, expected, FSSTRESS_RECORD) == 0;
+}
+
+// Checks every record of a shared file; returns how many are bad, or -1 if it could not be read
+static int fsstress_check_shared(fsstress_worker *worker, const char *name)
+{
+  int fd = f_open(name, F_READ);
+  if (fd == -1)
+    return -1;
+  // Other processes may move the offset or shrink the file in between, each record is still read whole
+  int bad = 0;
+  for (int records = 0; records < 2 * FSSTRESS_SHARED_SIZE / FSSTRESS_RECORD; records++) {
+    int n = f_read(fd, FSSTRESS_RECORD, worker->buffer);
+    if (n <= 0)
+      break;
+    if (n != FSSTRESS_RECORD || !fsstress_record_valid(worker->buffer)) {
+      if (bad++ == 0)
+        dprintf(fsstress_report, "fsstress: %s holds a bad %d byte record (checksum %016llx)\n", name, n,
+          (unsigned long long)fsstress_checksum(worker->buffer, n));
+    }
+  }
+  f_close(fd);
+  return bad;
+}
+
+// Writes count new records of the worker at the offset fd is at, one f_write each
+static bool fsstress_write_records(fsstress_worker *worker, int fd, int count)
+{
+  for (int i = 0; i < count; i++) {
+    fsstress_record(worker->buffer, worker->id, worker->records++);
+    if (f_write(fd, worker->buffer, FSSTRESS_RECORD) != FSSTRESS_RECORD)
+      return false;
+  }
+  return true;
+}
+
+static bool fsstress_op(fsstress_worker *worker, int op, fsstress_file *file, fsstress_file *other)
+{
+  int length, offset, size;
+  switch (op) {
+    case 0:  // create (or replace) a file
+    case 4:  // truncate to a short file
+      length = op == 0 ? fsstress_length(worker, FSSTRESS_SHARED_SIZE / 2) : rand_r(&worker->seed) % 128;
+      fsstress_fill(worker, length);
+      file->size = 0;
+      return fsstress_write(worker, file, f_open(file->name, F_WRITE), 0, length);
+    case 1:  // read the whole file back and compare
+      size = fsstress_read_file(worker, file->name);
+      if (size != file->size || memcmp(worker->buffer, file->data, size) != 0) {
+        worker->mismatches++;
+        dprintf(fsstress_report, "fsstress: %s holds %d bytes (checksum %016llx), expected %d (%016llx)\n", file->name, size,
+          (unsigned long long)fsstress_checksum(worker->buffer, size > 0 ? size : 0), file->size,
+          (unsigned long long)fsstress_checksum(file->data, file->size));
+        fsstress_reload(worker, file);
+      }
+      return true;
+    case 2:  // overwrite part of the file
+    case 3:
+      offset = op == 2 ? rand_r(&worker->seed) % (file->size + 1) : file->size;
+      length = fsstress_length(worker, FSSTRESS_SHARED_SIZE / 4);
+      length = offset + length > FSSTRESS_MAX_SIZE ? FSSTRESS_MAX_SIZE - offset : length;
+      fsstress_fill(worker, length);
+      return fsstress_write(worker, file, f_open(file->name, F_APPEND), offset, length);
+    case 5:
+      if (f_rm(file->name) == -1)
+        return false;
+      file->exists = false;
+      file->size = 0;
+      return true;
+    case 6:
+      if (f_mv(file->name, other->name) == -1)
+        return false;
+      memcpy(other->data, file->data, file->size);
+      other->size = file->size;
+      other->exists = true;
+      file->exists = false;
+      file->size = 0;
+      return true;
+    case 7:  // the listing itself goes to /dev/null
+      return f_ls(NULL) != -1;
+  }
+  return false;
+}
+
+// The same operations on a shared file, in whole records; returns false if the call lost a race
+static bool fsstress_shared_op(fsstress_worker *worker, int op, fsstress_file *file, fsstress_file *other)
+{
+  int max_records = FSSTRESS_SHARED_SIZE / FSSTRESS_RECORD;
+  int fd, bad, end;
+  bool written;
+  switch (op) {
+    case 0:
+    case 4:
+      if ((fd = f_open(file->name, F_WRITE)) == -1)
+        return false;
+      written = fsstress_write_records(worker, fd, rand_r(&worker->seed) % (op == 0 ? max_records / 2 : 2));
+      return f_close(fd) == 0 && written;
+    case 1:
+      if ((bad = fsstress_check_shared(worker, file->name)) == -1)
+        return false;
+      worker->mismatches += bad > 0;
+      return true;
+    case 2:
+    case 3:
+      if ((fd = f_open(file->name, F_APPEND)) == -1)
+        return false;
+      end = f_lseek(fd, 0, F_SEEK_END) / FSSTRESS_RECORD;
+      end = end < max_records ? end : max_records;
+      int record = op == 2 ? rand_r(&worker->seed) % (end + 1) : end;
+      int count = rand_r(&worker->seed) % (max_records / 4);
+      count = record + count > max_records ? max_records - record : count;
+      written = f_lseek(fd, record * FSSTRESS_RECORD, F_SEEK_SET) == record * FSSTRESS_RECORD
+        && fsstress_write_records(worker, fd, count);
+      return f_close(fd) == 0 && written;
+    case 5:
+      return f_rm(file->name) != -1;
+    case 6:
+      return f_mv(file->name, other->name) != -1;
+    case 7:
+      return f_ls(NULL) != -1;
+  }
+  return false;
+}
+
+static void fsstress_worker_main(int id)
+{
+  fsstress_worker *worker = &fsstress_workers[id - 1];
+  fsstress_file *private_files = &fsstress_files[FSSTRESS_SHARED_FILES + (id - 1) * FSSTRESS_PRIVATE_FILES];
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int i = 0; i < fsstress_num_ops; i++) {
+    // Half the operations go to the shared files, and a move stays among files of the same kind
+    bool shared = rand_r(&worker->seed) % 2 == 0;
+    fsstress_file *files = shared ? fsstress_files : private_files;
+    int num_files = shared ? FSSTRESS_SHARED_FILES : FSSTRESS_PRIVATE_FILES;
+    fsstress_file *file = &files[rand_r(&worker->seed) % num_files];
+    fsstress_file *other = &files[rand_r(&worker->seed) % num_files];
+    int op = rand_r(&worker->seed) % 8;
+
+    if (shared) {
+      // Whether the file exists can change under the call, which fails then
+      directory_entry dir_entry;
+      if (op != 7 && f_find_file(file->name, &dir_entry) == -1)
+        op = 0;
+      if (op == 6 && file == other)
+        op = 3;
+      if (!fsstress_shared_op(worker, op, file, other))
+        worker->contended++;
+    } else {
+      // Everything but create and ls needs an existing file
+      if (!file->exists && op != 7)
+        op = 0;
+      if (op == 6 && file == other)
+        op = 3;
+      if (!fsstress_op(worker, op, file, other)) {
+        worker->errors++;
+        dprintf(fsstress_report, "fsstress: %s %s failed in process %d\n", fsstress_ops[op], file->name, worker->pid);
+        fsstress_reload(worker, file);
+        fsstress_reload(worker, other);
+      }
+    }
+    worker->ops++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  worker->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  p_exit();
+}
+
+void fsstress(struct parsed_command *cmd)
+{
+  int num_processes = cmd->commands[0][1] != NULL ? atoi(cmd->commands[0][1]) : 4;
+  fsstress_num_ops = cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL ? atoi(cmd->commands[0][2]) : 200;
+  unsigned int seed = cmd->commands[0][1] != NULL && cmd->commands[0][2] != NULL && cmd->commands[0][3] != NULL
+    ? atoi(cmd->commands[0][3]) : time(NULL);
+  if (num_processes < 1 || num_processes > FSSTRESS_MAX_PROCESSES || fsstress_num_ops < 0) {
+    dprintf(STDERR_FILENO, "fsstress: 1 to %d processes\n", FSSTRESS_MAX_PROCESSES);
+    p_exit();
+  }
+  if (default_volume == -1) {
+    dprintf(STDERR_FILENO, "No filesystem is mounted\n");
+    p_exit();
+  }
+  if (fsstress_dev_null == -1)
+    fsstress_dev_null = open("/dev/null", O_WRONLY);
+  fsstress_num_processes = num_processes;
+
+  int num_files = FSSTRESS_SHARED_FILES + num_processes * FSSTRESS_PRIVATE_FILES;
+  for (int i = 0; i < num_files; i++) {
+    fsstress_file *file = &fsstress_files[i];
+    if (i < FSSTRESS_SHARED_FILES)
+      snprintf(file->name, sizeof file->name, "stress_s%d", i);
+    else
+      snprintf(file->name, sizeof file->name, "stress_p%d_%d", (i - FSSTRESS_SHARED_FILES) / FSSTRESS_PRIVATE_FILES,
+        (i - FSSTRESS_SHARED_FILES) % FSSTRESS_PRIVATE_FILES);
+    if (file->data == NULL)
+      file->data = malloc(FSSTRESS_MAX_SIZE);
+    if (crashtest_exists(file->name))
+      f_rm(file->name);
+    file->exists = false;
+    file->size = 0;
+  }
+
+  // Listings, and the errors of calls that lose races on shared files, would flood the terminal
+  fflush(stdout);
+  fflush(stderr);
+  fsstress_report = dup(STDERR_FILENO);
+  int saved_stdout = dup(STDOUT_FILENO);
+  dup2(fsstress_dev_null, STDOUT_FILENO);
+  dup2(fsstress_dev_null, STDERR_FILENO);
+
+  // Workers are passed their number, counted from 1 so that p_spawn hands it over as an int
+  for (int i = 0; i < num_processes; i++) {
+    fsstress_worker *worker = &fsstress_workers[i];
+    if (worker->buffer == NULL)
+      worker->buffer = malloc(FSSTRESS_MAX_SIZE);
+    worker->id = i + 1;
+    worker->seed = seed + i;
+    worker->ops = worker->errors = worker->contended = worker->mismatches = 0;
+    worker->records = 0;
+    worker->seconds = 0;
+
+    char id[16], name[32];
+    snprintf(id, sizeof id, "%d", i + 1);
+    snprintf(name, sizeof name, "fsstress_%d", i);
+    char *argv[] = { id, NULL };
+    char *copied_name = malloc(strlen(name) + 1);
+    copy_string(copied_name, name);
+    worker->pid = p_spawn(fsstress_worker_main, argv, STDERR_FILENO, STDERR_FILENO, copied_name);
+  }
+  while (p_waitpid(-1, NULL, false) >= 0)
+    ;
+
+  fflush(stdout);
+  fflush(stderr);
+  dup2(saved_stdout, STDOUT_FILENO);
+  dup2(fsstress_report, STDERR_FILENO);
+  close(saved_stdout);
+  close(fsstress_report);
+  fsstress_report = STDERR_FILENO;
+
+  // Private files must hold what their shadow copy says, shared files only whole records
+  int ops = 0, errors = 0, contended = 0, mismatches = 0, bad_files = 0;
+  double slowest = 0;
+  for (int i = 0; i < num_processes; i++) {
+    fsstress_worker *worker = &fsstress_workers[i];
+    dprintf(STDERR_FILENO, "process %d: %d ops in %.3f s (%.0f ops/s), %d errors, %d contended, %d mismatched reads\n",
+      worker->pid, worker->ops, worker->seconds, worker->seconds > 0 ? worker->ops / worker->seconds : 0, worker->errors,
+      worker->contended, worker->mismatches);
+    ops += worker->ops;
+    errors += worker->errors;
+    contended += worker->contended;
+    mismatches += worker->mismatches;
+    slowest = worker->seconds > slowest ? worker->seconds : slowest;
+  }
+  fsstress_worker *checker = &fsstress_workers[0];
+  for (int i = 0; i < num_files; i++) {
+    fsstress_file *file = &fsstress_files[i];
+    if (i < FSSTRESS_SHARED_FILES) {
+      bad_files += crashtest_exists(file->name) && fsstress_check_shared(checker, file->name) > 0;
+    } else {
+      int size = fsstress_read_file(checker, file->name);
+      bool exists = size != -1;
+      size = exists ? size : 0;
+      if (exists != file->exists || size != file->size || memcmp(checker->buffer, file->data, size) != 0) {
+        bad_files++;
+        dprintf(STDERR_FILENO, "fsstress: %s %s with %d bytes (checksum %016llx), expected %s with %d (%016llx)\n", file->name,
+          exists ? "exists" : "is missing", size, (unsigned long long)fsstress_checksum(checker->buffer, size),
+          file->exists ? "to exist" : "to be missing", file->size, (unsigned long long)fsstress_checksum(file->data, file->size));
+      }
+    }
+    if (crashtest_exists(file->name))
+      f_rm(file->name);
+  }
+
+  dprintf(STDERR_FILENO, "seed %u, %d processes, %d ops in %.3f s (%.0f ops/s)\n", seed, num_processes, ops, slowest,
+    slowest > 0 ? ops / slowest : 0);
+  dprintf(STDERR_FILENO, "%d errors, %d contended calls, %d mismatched reads, %d of %d files differ from what was written\n",
+    errors, contended, mismatches, bad_files, num_files);
+  p_exit();
+}
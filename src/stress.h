@@ -8,6 +8,8 @@
 #ifndef STRESS_H
 #define STRESS_H
 
+#include "parser.h"
+
 /**
  * @brief Causes the calling thread to enter an infinite loop, effectively hanging.
  *
@@ -34,4 +36,30 @@ void nohang(void);
  */
 void recur(void);
 
+/**
+ * @brief Crash-tests the default volume under a random workload.
+ *
+ * Runs random creates, writes, appends, truncates, removes, moves and copies,
+ * crashing each one at a random write. Every crashed image is mounted and
+ * checked, and the throughput and the share of inconsistent crashes are printed.
+ *
+ * @param cmd The parsed command: crashtest [OPS [SEED]].
+ */
+void crashtest(struct parsed_command *cmd);
+
+/**
+ * @brief Loads the file system and the scheduler together with concurrent processes.
+ *
+ * Spawns N processes that each run a seeded random mix of creates, reads,
+ * writes, appends, truncates, removes, moves and listings on files shared by
+ * all of them and on files of their own, without holding the file system
+ * between calls. Private files are compared with a shadow copy, and shared
+ * files are written in whole records that name their writer, so reads and
+ * the final check accept only records some process wrote. Each process's
+ * ops/sec, errors, contended calls and mismatches, and the totals are printed.
+ *
+ * @param cmd The parsed command: fsstress [N [OPS [SEED]]].
+ */
+void fsstress(struct parsed_command *cmd);
+
 #endif /* STRESS_H */